@@ -0,0 +1,587 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "bench.hpp"
+
+#include "output.hpp"
+#include "build.hpp"
+#include "update.hpp"
+#include "search.hpp"
+#include "files.hpp"
+#include "fileutil.hpp"
+#include "filestream.hpp"
+#include "workqueue.hpp"
+#include "stringutil.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+typedef std::chrono::high_resolution_clock BenchClock;
+
+// Every file is generated from its own seed, so the corpus is the same on every run and files can be regenerated one at a time
+static const uint64_t kBenchSeed = 0x9e3779b97f4a7c15ull;
+
+// Every search is repeated and the fastest run is reported, which filters out noise from other processes
+static const unsigned int kBenchRepeats = 3;
+
+// One in this many files is changed before the second update
+static const unsigned int kBenchChangeInterval = 100;
+
+struct BenchQuery
+{
+	const char* name;
+	unsigned int options;
+	const char* query;
+	unsigned int limit;
+};
+
+// Queries that cover the common search paths; the rare literal only occurs in a few files, which shows how well the index skips chunks
+static const BenchQuery kBenchSearchQueries[] =
+{
+	{ "literal", SO_LITERAL, "result = ", 0 },
+	{ "literal-rare", SO_LITERAL, "bench_marker_41", 0 },
+	{ "ignorecase", SO_LITERAL | SO_IGNORECASE, "Buffer_Size", 0 },
+	{ "regex", 0, "(alloc|free)_[0-9]+\\(", 0 },
+	{ "regex-ignorecase", SO_IGNORECASE, "HANDLE_\\w+ = ", 0 },
+};
+
+// Fuzzy queries are limited like they are in file pickers
+static const BenchQuery kBenchFilterQueries[] =
+{
+	{ "fuzzy", SO_FILE_FUZZY, "mod3prt1fl7", 100 },
+	{ "path", SO_FILE_PATHREGEX, "module_1[0-9]/part_2/", 0 },
+};
+
+static const char* kBenchWords[] =
+{
+	"buffer", "count", "index", "value", "result", "handle", "alloc", "free", "node", "entry",
+	"table", "offset", "size", "data", "stream", "chunk", "query", "match", "file", "path",
+};
+
+static const char* kBenchTypes[] =
+{
+	"int", "size_t", "const char*", "Node*", "uint64_t", "auto", "bool", "float",
+};
+
+// xorshift64*
+class BenchRandom
+{
+public:
+	explicit BenchRandom(uint64_t seed): state(seed ? seed : 1)
+	{
+	}
+
+	unsigned int operator()(unsigned int count)
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+
+		return static_cast<unsigned int>((state * 2685821657736338717ull) >> 32) % count;
+	}
+
+private:
+	uint64_t state;
+};
+
+// Progress messages and results are dropped; results are counted, and errors go to the real output
+class BenchOutput: public Output
+{
+public:
+	BenchOutput(Output* output): output(output), errors(0)
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		start = BenchClock::now();
+		first = start;
+		size = 0;
+	}
+
+	// JSON null if there were no results
+	std::string getFirstResultTime() const
+	{
+		return size ? std::to_string(getSeconds(start, first)) : "null";
+	}
+
+	virtual void rawprint(const char* data, size_t dataSize)
+	{
+		if (size == 0 && dataSize > 0)
+			first = BenchClock::now();
+
+		size += dataSize;
+	}
+
+	virtual void print(const char* message, ...)
+	{
+	}
+
+	virtual void error(const char* message, ...)
+	{
+		va_list l;
+		va_start(l, message);
+		std::string text;
+		strprintf(text, message, l);
+		va_end(l);
+
+		output->error("%s", text.c_str());
+		errors++;
+	}
+
+	static double getSeconds(BenchClock::time_point begin, BenchClock::time_point end)
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1e6;
+	}
+
+	Output* output;
+	unsigned int errors;
+
+	BenchClock::time_point start;
+	BenchClock::time_point first;
+	size_t size;
+};
+
+static void appendFormat(std::string& result, const char* format, ...)
+{
+	va_list l;
+	va_start(l, format);
+	strprintf(result, format, l);
+	va_end(l);
+}
+
+static void appendJsonString(std::string& result, const char* value)
+{
+	result += '"';
+
+	for (const char* s = value; *s; ++s)
+	{
+		if (*s == '"' || *s == '\\')
+		{
+			result += '\\';
+			result += *s;
+		}
+		else if (static_cast<unsigned char>(*s) < 32)
+			appendFormat(result, "\\u%04x", *s);
+		else
+			result += *s;
+	}
+
+	result += '"';
+}
+
+static double getRate(double amount, double seconds)
+{
+	return seconds > 0 ? amount / seconds : 0;
+}
+
+static void appendIdentifier(std::string& result, BenchRandom& rng)
+{
+	const char* word = kBenchWords[rng(sizeof(kBenchWords) / sizeof(kBenchWords[0]))];
+	const char* other = kBenchWords[rng(sizeof(kBenchWords) / sizeof(kBenchWords[0]))];
+
+	switch (rng(3))
+	{
+	case 0:
+		appendFormat(result, "%s_%d", word, rng(100));
+		break;
+
+	case 1:
+		result += word;
+		result += static_cast<char>(toupper(*other));
+		result += other + 1;
+		break;
+
+	default:
+		for (const char* s = word; *s; ++s) result += static_cast<char>(toupper(*s));
+		result += '_';
+		for (const char* s = other; *s; ++s) result += static_cast<char>(toupper(*s));
+	}
+}
+
+static void appendCodeLine(std::string& result, BenchRandom& rng, unsigned int& depth, const char* newline)
+{
+	unsigned int kind = rng(12);
+
+	if (kind == 0 && depth > 0)
+		depth--;
+
+	result.append(depth, '\t');
+
+	switch (kind)
+	{
+	case 0:
+		result += "}";
+		break;
+
+	case 1:
+	case 2:
+	case 3:
+		result += kBenchTypes[rng(sizeof(kBenchTypes) / sizeof(kBenchTypes[0]))];
+		result += ' ';
+		appendIdentifier(result, rng);
+		result += " = ";
+		appendIdentifier(result, rng);
+		result += '(';
+		appendIdentifier(result, rng);
+		appendFormat(result, ", %d);", rng(4096));
+		break;
+
+	case 4:
+		result += "if (";
+		appendIdentifier(result, rng);
+		result += " < ";
+		appendIdentifier(result, rng);
+		result += ") {";
+		depth++;
+		break;
+
+	case 5:
+		result += "for (size_t i = 0; i < ";
+		appendIdentifier(result, rng);
+		result += "; ++i) {";
+		depth++;
+		break;
+
+	case 6:
+		result += "return ";
+		appendIdentifier(result, rng);
+		result += ';';
+		break;
+
+	case 7:
+		result += "// ";
+		for (unsigned int i = 0, count = 3 + rng(8); i < count; ++i)
+		{
+			result += kBenchWords[rng(sizeof(kBenchWords) / sizeof(kBenchWords[0]))];
+			result += ' ';
+		}
+		break;
+
+	case 8:
+		result += "result = ";
+		appendIdentifier(result, rng);
+		result += "->";
+		appendIdentifier(result, rng);
+		result += "();";
+		break;
+
+	case 9:
+		result += "#define ";
+		appendIdentifier(result, rng);
+		appendFormat(result, " 0x%x", rng(65536));
+		break;
+
+	default:
+		break;
+	}
+
+	if (rng(512) == 0)
+		appendFormat(result, " // bench_marker_%d", rng(1000));
+
+	result += newline;
+}
+
+static void generateCode(std::string& result, BenchRandom& rng, size_t size, const char* newline)
+{
+	unsigned int depth = 0;
+
+	while (result.size() < size)
+		appendCodeLine(result, rng, depth, newline);
+
+	for (; depth > 0; --depth)
+	{
+		result.append(depth - 1, '\t');
+		result += '}';
+		result += newline;
+	}
+}
+
+// Minified scripts are a single long line
+static void generateMinified(std::string& result, BenchRandom& rng, size_t size)
+{
+	while (result.size() < size)
+	{
+		result += "var ";
+		appendIdentifier(result, rng);
+		result += "=function(";
+		appendIdentifier(result, rng);
+		result += "){return ";
+		appendIdentifier(result, rng);
+		appendFormat(result, "+%d};", rng(100));
+	}
+
+	result += '\n';
+}
+
+static std::string getCorpusFilePath(const std::string& corpus, size_t index)
+{
+	// one in 16 files is minified and one in 5 uses CRLF line endings
+	const char* ext = (index % 16 == 15) ? "js" : (index % 5 == 2) ? "cs" : (index % 2) ? "hpp" : "cpp";
+
+	std::string result = corpus;
+	appendFormat(result, "/module_%d/part_%d/file_%d.%s", int(index % 64), int(index / 64 % 4), int(index), ext);
+
+	return result;
+}
+
+static void generateCorpusFile(std::string& result, size_t index)
+{
+	BenchRandom rng(kBenchSeed ^ (index * 0xff51afd7ed558ccdull));
+
+	result.clear();
+
+	if (index % 16 == 15)
+		generateMinified(result, rng, 64 * 1024 + rng(192 * 1024));
+	else
+		generateCode(result, rng, 1024 + rng(32 * 1024), (index % 5 == 2) ? "\r\n" : "\n");
+}
+
+static bool writeCorpusFile(Output* output, const std::string& path, const std::string& data)
+{
+	createPathForFile(path.c_str());
+
+	FileStream out(path.c_str(), "wb");
+
+	if (!out || out.write(data.c_str(), data.size()) != data.size())
+	{
+		output->error("Error writing file %s\n", path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+static bool generateCorpus(Output* output, const std::string& corpus, size_t size, size_t& fileCount, uint64_t& total)
+{
+	std::string data;
+
+	total = 0;
+
+	for (fileCount = 0; total < size; ++fileCount)
+	{
+		generateCorpusFile(data, fileCount);
+
+		if (!writeCorpusFile(output, getCorpusFilePath(corpus, fileCount), data))
+			return false;
+
+		total += data.size();
+	}
+
+	return true;
+}
+
+static bool changeCorpus(Output* output, const std::string& corpus, size_t fileCount, size_t& changedCount)
+{
+	std::string data;
+
+	changedCount = 0;
+
+	for (size_t i = 0; i < fileCount; i += kBenchChangeInterval)
+	{
+		generateCorpusFile(data, i);
+		data += "// changed\n";
+
+		if (!writeCorpusFile(output, getCorpusFilePath(corpus, i), data))
+			return false;
+
+		changedCount++;
+	}
+
+	return true;
+}
+
+static void setWorkerCount(const char* value)
+{
+#ifdef _WIN32
+	_putenv_s("QGREP_WORKERS", value ? value : "");
+#else
+	if (value)
+		setenv("QGREP_WORKERS", value, 1);
+	else
+		unsetenv("QGREP_WORKERS");
+#endif
+}
+
+// Thread counts double up to the number of workers searches would use
+static std::vector<unsigned int> getBenchThreadCounts()
+{
+	unsigned int maxCount = WorkQueue::getIdealWorkerCount();
+
+	std::vector<unsigned int> result;
+
+	for (unsigned int count = 1; count < maxCount; count *= 2)
+		result.push_back(count);
+
+	result.push_back(maxCount);
+
+	return result;
+}
+
+static void benchSearch(std::string& json, BenchOutput& output, const std::string& project, const BenchQuery& query, unsigned int threads, uint64_t corpusSize)
+{
+	std::vector<std::string> files(1, project);
+
+	double bestTime = 0;
+	std::string bestFirst;
+	unsigned int matches = 0;
+	SearchStatistics best;
+
+	for (unsigned int run = 0; run < kBenchRepeats; ++run)
+	{
+		SearchStatistics statistics;
+
+		output.reset();
+		matches = searchProject(&output, files, query.query, query.options, query.limit ? query.limit : ~0u, nullptr, nullptr, nullptr, &statistics);
+
+		double time = BenchOutput::getSeconds(output.start, BenchClock::now());
+
+		if (run == 0 || time < bestTime)
+		{
+			bestTime = time;
+			bestFirst = output.getFirstResultTime();
+			best = statistics;
+		}
+	}
+
+	json += "    {\"name\": ";
+	appendJsonString(json, query.name);
+	json += ", \"query\": ";
+	appendJsonString(json, query.query);
+	appendFormat(json, ", \"threads\": %u, \"seconds\": %.6f, \"firstResultSeconds\": %s, \"matches\": %u", threads, bestTime, bestFirst.c_str(), matches);
+	appendFormat(json, ", \"chunks\": %llu, \"chunksSkipped\": %llu, \"indexSkipRate\": %.4f, \"chunksPerSecond\": %.1f",
+		(unsigned long long)best.chunkCount, (unsigned long long)best.chunksSkipped,
+		best.chunkCount ? double(best.chunksSkipped) / best.chunkCount : 0.0, getRate(best.chunksSearched, bestTime));
+	appendFormat(json, ", \"decompressedMBps\": %.1f, \"scannedMBps\": %.1f}",
+		getRate(best.uncompressedSize / 1e6, bestTime), getRate(corpusSize / 1e6, bestTime));
+}
+
+static void benchFilter(std::string& json, BenchOutput& output, const std::string& project, const BenchQuery& query, unsigned int threads, size_t fileCount)
+{
+	double bestTime = 0;
+	std::string bestFirst;
+	unsigned int matches = 0;
+
+	for (unsigned int run = 0; run < kBenchRepeats; ++run)
+	{
+		output.reset();
+		matches = searchFiles(&output, project.c_str(), query.query, query.options, query.limit ? query.limit : ~0u, nullptr, nullptr);
+
+		double time = BenchOutput::getSeconds(output.start, BenchClock::now());
+
+		if (run == 0 || time < bestTime)
+		{
+			bestTime = time;
+			bestFirst = output.getFirstResultTime();
+		}
+	}
+
+	json += "    {\"name\": ";
+	appendJsonString(json, query.name);
+	json += ", \"query\": ";
+	appendJsonString(json, query.query);
+	appendFormat(json, ", \"threads\": %u, \"seconds\": %.6f, \"firstResultSeconds\": %s, \"matches\": %u, \"entriesPerSecond\": %.1f}",
+		threads, bestTime, bestFirst.c_str(), matches, getRate(fileCount, bestTime));
+}
+
+bool runBenchmark(Output* output, const char* path, size_t size)
+{
+	std::string root = normalizePath(getCurrentDirectory().c_str(), path);
+	// corpora of different sizes go to different folders so that files of a larger corpus don't stay in a smaller one
+	std::string corpus = root + "/corpus-" + std::to_string(size >> 20);
+	std::string project = root + "/bench.cfg";
+
+	BenchOutput bout(output);
+
+	size_t fileCount = 0;
+	uint64_t corpusSize = 0;
+
+	if (!generateCorpus(output, corpus, size, fileCount, corpusSize))
+		return false;
+
+	{
+		std::string config = "path " + corpus + "\n";
+
+		if (!writeCorpusFile(output, project, config))
+			return false;
+	}
+
+	std::string json = "{\n";
+
+	// build
+	bout.reset();
+	buildProject(&bout, project.c_str());
+
+	double buildTime = BenchOutput::getSeconds(bout.start, BenchClock::now());
+
+	uint64_t mtime = 0, packSize = 0;
+	getFileAttributes(replaceExtension(project.c_str(), ".qgd").c_str(), &mtime, &packSize);
+
+	if (bout.errors)
+		return false;
+
+	appendFormat(json, "  \"corpus\": {\"files\": %llu, \"size\": %llu},\n", (unsigned long long)fileCount, (unsigned long long)corpusSize);
+	appendFormat(json, "  \"build\": {\"seconds\": %.6f, \"inputMBps\": %.1f, \"packSize\": %llu},\n", buildTime, getRate(corpusSize / 1e6, buildTime), (unsigned long long)packSize);
+
+	// update without changes only scans the files, the second update rebuilds the chunks with changed files
+	size_t changedCount = 0;
+
+	bout.reset();
+	bool updated = updateProject(&bout, project.c_str());
+	double updateTime = BenchOutput::getSeconds(bout.start, BenchClock::now());
+
+	if (!updated || !changeCorpus(output, corpus, fileCount, changedCount))
+		return false;
+
+	bout.reset();
+	updated = updateProject(&bout, project.c_str());
+	double changeTime = BenchOutput::getSeconds(bout.start, BenchClock::now());
+
+	if (!updated)
+		return false;
+
+	appendFormat(json, "  \"update\": [\n    {\"changedFiles\": 0, \"seconds\": %.6f},\n    {\"changedFiles\": %llu, \"seconds\": %.6f}\n  ],\n",
+		updateTime, (unsigned long long)changedCount, changeTime);
+
+	// searches and filters use the given number of workers
+	const char* workers = getenv("QGREP_WORKERS");
+	std::string savedWorkers = workers ? workers : "";
+
+	std::vector<unsigned int> threadCounts = getBenchThreadCounts();
+
+	json += "  \"search\": [\n";
+
+	for (size_t i = 0; i < sizeof(kBenchSearchQueries) / sizeof(kBenchSearchQueries[0]); ++i)
+		for (size_t j = 0; j < threadCounts.size(); ++j)
+		{
+			setWorkerCount(std::to_string(threadCounts[j]).c_str());
+
+			benchSearch(json, bout, project, kBenchSearchQueries[i], threadCounts[j], corpusSize);
+			json += (i + 1 < sizeof(kBenchSearchQueries) / sizeof(kBenchSearchQueries[0]) || j + 1 < threadCounts.size()) ? ",\n" : "\n";
+		}
+
+	json += "  ],\n  \"filter\": [\n";
+
+	for (size_t i = 0; i < sizeof(kBenchFilterQueries) / sizeof(kBenchFilterQueries[0]); ++i)
+		for (size_t j = 0; j < threadCounts.size(); ++j)
+		{
+			setWorkerCount(std::to_string(threadCounts[j]).c_str());
+
+			benchFilter(json, bout, project, kBenchFilterQueries[i], threadCounts[j], fileCount);
+			json += (i + 1 < sizeof(kBenchFilterQueries) / sizeof(kBenchFilterQueries[0]) || j + 1 < threadCounts.size()) ? ",\n" : "\n";
+		}
+
+	json += "  ]\n}\n";
+
+	setWorkerCount(workers ? savedWorkers.c_str() : nullptr);
+
+	output->rawprint(json.c_str(), json.size());
+
+	return bout.errors == 0;
+}
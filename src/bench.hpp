@@ -0,0 +1,9 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <stddef.h>
+
+class Output;
+
+// Generates a synthetic corpus of about the given size in the directory, builds, updates and searches it, and prints the measurements as JSON
+bool runBenchmark(Output* output, const char* path, size_t size);
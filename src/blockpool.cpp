@@ -3,47 +3,78 @@
 
 #include "blockpool.hpp"
 
-static char* pop(std::vector<char*>& v)
+#include "constants.hpp"
+#include "fileutil.hpp"
+
+#include <algorithm>
+#include <new>
+
+// Block data starts after the header, aligned to a cache line
+static const size_t kBlockHeaderSize = 64;
+static const unsigned int kSeparateBlock = ~0u;
+
+static_assert(sizeof(BlockHeader) <= kBlockHeaderSize, "Block header doesn't fit");
+
+static size_t roundUp(size_t value, size_t alignment)
 {
-	char* r = v.back();
-	v.pop_back();
-	return r;
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static unsigned int getThreadIndex()
+{
+	static std::atomic<unsigned int> nextThread(0);
+	thread_local unsigned int thread = nextThread++;
+
+	return thread;
 }
 
-BlockPool::BlockPool(size_t blockSize): blockSize(blockSize), liveBlocks(0)
+BlockPool::BlockPool(size_t blockSize, int node): blockSize(blockSize), node(node), cache(new CacheSlot[kCacheSlots]), freeList(0), slabs(new std::atomic<char*>[kMaxSlabs]()), slabCount(0), liveBlocks(0)
 {
+	blockStride = roundUp(kBlockHeaderSize + blockSize, kBlockHeaderSize);
+	slabSize = roundUp(std::max(kBlockPoolSlabSize, blockStride), kLargePageSize);
+	slabBlocks = slabSize / blockStride;
 }
 
 BlockPool::~BlockPool()
 {
 	assert(liveBlocks == 0);
 
-	for (size_t i = 0; i < blocks.size(); ++i)
-		delete[] blocks[i];
+	for (size_t i = 0; i < slabCount; ++i)
+		freeLargePages(slabs[i], slabSize);
 }
 
-std::shared_ptr<char> BlockPool::allocate(size_t size)
+BlockRef BlockPool::allocate(size_t size)
 {
-	if (size > blockSize)
-		return std::shared_ptr<char>(new char[size], std::default_delete<char[]>());
+	BlockHeader* block = nullptr;
 
-	std::lock_guard<std::mutex> lock(mutex);
+	if (size <= blockSize)
+	{
+		block = cache[getThreadIndex() % kCacheSlots].block.exchange(nullptr, std::memory_order_acquire);
 
-	char* block = blocks.empty() ? new char[blockSize] : pop(blocks);
+		if (!block)
+			block = pop();
 
-	liveBlocks++;
+		if (!block)
+			block = grow();
+	}
 
-	return std::shared_ptr<char>(block, [this](char* block) {
-		std::lock_guard<std::mutex> lock(this->mutex);
+	// large blocks and blocks that don't fit into the slab table are allocated separately
+	if (!block)
+	{
+		block = new (operator new(kBlockHeaderSize + size)) BlockHeader();
+		block->index = kSeparateBlock;
+		block->size = size;
+	}
+
+	block->pool = this;
+	block->refs.store(1, std::memory_order_relaxed);
 
-		assert(liveBlocks > 0);
-		liveBlocks--;
+	liveBlocks++;
 
-		blocks.push_back(block);
-	});
+	return BlockRef(block, reinterpret_cast<char*>(block) + kBlockHeaderSize);
 }
 
-std::shared_ptr<char> BlockPool::allocate(size_t size, std::nothrow_t)
+BlockRef BlockPool::allocate(size_t size, std::nothrow_t)
 {
 	try
 	{
@@ -51,6 +82,102 @@ std::shared_ptr<char> BlockPool::allocate(size_t size, std::nothrow_t)
 	}
 	catch (const std::bad_alloc&)
 	{
-		return std::shared_ptr<char>();
+		return BlockRef();
+	}
+}
+
+BlockHeader* BlockPool::getBlock(unsigned int index) const
+{
+	char* slab = slabs[index / slabBlocks].load(std::memory_order_acquire);
+
+	return reinterpret_cast<BlockHeader*>(slab + (index % slabBlocks) * blockStride);
+}
+
+BlockHeader* BlockPool::pop()
+{
+	uint64_t head = freeList.load(std::memory_order_acquire);
+
+	for (;;)
+	{
+		unsigned int index = static_cast<unsigned int>(head);
+
+		if (index == 0)
+			return nullptr;
+
+		// the block can be popped by another thread at the same time; the version makes sure the exchange fails in that case
+		BlockHeader* block = getBlock(index - 1);
+		unsigned int next = block->next.load(std::memory_order_relaxed);
+
+		uint64_t newHead = (((head >> 32) + 1) << 32) | next;
+
+		if (freeList.compare_exchange_weak(head, newHead, std::memory_order_acquire, std::memory_order_acquire))
+			return block;
 	}
 }
+
+void BlockPool::push(BlockHeader* block)
+{
+	uint64_t head = freeList.load(std::memory_order_relaxed);
+	uint64_t newHead;
+
+	do
+	{
+		block->next.store(static_cast<unsigned int>(head), std::memory_order_relaxed);
+		newHead = (((head >> 32) + 1) << 32) | (block->index + 1);
+	}
+	while (!freeList.compare_exchange_weak(head, newHead, std::memory_order_release, std::memory_order_relaxed));
+}
+
+BlockHeader* BlockPool::grow()
+{
+	std::lock_guard<std::mutex> lock(slabMutex);
+
+	// another thread could have added a slab while this one was waiting
+	if (BlockHeader* block = pop())
+		return block;
+
+	size_t count = slabCount;
+
+	if (count == kMaxSlabs)
+		return nullptr;
+
+	char* slab = static_cast<char*>(allocateLargePages(slabSize, node));
+
+	if (!slab)
+		throw std::bad_alloc();
+
+	slabs[count].store(slab, std::memory_order_release);
+	slabCount = count + 1;
+
+	for (size_t i = 0; i < slabBlocks; ++i)
+	{
+		BlockHeader* block = new (slab + i * blockStride) BlockHeader();
+		block->index = static_cast<unsigned int>(count * slabBlocks + i);
+		block->size = blockSize;
+	}
+
+	// the first block is returned, the rest are published for other threads
+	for (size_t i = slabBlocks; i > 1; --i)
+		push(reinterpret_cast<BlockHeader*>(slab + (i - 1) * blockStride));
+
+	return reinterpret_cast<BlockHeader*>(slab);
+}
+
+void BlockPool::free(BlockHeader* block)
+{
+	assert(liveBlocks > 0);
+	liveBlocks--;
+
+	if (block->index == kSeparateBlock)
+	{
+		block->~BlockHeader();
+		operator delete(block);
+		return;
+	}
+
+	// the block that was freed last on this thread is likely still in cache, so it's reused first
+	BlockHeader* old = cache[getThreadIndex() % kCacheSlots].block.exchange(block, std::memory_order_acq_rel);
+
+	if (old)
+		push(old);
+}
@@ -2,22 +2,156 @@
 #pragma once
 
 #include <mutex>
-#include <vector>
+#include <atomic>
 #include <memory>
+#include <utility>
 
+class BlockPool;
+
+// Header in front of every block; the reference count lives in the block so that handles don't allocate
+struct BlockHeader
+{
+	std::atomic<unsigned int> refs;
+	std::atomic<unsigned int> next;
+
+	BlockPool* pool;
+
+	// blocks that don't fit the pool block size are allocated separately and have no index
+	unsigned int index;
+	size_t size;
+};
+
+// Reference counted handle to a block; like std::shared_ptr, a handle can point into the middle of the block it keeps alive
+class BlockRef
+{
+public:
+	BlockRef(): header(nullptr), data(nullptr)
+	{
+	}
+
+	BlockRef(const BlockRef& other, char* data): header(other.header), data(data)
+	{
+		retain();
+	}
+
+	BlockRef(const BlockRef& other): header(other.header), data(other.data)
+	{
+		retain();
+	}
+
+	BlockRef(BlockRef&& other): header(other.header), data(other.data)
+	{
+		other.header = nullptr;
+		other.data = nullptr;
+	}
+
+	~BlockRef()
+	{
+		release();
+	}
+
+	BlockRef& operator=(BlockRef other)
+	{
+		std::swap(header, other.header);
+		std::swap(data, other.data);
+
+		return *this;
+	}
+
+	char* get() const
+	{
+		return data;
+	}
+
+	BlockPool* getPool() const
+	{
+		return header ? header->pool : nullptr;
+	}
+
+	explicit operator bool() const
+	{
+		return data != nullptr;
+	}
+
+private:
+	friend class BlockPool;
+
+	BlockRef(BlockHeader* header, char* data): header(header), data(data)
+	{
+	}
+
+	void retain()
+	{
+		if (header)
+			header->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void release();
+
+	BlockHeader* header;
+	char* data;
+};
+
+// Blocks are carved out of large page backed slabs; freed blocks go to a per-thread cache slot first and to a lock-free free list after that
 class BlockPool
 {
 public:
-    BlockPool(size_t blockSize);
+	// Slabs are placed on the NUMA node if one is given
+	BlockPool(size_t blockSize, int node = -1);
 	~BlockPool();
 
-	std::shared_ptr<char> allocate(size_t size);
-	std::shared_ptr<char> allocate(size_t size, std::nothrow_t);
+	BlockRef allocate(size_t size);
+	BlockRef allocate(size_t size, std::nothrow_t);
 
 private:
-    size_t blockSize;
+	friend class BlockRef;
+
+	static const size_t kMaxSlabs = 4096;
+	static const size_t kCacheSlots = 64;
+
+	// each slot keeps one free block; threads use the slot that matches their index, so contention only happens with many threads
+	struct CacheSlot
+	{
+		std::atomic<BlockHeader*> block;
+		char padding[64 - sizeof(std::atomic<BlockHeader*>)];
+
+		CacheSlot(): block(nullptr)
+		{
+		}
+	};
+
+	BlockHeader* getBlock(unsigned int index) const;
+
+	BlockHeader* pop();
+	void push(BlockHeader* block);
+	BlockHeader* grow();
 
-	std::mutex mutex;
-	std::vector<char*> blocks;
-	size_t liveBlocks;
-};
\ No newline at end of file
+	void free(BlockHeader* block);
+
+	size_t blockSize;
+	int node;
+
+	size_t blockStride;
+	size_t slabSize;
+	size_t slabBlocks;
+
+	std::unique_ptr<CacheSlot[]> cache;
+
+	// the free list head is a block index + 1 in the low half and a version in the high half, which prevents ABA problems
+	std::atomic<uint64_t> freeList;
+
+	std::mutex slabMutex;
+	std::unique_ptr<std::atomic<char*>[]> slabs;
+	std::atomic<size_t> slabCount;
+
+	std::atomic<size_t> liveBlocks;
+
+	BlockPool(const BlockPool&);
+	BlockPool& operator=(const BlockPool&);
+};
+
+inline void BlockRef::release()
+{
+	if (header && header->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		header->pool->free(header);
+}
@@ -1,6 +1,12 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
+#include <string.h>
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+#include "charsimd.hpp"
+#endif
+
 inline unsigned int ngram(char a, char b, char c, char d)
 {
     return (static_cast<unsigned char>(a) << 24) + (static_cast<unsigned char>(b) << 16) + (static_cast<unsigned char>(c) << 8) + static_cast<unsigned char>(d);
@@ -62,3 +68,77 @@ inline bool bloomFilterExists(const unsigned char* data, unsigned int size, unsi
 
     return true;
 }
+
+// Build never uses more iterations than this
+const unsigned int kBloomMaxIterations = 16;
+
+// Blocked variant keeps all bits for a value in one cache line; block count has to be a power of two
+const unsigned int kBloomBlockSize = 64;
+
+// Precomputed block hash and bit mask for a value; allows checking many blocked filters without rehashing
+struct BloomBlockedProbe
+{
+    unsigned char mask[kBloomBlockSize];
+    unsigned int hash;
+};
+
+inline void bloomBlockedProbePrepare(BloomBlockedProbe& probe, unsigned int value, unsigned int iterations)
+{
+    unsigned int h1 = bloomHash1(value);
+    unsigned int h2 = bloomHash2(value);
+    unsigned int hv = (h1 >> 16) | (h1 << 16);
+
+    memset(probe.mask, 0, sizeof(probe.mask));
+    probe.hash = h1;
+
+    for (unsigned int i = 0; i < iterations; ++i)
+    {
+        hv += h2;
+        unsigned int h = hv >> 23;
+
+        probe.mask[h / 8] |= 1 << (h % 8);
+    }
+}
+
+inline void bloomBlockedFilterUpdate(unsigned char* data, unsigned int size, unsigned int value, unsigned int iterations)
+{
+    assert(size % kBloomBlockSize == 0 && ((size / kBloomBlockSize) & (size / kBloomBlockSize - 1)) == 0);
+
+    BloomBlockedProbe probe;
+    bloomBlockedProbePrepare(probe, value, iterations);
+
+    unsigned char* dest = data + (probe.hash & (size / kBloomBlockSize - 1)) * kBloomBlockSize;
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+    for (unsigned int i = 0; i < kBloomBlockSize; i += 16)
+        simd_store(dest + i, simd_or(simd_load(dest + i), simd_load(probe.mask + i)));
+#else
+    for (unsigned int i = 0; i < kBloomBlockSize; ++i)
+        dest[i] |= probe.mask[i];
+#endif
+}
+
+inline bool bloomBlockedFilterExists(const unsigned char* data, unsigned int size, const BloomBlockedProbe& probe)
+{
+    assert(size % kBloomBlockSize == 0 && ((size / kBloomBlockSize) & (size / kBloomBlockSize - 1)) == 0);
+
+    const unsigned char* src = data + (probe.hash & (size / kBloomBlockSize - 1)) * kBloomBlockSize;
+    const unsigned char* mask = probe.mask;
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+    simd16 m0 = simd_load(mask + 0), m1 = simd_load(mask + 16), m2 = simd_load(mask + 32), m3 = simd_load(mask + 48);
+
+    simd16 r0 = simd_cmpeq(simd_and(simd_load(src + 0), m0), m0);
+    simd16 r1 = simd_cmpeq(simd_and(simd_load(src + 16), m1), m1);
+    simd16 r2 = simd_cmpeq(simd_and(simd_load(src + 32), m2), m2);
+    simd16 r3 = simd_cmpeq(simd_and(simd_load(src + 48), m3), m3);
+
+    return simd_movemask(simd_and(simd_and(r0, r1), simd_and(r2, r3))) == 0xffff;
+#else
+    for (unsigned int i = 0; i < kBloomBlockSize; ++i)
+        if ((src[i] & mask[i]) != mask[i])
+            return false;
+
+    return true;
+#endif
+}
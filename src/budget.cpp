@@ -0,0 +1,72 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "budget.hpp"
+
+#include "constants.hpp"
+#include "fileutil.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+static std::atomic<size_t> projectBudget(0);
+
+static size_t getEnvironmentMemoryBudget()
+{
+	// shared hosts and containers can limit the memory qgrep uses
+	if (const char* env = getenv("QGREP_MEMORY"))
+	{
+		char* end;
+		unsigned long long size = strtoull(env, &end, 10);
+
+		if (*end == 0 && size > 0)
+			return size_t(std::min(size, (unsigned long long)(SIZE_MAX / 2) >> 20) << 20);
+	}
+
+	return 0;
+}
+
+static size_t computeMemoryBudget()
+{
+	if (size_t size = getEnvironmentMemoryBudget())
+		return size;
+
+	uint64_t memory = getPhysicalMemorySize();
+
+	if (memory == 0)
+		return kMemoryBudgetDefault;
+
+	return size_t(std::min(memory / kMemoryBudgetShare, uint64_t(SIZE_MAX / 2)));
+}
+
+size_t getMemoryBudget()
+{
+	static size_t budget = computeMemoryBudget();
+	static bool environment = getEnvironmentMemoryBudget() != 0;
+
+	size_t project = projectBudget.load(std::memory_order_relaxed);
+
+	return (project && !environment) ? project : budget;
+}
+
+void setMemoryBudget(size_t size)
+{
+	projectBudget.store(size, std::memory_order_relaxed);
+}
+
+size_t getQueuedDataLimit()
+{
+	return std::max(getMemoryBudget() / kQueuedChunkDataShare, kMinQueuedChunkData);
+}
+
+size_t getBufferedOutputLimit()
+{
+	return std::max(getMemoryBudget() / kBufferedOutputShare, kMinBufferedOutput);
+}
+
+size_t getPendingDataLimit()
+{
+	return std::max(getMemoryBudget() / kPendingDataShare, kMinPendingData);
+}
@@ -0,0 +1,17 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <stddef.h>
+
+// Memory that data in flight can take, in bytes; QGREP_MEMORY sets it in megabytes, by default it's a share of the physical memory
+size_t getMemoryBudget();
+
+// Replaces the default budget with a project setting; QGREP_MEMORY takes precedence, and limits that were already taken stay as they are
+void setMemoryBudget(size_t size);
+
+// Chunk data queued for workers; all work queues of the process share this limit
+size_t getQueuedDataLimit();
+// Output that searches buffer until it can be written in order
+size_t getBufferedOutputLimit();
+// File contents that build reads ahead, and existing chunks that update reads ahead
+size_t getPendingDataLimit();
@@ -7,14 +7,20 @@
 #include "fileutil.hpp"
 #include "filestream.hpp"
 #include "constants.hpp"
+#include "budget.hpp"
 #include "project.hpp"
 #include "encoding.hpp"
+#include "classify.hpp"
 #include "files.hpp"
+#include "slices.hpp"
+#include "postings.hpp"
+#include "snapshot.hpp"
 #include "bloom.hpp"
-#include "casefold.hpp"
+#include "ngrams.hpp"
 #include "compression.hpp"
 #include "workqueue.hpp"
 #include "blockingqueue.hpp"
+#include "blockpool.hpp"
 
 #include <algorithm>
 #include <vector>
@@ -23,8 +29,15 @@
 #include <string>
 #include <memory>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <future>
+#include <functional>
+#include <chrono>
 
 #include <string.h>
+#include <math.h>
 
 struct BuildStatistics
 {
@@ -68,6 +81,21 @@ struct File
 	uint32_t startLine;
 	uint64_t fileSize;
 	uint64_t timeStamp;
+
+	// class of the file and the way it's stored, see DataChunkFileFlags
+	unsigned int flags;
+
+	// files that were read from disk in one piece can be stored as references to the same contents stored earlier
+	bool complete;
+	bool reference;
+	uint64_t contentHash;
+};
+
+// Reference to stored contents; the alias table is built from these once all chunks are stored
+struct FileReference
+{
+	std::string path;
+	uint64_t contentHash;
 };
 
 struct Chunk
@@ -82,8 +110,9 @@ struct Chunk
 
 struct ChunkData
 {
-	std::unique_ptr<char[]> data;
+	BlockRef data;
 	size_t size;
+	size_t fileCount;
 
 	size_t dataOffset;
 	size_t dataSize;
@@ -94,21 +123,48 @@ struct ChunkIndex
 	std::unique_ptr<char[]> data;
 	size_t size;
 	unsigned int iterations;
+	unsigned int type;
 
-	ChunkIndex(): size(0), iterations(0)
+	ChunkIndex(): size(0), iterations(0), type(DCI_BLOOM)
 	{
 	}
 };
 
+// Files are read and converted by workers; results are appended in the order files were added
+struct FileRead
+{
+	std::string path;
+	uint64_t timeStamp;
+	uint64_t fileSize;
+
+	std::vector<char> contents;
+	uint64_t contentHash;
+	unsigned int classFlags;
+	bool opened;
+	bool allocated;
+
+	std::promise<void> ready;
+};
+
+struct PendingFileRead
+{
+	std::shared_ptr<FileRead> read;
+	std::future<void> ready;
+};
+
 struct ChunkFileData
 {
 	unsigned int order;
 
 	DataChunkHeader header;
-	std::unique_ptr<char[]> compressedData;
+	BlockRef compressedData;
 	std::unique_ptr<char[]> index;
 	std::unique_ptr<char[]> extra;
 	bool firstFileIsSuffix;
+
+	// chunk that is already stored in the data file that is appended to; only the directory entry is written
+	bool preserved;
+	DataChunkDirectoryEntry entry;
 };
 
 struct BuildContext
@@ -116,20 +172,65 @@ struct BuildContext
 	Output* output;
 	size_t fileCount;
 
+	size_t chunkSize;
+	double indexFalsePositiveRate;
+	bool blockIndices;
+	bool dedup;
+	FilePolicy policies[FC_COUNT];
+
+	// chunk contents and compressed chunks are allocated from pools that outlive the queues that refer to them
+	BlockPool chunkPool;
+	BlockPool compressedPool;
+
+	CompressionCodec codec;
+	int compressionLevel;
+
+	// zstd chunks use the dictionary once it's trained on the first chunks; until then the chunks are held back
+	std::shared_ptr<CompressionDictionary> dictionary;
+	bool dictionaryPending;
+	std::vector<std::pair<std::function<void()>, std::shared_ptr<ChunkData>>> heldChunks;
+	size_t heldSize;
+
+	// when appending, the dictionary can already be stored in the data file
+	bool append;
+	bool dictionaryStored;
+	uint64_t dictionaryOffset;
+
+	// new chunks are written starting at this offset; when appending, the existing data stays in place
+	uint64_t dataOffset;
+	bool commit;
+
 	std::list<File> pendingFiles;
 	size_t pendingSize;
 
 	FileStream outData;
 
+	std::deque<PendingFileRead> pendingReads;
+	uint64_t pendingReadSize;
+
+	// location of the first stored file for every content hash, and references to stored contents in file order
+	std::unordered_map<uint64_t, std::pair<unsigned int, unsigned int>> contents;
+	std::vector<FileReference> references;
+
+	std::vector<DataFileAliasEntry> aliases;
+	std::vector<char> aliasNames;
+
 	unsigned int chunkOrder;
 	WorkQueue prepareChunkQueue;
+	WorkQueue readFileQueue;
 	BlockingQueue<ChunkFileData> writeChunkQueue;
 	std::thread writeChunkThread;
 
-	BuildContext(Output* output, size_t fileCount)
-		: output(output), fileCount(fileCount), pendingSize(0), chunkOrder(0)
-		, prepareChunkQueue(std::max(WorkQueue::getIdealWorkerCount(), 2u) - 1, kMaxQueuedChunkData)
+	BuildContext(Output* output, size_t fileCount, const ProjectGroup& settings)
+		: output(output), fileCount(fileCount), chunkSize(settings.chunkSize), indexFalsePositiveRate(settings.indexFalsePositiveRate), blockIndices(settings.blockFilters), dedup(settings.dedup)
+		, chunkPool(settings.chunkSize * 3 / 2), compressedPool(settings.chunkSize / 2)
+		, codec(settings.compressionCodec), compressionLevel(settings.compressionLevel), dictionaryPending(settings.compressionCodec == CC_ZSTD), heldSize(0)
+		, append(false), dictionaryStored(false), dictionaryOffset(0)
+		, dataOffset(sizeof(DataFileHeader)), commit(true), pendingSize(0), pendingReadSize(0), chunkOrder(0)
+		, prepareChunkQueue(std::max(WorkQueue::getIdealWorkerCount(), 2u) - 1, getQueuedDataLimit())
+		, readFileQueue(WorkQueue::getIdealWorkerCount(), 0)
 	{
+		std::copy(settings.policies, settings.policies + FC_COUNT, policies);
 	}
 };
 
@@ -140,40 +241,86 @@ static void printStatistics(Output* output, const BuildStatistics& stats, unsign
 		stats.fileCount, (int)(stats.fileSize / 1024 / 1024), (int)(stats.resultSize / 1024 / 1024));
 }
 
-static size_t normalizeEOL(char* data, size_t size)
+static unsigned int getFileClassFlags(FileClass fileClass)
 {
-	// fast path: no \r in the file
-	if (memchr(data, '\r', size) == nullptr)
-		return size;
+	switch (fileClass)
+	{
+	case FC_BINARY: return DCF_BINARY;
+	case FC_GENERATED: return DCF_GENERATED;
+	default: return 0;
+	}
+}
 
-	// replace \r\n with \n, replace stray \r with \n
-	size_t result = 0;
+static unsigned int getFilePolicyFlags(const BuildContext* context, unsigned int classFlags)
+{
+	FileClass fileClass = (classFlags & DCF_BINARY) ? FC_BINARY : (classFlags & DCF_GENERATED) ? FC_GENERATED : FC_TEXT;
 
-	for (size_t i = 0; i < size; ++i)
+	switch (context->policies[fileClass])
 	{
-		if (data[i] == '\r')
-		{
-			data[result++] = '\n';
-			if (i + 1 < size && data[i + 1] == '\n') i++;
-		}
-		else
-			data[result++] = data[i];
+	case FP_STORE: return DCF_UNINDEXED;
+	case FP_SKIP: return DCF_SKIPPED;
+	default: return 0;
 	}
+}
 
-	return result;
+// MurmurHash64A; references are created for equal hashes, so the hash has to be good enough to never collide in practice
+static uint64_t getContentHash(const char* data, size_t size)
+{
+	const uint64_t m = 0xc6a4a7935bd1e995ull;
+	const int r = 47;
+
+	uint64_t h = 0x9e3779b97f4a7c15ull ^ (size * m);
+
+	const char* end = data + size / 8 * 8;
+
+	for (const char* p = data; p != end; p += 8)
+	{
+		uint64_t k;
+		memcpy(&k, p, sizeof(k));
+
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+
+		h ^= k;
+		h *= m;
+	}
+
+	switch (size & 7)
+	{
+	case 7: h ^= uint64_t(static_cast<unsigned char>(end[6])) << 48;
+	case 6: h ^= uint64_t(static_cast<unsigned char>(end[5])) << 40;
+	case 5: h ^= uint64_t(static_cast<unsigned char>(end[4])) << 32;
+	case 4: h ^= uint64_t(static_cast<unsigned char>(end[3])) << 24;
+	case 3: h ^= uint64_t(static_cast<unsigned char>(end[2])) << 16;
+	case 2: h ^= uint64_t(static_cast<unsigned char>(end[1])) << 8;
+	case 1: h ^= uint64_t(static_cast<unsigned char>(end[0]));
+		h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+
+	return h;
 }
 
-static std::vector<char> readFile(FileStream& in)
+static std::vector<char> readFile(FileStream& in, uint64_t fileSize)
 {
-	std::vector<char> result;
+	// read file as is; the size from the file list is only a hint since the file may have changed since
+	std::vector<char> result(fileSize);
 
-	// read file as is
-	char buffer[65536];
-	size_t readsize;
+	size_t readsize = fileSize ? in.read(&result[0], fileSize) : 0;
+	result.resize(readsize);
 
-	while ((readsize = in.read(buffer, sizeof(buffer))) > 0)
+	if (readsize == fileSize)
 	{
-		result.insert(result.end(), buffer, buffer + readsize);
+		char buffer[65536];
+
+		while ((readsize = in.read(buffer, sizeof(buffer))) > 0)
+		{
+			result.insert(result.end(), buffer, buffer + readsize);
+		}
 	}
 
 	// normalize new lines in a cross-platform way (don't rely on text-mode file I/O)
@@ -219,6 +366,10 @@ static File splitPrefix(File& file, size_t size)
 	file.contents.offset += size;
 	file.contents.count -= size;
 
+	// parts of a file can still be referenced but they can't refer to other contents
+	result.complete = false;
+	file.complete = false;
+
 	return result;
 }
 
@@ -249,7 +400,7 @@ static void appendChunkFilePrefix(Chunk& chunk, File& file, size_t remainingSize
 	}
 }
 
-static void writeChunk(BuildContext* context, unsigned int order, const DataChunkHeader& header, std::unique_ptr<char[]> compressedData, std::unique_ptr<char[]> index, std::unique_ptr<char[]> extra, bool firstFileIsSuffix)
+static void writeChunk(BuildContext* context, unsigned int order, const DataChunkHeader& header, BlockRef compressedData, std::unique_ptr<char[]> index, std::unique_ptr<char[]> extra, bool firstFileIsSuffix)
 {
 	assert(compressedData);
 	ChunkFileData chunk = { order, header, std::move(compressedData), std::move(index), std::move(extra), firstFileIsSuffix };
@@ -277,7 +428,7 @@ static size_t getChunkDataTotalSize(const Chunk& chunk)
 	return result;
 }
 
-static ChunkData prepareChunkData(const Chunk& chunk)
+static ChunkData prepareChunkData(BlockPool& pool, const Chunk& chunk)
 {
 	size_t headerSize = sizeof(DataChunkFileHeader) * chunk.files.size();
 	size_t nameSize = getChunkNameTotalSize(chunk);
@@ -285,8 +436,9 @@ static ChunkData prepareChunkData(const Chunk& chunk)
 	size_t totalSize = headerSize + nameSize + dataSize;
 
 	ChunkData result;
-	result.data.reset(new char[totalSize]);
+	result.data = pool.allocate(totalSize);
 	result.size = totalSize;
+	result.fileCount = chunk.files.size();
 	result.dataOffset = headerSize + nameSize;
 	result.dataSize = dataSize;
 
@@ -298,7 +450,10 @@ static ChunkData prepareChunkData(const Chunk& chunk)
 		const File& f = chunk.files[i];
 
 		memcpy(result.data.get() + nameOffset, f.name.c_str(), f.name.length());
-		memcpy(result.data.get() + dataOffset, f.contents.data(), f.contents.size());
+
+		// references and empty files have no contents, and their blobs may have no storage
+		if (f.contents.size())
+			memcpy(result.data.get() + dataOffset, f.contents.data(), f.contents.size());
 
 		DataChunkFileHeader& h = reinterpret_cast<DataChunkFileHeader*>(result.data.get())[i];
 
@@ -308,11 +463,13 @@ static ChunkData prepareChunkData(const Chunk& chunk)
 		h.dataSize = f.contents.size();
 
 		h.startLine = f.startLine;
-		h.reserved = 0;
+		h.flags = f.flags | (f.reference ? DCF_REFERENCE : 0);
 
 		h.fileSize = f.fileSize;
 		h.timeStamp = f.timeStamp;
 
+		h.contentHash = f.contentHash;
+
 		nameOffset += f.name.size();
 		dataOffset += f.contents.size();
 	}
@@ -322,12 +479,9 @@ static ChunkData prepareChunkData(const Chunk& chunk)
 	return result;
 }
 
-static size_t getChunkIndexSize(size_t dataSize)
+static size_t getChunkIndexMaxSize(size_t dataSize)
 {
-	// data compression ratio is ~5x
-	// we want the index to be ~10% of the compressed data
-	// so index is ~50x smaller than the original data
-	size_t indexSize = dataSize / 50;
+	size_t indexSize = dataSize / kChunkIndexMaxRatio;
 
 	// don't bother storing tiny indices
 	return indexSize < 1024 ? 0 : indexSize;
@@ -340,164 +494,485 @@ static unsigned int getIndexHashIterations(unsigned int indexSize, unsigned int
 	unsigned int n = itemCount;
 	double k = n == 0 ? 1.0 : 0.693147181 * static_cast<double>(m) / static_cast<double>(n);
 
-	return (k < 1) ? 1 : (k > 16) ? 16 : static_cast<unsigned int>(k);
+	return (k < 1) ? 1 : (k > kBloomMaxIterations) ? kBloomMaxIterations : static_cast<unsigned int>(k);
 }
 
-struct IntSet
+// Items land in blocks with a Poisson distribution, so the rate is averaged over block loads instead of using the mean load
+static double getIndexBlockedFalsePositiveRate(size_t indexSize, size_t itemCount, unsigned int iterations)
 {
-	unsigned int* data;
-	size_t capacity;
-	size_t size;
+	const double kBlockBits = kBloomBlockSize * 8;
 
-	IntSet(size_t capacity = 0): data(new unsigned int[capacity]), capacity(capacity), size(0)
-	{
-		assert((capacity & (capacity - 1)) == 0);
+	if (itemCount == 0)
+		return 0;
 
-		memset(data, 0, capacity * sizeof(unsigned int));
-	}
+	double k = iterations;
+	double load = static_cast<double>(itemCount) / static_cast<double>(indexSize / kBloomBlockSize);
+	double spread = 8 * sqrt(load) + 8;
+
+	double result = 0;
 
-	~IntSet()
+	for (double j = std::max(0.0, floor(load - spread)); j <= load + spread; j += 1)
 	{
-		delete[] data;
+		double probability = exp(j * log(load) - load - lgamma(j + 1));
+		double filled = 1 - pow(1 - 1 / kBlockBits, k * j);
+
+		result += probability * pow(filled, k);
 	}
 
-	IntSet(const IntSet&) = delete;
-	IntSet(IntSet&&) = delete;
-	IntSet& operator=(const IntSet&) = delete;
-	IntSet& operator=(IntSet&&) = delete;
+	return result;
+}
 
-	void grow()
-	{
-		IntSet res(std::max(capacity * 2, size_t(16)));
+static double getIndexOptimalBits(size_t itemCount, double falsePositiveRate)
+{
+	// m = -n ln p / (ln 2)^2
+	return -static_cast<double>(itemCount) * log(falsePositiveRate) / (0.693147181 * 0.693147181);
+}
+
+static std::pair<size_t, unsigned int> getChunkIndexSize(size_t dataSize, size_t itemCount, double falsePositiveRate)
+{
+	size_t maxSize = getChunkIndexMaxSize(dataSize);
 
-		for (size_t i = 0; i < capacity; ++i)
-			if (data[i])
-				res.insert(data[i]);
+	double bits = getIndexOptimalBits(itemCount, falsePositiveRate);
+	size_t indexSize = std::max(size_t(1024), std::min(maxSize, static_cast<size_t>(bits / 8) + 1));
 
-		std::swap(data, res.data);
-		std::swap(capacity, res.capacity);
-		assert(size == res.size);
-	}
+	return std::make_pair(indexSize, getIndexHashIterations(indexSize, itemCount));
+}
 
-	void insert(unsigned int key)
-	{
-		assert(key != 0);
+static std::pair<size_t, unsigned int> getChunkIndexBlockedSize(size_t dataSize, size_t itemCount, double falsePositiveRate)
+{
+	size_t maxSize = getChunkIndexMaxSize(dataSize);
+
+	// blocked index needs a power of two block count; slice indices can only fold indices with enough blocks
+	size_t blocks = kSliceIndexBlocks;
 
-		if (size >= capacity / 2)
-			grow();
+	// blocked filters need more bits than the classic estimate, so start from it and grow until the target is met
+	while (blocks * 2 * kBloomBlockSize * 8 <= getIndexOptimalBits(itemCount, falsePositiveRate))
+		blocks *= 2;
 
-		unsigned int m = capacity - 1;
-		unsigned int h = bloomHash2(key) & m;
-		unsigned int i = 0;
+	while (blocks > 1 && blocks * kBloomBlockSize > maxSize)
+		blocks /= 2;
 
-		while (data[h] != key)
+	for (;;)
+	{
+		size_t indexSize = blocks * kBloomBlockSize;
+
+		// blocked filters are not well described by the classic formula, so pick the best iteration count directly
+		unsigned int bestIterations = 1;
+		double bestRate = 1;
+
+		for (unsigned int k = 1; k <= kBloomMaxIterations; ++k)
 		{
-			if (data[h] == 0)
+			double rate = getIndexBlockedFalsePositiveRate(indexSize, itemCount, k);
+
+			if (rate < bestRate)
 			{
-				data[h] = key;
-				size++;
-				break;
+				bestIterations = k;
+				bestRate = rate;
 			}
+		}
 
-			i = i + 1;
-			h = (h + i) & m;
+		// slice indices need enough iterations to fold the index; use them if that still meets the target
+		if (bestIterations < kSliceIndexIterations && getIndexBlockedFalsePositiveRate(indexSize, itemCount, kSliceIndexIterations) <= falsePositiveRate)
+		{
+			bestIterations = kSliceIndexIterations;
+			bestRate = getIndexBlockedFalsePositiveRate(indexSize, itemCount, bestIterations);
 		}
-	}
 
-	static size_t optimalCapacity(size_t count)
-	{
-		size_t capacity = 1;
-		while (count >= capacity / 2)
-			capacity *= 2;
-		return capacity;
+		if (bestRate <= falsePositiveRate || indexSize * 2 > maxSize)
+			return std::make_pair(indexSize, bestIterations);
+
+		blocks *= 2;
 	}
-};
+}
 
-static ChunkIndex prepareChunkIndex(const char* data, size_t size)
+static std::vector<unsigned int> getChunkIndexNgrams(const char* data, size_t size, unsigned int indexType)
 {
-	// estimate index size
-	size_t indexSize = getChunkIndexSize(size);
-
-	if (indexSize == 0) return ChunkIndex();
+	// collect ngram data; ngrams that cross lines are skipped so that we don't waste bits on them
+	std::vector<unsigned int> ngrams;
+	extractNgrams(ngrams, data, size);
 
-	// collect ngram data; assume ~10% ngrams are unique
-	IntSet ngrams(IntSet::optimalCapacity(size / 10));
-
-	for (size_t i = 3; i < size; ++i)
+	// short ngrams share the filter with 4-grams; their keys only collide with 4-grams that start with a zero byte
+	if (indexType == DCI_BLOOMBLOCKED_SHORT)
 	{
-		char a = data[i - 3], b = data[i - 2], c = data[i - 1], d = data[i];
+		std::vector<unsigned int> shortNgrams;
+		extractShortNgrams(shortNgrams, data, size);
 
-		// don't waste bits on ngrams that cross lines
-		if (a != '\n' && b != '\n' && c != '\n' && d != '\n')
-		{
-			unsigned int n = ngram(casefold(a), casefold(b), casefold(c), casefold(d));
-			if (n != 0)
-				ngrams.insert(n);
-		}
+		ngrams.insert(ngrams.end(), shortNgrams.begin(), shortNgrams.end());
 	}
 
-	// estimate iteration count
-	unsigned int iterations = getIndexHashIterations(indexSize, ngrams.size);
+	return ngrams;
+}
 
-	// fill bloom filter
+static ChunkIndex fillChunkIndex(const std::vector<unsigned int>& ngrams, size_t indexSize, unsigned int iterations, unsigned int indexType)
+{
 	ChunkIndex result;
 	result.data.reset(new char[indexSize]);
 	result.size = indexSize;
 	result.iterations = iterations;
+	result.type = indexType;
 
 	unsigned char* index = reinterpret_cast<unsigned char*>(result.data.get());
 
 	memset(index, 0, indexSize);
 
-	for (size_t i = 0; i < ngrams.capacity; ++i)
-		if (unsigned int n = ngrams.data[i])
+	for (auto n: ngrams)
+	{
+		if (indexType != DCI_BLOOM)
+			bloomBlockedFilterUpdate(index, indexSize, n, iterations);
+		else
 			bloomFilterUpdate(index, indexSize, n, iterations);
+	}
+
+	return result;
+}
+
+static unsigned int getChunkIndexType()
+{
+	return kChunkIndexBlocked ? (kChunkIndexShortNgrams ? DCI_BLOOMBLOCKED_SHORT : DCI_BLOOMBLOCKED) : DCI_BLOOM;
+}
+
+static ChunkIndex prepareChunkIndex(const char* data, size_t size, double falsePositiveRate)
+{
+	if (getChunkIndexMaxSize(size) == 0) return ChunkIndex();
+
+	unsigned int indexType = getChunkIndexType();
+	std::vector<unsigned int> ngrams = getChunkIndexNgrams(data, size, indexType);
+
+	// size the index for the target false positive rate
+	std::pair<size_t, unsigned int> sizing = (indexType != DCI_BLOOM)
+		? getChunkIndexBlockedSize(size, ngrams.size(), falsePositiveRate)
+		: getChunkIndexSize(size, ngrams.size(), falsePositiveRate);
+
+	return fillChunkIndex(ngrams, sizing.first, sizing.second, indexType);
+}
+
+// Block indices are never folded into the slice index and have a fixed size, so only the iteration count depends on the contents
+static ChunkIndex prepareChunkBlockIndex(const char* data, size_t size)
+{
+	size_t blocks = 1;
+
+	while (blocks * 2 * kBloomBlockSize <= size / kChunkBlockIndexRatio)
+		blocks *= 2;
+
+	size_t indexSize = blocks * kBloomBlockSize;
+
+	std::vector<unsigned int> ngrams = getChunkIndexNgrams(data, size, DCI_BLOOMBLOCKED_SHORT);
+
+	unsigned int bestIterations = 1;
+	double bestRate = 1;
+
+	for (unsigned int k = 1; k <= kBloomMaxIterations; ++k)
+	{
+		double rate = getIndexBlockedFalsePositiveRate(indexSize, ngrams.size(), k);
+
+		if (rate < bestRate)
+		{
+			bestIterations = k;
+			bestRate = rate;
+		}
+	}
+
+	return fillChunkIndex(ngrams, indexSize, bestIterations, DCI_BLOOMBLOCKED_SHORT);
+}
+
+struct ChunkBlocks
+{
+	BlockRef data;
+	size_t size;
+
+	unsigned int count;
+	size_t tableSize;
+};
+
+// Blocks are split at file boundaries, so files that are in blocks that can't contain matches are skipped by searches as a whole
+static std::vector<std::pair<size_t, size_t>> getChunkBlockRanges(const ChunkData& data, size_t fileCount)
+{
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data.data.get());
+
+	std::vector<std::pair<size_t, size_t>> result;
+	result.push_back(std::make_pair(size_t(0), data.dataOffset));
+
+	size_t blockBegin = data.dataOffset;
+
+	for (size_t i = 0; i < fileCount; ++i)
+	{
+		size_t fileEnd = files[i].dataOffset + files[i].dataSize;
+
+		if (fileEnd - blockBegin >= kChunkBlockSize)
+		{
+			result.push_back(std::make_pair(blockBegin, fileEnd));
+			blockBegin = fileEnd;
+		}
+	}
+
+	// small tail blocks compress worse, so the tail is merged with the previous data block
+	if (blockBegin < data.size)
+	{
+		if (result.size() > 1 && data.size - blockBegin < kChunkBlockSize / 4)
+			result.back().second = data.size;
+		else
+			result.push_back(std::make_pair(blockBegin, data.size));
+	}
+
+	return result;
+}
+
+static std::pair<std::unique_ptr<char[]>, size_t> compressChunkBlock(const char* data, size_t size, unsigned int codec, int level, const CompressionDictionary* dictionary)
+{
+	if (codec == DCC_LZ4)
+		return compress(data, size, level);
+	else
+		return compressZstd(data, size, level, codec == DCC_ZSTD_DICTIONARY ? dictionary : nullptr);
+}
+
+static ChunkBlocks prepareChunkBlocks(BlockPool& pool, const ChunkData& data, bool indexed, unsigned int codec, int level, const CompressionDictionary* dictionary)
+{
+	std::vector<std::pair<size_t, size_t>> ranges = getChunkBlockRanges(data, data.fileCount);
+
+	// the first block has the file table, which searches always decompress
+	bool blockIndexed = indexed && ranges.size() - 1 >= kChunkBlockIndexMinBlocks;
+
+	std::vector<DataChunkBlockHeader> headers(ranges.size());
+	std::vector<std::pair<std::unique_ptr<char[]>, size_t>> blocks(ranges.size());
+	std::vector<ChunkIndex> indices(ranges.size());
+
+	size_t tableSize = ranges.size() * sizeof(DataChunkBlockHeader);
+	size_t totalSize = 0;
+
+	for (size_t i = 0; i < ranges.size(); ++i)
+	{
+		const char* block = data.data.get() + ranges[i].first;
+		size_t blockSize = ranges[i].second - ranges[i].first;
+
+		blocks[i] = compressChunkBlock(block, blockSize, codec, level, dictionary);
+
+		if (blockIndexed && i > 0)
+			indices[i] = prepareChunkBlockIndex(block, blockSize);
+
+		DataChunkBlockHeader& h = headers[i];
+
+		h.compressedSize = blocks[i].second;
+		h.uncompressedSize = blockSize;
+		h.indexSize = indices[i].size;
+		h.indexHashIterations = indices[i].iterations;
+		h.indexType = indices[i].type;
+
+		tableSize += indices[i].size;
+		totalSize += blocks[i].second;
+	}
+
+	ChunkBlocks result;
+	result.size = tableSize + totalSize;
+	result.data = pool.allocate(result.size);
+	result.count = ranges.size();
+	result.tableSize = tableSize;
+
+	char* dest = result.data.get();
+
+	memcpy(dest, headers.data(), headers.size() * sizeof(DataChunkBlockHeader));
+	dest += headers.size() * sizeof(DataChunkBlockHeader);
+
+	for (auto& index: indices)
+	{
+		if (index.size)
+			memcpy(dest, index.data.get(), index.size);
+
+		dest += index.size;
+	}
+
+	for (auto& block: blocks)
+	{
+		memcpy(dest, block.first.get(), block.second);
+		dest += block.second;
+	}
+
+	assert(dest == result.data.get() + result.size);
 
 	return result;
 }
 
+// Files that are stored without an index are never in the same chunk as files with an index, see flushChunk
+static bool isChunkIndexed(const Chunk& chunk)
+{
+	for (auto& f: chunk.files)
+		if (f.contents.size())
+			return (f.flags & DCF_UNINDEXED) == 0;
+
+	return true;
+}
+
+// Searches use the paths to skip chunks without decompressing them, and the last path to find the changed files that belong to the chunk
+static std::string getChunkPaths(const Chunk& chunk)
+{
+	std::string result;
+
+	for (size_t i = 0; i < chunk.files.size(); ++i)
+	{
+		if (i > 0)
+			result += '\n';
+
+		result += chunk.files[i].name;
+	}
+
+	return result;
+}
+
+// Dictionary is trained on the file data of the chunks that were held back; zstd compresses blocks independently, so samples are limited to the block size
+static void trainDictionary(BuildContext* context)
+{
+	std::vector<char> samples;
+	std::vector<size_t> sampleSizes;
+
+	for (auto& held: context->heldChunks)
+	{
+		const ChunkData& data = *held.second;
+		const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data.data.get());
+
+		for (size_t i = 0; i < data.fileCount; ++i)
+		{
+			size_t size = std::min(size_t(files[i].dataSize), kChunkBlockSize);
+
+			if (size == 0)
+				continue;
+
+			samples.insert(samples.end(), data.data.get() + files[i].dataOffset, data.data.get() + files[i].dataOffset + size);
+			sampleSizes.push_back(size);
+		}
+	}
+
+	// the dictionary is stored in the data file, so it only pays off if there is much more data than the dictionary size
+	if (samples.size() < kCompressionDictionarySize * 8)
+		return;
+
+	std::vector<char> dictionary = trainZstdDictionary(samples.data(), sampleSizes, kCompressionDictionarySize);
+
+	// projects that are too small to train a dictionary on are compressed without it
+	if (!dictionary.empty())
+		context->dictionary.reset(new CompressionDictionary(std::move(dictionary), context->compressionLevel));
+}
+
+static void releaseHeldChunks(BuildContext* context)
+{
+	if (!context->dictionaryPending)
+		return;
+
+	trainDictionary(context);
+
+	context->dictionaryPending = false;
+
+	for (auto& held: context->heldChunks)
+		context->prepareChunkQueue.push(std::move(held.first), held.second->size);
+
+	context->heldChunks.clear();
+	context->heldSize = 0;
+}
+
 static void storeChunk(BuildContext* context, const Chunk& chunk)
 {
 	if (chunk.files.empty()) return;
 
-	ChunkData data = prepareChunkData(chunk);
+	ChunkData data = prepareChunkData(context->chunkPool, chunk);
 	unsigned int order = context->chunkOrder++;
 
 	size_t fileCount = chunk.files.size();
 	bool firstFileIsSuffix = !chunk.files.empty() && chunk.files[0].startLine != 0;
-	std::string lastFile = chunk.files.empty() ? "" : chunk.files.back().name;
+	std::string paths = getChunkPaths(chunk);
+	double falsePositiveRate = context->indexFalsePositiveRate;
+	bool indexed = isChunkIndexed(chunk);
+	bool blockIndexed = context->blockIndices;
 
 	// workaround for lack of generalized capture
 	std::shared_ptr<ChunkData> sdata(new ChunkData(std::move(data)));
 
-	context->prepareChunkQueue.push([=] {
-		ChunkIndex index = prepareChunkIndex(sdata->data.get() + sdata->dataOffset, sdata->dataSize);
+	// the dictionary is final once the job runs since held chunks are only queued after training
+	std::function<void()> job = [=] {
+		ChunkIndex index = indexed ? prepareChunkIndex(sdata->data.get() + sdata->dataOffset, sdata->dataSize, falsePositiveRate) : ChunkIndex();
+
+		CompressionDictionary* dictionary = context->dictionary.get();
+		unsigned int codec = context->codec == CC_LZ4 ? DCC_LZ4 : dictionary ? DCC_ZSTD_DICTIONARY : DCC_ZSTD;
 
-		std::pair<std::unique_ptr<char[]>, size_t> cdata = compress(sdata->data.get(), sdata->size, kFileDataCompressionLevel);
+		ChunkBlocks blocks = prepareChunkBlocks(context->compressedPool, *sdata, indexed && blockIndexed, codec, context->compressionLevel, dictionary);
 
-		std::unique_ptr<char[]> extra(new char[lastFile.size()]);
-		memcpy(extra.get(), lastFile.data(), lastFile.size());
+		std::unique_ptr<char[]> extra(new char[paths.size()]);
+		memcpy(extra.get(), paths.data(), paths.size());
 
 		DataChunkHeader header = {};
 		header.fileCount = fileCount;
 		header.fileTableSize = sdata->dataOffset;
-		header.compressedSize = cdata.second;
+		header.compressedSize = blocks.size;
 		header.uncompressedSize = sdata->size;
 		header.indexSize = index.size;
 		header.indexHashIterations = index.iterations;
-		header.extraSize = lastFile.size();
+		header.indexType = index.type;
+		header.extraSize = paths.size();
+		header.blockCount = blocks.count;
+		header.blockTableSize = blocks.tableSize;
+		header.codec = codec;
 
-		writeChunk(context, order, header, std::move(cdata.first), std::move(index.data), std::move(extra), firstFileIsSuffix);
-	}, sdata->size);
+		writeChunk(context, order, header, std::move(blocks.data), std::move(index.data), std::move(extra), firstFileIsSuffix);
+	};
+
+	if (context->dictionaryPending)
+	{
+		context->heldChunks.push_back(std::make_pair(std::move(job), sdata));
+		context->heldSize += sdata->size;
+
+		if (context->heldSize >= kCompressionDictionarySampleSize)
+			releaseHeldChunks(context);
+	}
+	else
+		context->prepareChunkQueue.push(std::move(job), sdata->size);
+}
+
+// Contents that start at the first line can be referred to by later files; the hash is stored so that updates can keep referring to them
+static void addFileContents(BuildContext* context, File& file, unsigned int chunkIndex, unsigned int fileIndex)
+{
+	if (file.startLine != 0 || (file.flags & DCF_SKIPPED))
+		return;
+
+	if (!file.complete)
+		file.contentHash = getContentHash(file.contents.data(), file.contents.size());
+
+	context->contents.emplace(file.contentHash, std::make_pair(chunkIndex, fileIndex));
+}
+
+// Files with contents that are already stored keep a reference instead of the data
+static bool addFileReference(BuildContext* context, File& file)
+{
+	if (!context->dedup || !file.complete || file.contents.size() < kFileReferenceMinSize || context->contents.count(file.contentHash) == 0)
+		return false;
+
+	FileReference ref = { file.name, file.contentHash };
+	context->references.push_back(ref);
+
+	file.contents = Blob(std::vector<char>());
+	file.reference = true;
+
+	return true;
 }
 
 static void flushChunk(BuildContext* context, size_t size)
 {
 	Chunk chunk;
+	size_t referencedSize = 0;
+
+	// chunks get consecutive order numbers as they are stored, so this is the index of the chunk in the data file
+	unsigned int chunkIndex = context->chunkOrder;
+
+	// chunks have an index for all of their data or for none of it; files without data can go to any chunk
+	bool unindexed = false;
 
 	// grab pending files one by one and add it to current chunk
 	while (chunk.totalSize < size && !context->pendingFiles.empty())
 	{
+		const File& next = context->pendingFiles.front();
+
+		if (chunk.totalSize && next.contents.size() && unindexed != ((next.flags & DCF_UNINDEXED) != 0))
+			break;
+
+		if (chunk.totalSize == 0)
+			unindexed = (next.flags & DCF_UNINDEXED) != 0;
+
 		File file = std::move(context->pendingFiles.front());
 		context->pendingFiles.pop_front();
 
@@ -505,14 +980,26 @@ static void flushChunk(BuildContext* context, size_t size)
 
 		if (file.contents.size() <= remainingSize)
 		{
+			size_t fileSize = file.contents.size();
+
 			// no need to split the file, just add it
+			if (addFileReference(context, file))
+				referencedSize += fileSize;
+			else
+				addFileContents(context, file, chunkIndex, chunk.files.size());
+
 			appendChunkFile(chunk, std::move(file));
 		}
 		else
 		{
+			size_t fileCount = chunk.files.size();
+
 			// last file may not fit completely, store some part of it and put the remaining lines back into pending list
 			appendChunkFilePrefix(chunk, file, remainingSize);
 
+			if (chunk.files.size() > fileCount)
+				addFileContents(context, chunk.files.back(), chunkIndex, fileCount);
+
 			// we might have fully appended the file if it was one huge line, but usually there's a remainder to be processed later
 			if (file.contents.size())
 				context->pendingFiles.emplace_front(file);
@@ -523,18 +1010,71 @@ static void flushChunk(BuildContext* context, size_t size)
 	}
 
 	// update pending size
-	assert(chunk.totalSize <= context->pendingSize);
-	context->pendingSize -= chunk.totalSize;
+	assert(chunk.totalSize + referencedSize <= context->pendingSize);
+	context->pendingSize -= chunk.totalSize + referencedSize;
 
 	// store resulting chunk
 	storeChunk(context, chunk);
 }
 
+// Dictionary is written after the chunks once; when appending, a dictionary that is already stored stays where it is
+static uint64_t writeDictionary(BuildContext* context, uint64_t offset)
+{
+	if (!context->dictionary || context->dictionaryStored)
+		return offset;
+
+	const std::vector<char>& data = context->dictionary->getData();
+
+	context->outData.write(data.data(), data.size());
+	context->dictionaryOffset = offset;
+	context->dictionaryStored = true;
+
+	return offset + data.size();
+}
+
+static void writeDirectory(BuildContext* context, uint64_t offset, const std::vector<DataChunkDirectoryEntry>& directory)
+{
+	const std::vector<DataFileAliasEntry>& aliases = context->aliases;
+	const std::vector<char>& aliasNames = context->aliasNames;
+
+	if (!directory.empty())
+		context->outData.write(&directory[0], directory.size() * sizeof(DataChunkDirectoryEntry));
+
+	if (!aliases.empty())
+		context->outData.write(&aliases[0], aliases.size() * sizeof(DataFileAliasEntry));
+
+	if (!aliasNames.empty())
+		context->outData.write(&aliasNames[0], aliasNames.size());
+
+	DataFileFooter footer = {};
+	footer.directoryOffset = offset;
+	footer.dictionaryOffset = context->dictionary ? context->dictionaryOffset : 0;
+	footer.dictionarySize = context->dictionary ? context->dictionary->getData().size() : 0;
+	footer.chunkCount = directory.size();
+	footer.aliasCount = aliases.size();
+	footer.aliasNameSize = aliasNames.size();
+	memcpy(footer.magic, kDataFileFooterMagic, sizeof(footer.magic));
+
+	context->outData.write(&footer, sizeof(footer));
+
+	// the committed size is updated last so that readers of an appended file see either the old or the new directory
+	if (context->commit)
+	{
+		uint64_t committedSize = offset + directory.size() * sizeof(DataChunkDirectoryEntry) + aliases.size() * sizeof(DataFileAliasEntry) + aliasNames.size() + sizeof(footer);
+
+		context->outData.seek(offsetof(DataFileHeader, committedSize));
+		context->outData.write(&committedSize, sizeof(committedSize));
+	}
+}
+
 static void writeChunkThreadFun(BuildContext* context)
 {
 	unsigned int order = 0;
 	std::map<unsigned int, ChunkFileData> chunks;
 
+	uint64_t offset = context->dataOffset;
+	std::vector<DataChunkDirectoryEntry> directory;
+
 	BuildStatistics stats = {};
 
 	printStatistics(context->output, stats, context->fileCount);
@@ -552,19 +1092,42 @@ static void writeChunkThreadFun(BuildContext* context)
 			const DataChunkHeader& header = chunk.header;
 
 			// empty compressed data acts as a terminator flag
-			if (!chunk.compressedData)
+			if (!chunk.compressedData && !chunk.preserved)
+			{
+				offset = writeDictionary(context, offset);
+				writeDirectory(context, offset, directory);
 				return;
-
-			context->outData.write(&header, sizeof(header));
-			context->outData.write(chunk.extra.get(), header.extraSize);
-			context->outData.write(chunk.index.get(), header.indexSize);
-			context->outData.write(chunk.compressedData.get(), header.compressedSize);
+			}
 
 			stats.chunkCount++;
 			stats.fileCount += header.fileCount - chunk.firstFileIsSuffix;
 			stats.fileSize += header.uncompressedSize;
 			stats.resultSize += header.compressedSize;
 
+			if (chunk.preserved)
+			{
+				directory.push_back(chunk.entry);
+
+				chunks.erase(chunks.begin());
+				order++;
+
+				continue;
+			}
+
+			DataChunkDirectoryEntry entry = {};
+			entry.headerOffset = offset;
+			entry.indexOffset = entry.headerOffset + sizeof(header) + header.extraSize;
+			entry.dataOffset = entry.indexOffset + header.indexSize;
+			entry.header = header;
+
+			directory.push_back(entry);
+			offset = entry.dataOffset + header.compressedSize;
+
+			context->outData.write(&header, sizeof(header));
+			context->outData.write(chunk.extra.get(), header.extraSize);
+			context->outData.write(chunk.index.get(), header.indexSize);
+			context->outData.write(chunk.compressedData.get(), header.compressedSize);
+
 			chunks.erase(chunks.begin());
 			order++;
 
@@ -573,9 +1136,22 @@ static void writeChunkThreadFun(BuildContext* context)
 	}
 }
 
-BuildContext* buildStart(Output* output, const char* path, unsigned int fileCount)
+// The writer of a build that runs at background priority gets the same priority, which Windows doesn't pass on to new threads
+static void startWriteChunkThread(BuildContext* context)
 {
-	std::unique_ptr<BuildContext> context(new BuildContext(output, fileCount));
+	bool background = isBackgroundPriority();
+
+	std::thread([=]() {
+		if (background)
+			setBackgroundPriority();
+
+		writeChunkThreadFun(context);
+	}).swap(context->writeChunkThread);
+}
+
+BuildContext* buildStart(Output* output, const char* path, unsigned int fileCount, const ProjectGroup& settings)
+{
+	std::unique_ptr<BuildContext> context(new BuildContext(output, fileCount, settings));
 
 	createPathForFile(path);
 
@@ -591,23 +1167,61 @@ BuildContext* buildStart(Output* output, const char* path, unsigned int fileCoun
 
 	context->outData.write(&header, sizeof(header));
 
-	std::thread(std::bind(writeChunkThreadFun, context.get())).swap(context->writeChunkThread);
+	startWriteChunkThread(context.get());
+
+	return context.release();
+}
+
+BuildContext* buildStartAppend(Output* output, const char* path, unsigned int fileCount, const ProjectGroup& settings)
+{
+	std::unique_ptr<BuildContext> context(new BuildContext(output, fileCount, settings));
+
+	context->outData.open(path, "r+b");
+	if (!context->outData)
+	{
+		output->error("Error opening data file %s for writing\n", path);
+		return 0;
+	}
+
+	DataFileHeader header;
+	if (!read(context->outData, header) || memcmp(header.magic, kDataFileHeaderMagic, sizeof(header.magic)) != 0 || header.committedSize < sizeof(header))
+	{
+		output->error("Error reading data file %s: malformed header\n", path);
+		return 0;
+	}
+
+	// anything past the committed size is left over from an interrupted update and is overwritten
+	context->dataOffset = header.committedSize;
+	context->append = true;
+	context->outData.seek(context->dataOffset);
+
+	startWriteChunkThread(context.get());
 
 	return context.release();
 }
 
-void buildAppendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize)
+// Complete files are appended in one piece right after they are read, along with the hash of their contents
+static void appendFilePart(BuildContext* context, const char* path, unsigned int startLine, std::vector<char> contents, uint64_t timeStamp, uint64_t fileSize, unsigned int classFlags, bool complete = false, uint64_t contentHash = 0)
 {
+	unsigned int flags = classFlags | getFilePolicyFlags(context, classFlags);
+
+	// skipped files keep their entry so that updates can tell that they didn't change
+	if (flags & DCF_SKIPPED)
+		contents.clear();
+
+	size_t dataSize = contents.size();
+
 	if (!context->pendingFiles.empty() && context->pendingFiles.back().name == path)
 	{
 		File& file = context->pendingFiles.back();
 
 		assert(file.startLine < startLine);
-		assert(file.timeStamp == timeStamp && file.fileSize == fileSize);
+		assert(file.timeStamp == timeStamp && file.fileSize == fileSize && file.flags == flags);
 		assert(file.contents.offset + file.contents.count == file.contents.storage->size());
 
-		file.contents.storage->insert(file.contents.storage->end(), data, data + dataSize);
+		file.contents.storage->insert(file.contents.storage->end(), contents.begin(), contents.end());
 		file.contents.count += dataSize;
+		file.complete = false;
 
 		context->pendingSize += dataSize;
 	}
@@ -619,79 +1233,151 @@ void buildAppendFilePart(BuildContext* context, const char* path, unsigned int s
 		file.startLine = startLine;
 		file.timeStamp = timeStamp;
 		file.fileSize = fileSize;
-		file.contents = std::vector<char>(data, data + dataSize);
+		file.contents = std::move(contents);
+		file.flags = flags;
+		file.complete = complete;
+		file.reference = false;
+		file.contentHash = contentHash;
 
 		context->pendingFiles.emplace_back(file);
 		context->pendingSize += dataSize;
 	}
 
 	// We try to maintain a small pending set; this makes sure we have at most 2 chunk sizes worth of data
-	// It's possible in theory to flush chunks earlier (when we reach kChunkSize), but this means that if we
+	// It's possible in theory to flush chunks earlier (when we reach the chunk size), but this means that if we
 	// see an already compressed chunk (buildAppendChunk), we may not be able to rebalance chunk sizes and will
 	// be forced to recompress.
-	while (context->pendingSize >= kChunkSize * 2)
+	while (context->pendingSize >= context->chunkSize * 2)
 	{
-		flushChunk(context, kChunkSize);
+		flushChunk(context, context->chunkSize);
 	}
 }
 
-bool buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize)
+static void readFileContents(const BuildContext* context, FileRead& read)
 {
-	FileStream in(path, "rb");
-	if (!in)
+	FileStream in(read.path.c_str(), "rb");
+
+	read.opened = !!in;
+	read.allocated = true;
+
+	if (read.opened)
 	{
-		context->output->error("Error reading file %s\n", path);
-		return false;
+		try
+		{
+			read.contents = convertToUTF8(readFile(in, read.fileSize));
+			read.contentHash = getContentHash(read.contents.data(), read.contents.size());
+			read.classFlags = getFileClassFlags(classifyFile(read.contents.data(), read.contents.size()));
+
+			// contents of skipped files are released right away instead of waiting in the read queue
+			if (getFilePolicyFlags(context, read.classFlags) & DCF_SKIPPED)
+				std::vector<char>().swap(read.contents);
+		}
+		catch (const std::bad_alloc&)
+		{
+			read.allocated = false;
+		}
 	}
 
-	try
+	read.ready.set_value();
+}
+
+// Appends files that were read, in order; if wait is false, stops at the first file that is still being read
+static void flushFileReads(BuildContext* context, bool wait)
+{
+	while (!context->pendingReads.empty())
 	{
-		std::vector<char> contents = convertToUTF8(readFile(in));
+		PendingFileRead& pending = context->pendingReads.front();
+
+		if (!wait && pending.ready.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			break;
+
+		pending.ready.wait();
+
+		FileRead& read = *pending.read;
 
-		buildAppendFilePart(context, path, 0, contents.empty() ? 0 : &contents[0], contents.size(), timeStamp, fileSize);
+		if (!read.opened)
+			context->output->error("Error reading file %s\n", read.path.c_str());
+		else if (!read.allocated)
+			context->output->error("Error reading file %s: out of memory\n", read.path.c_str());
+		else
+			appendFilePart(context, read.path.c_str(), 0, std::move(read.contents), read.timeStamp, read.fileSize, read.classFlags, /* complete= */ true, read.contentHash);
 
-		return true;
+		context->pendingReadSize -= read.fileSize;
+		context->pendingReads.pop_front();
 	}
-	catch (const std::bad_alloc&)
+}
+
+void buildAppendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize, unsigned int classFlags)
+{
+	flushFileReads(context, /* wait= */ true);
+
+	appendFilePart(context, path, startLine, std::vector<char>(data, data + dataSize), timeStamp, fileSize, classFlags);
+}
+
+void buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize)
+{
+	flushFileReads(context, /* wait= */ false);
+
+	// the amount of file data that is read ahead is limited; a single large file can still be read on its own
+	while (!context->pendingReads.empty() && (context->pendingReads.size() >= kMaxPendingFileReads || context->pendingReadSize + fileSize > getPendingDataLimit()))
 	{
-		context->output->error("Error reading file %s: out of memory\n", path);
-		return false;
+		PendingFileRead& pending = context->pendingReads.front();
+		pending.ready.wait();
+
+		flushFileReads(context, /* wait= */ false);
 	}
+
+	std::shared_ptr<FileRead> read(new FileRead());
+	read->path = path;
+	read->timeStamp = timeStamp;
+	read->fileSize = fileSize;
+	read->classFlags = 0;
+	read->opened = false;
+	read->allocated = false;
+
+	PendingFileRead pending = { read, read->ready.get_future() };
+
+	context->pendingReads.push_back(std::move(pending));
+	context->pendingReadSize += fileSize;
+
+	context->readFileQueue.push([=]() { readFileContents(context, *read); });
 }
 
-static size_t getOptimalChunkSize(size_t pendingSize)
+static size_t getOptimalChunkSize(size_t chunkSize, size_t pendingSize)
 {
 	// This function returns a size in [0.75x .. 1.5x] range (or 0)
-	const size_t kChunkMaxSize = kChunkSize * 3 / 2;
-	const size_t kChunkMinSize = kChunkMaxSize / 2;
+	const size_t chunkMaxSize = chunkSize * 3 / 2;
+	const size_t chunkMinSize = chunkMaxSize / 2;
 
 	// Never store chunks smaller than 0.75x
-	if (pendingSize < kChunkMinSize)
+	if (pendingSize < chunkMinSize)
 		return 0;
 
 	// If we have at least 2 chunks worth of data, it's safe to store a full chunk
-	if (pendingSize >= kChunkSize * 2)
-		return kChunkSize;
+	if (pendingSize >= chunkSize * 2)
+		return chunkSize;
 
 	// If we have less than 1.5x chunks, we need to store the entire set in one go
-	if (pendingSize < kChunkMaxSize)
+	if (pendingSize < chunkMaxSize)
 		return pendingSize;
 
 	// Otherwise we should split the chunk in half; the reason why it's important to not just
-	// return kChunkSize here is that if we have, say, 1.6x chunks to store, splitting into 1x and 0.6x
+	// return chunkSize here is that if we have, say, 1.6x chunks to store, splitting into 1x and 0.6x
 	// leaves us with a chunk that's smaller than 0.75x
-	// Splitting in half makes sure that both halves are at least kChunkMinSize
+	// Splitting in half makes sure that both halves are at least chunkMinSize
 	return pendingSize / 2;
 }
 
-bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, std::unique_ptr<char[]>& compressedData, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra, bool firstFileIsSuffix)
+static bool flushPendingFiles(BuildContext* context)
 {
+	flushFileReads(context, /* wait= */ true);
+
 	// In order to maintain file order, we need to flush pending files before writing the chunk.
 	// To balance the cost of chunk recompression with chunk sizes, we flush all files but instead of
 	// using a fixed chunk size, we use a balanced chunk size computed in getOptimalChunkSize
 	while (!context->pendingFiles.empty())
 	{
-		size_t chunkSize = getOptimalChunkSize(context->pendingSize);
+		size_t chunkSize = getOptimalChunkSize(context->chunkSize, context->pendingSize);
 
 		if (chunkSize == 0)
 			return false;
@@ -702,22 +1388,137 @@ bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, std:
 	// We should be good to go now
 	assert(context->pendingSize == 0 && context->pendingFiles.empty());
 
+	return true;
+}
+
+// Registers contents and references of a chunk that is kept as is; references can only be kept if the contents they refer to are stored
+// and the project still stores duplicates as references
+static bool addChunkFileTable(BuildContext* context, const DataChunkHeader& header, const char* data)
+{
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+
+	std::unordered_set<uint64_t> chunkContents;
+
+	for (size_t i = 0; i < header.fileCount; ++i)
+	{
+		const DataChunkFileHeader& f = files[i];
+
+		if (f.flags & DCF_REFERENCE)
+		{
+			if (!context->dedup || (context->contents.count(f.contentHash) == 0 && chunkContents.count(f.contentHash) == 0))
+				return false;
+		}
+		else if (f.startLine == 0 && !(f.flags & DCF_SKIPPED))
+			chunkContents.insert(f.contentHash);
+	}
+
+	unsigned int chunkIndex = context->chunkOrder;
+
+	for (size_t i = 0; i < header.fileCount; ++i)
+	{
+		const DataChunkFileHeader& f = files[i];
+
+		if (f.flags & DCF_REFERENCE)
+		{
+			FileReference ref = { std::string(data + f.nameOffset, f.nameLength), f.contentHash };
+			context->references.push_back(ref);
+		}
+		else if (f.startLine == 0 && !(f.flags & DCF_SKIPPED))
+			context->contents.emplace(f.contentHash, std::make_pair(chunkIndex, unsigned(i)));
+	}
+
+	return true;
+}
+
+bool buildIsFilePolicyCurrent(const BuildContext* context, unsigned int flags)
+{
+	return (flags & DCF_POLICY_MASK) == getFilePolicyFlags(context, flags & DCF_CLASS_MASK);
+}
+
+bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, const char* fileTable, BlockRef& compressedData, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra, bool firstFileIsSuffix)
+{
+	if (!flushPendingFiles(context) || !addChunkFileTable(context, header, fileTable))
+		return false;
+
 	unsigned int order = context->chunkOrder++;
 	writeChunk(context, order, header, std::move(compressedData), std::move(index), std::move(extra), firstFileIsSuffix);
 
 	return true;
 }
 
-unsigned int buildFinish(BuildContext* context)
+void buildSetDictionary(BuildContext* context, const CompressionDictionary& dictionary, uint64_t offset)
+{
+	assert(context->chunkOrder == 0);
+
+	// the dictionary is prepared again since the compression level can be different
+	context->dictionary.reset(new CompressionDictionary(dictionary.getData(), context->compressionLevel));
+	context->dictionaryPending = false;
+
+	context->dictionaryStored = context->append;
+	context->dictionaryOffset = offset;
+}
+
+BlockPool& buildGetChunkPool(BuildContext* context)
+{
+	return context->chunkPool;
+}
+
+bool buildPreserveChunk(BuildContext* context, const DataChunkDirectoryEntry& entry, const char* fileTable, bool firstFileIsSuffix)
 {
+	if (!flushPendingFiles(context) || !addChunkFileTable(context, entry.header, fileTable))
+		return false;
+
+	ChunkFileData chunk = { context->chunkOrder++, entry.header };
+	chunk.firstFileIsSuffix = firstFileIsSuffix;
+	chunk.preserved = true;
+	chunk.entry = entry;
+
+	context->writeChunkQueue.push(std::move(chunk));
+
+	return true;
+}
+
+static void buildAliases(BuildContext* context)
+{
+	for (auto& ref: context->references)
+	{
+		auto it = context->contents.find(ref.contentHash);
+		assert(it != context->contents.end());
+
+		DataFileAliasEntry alias = {};
+		alias.chunkIndex = it->second.first;
+		alias.fileIndex = it->second.second;
+		alias.nameOffset = context->aliasNames.size();
+		alias.nameLength = ref.path.size();
+
+		context->aliases.push_back(alias);
+		context->aliasNames.insert(context->aliasNames.end(), ref.path.begin(), ref.path.end());
+	}
+
+	// references are in file order, so the aliases of every stored file stay in file order as well
+	std::stable_sort(context->aliases.begin(), context->aliases.end(), [](const DataFileAliasEntry& l, const DataFileAliasEntry& r) {
+		return l.chunkIndex != r.chunkIndex ? l.chunkIndex < r.chunkIndex : l.fileIndex < r.fileIndex;
+	});
+}
+
+unsigned int buildFinish(BuildContext* context, bool commit)
+{
+	flushFileReads(context, /* wait= */ true);
+
+	context->commit = commit;
+
 	if (context->writeChunkThread.joinable())
 	{
 		// Write all remaining files (usually just flushes a single chunk)
 		while (!context->pendingFiles.empty())
 		{
-			flushChunk(context, kChunkSize);
+			flushChunk(context, context->chunkSize);
 		}
 
+		releaseHeldChunks(context);
+
+		buildAliases(context);
+
 		ChunkFileData chunkDummy = { context->chunkOrder };
 		context->writeChunkQueue.push(std::move(chunkDummy));
 		context->writeChunkThread.join();
@@ -739,21 +1540,27 @@ void buildProject(Output* output, const char* path)
 		return;
 
 	removeFile(replaceExtension(path, ".qgc").c_str());
+	removeFile(replaceExtension(path, ".qgt").c_str());
 
 	output->print("Scanning project...\r");
 
-	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get());
+	DirectorySnapshot scanned = {};
+	scanned.scansLeft = kSnapshotFullScanInterval;
+
+	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get(), nullptr, &scanned.listings);
+
+	writeDirectorySnapshot(output, path, scanned);
 
 	output->print("Building file table...\r");
 
-	if (!buildFiles(output, path, files))
+	if (!buildFiles(output, path, files, group->compressFileList))
 		return;
 	
 	std::string targetPath = replaceExtension(path, ".qgd");
 	std::string tempPath = targetPath + "_";
 
 	{
-		BuildContext* builder = buildStart(output, tempPath.c_str(), files.size());
+		BuildContext* builder = buildStart(output, tempPath.c_str(), files.size(), *group);
 		if (!builder) return;
 
 		for (auto& f: files)
@@ -771,4 +1578,7 @@ void buildProject(Output* output, const char* path)
 		output->error("Error saving data file %s\n", targetPath.c_str());
 		return;
 	}
+
+	if (buildSlices(output, path))
+		buildPostings(output, path, group->postings, group->identifiers);
 }
@@ -4,16 +4,37 @@
 #include <memory>
 
 class Output;
+struct ProjectGroup;
 struct DataChunkHeader;
+struct DataChunkDirectoryEntry;
+class CompressionDictionary;
+class BlockPool;
+class BlockRef;
 
 struct BuildContext;
 
-BuildContext* buildStart(Output* output, const char* path, unsigned int fileCount = 0);
+// Chunk size, index false positive rate and file class policies come from the root group of the project
+BuildContext* buildStart(Output* output, const char* path, unsigned int fileCount, const ProjectGroup& settings);
+// Appends new chunks to an existing data file; the new directory only becomes visible once the build is committed
+BuildContext* buildStartAppend(Output* output, const char* path, unsigned int fileCount, const ProjectGroup& settings);
 
-void buildAppendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize);
-bool buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize);
-bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, std::unique_ptr<char[]>& compressedData, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra, bool firstFileIsSuffix);
+// Parts of files that are already stored keep their class (DCF_CLASS_MASK flags); the policy for the class is applied again
+void buildAppendFilePart(BuildContext* context, const char* path, unsigned int startLine, const char* data, size_t dataSize, uint64_t timeStamp, uint64_t fileSize, unsigned int classFlags);
+// Files are read in the background and appended in order; read errors are reported once the file is appended
+void buildAppendFile(BuildContext* context, const char* path, uint64_t timeStamp, uint64_t fileSize);
+// Files that are stored differently than the file class policies say have to be read again
+bool buildIsFilePolicyCurrent(const BuildContext* context, unsigned int flags);
+// Existing chunks are passed with their decompressed file table; chunks with references to contents that are no longer stored are rejected
+bool buildAppendChunk(BuildContext* context, const DataChunkHeader& header, const char* fileTable, BlockRef& compressedData, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra, bool firstFileIsSuffix);
+// Chunks that use the compression dictionary of the existing data file can only be kept with the same dictionary; updates set it before anything is
+// appended. The offset of the dictionary in the existing data file is only used when appending to it
+void buildSetDictionary(BuildContext* context, const CompressionDictionary& dictionary, uint64_t offset);
+// Pool for the chunk data that is passed to buildAppendChunk, shared with the chunks that are built
+BlockPool& buildGetChunkPool(BuildContext* context);
+// Keeps a chunk of the data file that is appended to without copying it
+bool buildPreserveChunk(BuildContext* context, const DataChunkDirectoryEntry& entry, const char* fileTable, bool firstFileIsSuffix);
 
-unsigned int buildFinish(BuildContext* context);
+// Without commit, an appended data file keeps its previous contents
+unsigned int buildFinish(BuildContext* context, bool commit = true);
 
 void buildProject(Output* output, const char* path);
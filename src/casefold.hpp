@@ -30,6 +30,28 @@ inline char casefold(char ch)
 	return kCaseFoldASCII[static_cast<unsigned char>(ch)];
 }
 
+#ifdef USE_SSE2
+SIMD_TARGET_AVX2 inline const char* casefoldRangeAVX2(char* dest, const char* begin, const char* end)
+{
+	simd32 shiftAmount = simd32_dup(127 - 'Z');
+	simd32 lowerBound = simd32_dup(127 - ('Z' - 'A') - 1);
+	simd32 upperBit = simd32_dup(0x20);
+
+	const char* i = begin;
+
+	for (; i + 32 < end; i += 32)
+	{
+		simd32 v = simd32_load(i);
+		simd32 upperMask = simd32_cmpgt(simd32_add(v, shiftAmount), lowerBound);
+		simd32 cfv = simd32_or(v, simd32_and(upperMask, upperBit));
+		simd32_store(dest, cfv);
+		dest += 32;
+	}
+
+	return i;
+}
+#endif
+
 #if defined(USE_SSE2) || defined(USE_NEON)
 inline void casefoldRange(char* dest, const char* begin, const char* end)
 {
@@ -48,6 +70,14 @@ inline void casefoldRange(char* dest, const char* begin, const char* end)
 
 		const char* i = begin;
 
+	#ifdef USE_SSE2
+		if (simd_avx2())
+		{
+			i = casefoldRangeAVX2(dest, begin, end);
+			dest += i - begin;
+		}
+	#endif
+
 		for (; i + 16 < end; i += 16)
 		{
 			simd16 v = simd_load(i);
@@ -6,6 +6,7 @@
 #include "filestream.hpp"
 #include "output.hpp"
 #include "project.hpp"
+#include "encoding.hpp"
 
 #include <algorithm>
 #include <fstream>
@@ -52,6 +53,11 @@ static bool isFileInProjectGroupRec(ProjectGroup* group, const std::string& file
 			if (isFileAcceptable(group, file.c_str()))
 				return true;
 
+	for (auto& path: group->gitPaths)
+		if (file.length() > path.length() && file.compare(0, path.length(), path) == 0)
+			if (isFileAcceptable(group, file.c_str()))
+				return true;
+
 	for (auto& child: group->groups)
 		if (isFileInProjectGroupRec(child.get(), file))
 			return true;
@@ -88,3 +94,135 @@ void appendChanges(Output* output, const char* path, const std::vector<std::stri
 			output->error("Error writing changes for project %s\n", path);
 	}
 }
+
+ChangeTimes readChangeTimes(const char* path)
+{
+	std::string filePath = replaceExtension(path, ".qgt");
+
+	ChangeTimes result = {};
+	std::string kind;
+	uint64_t time = 0;
+
+	std::ifstream in(filePath.c_str(), std::ios::in);
+
+	while (in >> kind >> time)
+	{
+		if (kind == "update")
+			result.updateTime = time;
+		else if (kind == "search")
+			result.searchTime += time;
+	}
+
+	return result;
+}
+
+void writeUpdateTime(const char* path, uint64_t time)
+{
+	std::string targetPath = replaceExtension(path, ".qgt");
+	std::string tempPath = targetPath + "_";
+
+	{
+		FileStream out(tempPath.c_str(), "wb");
+		if (!out)
+			return;
+
+		std::string line = "update " + std::to_string(time) + "\n";
+		out.write(line.data(), line.size());
+	}
+
+	// times that can't be saved only make the watcher fall back to estimates
+	renameFile(tempPath.c_str(), targetPath.c_str());
+}
+
+void appendSearchChangeTime(const char* path, uint64_t time)
+{
+	std::string filePath = replaceExtension(path, ".qgt");
+
+	// searches of several processes can append at once; a single short write keeps their lines intact
+	std::unique_ptr<FILE, int(*)(FILE*)> file(openFile(filePath.c_str(), "ab"), fclose);
+	if (!file)
+		return;
+
+	std::string line = "search " + std::to_string(time) + "\n";
+	fwrite(line.data(), 1, line.size(), file.get());
+}
+
+std::shared_ptr<std::vector<char>> readChangedFile(const std::string& path)
+{
+	std::unique_ptr<FILE, int(*)(FILE*)> file(openFile(path.c_str(), "rb"), fclose);
+	if (!file)
+		return std::shared_ptr<std::vector<char>>();
+
+	fseek(file.get(), 0, SEEK_END);
+	size_t length = ftell(file.get());
+	fseek(file.get(), 0, SEEK_SET);
+
+	std::shared_ptr<std::vector<char>> result(new (std::nothrow) std::vector<char>());
+	if (!result)
+		return result;
+
+	try
+	{
+		result->resize(length);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return std::shared_ptr<std::vector<char>>();
+	}
+
+	if (length && fread(&(*result)[0], 1, length, file.get()) != length)
+		return std::shared_ptr<std::vector<char>>();
+
+	if (ferror(file.get()) != 0)
+		return std::shared_ptr<std::vector<char>>();
+
+	result->resize(length ? normalizeEOL(&(*result)[0], length) : 0);
+
+	return result;
+}
+
+ChangeOverlay::ChangeOverlay(size_t memoryLimit): memoryLimit(memoryLimit), memorySize(0)
+{
+}
+
+std::shared_ptr<std::vector<char>> ChangeOverlay::getFile(const std::string& path)
+{
+	// attributes are read before the contents, so a file that is changed while it's read is read again next time
+	uint64_t timeStamp = 0, fileSize = 0;
+	if (!getFileAttributes(path.c_str(), &timeStamp, &fileSize))
+		return std::shared_ptr<std::vector<char>>();
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		auto it = files.find(path);
+
+		if (it != files.end() && it->second.timeStamp == timeStamp && it->second.fileSize == fileSize)
+			return it->second.data;
+	}
+
+	std::shared_ptr<std::vector<char>> data = readChangedFile(path);
+
+	if (!data)
+		return data;
+
+	std::unique_lock<std::mutex> lock(mutex);
+
+	auto it = files.find(path);
+
+	if (it != files.end())
+	{
+		memorySize -= it->second.data->size();
+		files.erase(it);
+	}
+
+	if (memorySize + data->size() <= memoryLimit)
+	{
+		Entry entry = { timeStamp, fileSize, data };
+
+		files[path] = entry;
+		memorySize += data->size();
+	}
+
+	return data;
+}
@@ -3,6 +3,9 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 class Output;
 
@@ -10,3 +13,45 @@ std::vector<std::string> readChanges(const char* path);
 bool writeChanges(const char* path, const std::vector<std::string>& files);
 
 void appendChanges(Output* output, const char* path, const std::vector<std::string>& files);
+
+// Times in microseconds that searches spent on changed files since the last update, and the time that update took; 0 if the update wasn't measured
+struct ChangeTimes
+{
+	uint64_t updateTime;
+	uint64_t searchTime;
+};
+
+// Times are kept in a file next to the changes; recording the update time resets the search time
+ChangeTimes readChangeTimes(const char* path);
+void writeUpdateTime(const char* path, uint64_t time);
+void appendSearchChangeTime(const char* path, uint64_t time);
+
+// Contents of a changed file with normalized line endings; returns null if the file can't be read
+std::shared_ptr<std::vector<char>> readChangedFile(const std::string& path);
+
+// Keeps contents of changed files between searches; files are read again once their size or modification time changes
+class ChangeOverlay
+{
+public:
+	ChangeOverlay(size_t memoryLimit);
+
+	// Can be called from multiple threads; files that don't fit in the memory limit are read every time
+	std::shared_ptr<std::vector<char>> getFile(const std::string& path);
+
+private:
+	struct Entry
+	{
+		uint64_t timeStamp;
+		uint64_t fileSize;
+		std::shared_ptr<std::vector<char>> data;
+	};
+
+	std::mutex mutex;
+	size_t memoryLimit;
+	size_t memorySize;
+
+	std::unordered_map<std::string, Entry> files;
+
+	ChangeOverlay(const ChangeOverlay&);
+	ChangeOverlay& operator=(const ChangeOverlay&);
+};
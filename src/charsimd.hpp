@@ -3,6 +3,34 @@
 
 #include <stdint.h>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#pragma intrinsic(_BitScanForward)
+#pragma intrinsic(_BitScanReverse)
+#endif
+
+inline int countTrailingZeros(int value)
+{
+#ifdef _MSC_VER
+	unsigned long r;
+	_BitScanForward(&r, value);
+	return r;
+#else
+	return __builtin_ctz(value);
+#endif
+}
+
+inline int countLeadingZeros(int value)
+{
+#ifdef _MSC_VER
+	unsigned long r;
+	_BitScanReverse(&r, value);
+	return 31 - r;
+#else
+	return __builtin_clz(value);
+#endif
+}
+
 #ifdef USE_SSE2
 #include <emmintrin.h>
 
@@ -38,6 +66,11 @@ inline simd16 simd_add(simd16 a, simd16 b)
 	return _mm_add_epi8(a, b);
 }
 
+inline simd16 simd_sub(simd16 a, simd16 b)
+{
+	return _mm_sub_epi8(a, b);
+}
+
 inline simd16 simd_and(simd16 a, simd16 b)
 {
 	return _mm_and_si128(a, b);
@@ -52,6 +85,111 @@ inline int simd_movemask(simd16 v)
 {
 	return _mm_movemask_epi8(v);
 }
+
+// Sum of all bytes as unsigned values
+inline unsigned int simd_sum(simd16 v)
+{
+	simd16 sums = _mm_sad_epu8(v, _mm_setzero_si128());
+
+	return _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+}
+
+// AVX2 kernels are compiled for the target ISA independently of compiler flags; callers have to check simd_avx2() first
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SIMD_TARGET_AVX2
+#else
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#include <immintrin.h>
+
+typedef __m256i simd32;
+
+SIMD_TARGET_AVX2 inline simd32 simd32_dup(char v)
+{
+	return _mm256_set1_epi8(v);
+}
+
+SIMD_TARGET_AVX2 inline simd32 simd32_load(const void* p)
+{
+	return _mm256_loadu_si256(static_cast<const __m256i*>(p));
+}
+
+SIMD_TARGET_AVX2 inline void simd32_store(void* p, simd32 v)
+{
+	_mm256_storeu_si256(static_cast<__m256i*>(p), v);
+}
+
+SIMD_TARGET_AVX2 inline simd32 simd32_cmpgt(simd32 a, simd32 b)
+{
+	return _mm256_cmpgt_epi8(a, b);
+}
+
+SIMD_TARGET_AVX2 inline simd32 simd32_cmpeq(simd32 a, simd32 b)
+{
+	return _mm256_cmpeq_epi8(a, b);
+}
+
+SIMD_TARGET_AVX2 inline simd32 simd32_add(simd32 a, simd32 b)
+{
+	return _mm256_add_epi8(a, b);
+}
+
+SIMD_TARGET_AVX2 inline simd32 simd32_sub(simd32 a, simd32 b)
+{
+	return _mm256_sub_epi8(a, b);
+}
+
+SIMD_TARGET_AVX2 inline simd32 simd32_and(simd32 a, simd32 b)
+{
+	return _mm256_and_si256(a, b);
+}
+
+SIMD_TARGET_AVX2 inline simd32 simd32_or(simd32 a, simd32 b)
+{
+	return _mm256_or_si256(a, b);
+}
+
+SIMD_TARGET_AVX2 inline unsigned int simd32_movemask(simd32 v)
+{
+	return static_cast<unsigned int>(_mm256_movemask_epi8(v));
+}
+
+SIMD_TARGET_AVX2 inline unsigned int simd32_sum(simd32 v)
+{
+	__m256i sad = _mm256_sad_epu8(v, _mm256_setzero_si256());
+	simd16 sums = _mm_add_epi64(_mm256_castsi256_si128(sad), _mm256_extracti128_si256(sad, 1));
+
+	return _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+}
+
+inline bool simd_detect_avx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+
+	// AVX state has to be enabled by the OS
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return false;
+	if ((_xgetbv(0) & 6) != 6) return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+inline bool simd_avx2()
+{
+	static const bool result = simd_detect_avx2();
+	return result;
+}
 #endif
 
 #ifdef USE_NEON
@@ -89,6 +227,11 @@ inline simd16 simd_add(simd16 a, simd16 b)
 	return vaddq_s8(a, b);
 }
 
+inline simd16 simd_sub(simd16 a, simd16 b)
+{
+	return vsubq_s8(a, b);
+}
+
 inline simd16 simd_and(simd16 a, simd16 b)
 {
 	return vandq_s8(a, b);
@@ -122,4 +265,12 @@ inline int simd_movemask(simd16 v)
 
 	return mask0 | (mask1 << 8);
 }
+
+// Sum of all bytes as unsigned values
+inline unsigned int simd_sum(simd16 v)
+{
+	uint64x2_t sums = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vreinterpretq_u8_s8(v))));
+
+	return static_cast<unsigned int>(vgetq_lane_u64(sums, 0) + vgetq_lane_u64(sums, 1));
+}
 #endif
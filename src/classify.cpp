@@ -0,0 +1,104 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "classify.hpp"
+
+#include "constants.hpp"
+
+#include <algorithm>
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+#include "charsimd.hpp"
+#endif
+
+inline unsigned int countBits(unsigned int value)
+{
+#ifdef _MSC_VER
+	value = value - ((value >> 1) & 0x55555555);
+	value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+	return (((value + (value >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+#else
+	return __builtin_popcount(value);
+#endif
+}
+
+inline bool isControl(unsigned char ch)
+{
+	// tab, newline, vertical tab, form feed and carriage return are whitespace
+	return ch < 32 && !(ch >= 9 && ch <= 13);
+}
+
+struct ClassStatistics
+{
+	size_t zeros;
+	size_t controls;
+	size_t longLineSize;
+
+	size_t lineStart;
+};
+
+inline void addLine(ClassStatistics& stats, size_t end)
+{
+	size_t length = end - stats.lineStart;
+
+	if (length > kFileClassGeneratedLineLength)
+		stats.longLineSize += length;
+
+	stats.lineStart = end + 1;
+}
+
+FileClass classifyFile(const char* data, size_t size)
+{
+	size_t sampleSize = std::min(size, kFileClassSampleSize);
+
+	ClassStatistics stats = {};
+	size_t offset = 0;
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+	simd16 zero = simd_dup(0);
+	simd16 newline = simd_dup('\n');
+	simd16 controlMin = simd_dup(-1);
+	simd16 controlMax = simd_dup(32);
+	simd16 spaceMin = simd_dup(8);
+	simd16 spaceMax = simd_dup(14);
+
+	for (; offset + 16 <= sampleSize; offset += 16)
+	{
+		simd16 v = simd_load(data + offset);
+
+		// bytes are compared as signed, so the range checks exclude bytes >= 128
+		unsigned int zeros = unsigned(simd_movemask(simd_cmpeq(v, zero))) & 0xffff;
+		unsigned int controls = unsigned(simd_movemask(simd_and(simd_cmpgt(v, controlMin), simd_cmpgt(controlMax, v)))) & 0xffff;
+		unsigned int spaces = unsigned(simd_movemask(simd_and(simd_cmpgt(v, spaceMin), simd_cmpgt(spaceMax, v)))) & 0xffff;
+		unsigned int newlines = unsigned(simd_movemask(simd_cmpeq(v, newline))) & 0xffff;
+
+		stats.zeros += countBits(zeros);
+		stats.controls += countBits(controls & ~spaces);
+
+		for (; newlines; newlines &= newlines - 1)
+			addLine(stats, offset + countTrailingZeros(newlines));
+	}
+#endif
+
+	for (; offset < sampleSize; ++offset)
+	{
+		unsigned char ch = data[offset];
+
+		stats.zeros += (ch == 0);
+		stats.controls += isControl(ch);
+
+		if (ch == '\n')
+			addLine(stats, offset);
+	}
+
+	// the last line may continue past the sample, in which case it's at least as long as the part we've seen
+	if (stats.lineStart < sampleSize)
+		addLine(stats, sampleSize);
+
+	if (stats.zeros * kFileClassBinaryZeroRatio > sampleSize || stats.controls * kFileClassBinaryControlRatio > sampleSize)
+		return FC_BINARY;
+
+	if (stats.longLineSize * 2 > sampleSize)
+		return FC_GENERATED;
+
+	return FC_TEXT;
+}
@@ -0,0 +1,23 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <stddef.h>
+
+enum FileClass
+{
+	FC_TEXT,
+	FC_BINARY,
+	FC_GENERATED,
+
+	FC_COUNT
+};
+
+enum FilePolicy
+{
+	FP_INDEX,
+	FP_STORE,
+	FP_SKIP
+};
+
+// Classifies file contents (after conversion to UTF-8) from a prefix: binary files have zero or control bytes, generated files (i.e. minified sources) mostly consist of long lines
+FileClass classifyFile(const char* data, size_t size);
@@ -40,3 +40,152 @@ void decompressPartial(void* dest, size_t destSize, const void* source, size_t s
 	assert(static_cast<size_t>(result) >= targetSize);
 	assert(static_cast<size_t>(result) <= destSize);
 }
+
+int getLZ4MaxLevel()
+{
+	return LZ4HC_CLEVEL_MAX;
+}
+
+#ifdef USE_ZSTD
+#include "zstd.h"
+#include "zdict.h"
+
+// Contexts are expensive to create, so every thread keeps one for compression and one for decompression
+struct ZstdContexts
+{
+	ZSTD_CCtx* cctx;
+	ZSTD_DCtx* dctx;
+
+	ZstdContexts(): cctx(nullptr), dctx(nullptr)
+	{
+	}
+
+	~ZstdContexts()
+	{
+		ZSTD_freeCCtx(cctx);
+		ZSTD_freeDCtx(dctx);
+	}
+};
+
+static thread_local ZstdContexts gZstdContexts;
+
+CompressionDictionary::CompressionDictionary(std::vector<char> data): data(std::move(data)), compressionDictionary(nullptr)
+{
+	decompressionDictionary = ZSTD_createDDict(this->data.data(), this->data.size());
+}
+
+CompressionDictionary::CompressionDictionary(std::vector<char> data, int level): data(std::move(data))
+{
+	compressionDictionary = ZSTD_createCDict(this->data.data(), this->data.size(), level);
+	decompressionDictionary = ZSTD_createDDict(this->data.data(), this->data.size());
+}
+
+CompressionDictionary::~CompressionDictionary()
+{
+	ZSTD_freeCDict(static_cast<ZSTD_CDict*>(compressionDictionary));
+	ZSTD_freeDDict(static_cast<ZSTD_DDict*>(decompressionDictionary));
+}
+
+bool isZstdSupported()
+{
+	return true;
+}
+
+int getZstdMaxLevel()
+{
+	return ZSTD_maxCLevel();
+}
+
+std::pair<std::unique_ptr<char[]>, size_t> compressZstd(const void* data, size_t dataSize, int level, const CompressionDictionary* dictionary)
+{
+	if (dataSize == 0) return std::make_pair(std::unique_ptr<char[]>(), 0);
+
+	ZSTD_CCtx*& cctx = gZstdContexts.cctx;
+
+	if (!cctx)
+		cctx = ZSTD_createCCtx();
+
+	size_t csizeBound = ZSTD_compressBound(dataSize);
+
+	std::unique_ptr<char[]> cdata(new char[csizeBound]);
+
+	assert(!dictionary || dictionary->compressionDictionary);
+
+	size_t csize = dictionary
+		? ZSTD_compress_usingCDict(cctx, cdata.get(), csizeBound, data, dataSize, static_cast<const ZSTD_CDict*>(dictionary->compressionDictionary))
+		: ZSTD_compressCCtx(cctx, cdata.get(), csizeBound, data, dataSize, level);
+	assert(!ZSTD_isError(csize) && csize <= csizeBound);
+
+	return std::make_pair(std::move(cdata), csize);
+}
+
+void decompressZstd(void* dest, size_t destSize, const void* source, size_t sourceSize, const CompressionDictionary* dictionary)
+{
+	if (sourceSize == 0 && destSize == 0) return;
+
+	ZSTD_DCtx*& dctx = gZstdContexts.dctx;
+
+	if (!dctx)
+		dctx = ZSTD_createDCtx();
+
+	size_t result = dictionary
+		? ZSTD_decompress_usingDDict(dctx, dest, destSize, source, sourceSize, static_cast<const ZSTD_DDict*>(dictionary->decompressionDictionary))
+		: ZSTD_decompressDCtx(dctx, dest, destSize, source, sourceSize);
+	assert(!ZSTD_isError(result));
+	assert(result == destSize);
+}
+
+std::vector<char> trainZstdDictionary(const char* samples, const std::vector<size_t>& sampleSizes, size_t dictionarySize)
+{
+	std::vector<char> result(dictionarySize);
+
+	size_t size = sampleSizes.empty() ? 0 : ZDICT_trainFromBuffer(result.data(), result.size(), samples, sampleSizes.data(), sampleSizes.size());
+
+	result.resize(sampleSizes.empty() || ZDICT_isError(size) ? 0 : size);
+
+	return result;
+}
+#else
+CompressionDictionary::CompressionDictionary(std::vector<char> data): data(std::move(data)), compressionDictionary(nullptr), decompressionDictionary(nullptr)
+{
+}
+
+CompressionDictionary::CompressionDictionary(std::vector<char> data, int level): data(std::move(data)), compressionDictionary(nullptr), decompressionDictionary(nullptr)
+{
+}
+
+CompressionDictionary::~CompressionDictionary()
+{
+}
+
+bool isZstdSupported()
+{
+	return false;
+}
+
+int getZstdMaxLevel()
+{
+	return 0;
+}
+
+std::pair<std::unique_ptr<char[]>, size_t> compressZstd(const void* data, size_t dataSize, int level, const CompressionDictionary* dictionary)
+{
+	assert(!"zstd is not supported");
+	return std::make_pair(std::unique_ptr<char[]>(), 0);
+}
+
+void decompressZstd(void* dest, size_t destSize, const void* source, size_t sourceSize, const CompressionDictionary* dictionary)
+{
+	assert(!"zstd is not supported");
+}
+
+std::vector<char> trainZstdDictionary(const char* samples, const std::vector<size_t>& sampleSizes, size_t dictionarySize)
+{
+	return std::vector<char>();
+}
+#endif
+
+const std::vector<char>& CompressionDictionary::getData() const
+{
+	return data;
+}
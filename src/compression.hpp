@@ -3,8 +3,50 @@
 
 #include <memory>
 #include <utility>
+#include <vector>
+
+enum CompressionCodec
+{
+	CC_LZ4,
+	CC_ZSTD,
+};
+
+// Prepared zstd dictionary; the same dictionary has to be used to compress and decompress the data
+class CompressionDictionary
+{
+public:
+	// Dictionaries that are created without a compression level can only be used for decompression
+	CompressionDictionary(std::vector<char> data);
+	CompressionDictionary(std::vector<char> data, int level);
+	~CompressionDictionary();
+
+	const std::vector<char>& getData() const;
+
+private:
+	CompressionDictionary(const CompressionDictionary&);
+	CompressionDictionary& operator=(const CompressionDictionary&);
+
+	friend std::pair<std::unique_ptr<char[]>, size_t> compressZstd(const void* data, size_t dataSize, int level, const CompressionDictionary* dictionary);
+	friend void decompressZstd(void* dest, size_t destSize, const void* source, size_t sourceSize, const CompressionDictionary* dictionary);
+
+	std::vector<char> data;
+	void* compressionDictionary;
+	void* decompressionDictionary;
+};
 
 std::pair<std::unique_ptr<char[]>, size_t> compress(const void* data, size_t dataSize, int level);
 
 void decompress(void* dest, size_t destSize, const void* source, size_t sourceSize);
 void decompressPartial(void* dest, size_t destSize, const void* source, size_t sourceSize, size_t targetSize);
+
+int getLZ4MaxLevel();
+
+// zstd is only available in builds with USE_ZSTD; data compressed with a dictionary has to be decompressed with the same dictionary
+bool isZstdSupported();
+int getZstdMaxLevel();
+
+std::pair<std::unique_ptr<char[]>, size_t> compressZstd(const void* data, size_t dataSize, int level, const CompressionDictionary* dictionary);
+void decompressZstd(void* dest, size_t destSize, const void* source, size_t sourceSize, const CompressionDictionary* dictionary);
+
+// Samples are stored one after another; returns an empty dictionary if there is not enough data to train one
+std::vector<char> trainZstdDictionary(const char* samples, const std::vector<size_t>& sampleSizes, size_t dictionarySize);
@@ -4,32 +4,168 @@
 #define Kb *1024
 #define Mb Kb Kb
 
-// Approximate uncompressed total size of the chunk
+// Approximate uncompressed total size of the chunk; can be changed per project
 const size_t kChunkSize = 512 Kb;
 
-// Total amount of chunk data in flight
-const size_t kMaxQueuedChunkData = 256 Mb;
+// Block pools allocate memory in slabs of this size, rounded up to the large page size
+const size_t kBlockPoolSlabSize = 8 Mb;
+const size_t kLargePageSize = 2 Mb;
 
-// Total amount of buffered output in flight
-const size_t kMaxBufferedOutput = 32 Mb;
+// Approximate uncompressed size of independently compressed blocks in a chunk; LZ4 only refers to the last 64 Kb of data,
+// so splitting the chunk into blocks of this size costs little compression
+const size_t kChunkBlockSize = 64 Kb;
+
+// Block filters are opt-in and use this fraction of the block data; queries check several ngrams, so a high per-ngram rate still skips blocks
+const size_t kChunkBlockIndexRatio = 32;
+
+// Chunks with fewer data blocks don't get block filters, since there are few blocks to skip
+const size_t kChunkBlockIndexMinBlocks = 4;
+
+// Range of chunk sizes that projects can use
+const size_t kChunkSizeMin = 64 Kb;
+const size_t kChunkSizeMax = 64 Mb;
+
+// Updates append to the data file until chunks that are no longer referenced take more than this fraction of it
+const double kDataFileMaxUnusedRatio = 0.5;
+
+// Memory budget for data in flight as a share of the physical memory, and the budget if the memory size is unknown
+const size_t kMemoryBudgetShare = 16;
+const size_t kMemoryBudgetDefault = 512 Mb;
+
+// Shares of the memory budget for chunk data in flight, for files and chunks that build and update read ahead, and for buffered output
+const size_t kQueuedChunkDataShare = 2;
+const size_t kPendingDataShare = 8;
+const size_t kBufferedOutputShare = 16;
+
+// Smallest limits that the memory budget can set for them, which keep small budgets from serializing the work
+const size_t kMinQueuedChunkData = 16 Mb;
+const size_t kMinPendingData = 4 Mb;
+const size_t kMinBufferedOutput = 2 Mb;
+
+// Files with the same contents as a stored file are stored as references if they are at least this large
+const size_t kFileReferenceMinSize = 256;
+
+// Files are classified as binary or generated by looking at this many bytes from the start
+const size_t kFileClassSampleSize = 64 Kb;
+
+// Files with more than one zero byte per this many bytes, or more than one control character per 16 bytes are binary
+const size_t kFileClassBinaryZeroRatio = 256;
+const size_t kFileClassBinaryControlRatio = 16;
+
+// Files where more than half of the data is in lines longer than this are generated
+const size_t kFileClassGeneratedLineLength = 1024;
+
+// Number of files that are read ahead of the file being appended to the build
+const size_t kMaxPendingFileReads = 4096;
+
+// Number of chunks with indices checked by a single search job
+const size_t kChunkFilterBatchSize = 64;
+
+// Amount of mapped data file contents to prefetch ahead of the chunk being read
+const size_t kDataPrefetchWindow = 8 Mb;
+
+// Amount of compressed data of chunks that will be searched to read ahead of the chunk being queued
+const size_t kChunkPrefetchWindow = 32 Mb;
+
+// Default amount of decompressed chunk data kept by the search server
+const size_t kServerChunkCacheSize = 1024 Mb;
+
+// Size of the synthetic corpus that `qgrep bench` generates by default
+const size_t kBenchCorpusSize = 64 Mb;
+
+// Total size of search results kept by the search server; larger results are not cached
+const size_t kServerResultCacheSize = 64 Mb;
+
+// Total size of changed file contents kept between searches by the search server, or between queries of one search
+const size_t kChangeOverlaySize = 64 Mb;
+
+// Amount of output the search server collects before sending it to the client
+const size_t kServerOutputBufferSize = 64 Kb;
+
+// Amount of output the coordinator buffers for every shard that it hasn't printed yet; shards wait until earlier shards are printed
+const size_t kShardOutputBufferSize = 16 Mb;
+
+// Amount of output collected for the embedding callback before the search waits for the callback to catch up
+const size_t kCallbackOutputLimit = 4 Mb;
+
+// Number of characters around a match that are printed for long lines with windowed output
+const size_t kMatchWindowSize = 200;
 
 // Flush buffered output from the current chunk after reaching this threshold, if possible
 const size_t kBufferedOutputFlushThreshold = 32 Kb;
 
+// Number of chunks that can be completed ahead of the oldest chunk that is not written yet
+const size_t kBufferedOutputChunks = 1024;
+
+// Number of file list entries matched by a single filter job
+const size_t kFilterBatchSize = 16384;
+
 // File list compression level, 0-9
 const int kFileListCompressionLevel = 1;
 
-// File data compression level, 0-9
+// File data compression level, 0-12 for LZ4; can be changed per project
 const int kFileDataCompressionLevel = 3;
 
+// Default compression level for projects that use zstd
+const int kZstdCompressionLevel = 9;
+
+// Size of the zstd dictionary, and the amount of file data in the first chunks of the build that it's trained on
+const size_t kCompressionDictionarySize = 112 Kb;
+const size_t kCompressionDictionarySampleSize = 16 Mb;
+
+// Build chunk indices as blocked bloom filters (one cache line per ngram) which are faster to query
+const bool kChunkIndexBlocked = true;
+
+// Add 2-grams and 3-grams to blocked chunk indices, so that atoms with less than 4 characters can skip chunks
+const bool kChunkIndexShortNgrams = true;
+
+// Shortest regex atom that is checked against chunk indices
+const int kChunkIndexMinAtomLength = 2;
+
+// Target false positive rate of chunk indices; can be changed per project. Chunks that need more than the size limit stay above it
+const double kChunkIndexFalsePositiveRate = 0.01;
+
+// Chunk indices are never larger than the chunk data divided by this; blocked indices are rounded down to a power of two
+const size_t kChunkIndexMaxRatio = 8;
+
+// Slice index signature size in index blocks; chunk indices are folded to this size
+const unsigned int kSliceIndexBlocks = 64;
+
+// Number of signature bits checked per ngram in the slice index; chunks with fewer index iterations always match
+const unsigned int kSliceIndexIterations = 8;
+
+// Number of chunks in one slice index group (has to be a multiple of 128)
+const unsigned int kSliceIndexGroupSize = 512;
+
+// Don't bother building a slice index for small projects
+const unsigned int kSliceIndexMinChunks = 256;
+
+// Number of atoms and chunks with the most false positives that `qgrep info` lists when it replays queries
+const size_t kIndexAnalysisListSize = 10;
+
+// Identifiers longer than this are not added to identifier indices, so whole word queries for them can't use the index
+const size_t kIdentifierMaxLength = 128;
+
+// Number of (ngram, chunk) or (identifier, chunk) pairs collected in memory before spilling a sorted run to disk when building posting lists
+const size_t kPostingRunSize = 16 * 1024 * 1024;
+
+// Number of threads used to list directories; traversal mostly waits for the file system, so this does not depend on the core count
+const unsigned int kTraverseThreadCount = 8;
+
+// Number of updates that reuse cached directory listings before the project is scanned in full again
+const unsigned int kSnapshotFullScanInterval = 16;
+
 // Wait for several seconds before writing changes to amortize writes when many changes are done at once
 const int kWatchWriteDeadline = 1;
 
 // Wait for many seconds before launching an update to minimize the chance of concurrent work
 const int kWatchUpdateTimeout = 60;
 
-// When we're above a certain threshold of changed files, automatically update
-const int kWatchUpdateThresholdFiles = 100;
+// Until an update of the project was timed, update once changed files make every search read more than this fraction of the pack data in addition
+const double kWatchUpdatePenaltyRatio = 0.05;
+
+// Check how long searches spent on changed files this often while there are changes
+const int kWatchChangeTimeInterval = 5;
 
 #undef Mb
 #undef Kb
\ No newline at end of file
@@ -0,0 +1,384 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "datafile.hpp"
+
+#include "fileutil.hpp"
+#include "compression.hpp"
+#include "constants.hpp"
+
+#include <algorithm>
+#include <new>
+
+#include <string.h>
+
+// Decompressed chunk data starts with the file table, so it's aligned at least as much as the file headers
+static const size_t kChunkDataAlignment = 16;
+
+static_assert(alignof(DataChunkFileHeader) <= kChunkDataAlignment, "Chunk data alignment is too small for the file table");
+
+DataFileReader::DataFileReader(): mapping(nullptr), mappingSize(0), position(0), prefetchPosition(0), failed(false)
+{
+}
+
+DataFileReader::DataFileReader(const char* path): mapping(nullptr), mappingSize(0), position(0), prefetchPosition(0), failed(false)
+{
+	open(path);
+}
+
+DataFileReader::~DataFileReader()
+{
+	if (mapping) unmapFile(mapping, mappingSize);
+}
+
+bool DataFileReader::open(const char* path)
+{
+	assert(!mapping && !stream);
+
+	mapping = static_cast<const char*>(mapFile(path, &mappingSize));
+
+	// fall back to regular reads if the file can't be mapped
+	return mapping || stream.open(path, "rb");
+}
+
+DataFileReader::operator bool() const
+{
+	return !failed && (mapping || stream);
+}
+
+bool DataFileReader::isMapped() const
+{
+	return mapping != nullptr;
+}
+
+const char* DataFileReader::read(size_t size)
+{
+	if (mapping)
+	{
+		if (failed || size > mappingSize - position)
+		{
+			failed = true;
+			return nullptr;
+		}
+
+		const char* result = mapping + position;
+		position += size;
+
+		prefetch();
+
+		return result;
+	}
+	else
+	{
+		if (size == 0)
+			return "";
+
+		try
+		{
+			buffer.resize(size);
+		}
+		catch (const std::bad_alloc&)
+		{
+			return nullptr;
+		}
+
+		return ::read(stream, &buffer[0], size) ? buffer.data() : nullptr;
+	}
+}
+
+void DataFileReader::skip(size_t size)
+{
+	if (mapping)
+	{
+		if (size > mappingSize - position)
+			failed = true;
+		else
+			position += size;
+
+		prefetch();
+	}
+	else
+	{
+		stream.skip(size);
+	}
+}
+
+void DataFileReader::seek(uint64_t offset)
+{
+	if (mapping)
+	{
+		if (offset > mappingSize)
+			failed = true;
+		else
+			position = offset;
+	}
+	else
+	{
+		stream.seek(offset);
+	}
+}
+
+const char* DataFileReader::map(uint64_t offset, size_t size) const
+{
+	return (mapping && offset <= mappingSize && size <= mappingSize - offset) ? mapping + offset : nullptr;
+}
+
+uint64_t DataFileReader::size()
+{
+	return mapping ? mappingSize : stream.size();
+}
+
+bool DataFileReader::read(void* data, size_t size)
+{
+	if (mapping)
+	{
+		const char* result = read(size);
+		if (!result) return false;
+
+		memcpy(data, result, size);
+		return true;
+	}
+	else
+	{
+		return ::read(stream, data, size);
+	}
+}
+
+void DataFileReader::prefetch(uint64_t offset, size_t size)
+{
+	if (mapping)
+	{
+		if (offset <= mappingSize && size <= mappingSize - offset)
+			prefetchMemory(mapping + offset, size);
+	}
+	else if (stream)
+	{
+		stream.prefetch(offset, size);
+	}
+}
+
+void DataFileReader::prefetch()
+{
+	// keep a window of data ahead of the read position resident; refill once half of it is consumed
+	if (position + kDataPrefetchWindow / 2 <= prefetchPosition)
+		return;
+
+	uint64_t begin = std::max(position, prefetchPosition);
+	uint64_t end = std::min(position + kDataPrefetchWindow, mappingSize);
+
+	if (begin < end)
+		prefetchMemory(mapping + begin, end - begin);
+
+	prefetchPosition = end;
+}
+
+static bool readDataFileFooter(DataFileReader& in, DataFileFooter& footer)
+{
+	in.seek(0);
+
+	DataFileHeader header;
+	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+		return false;
+
+	uint64_t fileSize = in.size();
+	uint64_t committedSize = header.committedSize;
+
+	if (committedSize < sizeof(DataFileHeader) + sizeof(DataFileFooter) || committedSize > fileSize)
+		return false;
+
+	in.seek(committedSize - sizeof(DataFileFooter));
+
+	if (!read(in, footer) || memcmp(footer.magic, kDataFileFooterMagic, strlen(kDataFileFooterMagic)) != 0)
+		return false;
+
+	uint64_t tableSize = uint64_t(footer.chunkCount) * sizeof(DataChunkDirectoryEntry) + uint64_t(footer.aliasCount) * sizeof(DataFileAliasEntry) + footer.aliasNameSize;
+
+	return footer.directoryOffset >= sizeof(DataFileHeader) && footer.directoryOffset + tableSize == committedSize - sizeof(DataFileFooter) &&
+		(footer.dictionarySize == 0 || (footer.dictionaryOffset >= sizeof(DataFileHeader) && footer.dictionaryOffset + footer.dictionarySize <= footer.directoryOffset));
+}
+
+// Packs with zstd chunks can only be read by builds with zstd support; these are reported as out of date
+static bool isChunkCodecSupported(unsigned int codec, bool hasDictionary)
+{
+	switch (codec)
+	{
+	case DCC_LZ4:
+		return true;
+
+	case DCC_ZSTD:
+		return isZstdSupported();
+
+	case DCC_ZSTD_DICTIONARY:
+		return isZstdSupported() && hasDictionary;
+
+	default:
+		return false;
+	}
+}
+
+bool readDataFileDirectory(DataFileReader& in, std::vector<DataChunkDirectoryEntry>& chunks)
+{
+	DataFileFooter footer;
+	if (!readDataFileFooter(in, footer))
+		return false;
+
+	try
+	{
+		chunks.resize(footer.chunkCount);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return false;
+	}
+
+	in.seek(footer.directoryOffset);
+
+	if (!chunks.empty() && !in.read(&chunks[0], chunks.size() * sizeof(DataChunkDirectoryEntry)))
+		return false;
+
+	// validate chunk extents once so that readers can rely on them
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		const DataChunkDirectoryEntry& e = chunks[i];
+
+		if (e.headerOffset < sizeof(DataFileHeader) ||
+			e.headerOffset + sizeof(DataChunkHeader) + e.header.extraSize > e.indexOffset ||
+			e.indexOffset + e.header.indexSize > e.dataOffset ||
+			e.dataOffset + e.header.compressedSize > footer.directoryOffset ||
+			e.header.blockCount == 0 ||
+			e.header.blockCount * sizeof(DataChunkBlockHeader) > e.header.blockTableSize ||
+			e.header.blockTableSize > e.header.compressedSize ||
+			!isChunkCodecSupported(e.header.codec, footer.dictionarySize != 0))
+			return false;
+	}
+
+	return true;
+}
+
+bool readDataFileAliases(DataFileReader& in, std::vector<DataFileAliasEntry>& aliases, std::vector<char>& names)
+{
+	DataFileFooter footer;
+	if (!readDataFileFooter(in, footer))
+		return false;
+
+	try
+	{
+		aliases.resize(footer.aliasCount);
+		names.resize(footer.aliasNameSize);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return false;
+	}
+
+	in.seek(footer.directoryOffset + uint64_t(footer.chunkCount) * sizeof(DataChunkDirectoryEntry));
+
+	if (!aliases.empty() && !in.read(&aliases[0], aliases.size() * sizeof(DataFileAliasEntry)))
+		return false;
+
+	if (!names.empty() && !in.read(&names[0], names.size()))
+		return false;
+
+	// validate alias order and name extents once so that readers can rely on them
+	for (size_t i = 0; i < aliases.size(); ++i)
+	{
+		const DataFileAliasEntry& e = aliases[i];
+
+		if (uint64_t(e.nameOffset) + e.nameLength > names.size() || e.chunkIndex >= footer.chunkCount)
+			return false;
+
+		if (i > 0 && (aliases[i - 1].chunkIndex > e.chunkIndex || (aliases[i - 1].chunkIndex == e.chunkIndex && aliases[i - 1].fileIndex > e.fileIndex)))
+			return false;
+	}
+
+	return true;
+}
+
+bool readDataFileDictionary(DataFileReader& in, std::shared_ptr<CompressionDictionary>& dictionary, uint64_t* offset)
+{
+	DataFileFooter footer;
+	if (!readDataFileFooter(in, footer))
+		return false;
+
+	dictionary.reset();
+
+	if (offset)
+		*offset = footer.dictionaryOffset;
+
+	if (footer.dictionarySize == 0)
+		return true;
+
+	std::vector<char> data;
+
+	try
+	{
+		data.resize(footer.dictionarySize);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return false;
+	}
+
+	in.seek(footer.dictionaryOffset);
+
+	if (!in.read(&data[0], data.size()))
+		return false;
+
+	dictionary.reset(new (std::nothrow) CompressionDictionary(std::move(data)));
+
+	return dictionary != nullptr;
+}
+
+std::vector<DataChunkBlockHeader> getChunkBlocks(const DataChunkHeader& chunk, const char* compressed)
+{
+	assert(chunk.blockCount > 0 && chunk.blockCount * sizeof(DataChunkBlockHeader) <= chunk.blockTableSize);
+
+	// chunk data is not aligned in the data file
+	std::vector<DataChunkBlockHeader> result(chunk.blockCount);
+	memcpy(&result[0], compressed, result.size() * sizeof(DataChunkBlockHeader));
+
+	return result;
+}
+
+void decompressChunkBlock(char* dest, const DataChunkHeader& chunk, const DataChunkBlockHeader& block, const char* source, const CompressionDictionary* dictionary)
+{
+	if (chunk.codec == DCC_LZ4)
+		decompress(dest, block.uncompressedSize, source, block.compressedSize);
+	else
+	{
+		assert(chunk.codec == DCC_ZSTD || (chunk.codec == DCC_ZSTD_DICTIONARY && dictionary));
+		decompressZstd(dest, block.uncompressedSize, source, block.compressedSize, chunk.codec == DCC_ZSTD_DICTIONARY ? dictionary : nullptr);
+	}
+}
+
+static void decompressChunkBlocks(char* dest, const DataChunkHeader& chunk, const char* compressed, size_t count, const CompressionDictionary* dictionary)
+{
+	std::vector<DataChunkBlockHeader> blocks = getChunkBlocks(chunk, compressed);
+
+	const char* source = compressed + chunk.blockTableSize;
+
+	for (size_t i = 0; i < count && i < blocks.size(); ++i)
+	{
+		const DataChunkBlockHeader& b = blocks[i];
+
+		assert(source + b.compressedSize <= compressed + chunk.compressedSize);
+		decompressChunkBlock(dest, chunk, b, source, dictionary);
+
+		dest += b.uncompressedSize;
+		source += b.compressedSize;
+	}
+}
+
+size_t getChunkDataOffset(size_t compressedSize)
+{
+	return (compressedSize + kChunkDataAlignment - 1) / kChunkDataAlignment * kChunkDataAlignment;
+}
+
+void decompressChunk(char* dest, const DataChunkHeader& chunk, const char* compressed, const CompressionDictionary* dictionary)
+{
+	decompressChunkBlocks(dest, chunk, compressed, chunk.blockCount, dictionary);
+}
+
+void decompressChunkFileTable(char* dest, const DataChunkHeader& chunk, const char* compressed, const CompressionDictionary* dictionary)
+{
+	decompressChunkBlocks(dest, chunk, compressed, 1, dictionary);
+}
@@ -0,0 +1,86 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include "filestream.hpp"
+#include "format.hpp"
+
+#include <memory>
+#include <vector>
+
+class CompressionDictionary;
+
+// Sequential reader for data files; maps the file into memory when possible so that chunk data can be used in place
+class DataFileReader
+{
+public:
+	DataFileReader();
+	DataFileReader(const char* path);
+	~DataFileReader();
+
+	bool open(const char* path);
+
+	operator bool() const;
+
+	bool isMapped() const;
+
+	// Returns a pointer to the next size bytes; for mapped files the data stays valid until the reader is destroyed, otherwise until the next read
+	const char* read(size_t size);
+
+	void skip(size_t size);
+	void seek(uint64_t offset);
+
+	uint64_t size();
+
+	// Returns a pointer to mapped file contents without moving the read position; returns nullptr if the file isn't mapped
+	const char* map(uint64_t offset, size_t size) const;
+
+	// Reads the next size bytes into caller-provided storage
+	bool read(void* data, size_t size);
+
+	// Asks the OS to read the range ahead so that scattered reads overlap; this is only a hint, and it does nothing for unmapped files on Windows
+	void prefetch(uint64_t offset, size_t size);
+
+private:
+	DataFileReader(const DataFileReader&);
+	DataFileReader& operator=(const DataFileReader&);
+
+	void prefetch();
+
+	FileStream stream;
+	std::vector<char> buffer;
+
+	const char* mapping;
+	uint64_t mappingSize;
+	uint64_t position;
+	uint64_t prefetchPosition;
+	bool failed;
+};
+
+template <typename T> inline bool read(DataFileReader& in, T& value)
+{
+	return in.read(&value, sizeof(T));
+}
+
+// Reads the file header and the chunk directory; fails if the file is malformed or uses an older format
+bool readDataFileDirectory(DataFileReader& in, std::vector<DataChunkDirectoryEntry>& chunks);
+
+// Reads the alias table that lists references to stored files; fails if the file is malformed or uses an older format
+bool readDataFileAliases(DataFileReader& in, std::vector<DataFileAliasEntry>& aliases, std::vector<char>& names);
+
+// Reads the compression dictionary that is used to decompress the chunks; the result is empty if the file doesn't have one
+bool readDataFileDictionary(DataFileReader& in, std::shared_ptr<CompressionDictionary>& dictionary, uint64_t* offset = nullptr);
+
+// Returns the block table of the chunk; compressed points to the chunk data
+std::vector<DataChunkBlockHeader> getChunkBlocks(const DataChunkHeader& chunk, const char* compressed);
+
+// Decompresses one block of the chunk; source points to the compressed block
+void decompressChunkBlock(char* dest, const DataChunkHeader& chunk, const DataChunkBlockHeader& block, const char* source, const CompressionDictionary* dictionary);
+
+// Decompresses all blocks of the chunk; dest has to have room for uncompressedSize bytes
+void decompressChunk(char* dest, const DataChunkHeader& chunk, const char* compressed, const CompressionDictionary* dictionary);
+
+// Decompresses the first block of the chunk which has the file table; dest has to have room for fileTableSize bytes
+void decompressChunkFileTable(char* dest, const DataChunkHeader& chunk, const char* compressed, const CompressionDictionary* dictionary);
+
+// Chunks that are read into memory are decompressed after the compressed data; returns the offset of the decompressed data, which keeps the file table aligned
+size_t getChunkDataOffset(size_t compressedSize);
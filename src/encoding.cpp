@@ -4,6 +4,10 @@
 
 #include <string.h>
 
+#if defined(USE_SSE2) || defined(USE_NEON)
+#include "charsimd.hpp"
+#endif
+
 inline uint16_t endianSwap(uint16_t value)
 {
 	return static_cast<uint16_t>(((value & 0xff) << 8) | (value >> 8));
@@ -164,7 +168,64 @@ std::vector<char> convertToUTF8(std::vector<char> data)
 	if (size >= 4 && *reinterpret_cast<const uint32_t*>(contents) == 0xfffe0000) return convertToUTF8Impl<UTF32Decoder<true>>(contents + 4, size - 4);
 	if (size >= 2 && *reinterpret_cast<const uint16_t*>(contents) == 0xfeff) return convertToUTF8Impl<UTF16Decoder<false>>(contents + 2, size - 2);
 	if (size >= 2 && *reinterpret_cast<const uint16_t*>(contents) == 0xfffe) return convertToUTF8Impl<UTF16Decoder<true>>(contents + 2, size - 2);
-	if (size >= 3 && memcmp(contents, "\xef\xbb\xbf", 3) == 0) return std::vector<char>(contents + 3, contents + size);
+
+	// UTF-8 BOM is stripped in place; callers move the buffer in, so plain UTF-8 files are never copied
+	if (size >= 3 && memcmp(contents, "\xef\xbb\xbf", 3) == 0)
+		data.erase(data.begin(), data.begin() + 3);
 
 	return data;
 }
+
+size_t normalizeEOL(char* data, size_t size)
+{
+	// fast path: no \r in the file
+	const char* cr = static_cast<const char*>(memchr(data, '\r', size));
+	if (!cr)
+		return size;
+
+	// replace \r\n with \n, replace stray \r with \n; everything before the first \r stays where it is
+	size_t result = cr - data;
+	size_t i = result;
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+	simd16 pattern = simd_dup('\r');
+
+	// blocks without \r are moved down as a whole; the block is loaded before it's stored and result <= i, so
+	// the store never overwrites bytes that haven't been read yet
+	while (i + 16 <= size)
+	{
+		simd16 v = simd_load(data + i);
+		int mask = simd_movemask(simd_cmpeq(v, pattern));
+
+		if (mask == 0)
+		{
+			simd_store(data + result, v);
+			i += 16;
+			result += 16;
+			continue;
+		}
+
+		int offset = countTrailingZeros(mask);
+
+		memmove(data + result, data + i, offset);
+		result += offset;
+		i += offset;
+
+		data[result++] = '\n';
+		i += (i + 1 < size && data[i + 1] == '\n') ? 2 : 1;
+	}
+#endif
+
+	for (; i < size; ++i)
+	{
+		if (data[i] == '\r')
+		{
+			data[result++] = '\n';
+			if (i + 1 < size && data[i + 1] == '\n') i++;
+		}
+		else
+			data[result++] = data[i];
+	}
+
+	return result;
+}
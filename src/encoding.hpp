@@ -3,4 +3,7 @@
 
 #include <vector>
 
+// Replaces \r\n and stray \r with \n in place; returns the new size
+size_t normalizeEOL(char* data, size_t size);
+
 std::vector<char> convertToUTF8(std::vector<char> data);
@@ -9,10 +9,13 @@
 #include "format.hpp"
 #include "compression.hpp"
 #include "filter.hpp"
+#include "fuzzymatch.hpp"
 #include "constants.hpp"
 
 #include <memory>
+#include <functional>
 
+#include <stddef.h>
 #include <string.h>
 
 static std::vector<const char*> getFileNames(const char** files, unsigned int count)
@@ -41,9 +44,9 @@ static size_t getStringBufferSize(const std::vector<const char*>& strings)
 	return result;
 }
 
-typedef std::pair<unsigned int, unsigned int> BufferOffsetLength;
+static_assert(sizeof(FileFileEntry) == sizeof(FilterEntry) && offsetof(FileFileEntry, length) == offsetof(FilterEntry, length), "File list entries must match filter entries");
 
-static std::pair<std::vector<char>, std::pair<BufferOffsetLength, BufferOffsetLength>> prepareFileData(const std::vector<FileInfo>& files)
+static std::vector<char> prepareFileData(FileFileHeader& header, const std::vector<FileInfo>& files)
 {
 	size_t count = files.size();
 
@@ -53,42 +56,65 @@ static std::pair<std::vector<char>, std::pair<BufferOffsetLength, BufferOffsetLe
 
 	std::vector<const char*> names = getFileNames(paths.data(), count);
 
+	size_t signatureSize = sizeof(uint64_t) * count;
 	size_t entrySize = sizeof(FileFileEntry) * count;
-	size_t nameSize = getStringBufferSize(names);
 	size_t pathSize = getStringBufferSize(paths);
-	size_t totalSize = entrySize + nameSize + pathSize;
+	size_t nameSize = getStringBufferSize(names);
+	size_t totalSize = signatureSize + entrySize * 2 + pathSize + nameSize;
+
+	header.fileCount = count;
+	header.uncompressedSize = totalSize;
+
+	// signatures go first since they have the largest alignment
+	header.pathSignatureOffset = 0;
+	header.pathEntryOffset = signatureSize;
+	header.nameEntryOffset = signatureSize + entrySize;
+	header.pathBufferOffset = signatureSize + entrySize * 2;
+	header.pathBufferLength = pathSize;
+	header.nameBufferOffset = signatureSize + entrySize * 2 + pathSize;
+	header.nameBufferLength = nameSize;
 
 	std::vector<char> data(totalSize);
 
-	size_t nameOffset = entrySize;
-	size_t pathOffset = entrySize + nameSize;
-	
-	for (unsigned int i = 0; i < count; ++i)
+	uint64_t* pathSignatures = reinterpret_cast<uint64_t*>(data.data() + header.pathSignatureOffset);
+	FileFileEntry* pathEntries = reinterpret_cast<FileFileEntry*>(data.data() + header.pathEntryOffset);
+	FileFileEntry* nameEntries = reinterpret_cast<FileFileEntry*>(data.data() + header.nameEntryOffset);
+
+	size_t pathOffset = 0;
+	size_t nameOffset = 0;
+
+	for (size_t i = 0; i < count; ++i)
 	{
-		size_t nameLength = strlen(names[i]);
 		size_t pathLength = strlen(paths[i]);
+		size_t nameLength = strlen(names[i]);
 
-		std::copy(names[i], names[i] + nameLength, data.begin() + nameOffset);
-		data[nameOffset + nameLength] = '\n';
+		char* pathData = data.data() + header.pathBufferOffset + pathOffset;
+		char* nameData = data.data() + header.nameBufferOffset + nameOffset;
 
-		std::copy(paths[i], paths[i] + pathLength, data.begin() + pathOffset);
-		data[pathOffset + pathLength] = '\n';
+		memcpy(pathData, paths[i], pathLength);
+		pathData[pathLength] = '\n';
 
-		FileFileEntry& e = reinterpret_cast<FileFileEntry*>(&data[0])[i];
+		memcpy(nameData, names[i], nameLength);
+		nameData[nameLength] = '\n';
 
-		e.nameOffset = nameOffset;
-		e.pathOffset = pathOffset;
+		pathSignatures[i] = getCharacterSignature(paths[i], pathLength);
+
+		pathEntries[i].offset = pathOffset;
+		pathEntries[i].length = pathLength;
+
+		nameEntries[i].offset = nameOffset;
+		nameEntries[i].length = nameLength;
 
-		nameOffset += nameLength + 1;
 		pathOffset += pathLength + 1;
+		nameOffset += nameLength + 1;
 	}
 
-	assert(nameOffset == entrySize + nameSize && pathOffset == totalSize);
+	assert(pathOffset == pathSize && nameOffset == nameSize);
 
-	return std::make_pair(data, std::make_pair(BufferOffsetLength(entrySize, nameSize), BufferOffsetLength(entrySize + nameSize, pathSize)));
+	return data;
 }
 
-bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& files)
+bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& files, bool compressed)
 {
 	std::string targetPath = replaceExtension(path, ".qgf");
 	std::string tempPath = targetPath + "_";
@@ -103,23 +129,25 @@ bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& f
 			return false;
 		}
 
-		std::pair<std::vector<char>, std::pair<BufferOffsetLength, BufferOffsetLength>> data = prepareFileData(files);
-		std::pair<std::unique_ptr<char[]>, size_t> compressed = compress(data.first.data(), data.first.size(), kFileListCompressionLevel);
-
-		FileFileHeader header;
+		FileFileHeader header = {};
 		memcpy(header.magic, kFileFileHeaderMagic, sizeof(header.magic));
 
-		header.fileCount = files.size();
-		header.compressedSize = compressed.second;
-		header.uncompressedSize = data.first.size();
+		std::vector<char> data = prepareFileData(header, files);
+
+		if (compressed)
+		{
+			std::pair<std::unique_ptr<char[]>, size_t> packed = compress(data.data(), data.size(), kFileListCompressionLevel);
 
-		header.nameBufferOffset = data.second.first.first;
-		header.nameBufferLength = data.second.first.second;
-		header.pathBufferOffset = data.second.second.first;
-		header.pathBufferLength = data.second.second.second;
+			header.compressedSize = packed.second;
 
-		out.write(&header, sizeof(header));
-		if (compressed.first) out.write(compressed.first.get(), compressed.second);
+			out.write(&header, sizeof(header));
+			if (packed.first) out.write(packed.first.get(), packed.second);
+		}
+		else
+		{
+			out.write(&header, sizeof(header));
+			out.write(data.data(), data.size());
+		}
 	}
 
 	if (!renameFile(tempPath.c_str(), targetPath.c_str()))
@@ -131,66 +159,97 @@ bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& f
 	return true;
 }
 
-template <typename ExtractOffset>
-static void buildFilterEntries(FilterEntries& result, std::unique_ptr<FilterEntry[]>& entryptr,
-    const FileFileHeader& header, const char* data, unsigned int bufferOffset, unsigned int bufferLength, ExtractOffset extractOffset)
+template <typename T> static const T* getTable(const FileFileHeader& header, const char* data, uint32_t offset)
 {
-    const FileFileEntry* entries = reinterpret_cast<const FileFileEntry*>(data);
+	// tables are used in place, so they have to be aligned; their contents are trusted like the rest of the data
+	if (reinterpret_cast<uintptr_t>(data + offset) % alignof(T) != 0 || offset + uint64_t(header.fileCount) * sizeof(T) > header.uncompressedSize)
+		return nullptr;
 
-    entryptr.reset(new FilterEntry[header.fileCount]);
+	return reinterpret_cast<const T*>(data + offset);
+}
 
-    result.buffer = data + bufferOffset;
-    result.bufferSize = bufferLength;
+static bool getFilterEntries(FilterEntries& result, const FileFileHeader& header, const char* data, uint32_t entryOffset, uint32_t bufferOffset, uint32_t bufferLength)
+{
+	if (uint64_t(bufferOffset) + bufferLength > header.uncompressedSize)
+		return false;
 
-    result.entries = entryptr.get();
-    result.entryCount = header.fileCount;
+	result.buffer = data + bufferOffset;
+	result.bufferSize = bufferLength;
 
-    for (size_t i = 0; i < header.fileCount; ++i)
-    {
-        FilterEntry& e = result.entries[i];
+	result.entries = getTable<FilterEntry>(header, data, entryOffset);
+	result.entryCount = header.fileCount;
 
-        size_t offset = extractOffset(entries[i]);
+	result.signatures = nullptr;
 
-        e.offset = offset - bufferOffset;
-        e.length = (i + 1 < header.fileCount ? extractOffset(entries[i + 1]) : bufferOffset + bufferLength) - offset - 1;
-    }
+	return result.entries != nullptr;
 }
 
-unsigned int searchFiles(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude)
+unsigned int searchFiles(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude, FilterSession* session)
 {
 	std::string dataPath = replaceExtension(file, ".qgf");
-	FileStream in(dataPath.c_str(), "rb");
-	if (!in)
+
+	uint64_t mappingSize = 0;
+	const char* mapping = static_cast<const char*>(mapFile(dataPath.c_str(), &mappingSize));
+	if (!mapping)
 	{
 		output->error("Error reading data file %s\n", dataPath.c_str());
 		return 0;
 	}
-	
-	FileFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kFileFileHeaderMagic, strlen(kFileFileHeaderMagic)) != 0)
+
+	std::unique_ptr<const char, std::function<void (const char*)>> mappingGuard(mapping, [=](const char* data) { unmapFile(data, mappingSize); });
+
+	FileFileHeader header = {};
+	if (mappingSize >= sizeof(header))
+		memcpy(&header, mapping, sizeof(header));
+
+	if (memcmp(header.magic, kFileFileHeaderMagic, strlen(kFileFileHeaderMagic)) != 0 ||
+		mappingSize - sizeof(header) < (header.compressedSize ? header.compressedSize : header.uncompressedSize))
 	{
 		output->error("Error reading data file %s: malformed header\n", dataPath.c_str());
 		return 0;
 	}
 
-	std::unique_ptr<char[]> buffer(new (std::nothrow) char[header.compressedSize + header.uncompressedSize]);
+	const char* data = mapping + sizeof(header);
+
+	// compressed file lists have to be unpacked first; the tables are used in place after that
+	std::unique_ptr<char[]> buffer;
+
+	if (header.compressedSize)
+	{
+		buffer.reset(new (std::nothrow) char[header.uncompressedSize]);
+
+		if (!buffer)
+		{
+			output->error("Error reading data file %s: out of memory\n", dataPath.c_str());
+			return 0;
+		}
+
+		decompress(buffer.get(), header.uncompressedSize, data, header.compressedSize);
+		data = buffer.get();
+	}
+
+	FilterEntries paths, names;
 
-	if (!buffer || !read(in, buffer.get(), header.compressedSize))
+	bool valid =
+		getFilterEntries(paths, header, data, header.pathEntryOffset, header.pathBufferOffset, header.pathBufferLength) &&
+		getFilterEntries(names, header, data, header.nameEntryOffset, header.nameBufferOffset, header.nameBufferLength);
+
+	paths.signatures = getTable<uint64_t>(header, data, header.pathSignatureOffset);
+
+	if (!valid || !paths.signatures)
 	{
 		output->error("Error reading data file %s: malformed header\n", dataPath.c_str());
 		return 0;
 	}
 
-	char* data = buffer.get() + header.compressedSize;
-	decompress(data, header.uncompressedSize, buffer.get(), header.compressedSize);
-
-    FilterEntries paths;
-    std::unique_ptr<FilterEntry[]> pathEntries;
-    buildFilterEntries(paths, pathEntries, header, data, header.pathBufferOffset, header.pathBufferLength, [](const FileFileEntry& e) { return e.pathOffset; });
+	// matches of the last search are only valid for the same version of the file list
+	if (session)
+	{
+		uint64_t timeStamp = 0, fileSize = 0;
+		getFileAttributes(dataPath.c_str(), &timeStamp, &fileSize);
 
-    FilterEntries names;
-    std::unique_ptr<FilterEntry[]> nameEntries;
-    buildFilterEntries(names, nameEntries, header, data, header.nameBufferOffset, header.nameBufferLength, [](const FileFileEntry& e) { return e.nameOffset; });
+		session->setList(dataPath + ":" + std::to_string(timeStamp) + ":" + std::to_string(fileSize));
+	}
 
-    return filter(output, string, options, limit, paths, &names);
+	return filter(output, string, options, limit, paths, &names, session);
 }
@@ -6,7 +6,10 @@
 
 class Output;
 struct FileInfo;
+struct FilterSession;
 
-bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& files);
+// The file list is stored uncompressed so that searches can map it and use it in place, unless it's compressed for storage
+bool buildFiles(Output* output, const char* path, const std::vector<FileInfo>& files, bool compressed);
 
-unsigned int searchFiles(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude);
\ No newline at end of file
+// The session keeps the matches of the last search, which lets searches for longer queries skip the files that didn't match
+unsigned int searchFiles(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude, FilterSession* session = nullptr);
\ No newline at end of file
@@ -8,6 +8,7 @@
 
 #ifdef _WIN32
 #   define fseeko _fseeki64
+#   define ftello _ftelli64
 #endif
 
 FileStream::FileStream(): file(0)
@@ -41,6 +42,29 @@ void FileStream::skip(size_t offset)
     fseeko(static_cast<FILE*>(file), offset, SEEK_CUR);
 }
 
+void FileStream::seek(uint64_t offset)
+{
+    fseeko(static_cast<FILE*>(file), offset, SEEK_SET);
+}
+
+uint64_t FileStream::size()
+{
+    FILE* f = static_cast<FILE*>(file);
+
+    uint64_t position = ftello(f);
+    fseeko(f, 0, SEEK_END);
+
+    uint64_t result = ftello(f);
+    fseeko(f, position, SEEK_SET);
+
+    return result;
+}
+
+void FileStream::prefetch(uint64_t offset, uint64_t size)
+{
+    prefetchFile(static_cast<FILE*>(file), offset, size);
+}
+
 size_t FileStream::read(void* data, size_t size)
 {
     return fread(data, 1, size, static_cast<FILE*>(file));
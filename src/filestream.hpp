@@ -15,6 +15,12 @@ public:
 	operator bool() const;
 
 	void skip(size_t offset);
+	void seek(uint64_t offset);
+	uint64_t size();
+
+	// Starts reading the range in the background so that a later read doesn't have to wait for the disk
+	void prefetch(uint64_t offset, uint64_t size);
+
 	size_t read(void* data, size_t size);
 	size_t write(const void* data, size_t size);
 
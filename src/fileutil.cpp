@@ -2,6 +2,14 @@
 #include "common.hpp"
 #include "fileutil.hpp"
 
+#include "constants.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include <string.h>
 
 static bool isSeparator(char ch)
@@ -68,6 +76,257 @@ bool passthroughDirectoryFilter(const char* name)
 	return true;
 }
 
+static bool traverseDirectoryRec(const char* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+{
+	std::vector<DirectoryEntry> entries;
+
+	if (!readDirectory(path, entries))
+		return false;
+
+	std::string buf, relbuf;
+
+	for (auto& e: entries)
+	{
+		joinPaths(relbuf, relpath, e.name.c_str());
+
+		if (e.directory)
+		{
+			joinPaths(buf, path, e.name.c_str());
+
+			if (directoryFilter(relbuf.c_str()))
+				traverseDirectoryRec(buf.c_str(), relbuf.c_str(), callback, directoryFilter);
+		}
+		else
+		{
+			callback(relbuf.c_str(), e.mtime, e.size);
+		}
+	}
+
+	return true;
+}
+
+bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+{
+	return traverseDirectoryRec(path, "", callback, directoryFilter);
+}
+
+struct TraverseNode;
+
+struct TraverseItem
+{
+	std::string name;
+	uint64_t mtime;
+	uint64_t size;
+
+	// null for files
+	TraverseNode* child;
+};
+
+struct TraverseNode
+{
+	std::string path;
+	std::string relpath;
+
+	std::vector<TraverseItem> items;
+
+	DirectoryListing listing;
+};
+
+struct TraverseContext
+{
+	const std::function<bool (const char* name)>& fileFilter;
+	const std::function<bool (const char* name)>& directoryFilter;
+
+	DirectoryListingCache* cached;
+	DirectoryListingCache* listings;
+
+	std::vector<std::unique_ptr<TraverseNode>> nodes;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+
+	// directories are listed depth-first so that the pending list stays short
+	std::vector<TraverseNode*> pending;
+	size_t activeCount;
+
+	bool rootRead;
+};
+
+// Orders items so that the tree is visited in the order of sorted paths: a directory sorts as its name followed by a slash
+static bool isTraverseItemLess(const TraverseItem& l, const TraverseItem& r)
+{
+	size_t length = std::min(l.name.size(), r.name.size());
+
+	if (int rc = memcmp(l.name.c_str(), r.name.c_str(), length))
+		return rc < 0;
+
+	int lch = l.name.size() > length ? static_cast<unsigned char>(l.name[length]) : l.child ? '/' : -1;
+	int rch = r.name.size() > length ? static_cast<unsigned char>(r.name[length]) : r.child ? '/' : -1;
+
+	return lch < rch;
+}
+
+static void traverseDirectoryNode(TraverseContext& context, TraverseNode* node, std::vector<DirectoryEntry>& entries, std::vector<TraverseNode*>& children)
+{
+	entries.clear();
+	children.clear();
+
+	DirectoryListing* listing = nullptr;
+
+	if (context.listings)
+	{
+		listing = &node->listing;
+
+		// every directory is visited once, so its listing can be taken from the cache; lookups don't modify the cache and can run concurrently
+		if (context.cached)
+		{
+			auto it = context.cached->find(node->path);
+
+			if (it != context.cached->end())
+				node->listing = std::move(it->second);
+		}
+	}
+
+	bool result = readDirectory(node->path.c_str(), entries, listing);
+
+	std::string relbuf;
+
+	node->items.reserve(entries.size());
+
+	for (auto& e: entries)
+	{
+		joinPaths(relbuf, node->relpath.c_str(), e.name.c_str());
+
+		if (e.directory)
+		{
+			if (context.directoryFilter(relbuf.c_str()))
+			{
+				TraverseNode* child = new TraverseNode();
+
+				joinPaths(child->path, node->path.c_str(), e.name.c_str());
+				child->relpath = relbuf;
+
+				children.push_back(child);
+
+				TraverseItem item = { std::move(e.name), 0, 0, child };
+				node->items.push_back(std::move(item));
+			}
+		}
+		else
+		{
+			if (context.fileFilter(relbuf.c_str()))
+			{
+				TraverseItem item = { std::move(e.name), e.mtime, e.size, nullptr };
+				node->items.push_back(std::move(item));
+			}
+		}
+	}
+
+	std::sort(node->items.begin(), node->items.end(), isTraverseItemLess);
+
+	std::unique_lock<std::mutex> lock(context.mutex);
+
+	if (node == context.nodes[0].get())
+		context.rootRead = result;
+
+	for (auto& child: children)
+	{
+		context.nodes.emplace_back(child);
+		context.pending.push_back(child);
+	}
+
+	context.activeCount--;
+
+	// the traversal is complete once no directory is being read and none are pending
+	if (!children.empty() || (context.activeCount == 0 && context.pending.empty()))
+		context.condition.notify_all();
+}
+
+static void traverseDirectoryWorker(TraverseContext& context)
+{
+	std::vector<DirectoryEntry> entries;
+	std::vector<TraverseNode*> children;
+
+	for (;;)
+	{
+		TraverseNode* node;
+
+		{
+			std::unique_lock<std::mutex> lock(context.mutex);
+
+			context.condition.wait(lock, [&]() { return !context.pending.empty() || context.activeCount == 0; });
+
+			if (context.pending.empty())
+				return;
+
+			node = context.pending.back();
+			context.pending.pop_back();
+			context.activeCount++;
+		}
+
+		traverseDirectoryNode(context, node, entries, children);
+	}
+}
+
+static void reportTraverseItems(const TraverseNode* node, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, std::string& relbuf)
+{
+	for (auto& item: node->items)
+	{
+		if (item.child)
+			reportTraverseItems(item.child, callback, relbuf);
+		else
+		{
+			joinPaths(relbuf, node->relpath.c_str(), item.name.c_str());
+
+			callback(relbuf.c_str(), item.mtime, item.size);
+		}
+	}
+}
+
+bool traverseDirectoryParallel(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& fileFilter, const std::function<bool (const char* name)>& directoryFilter,
+	DirectoryListingCache* cached, DirectoryListingCache* listings)
+{
+	TraverseContext context = { fileFilter, directoryFilter, cached, listings };
+
+	TraverseNode* root = new TraverseNode();
+	root->path = path;
+
+	context.nodes.emplace_back(root);
+	context.pending.push_back(root);
+	context.activeCount = 0;
+	context.rootRead = false;
+
+	std::vector<std::thread> threads;
+
+	bool background = isBackgroundPriority();
+
+	for (unsigned int i = 1; i < kTraverseThreadCount; ++i)
+		threads.emplace_back([&context, background]() {
+			if (background)
+				setBackgroundPriority();
+
+			traverseDirectoryWorker(context);
+		});
+
+	traverseDirectoryWorker(context);
+
+	for (auto& t: threads)
+		t.join();
+
+	if (listings)
+		for (auto& node: context.nodes)
+			if (node->listing.mtime)
+				(*listings)[node->path] = std::move(node->listing);
+
+	if (!context.rootRead)
+		return false;
+
+	std::string relbuf;
+	reportTraverseItems(root, callback, relbuf);
+
+	return true;
+}
+
 void joinPaths(std::string& buf, const char* lhs, const char* rhs)
 {
 	buf = lhs;
@@ -2,14 +2,44 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <unordered_map>
 #include <functional>
 
 #include <stdio.h>
 
 bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter);
+
+struct DirectoryListing;
+typedef std::unordered_map<std::string, DirectoryListing> DirectoryListingCache;
+
+// Traverses the directory on several threads; the filters are called concurrently, and files that pass them are reported on the calling thread in sorted path order
+// Listings of unchanged directories are moved out of the cached ones instead of reading the directories again; listings of all traversed directories are added to listings
+bool traverseDirectoryParallel(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& fileFilter, const std::function<bool (const char* name)>& directoryFilter,
+	DirectoryListingCache* cached = nullptr, DirectoryListingCache* listings = nullptr);
+
 bool traverseFileNeeded(const char* name);
 bool passthroughDirectoryFilter(const char* name);
 
+struct DirectoryEntry
+{
+	std::string name;
+	bool directory;
+	uint64_t mtime;
+	uint64_t size;
+};
+
+// Names of the entries that were read from a directory, with a slash after directory names; a listing with zero mtime can't be reused
+struct DirectoryListing
+{
+	uint64_t mtime;
+	std::vector<std::string> names;
+};
+
+// Reads the entries of a single directory, skipping links and the entries rejected by traverseFileNeeded; implemented per platform
+// If the listing matches the directory mtime, the entry names are taken from it instead of the directory; the listing is then replaced with the one that was read
+bool readDirectory(const char* path, std::vector<DirectoryEntry>& entries, DirectoryListing* listing = nullptr);
+
 void createDirectory(const char* path);
 void createPath(const char* path);
 void createPathForFile(const char* path);
@@ -27,4 +57,28 @@ bool getFileAttributes(const char* path, uint64_t* mtime, uint64_t* size);
 
 FILE* openFile(const char* path, const char* mode);
 
+const void* mapFile(const char* path, uint64_t* size);
+void unmapFile(const void* data, uint64_t size);
+void prefetchMemory(const void* data, size_t size);
+
+// Allocates zero-filled memory that is backed by large pages where the system allows it; returns nullptr on failure
+// Memory is placed on the NUMA node if one is given and the system supports it
+void* allocateLargePages(size_t size, int node = -1);
+void freeLargePages(void* data, size_t size);
+void prefetchFile(FILE* file, uint64_t offset, uint64_t size);
+
 bool watchDirectory(const char* path, const std::function<void (const char* name)>& callback);
+
+// Lowers CPU and I/O priority of the calling thread where the platform supports it
+void setBackgroundPriority();
+
+// Returns true if the calling thread has background priority; Windows threads don't pass it on, so threads started by such a thread set it again
+bool isBackgroundPriority();
+
+// NUMA nodes with processors that the process can run on; empty if the platform doesn't report NUMA nodes
+std::vector<unsigned int> getNumaNodes();
+// Restricts the calling thread to the processors of the node
+void setThreadNumaNode(unsigned int node);
+
+// Physical memory that the process can use in bytes, including the memory limit of the container on Linux; 0 if unknown
+uint64_t getPhysicalMemorySize();
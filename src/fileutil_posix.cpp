@@ -4,89 +4,168 @@
 #include "common.hpp"
 #include "fileutil.hpp"
 
+#include "constants.hpp"
+
 #include <string>
 #include <vector>
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __linux__
+#include <sched.h>
 #include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #endif
 
 #ifdef __APPLE__
 #include <CoreServices/CoreServices.h>
+#include <pthread.h>
 #endif
 
-static bool traverseDirectoryRec(const char* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+#ifdef __linux__
+// glibc only exposes getdents64 since 2.30
+struct LinuxDirent64
 {
-	int fd = open(path, O_DIRECTORY);
-	DIR* dir = fdopendir(fd);
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+#endif
 
-	if (!dir)
-		return false;
+static void readDirectoryEntry(std::vector<DirectoryEntry>& entries, int fd, const char* name, int type)
+{
+	if (!traverseFileNeeded(name))
+		return;
 
-	std::string buf, relbuf;
+	struct stat st = {};
 
-	while (dirent* entry = readdir(dir))
+	// we need to stat DT_UNKNOWN to be able to tell the type, and we need to stat files to get mtime/size
+	if (type == DT_UNKNOWN || type == DT_REG)
 	{
-		const dirent& data = *entry;
+		if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			return; // skip file entry
 
-		if (traverseFileNeeded(data.d_name))
-		{
-			joinPaths(relbuf, relpath, data.d_name);
-			joinPaths(buf, path, data.d_name);
+		type = IFTODT(st.st_mode);
+	}
 
-			struct stat st = {};
-			int type = data.d_type;
+	// Skip symbolic links to avoid handling cycles
+	if (type == DT_DIR || type == DT_REG)
+	{
+		DirectoryEntry e = { name, type == DT_DIR, uint64_t(st.st_mtime), uint64_t(st.st_size) };
 
-			// we need to stat DT_UNKNOWN to be able to tell the type, and we need to stat files to get mtime/size
-			if (type == DT_UNKNOWN || type == DT_REG)
-			{
-			#ifdef _ATFILE_SOURCE
-				int rc = fstatat(fd, data.d_name, &st, 0);
-			#else
-				int rc = lstat(buf.c_str(), &st);
-			#endif
+		entries.push_back(std::move(e));
+	}
+}
 
-				if (rc == 0)
-				{
-					assert(type == DT_UNKNOWN || type == int(IFTODT(st.st_mode)));
-					type = IFTODT(st.st_mode);
-				}
-				else
-				{
-					type = DT_UNKNOWN; // skip file entry
-				}
-			}
-
-			if (type == DT_DIR)
-			{
-				if (directoryFilter(relbuf.c_str()))
-					traverseDirectoryRec(buf.c_str(), relbuf.c_str(), callback, directoryFilter);
-			}
-			else if (type == DT_REG)
-			{
-				callback(relbuf.c_str(), st.st_mtime, st.st_size);
-			}
-			else if (type == DT_LNK)
-			{
-				// Skip symbolic links to avoid handling cycles
-			}
+static bool readDirectoryEntries(int fd, std::vector<DirectoryEntry>& entries)
+{
+#ifdef __linux__
+	// large batches cut the number of round trips on network file systems
+	alignas(LinuxDirent64) char buf[65536];
+
+	for (;;)
+	{
+		long size = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+
+		if (size < 0)
+			return false;
+
+		if (size == 0)
+			break;
+
+		for (long offset = 0; offset < size; )
+		{
+			const LinuxDirent64* data = reinterpret_cast<const LinuxDirent64*>(buf + offset);
+
+			readDirectoryEntry(entries, fd, data->d_name, data->d_type);
+
+			offset += data->d_reclen;
 		}
 	}
 
+	return true;
+#else
+	// closedir closes the descriptor the directory was opened with
+	DIR* dir = fdopendir(dup(fd));
+
+	if (!dir)
+		return false;
+
+	while (dirent* entry = readdir(dir))
+		readDirectoryEntry(entries, fd, entry->d_name, entry->d_type);
+
 	closedir(dir);
 
 	return true;
+#endif
+}
+
+static void reuseDirectoryEntries(int fd, std::vector<DirectoryEntry>& entries, const DirectoryListing& listing)
+{
+	for (auto& name: listing.names)
+	{
+		if (!name.empty() && name.back() == '/')
+		{
+			DirectoryEntry e = { name.substr(0, name.size() - 1), true, 0, 0 };
+
+			entries.push_back(std::move(e));
+		}
+		else
+		{
+			// files still have to be checked since changing their contents doesn't change the directory mtime
+			readDirectoryEntry(entries, fd, name.c_str(), DT_REG);
+		}
+	}
 }
 
-bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool(const char* name)>& directoryFilter)
+bool readDirectory(const char* path, std::vector<DirectoryEntry>& entries, DirectoryListing* listing)
 {
-	return traverseDirectoryRec(path, "", callback, directoryFilter);
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+
+	// mtime has a resolution of one second, so a listing can only be reused if the directory wasn't modified during the second it was read in
+	uint64_t mtime = 0;
+	struct stat st;
+
+	if (listing && fstat(fd, &st) == 0 && st.st_mtime < time(nullptr))
+		mtime = st.st_mtime;
+
+	bool result = true;
+
+	if (listing && mtime != 0 && listing->mtime == mtime)
+		reuseDirectoryEntries(fd, entries, *listing);
+	else
+	{
+		result = readDirectoryEntries(fd, entries);
+
+		if (listing)
+		{
+			listing->names.clear();
+			listing->names.reserve(entries.size());
+
+			for (auto& e: entries)
+				listing->names.push_back(e.directory ? e.name + "/" : e.name);
+		}
+	}
+
+	if (listing)
+		listing->mtime = result ? mtime : 0;
+
+	close(fd);
+
+	return result;
 }
 
 bool renameFile(const char* oldpath, const char* newpath)
@@ -139,6 +218,126 @@ FILE* openFile(const char* path, const char* mode)
 	return fopen(path, mode);
 }
 
+const void* mapFile(const char* path, uint64_t* size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	void* result = nullptr;
+	struct stat st;
+
+	// empty files can't be mapped; files that don't fit into the address space have to be read instead
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && uint64_t(st.st_size) <= SIZE_MAX)
+	{
+		void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (data != MAP_FAILED)
+		{
+			result = data;
+			*size = st.st_size;
+		}
+	}
+
+	// the mapping keeps a reference to the file
+	close(fd);
+
+	return result;
+}
+
+void unmapFile(const void* data, uint64_t size)
+{
+	munmap(const_cast<void*>(data), size);
+}
+
+void prefetchMemory(const void* data, size_t size)
+{
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+
+	uintptr_t begin = reinterpret_cast<uintptr_t>(data) & ~(pageSize - 1);
+	uintptr_t end = reinterpret_cast<uintptr_t>(data) + size;
+
+	madvise(reinterpret_cast<void*>(begin), end - begin, MADV_WILLNEED);
+}
+
+static void bindMemory(void* data, size_t size, int node)
+{
+#ifdef __linux__
+	// MPOL_PREFERRED falls back to other nodes when the node runs out of memory; pages are placed once they are touched
+	unsigned long mask[1024 / (sizeof(unsigned long) * 8)] = {};
+
+	if (node >= 0 && size_t(node) < sizeof(mask) * 8)
+	{
+		mask[node / (sizeof(unsigned long) * 8)] |= 1ul << (node % (sizeof(unsigned long) * 8));
+
+		syscall(SYS_mbind, data, size, 1, mask, sizeof(mask) * 8, 0);
+	}
+#else
+	(void)data;
+	(void)size;
+	(void)node;
+#endif
+}
+
+void* allocateLargePages(size_t size, int node)
+{
+#ifdef MAP_HUGETLB
+	// explicit huge pages are only available if the system reserved them
+	if (size % kLargePageSize == 0)
+	{
+		void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if (data != MAP_FAILED)
+		{
+			bindMemory(data, size, node);
+			return data;
+		}
+	}
+#endif
+
+	// transparent huge pages need an aligned range, so the mapping is trimmed to the alignment
+	size_t padding = size >= kLargePageSize ? kLargePageSize : 0;
+
+	void* data = mmap(nullptr, size + padding, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (data == MAP_FAILED)
+		return nullptr;
+
+	char* begin = static_cast<char*>(data);
+	char* aligned = padding ? reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(begin) + padding - 1) & ~(padding - 1)) : begin;
+
+	if (aligned != begin)
+		munmap(begin, aligned - begin);
+
+	if (begin + padding != aligned)
+		munmap(aligned + size, begin + padding - aligned);
+
+#ifdef MADV_HUGEPAGE
+	if (padding)
+		madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+
+	bindMemory(aligned, size, node);
+
+	return aligned;
+}
+
+void freeLargePages(void* data, size_t size)
+{
+	munmap(data, size);
+}
+
+void prefetchFile(FILE* file, uint64_t offset, uint64_t size)
+{
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fileno(file), offset, size, POSIX_FADV_WILLNEED);
+#else
+	(void)file;
+	(void)offset;
+	(void)size;
+#endif
+}
+
 #ifdef __linux__
 static void addWatchRec(int fd, const char* path, const char* relpath, std::vector<std::string>& paths)
 {
@@ -291,4 +490,146 @@ bool watchDirectory(const char* path, const std::function<void (const char* name
 	return false;
 #endif
 }
+
+static thread_local bool backgroundPriority = false;
+
+void setBackgroundPriority()
+{
+	backgroundPriority = true;
+
+#if defined(__linux__)
+	// on Linux, both priorities apply to the calling thread and are inherited by the threads it starts
+	pid_t tid = pid_t(syscall(SYS_gettid));
+
+	setpriority(PRIO_PROCESS, tid, 10);
+
+	// IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE
+	syscall(SYS_ioprio_set, 1, int(tid), 3 << 13);
+#elif defined(__APPLE__)
+	// background QoS throttles both CPU and I/O
+	pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0);
+#endif
+}
+
+bool isBackgroundPriority()
+{
+	return backgroundPriority;
+}
+
+#ifdef __linux__
+// Parses lists like 0-3,8,10-11 that are used for node and processor sets in sysfs
+static std::vector<unsigned int> readSystemList(const char* path)
+{
+	std::vector<unsigned int> result;
+
+	FILE* file = fopen(path, "r");
+	if (!file)
+		return result;
+
+	char buf[4096];
+	const char* text = fgets(buf, sizeof(buf), file);
+
+	fclose(file);
+
+	while (text && *text >= '0' && *text <= '9')
+	{
+		char* end;
+		unsigned int first = strtoul(text, &end, 10);
+		unsigned int last = *end == '-' ? strtoul(end + 1, &end, 10) : first;
+
+		for (unsigned int i = first; i <= last; ++i)
+			result.push_back(i);
+
+		text = *end == ',' ? end + 1 : nullptr;
+	}
+
+	return result;
+}
+
+// Processors of the node that the process is allowed to run on
+static bool getNodeProcessors(unsigned int node, cpu_set_t& result)
+{
+	CPU_ZERO(&result);
+
+	cpu_set_t affinity;
+	if (sched_getaffinity(0, sizeof(affinity), &affinity) != 0)
+		return false;
+
+	char path[256];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+
+	for (auto cpu: readSystemList(path))
+		if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &affinity))
+			CPU_SET(cpu, &result);
+
+	return CPU_COUNT(&result) > 0;
+}
+#endif
+
+std::vector<unsigned int> getNumaNodes()
+{
+	std::vector<unsigned int> result;
+
+#ifdef __linux__
+	cpu_set_t processors;
+
+	for (auto node: readSystemList("/sys/devices/system/node/online"))
+		if (getNodeProcessors(node, processors))
+			result.push_back(node);
+#endif
+
+	return result;
+}
+
+void setThreadNumaNode(unsigned int node)
+{
+#ifdef __linux__
+	cpu_set_t processors;
+
+	// on Linux, the affinity set with a zero pid applies to the calling thread
+	if (getNodeProcessors(node, processors))
+		sched_setaffinity(0, sizeof(processors), &processors);
+#else
+	(void)node;
+#endif
+}
+
+#ifdef __linux__
+// Memory limit of the cgroup of the process; cgroup v2 reports "max" and v1 a huge number if there is no limit
+static uint64_t getCgroupMemoryLimit()
+{
+	const char* paths[] = { "/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes" };
+
+	for (auto path: paths)
+		if (FILE* file = fopen(path, "r"))
+		{
+			char buf[64];
+			const char* text = fgets(buf, sizeof(buf), file);
+
+			fclose(file);
+
+			if (text && *text >= '0' && *text <= '9')
+				return strtoull(text, nullptr, 10);
+		}
+
+	return 0;
+}
+#endif
+
+uint64_t getPhysicalMemorySize()
+{
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pageSize = sysconf(_SC_PAGESIZE);
+
+	uint64_t result = (pages > 0 && pageSize > 0) ? uint64_t(pages) * uint64_t(pageSize) : 0;
+
+#ifdef __linux__
+	uint64_t limit = getCgroupMemoryLimit();
+
+	if (limit > 0 && (result == 0 || limit < result))
+		result = limit;
+#endif
+
+	return result;
+}
 #endif
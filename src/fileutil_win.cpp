@@ -7,6 +7,9 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <memory>
+
+#include <io.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -41,9 +44,13 @@ static uint64_t combine(uint32_t hi, uint32_t lo)
 	return (static_cast<uint64_t>(hi) << 32) | lo;
 }
 
-static bool traverseDirectoryRec(const wchar_t* path, const char* relpath, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
+bool readDirectory(const char* path, std::vector<DirectoryEntry>& entries, DirectoryListing* listing)
 {
-	std::wstring query = path + std::wstring(L"/*");
+	// FindNextFile returns file attributes together with the names, so reusing a listing would only add work
+	if (listing)
+		listing->mtime = 0;
+
+	std::wstring query = fromUtf8(path) + L"/*";
 
 	WIN32_FIND_DATAW data;
 	HANDLE h = FindFirstFileExW(query.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
@@ -51,38 +58,26 @@ static bool traverseDirectoryRec(const wchar_t* path, const char* relpath, const
 	if (h == INVALID_HANDLE_VALUE)
 		return false;
 
-	std::wstring buf;
-	std::string relbuf;
-
 	do
 	{
 		char filename[MAX_PATH];
 		WideCharToMultiByte(CP_UTF8, 0, data.cFileName, -1, filename, sizeof(filename), 0, 0);
 
-		if (traverseFileNeeded(filename))
-		{
-			joinPaths(relbuf, relpath, filename);
+		if (!traverseFileNeeded(filename))
+			continue;
 
-			if (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
-			{
-				// Skip reparse points to avoid handling cycles
-			}
-			else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			{
-				buf = path;
-				buf += '/';
-				buf += data.cFileName;
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+		{
+			// Skip reparse points to avoid handling cycles
+		}
+		else
+		{
+			uint64_t mtime = combine(data.ftLastWriteTime.dwHighDateTime, data.ftLastWriteTime.dwLowDateTime);
+			uint64_t size = combine(data.nFileSizeHigh, data.nFileSizeLow);
 
-				if (directoryFilter(relbuf.c_str()))
-					traverseDirectoryRec(buf.c_str(), relbuf.c_str(), callback, directoryFilter);
-			}
-			else
-			{
-				uint64_t mtime = combine(data.ftLastWriteTime.dwHighDateTime, data.ftLastWriteTime.dwLowDateTime);
-				uint64_t size = combine(data.nFileSizeHigh, data.nFileSizeLow);
+			DirectoryEntry e = { filename, (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0, mtime, size };
 
-				callback(relbuf.c_str(), mtime, size);
-			}
+			entries.push_back(std::move(e));
 		}
 	}
 	while (FindNextFileW(h, &data));
@@ -92,11 +87,6 @@ static bool traverseDirectoryRec(const wchar_t* path, const char* relpath, const
 	return true;
 }
 
-bool traverseDirectory(const char* path, const std::function<void (const char* name, uint64_t mtime, uint64_t size)>& callback, const std::function<bool (const char* name)>& directoryFilter)
-{
-	return traverseDirectoryRec(fromUtf8(path).c_str(), "", callback, directoryFilter);
-}
-
 bool renameFile(const char* oldpath, const char* newpath)
 {
 	return !!MoveFileExW(fromUtf8(oldpath).c_str(), fromUtf8(newpath).c_str(), MOVEFILE_REPLACE_EXISTING);
@@ -145,7 +135,7 @@ static bool isFullPath(const char* path)
 	return false; // path relative to current directory
 }
 
-FILE* openFile(const char* path, const char* mode)
+static std::wstring getFilePath(const char* path)
 {
 	// we need to get a full path to the file for relative paths (normalizePath will always work, isFullPath is an optimization)
 	std::wstring wpath = fromUtf8(isFullPath(path) ? path : normalizePath(getCurrentDirectory().c_str(), path).c_str());
@@ -154,6 +144,13 @@ FILE* openFile(const char* path, const char* mode)
 	wpath.insert(0, L"\\\\?\\");
 	std::replace(wpath.begin(), wpath.end(), '/', '\\');
 
+	return wpath;
+}
+
+FILE* openFile(const char* path, const char* mode)
+{
+	std::wstring wpath = getFilePath(path);
+
 	// convert file mode, assume short ASCII literal string
 	wchar_t wmode[8] = {};
 	assert(strlen(mode) < ARRAYSIZE(wmode));
@@ -162,6 +159,137 @@ FILE* openFile(const char* path, const char* mode)
 	return _wfopen(wpath.c_str(), wmode);
 }
 
+const void* mapFile(const char* path, uint64_t* size)
+{
+	HANDLE file = CreateFileW(getFilePath(path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	const void* result = nullptr;
+	LARGE_INTEGER fileSize;
+
+	// empty files can't be mapped; files that don't fit into the address space have to be read instead
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && uint64_t(fileSize.QuadPart) <= SIZE_MAX)
+	{
+		if (HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL))
+		{
+			result = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+			if (result)
+				*size = fileSize.QuadPart;
+
+			// the view keeps a reference to the mapping
+			CloseHandle(mapping);
+		}
+	}
+
+	CloseHandle(file);
+
+	return result;
+}
+
+void unmapFile(const void* data, uint64_t size)
+{
+	UnmapViewOfFile(data);
+}
+
+void prefetchMemory(const void* data, size_t size)
+{
+	// PrefetchVirtualMemory is only available on Windows 8+
+	struct MemoryRange { void* address; size_t size; };
+	typedef BOOL (WINAPI *PrefetchVirtualMemoryFn)(HANDLE, ULONG_PTR, MemoryRange*, ULONG);
+
+	static PrefetchVirtualMemoryFn prefetch = reinterpret_cast<PrefetchVirtualMemoryFn>(GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory"));
+
+	if (prefetch)
+	{
+		MemoryRange range = { const_cast<void*>(data), size };
+		prefetch(GetCurrentProcess(), 1, &range, 0);
+	}
+}
+
+static void* allocateVirtualMemory(size_t size, DWORD type, int node)
+{
+	if (node >= 0)
+		return VirtualAllocExNuma(GetCurrentProcess(), NULL, size, type, PAGE_READWRITE, node);
+	else
+		return VirtualAlloc(NULL, size, type, PAGE_READWRITE);
+}
+
+void* allocateLargePages(size_t size, int node)
+{
+	// large pages need SeLockMemoryPrivilege, which most accounts don't have; regular pages are used instead
+	size_t largePageSize = GetLargePageMinimum();
+
+	if (largePageSize && size % largePageSize == 0)
+		if (void* data = allocateVirtualMemory(size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, node))
+			return data;
+
+	return allocateVirtualMemory(size, MEM_RESERVE | MEM_COMMIT, node);
+}
+
+void freeLargePages(void* data, size_t size)
+{
+	(void)size;
+
+	VirtualFree(data, 0, MEM_RELEASE);
+}
+
+// Read-ahead of a file range; the data is discarded, the read only brings it into the file cache
+struct PrefetchRead
+{
+	OVERLAPPED overlapped;
+	HANDLE file;
+	std::unique_ptr<char[]> data;
+};
+
+static VOID CALLBACK finishPrefetchRead(DWORD error, DWORD size, LPOVERLAPPED overlapped)
+{
+	(void)error;
+	(void)size;
+
+	std::unique_ptr<PrefetchRead> read(reinterpret_cast<PrefetchRead*>(overlapped));
+
+	CloseHandle(read->file);
+}
+
+void prefetchFile(FILE* file, uint64_t offset, uint64_t size)
+{
+	// there's no read-ahead hint for files that aren't mapped, so the range is read into the file cache with an overlapped read that completes on the system thread pool
+	// the file is reopened since the stream handle isn't overlapped; reads are limited to the prefetch windows of the callers, which bounds the memory in flight
+	HANDLE stream = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(file)));
+	if (stream == INVALID_HANDLE_VALUE || size == 0 || size > MAXDWORD)
+		return;
+
+	std::unique_ptr<PrefetchRead> read(new (std::nothrow) PrefetchRead());
+	if (!read)
+		return;
+
+	read->data.reset(new (std::nothrow) char[size]);
+	if (!read->data)
+		return;
+
+	read->file = ReOpenFile(stream, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_FLAG_OVERLAPPED);
+	if (read->file == INVALID_HANDLE_VALUE)
+		return;
+
+	if (!BindIoCompletionCallback(read->file, finishPrefetchRead, 0))
+	{
+		CloseHandle(read->file);
+		return;
+	}
+
+	read->overlapped.Offset = static_cast<DWORD>(offset);
+	read->overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+	// the completion callback owns the read once it's started, including reads that complete right away
+	if (ReadFile(read->file, read->data.get(), static_cast<DWORD>(size), nullptr, &read->overlapped) || GetLastError() == ERROR_IO_PENDING)
+		read.release();
+	else
+		CloseHandle(read->file);
+}
+
 bool watchDirectory(const char* path, const std::function<void (const char* name)>& callback)
 {
 	HANDLE h = CreateFileW(fromUtf8(path).c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
@@ -207,4 +335,53 @@ bool watchDirectory(const char* path, const std::function<void (const char* name
 
 	return true;
 }
+
+static thread_local bool backgroundPriority = false;
+
+void setBackgroundPriority()
+{
+	backgroundPriority = true;
+
+	// lowers both CPU and I/O priority; threads started by this thread are not affected, see isBackgroundPriority
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+}
+
+bool isBackgroundPriority()
+{
+	return backgroundPriority;
+}
+
+std::vector<unsigned int> getNumaNodes()
+{
+	std::vector<unsigned int> result;
+
+	ULONG highest = 0;
+	if (!GetNumaHighestNodeNumber(&highest))
+		return result;
+
+	for (ULONG node = 0; node <= highest; ++node)
+	{
+		GROUP_AFFINITY affinity;
+
+		if (GetNumaNodeProcessorMaskEx(USHORT(node), &affinity) && affinity.Mask)
+			result.push_back(node);
+	}
+
+	return result;
+}
+
+void setThreadNumaNode(unsigned int node)
+{
+	GROUP_AFFINITY affinity;
+
+	if (GetNumaNodeProcessorMaskEx(USHORT(node), &affinity))
+		SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL);
+}
+
+uint64_t getPhysicalMemorySize()
+{
+	MEMORYSTATUSEX status = { sizeof(status) };
+
+	return GlobalMemoryStatusEx(&status) ? status.ullTotalPhys : 0;
+}
 #endif
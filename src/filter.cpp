@@ -8,9 +8,16 @@
 #include "stringutil.hpp"
 #include "highlight.hpp"
 #include "fuzzymatch.hpp"
+#include "workqueue.hpp"
+#include "constants.hpp"
+#include "charsimd.hpp"
+#include "casefold.hpp"
 
 #include <memory>
 #include <algorithm>
+#include <mutex>
+#include <atomic>
+
 #include <limits.h>
 
 struct FilterOutput
@@ -60,26 +67,114 @@ static unsigned int dumpEntries(const FilterEntries& entries, FilterOutput* outp
 	return count;
 }
 
-template <typename Pred> static void filterRegex(const FilterEntries& entries, Regex* re, unsigned int limit, Pred pred)
+// Entries are split into ranges that are filtered in parallel; filter(begin, end, result) fills the result of a range and returns how many of
+// its matches count towards the limit. Once the ranges before some range have enough matches, the ranges after it are skipped since nothing from them is used
+template <typename Result, typename Filter> static std::vector<Result> filterRanges(unsigned int entryCount, unsigned int limit, Filter filter)
 {
-	const char* range = re->rangePrepare(entries.buffer, entries.bufferSize);
+	size_t rangeCount = (entryCount + kFilterBatchSize - 1) / kFilterBatchSize;
+
+	std::vector<Result> results(rangeCount);
+	std::vector<unsigned int> counts(rangeCount);
+	std::unique_ptr<bool[]> done(new bool[rangeCount]());
+
+	std::mutex mutex;
+	size_t prefixRanges = 0;
+	size_t prefixCount = 0;
+	std::atomic<size_t> lastRange(rangeCount);
+
+	{
+		// short lists are filtered inline
+		WorkQueue queue(rangeCount > 1 ? std::min<size_t>(WorkQueue::getIdealWorkerCount(), rangeCount) : 0, 0);
+
+		for (size_t i = 0; i < rangeCount; ++i)
+			queue.push([&, i]() {
+				if (i > lastRange.load())
+					return;
+
+				unsigned int begin = static_cast<unsigned int>(i * kFilterBatchSize);
+				unsigned int end = std::min(static_cast<unsigned int>(begin + kFilterBatchSize), entryCount);
+
+				unsigned int count = filter(begin, end, results[i]);
+
+				std::lock_guard<std::mutex> lock(mutex);
+
+				counts[i] = count;
+				done[i] = true;
+
+				for (; prefixRanges < rangeCount && done[prefixRanges]; ++prefixRanges)
+				{
+					prefixCount += counts[prefixRanges];
+
+					if (prefixCount >= limit && prefixRanges < lastRange)
+						lastRange = prefixRanges;
+				}
+			});
+	}
+
+	return results;
+}
+
+// Concatenates results of all ranges in order and keeps the first limit of them
+template <typename Result> static std::vector<Result> mergeRanges(std::vector<std::vector<Result>>& ranges, unsigned int limit)
+{
+	std::vector<Result> result;
+
+	for (auto& r: ranges)
+	{
+		if (result.size() >= limit)
+			break;
+
+		result.insert(result.end(), r.begin(), r.begin() + std::min(r.size(), limit - result.size()));
+	}
+
+	return result;
+}
+
+// Mask of entries in [first, first + count) that can contain all characters of the signature; count is at most 32
+static uint32_t getSignatureCandidates(const FilterEntries& entries, unsigned int first, unsigned int count, uint64_t signature)
+{
+	assert(count <= 32);
+
+	if (!entries.signatures)
+		return count == 32 ? ~0u : (1u << count) - 1;
+
+	const uint64_t* signatures = entries.signatures + first;
+
+	// the loop is branchless so that entries are rejected with an and and a compare each
+	uint32_t result = 0;
+
+	for (unsigned int i = 0; i < count; ++i)
+		result |= uint32_t((signatures[i] & signature) == signature) << i;
+
+	return result;
+}
+
+template <typename Pred> static void filterRegex(const FilterEntries& entries, unsigned int first, unsigned int last, Regex* re, unsigned int limit, Pred pred)
+{
+	if (first == last || limit == 0) return;
+
+	// the range covers all lines up to the next entry, so matches are attributed the same way as if the entire buffer was searched
+	size_t rangeOffset = entries.entries[first].offset;
+	size_t rangeSize = (last < entries.entryCount ? entries.entries[last].offset : entries.bufferSize) - rangeOffset;
+
+	const char* range = re->rangePrepare(entries.buffer + rangeOffset, rangeSize);
 
 	const char* begin = range;
-	const char* end = begin + entries.bufferSize;
+	const char* end = begin + rangeSize;
 
 	unsigned int matches = 0;
 
 	while (RegexMatch match = re->rangeSearch(begin, end - begin))
 	{
-		size_t matchOffset = match.data - range;
+		size_t matchOffset = rangeOffset + (match.data - range);
 
 		// find first file entry with offset > matchOffset
 		const FilterEntry* entry =
-			std::upper_bound(entries.entries, entries.entries + entries.entryCount, matchOffset,
+			std::upper_bound(entries.entries + first, entries.entries + last, matchOffset,
                 [](size_t l, const FilterEntry& r) { return l < r.offset; });
 
 		// find last file entry with offset <= matchOffset
-		assert(entry > entries.entries);
+		assert(entry > entries.entries + first);
 		entry--;
 
 		// print match
@@ -110,25 +205,55 @@ static void processMatchHighlightRegex(Regex* re, FilterHighlightBuffer& hlbuf,
 	processMatch(hlbuf.result.c_str(), hlbuf.result.size(), output);
 }
 
-static unsigned int filterRegex(const FilterEntries& entries, const FilterEntries& matchEntries, const char* string, FilterOutput* output)
+// Only candidates are matched if they are given; all matching entries are collected if allMatches is given, otherwise matching stops at the limit
+static unsigned int filterRegex(const FilterEntries& entries, const FilterEntries& matchEntries, const char* string, FilterOutput* output,
+	const std::vector<unsigned int>* candidates, std::vector<unsigned int>* allMatches)
 {
 	unsigned int result = 0;
+	unsigned int limit = allMatches ? ~0u : output->limit;
 
 	std::unique_ptr<Regex> re(createRegex(string, getRegexOptions(output->options)));
 
+	auto ranges = filterRanges<std::vector<unsigned int>>(candidates ? candidates->size() : matchEntries.entryCount, limit,
+		[&](unsigned int begin, unsigned int end, std::vector<unsigned int>& results) -> unsigned int {
+			if (candidates)
+			{
+				for (unsigned int k = begin; k < end && results.size() < limit; ++k)
+				{
+					unsigned int i = (*candidates)[k];
+					const FilterEntry& me = matchEntries.entries[i];
+
+					if (re->search(matchEntries.buffer + me.offset, me.length))
+						results.push_back(i);
+				}
+			}
+			else
+				filterRegex(matchEntries, begin, end, re.get(), limit, [&](unsigned int i) { results.push_back(i); });
+
+			return results.size();
+		});
+
 	FilterHighlightBuffer hlbuf;
 
-	filterRegex(matchEntries, re.get(), output->limit,
-		[&](unsigned int i) {
-            const FilterEntry& e = entries.entries[i];
+	std::vector<unsigned int> matches = mergeRanges(ranges, limit);
 
-			if (output->options & SO_HIGHLIGHT_MATCHES)
-				processMatchHighlightRegex(re.get(), hlbuf, e, e.length - matchEntries.entries[i].length, entries.buffer, output);
-			else
-				processMatch(e, entries.buffer, output);
+	if (allMatches)
+	{
+		allMatches->swap(matches);
+		matches.assign(allMatches->begin(), allMatches->begin() + std::min<size_t>(allMatches->size(), output->limit));
+	}
 
-			result++;
-		});
+	for (auto& i: matches)
+	{
+		const FilterEntry& e = entries.entries[i];
+
+		if (output->options & SO_HIGHLIGHT_MATCHES)
+			processMatchHighlightRegex(re.get(), hlbuf, e, e.length - matchEntries.entries[i].length, entries.buffer, output);
+		else
+			processMatch(e, entries.buffer, output);
+
+		result++;
+	}
 
 	return result;
 }
@@ -178,27 +303,39 @@ static unsigned int filterVisualAssist(const FilterEntries& entries, const Filte
             return (lhs.ispath != rhs.ispath) ? lhs.ispath < rhs.ispath : lhs.text.length() > rhs.text.length();
         });
 
-	// gather files by first component
-	std::vector<unsigned int> results;
-
-	filterRegex(fragments[0].ispath ? entries : names, fragments[0].re.get(),
-		(fragments.size() == 1) ? output->limit : ~0u, [&](unsigned int i) { results.push_back(i); });
+	// all components have to be in the path, so files without their characters can be skipped before searching for the components
+	uint64_t restSignature = 0;
 
-	// filter results by subsequent components
 	for (size_t i = 1; i < fragments.size(); ++i)
-	{
-        const VisualAssistFragment& f = fragments[i];
+		restSignature |= getCharacterSignature(fragments[i].text.c_str(), fragments[i].text.size());
 
-		results.erase(std::remove_if(results.begin(), results.end(), [&](unsigned int i) -> bool {
-            const FilterEntries& matchEntries = f.ispath ? entries : names;
-            const FilterEntry& me = matchEntries.entries[i];
+	auto ranges = filterRanges<std::vector<unsigned int>>(entries.entryCount, output->limit,
+		[&](unsigned int begin, unsigned int end, std::vector<unsigned int>& results) -> unsigned int {
+			// gather files by first component
+			filterRegex(fragments[0].ispath ? entries : names, begin, end, fragments[0].re.get(),
+				(fragments.size() == 1) ? output->limit : ~0u, [&](unsigned int i) { results.push_back(i); });
 
-			return f.re->search(matchEntries.buffer + me.offset, me.length).size == 0; }), results.end());
-	}
+			if (entries.signatures && restSignature)
+				results.erase(std::remove_if(results.begin(), results.end(), [&](unsigned int i) {
+					return (entries.signatures[i] & restSignature) != restSignature; }), results.end());
+
+			// filter results by subsequent components
+			for (size_t i = 1; i < fragments.size(); ++i)
+			{
+				const VisualAssistFragment& f = fragments[i];
+
+				results.erase(std::remove_if(results.begin(), results.end(), [&](unsigned int i) -> bool {
+					const FilterEntries& matchEntries = f.ispath ? entries : names;
+					const FilterEntry& me = matchEntries.entries[i];
+
+					return f.re->search(matchEntries.buffer + me.offset, me.length).size == 0; }), results.end());
+			}
+
+			return results.size();
+		});
 
 	// trim results according to limit
-	if (results.size() > output->limit)
-		results.resize(output->limit);
+	std::vector<unsigned int> results = mergeRanges(ranges, output->limit);
 
 	// output results
 	FilterHighlightBuffer hlbuf;
@@ -237,36 +374,108 @@ static void processMatchHighlightFuzzy(FuzzyMatcher& matcher, bool ranked, Filte
 	processMatch(hlbuf.result.c_str(), hlbuf.result.size(), output);
 }
 
-static unsigned int filterFuzzy(const FilterEntries& entries, const char* string, FilterOutput* output)
+// Only candidates are matched if they are given; all matching entries are collected if allMatches is given, otherwise only the best ones are kept
+static unsigned int filterFuzzy(const FilterEntries& entries, const char* string, FilterOutput* output,
+	const std::vector<unsigned int>* candidates, std::vector<unsigned int>* allMatches)
 {
-	FuzzyMatcher matcher(string);
-
 	typedef std::pair<int, const FilterEntry*> Match;
 
-	std::vector<Match> matches;
-	unsigned int perfectMatches = 0;
+	auto compareMatches = [](const Match& l, const Match& r) { return l.first == r.first ? l.second < r.second : l.first < r.first; };
 
-	for (size_t i = 0; i < entries.entryCount; ++i)
-	{
-		const FilterEntry& e = entries.entries[i];
-		const char* data = entries.buffer + e.offset;
+	uint64_t signature = getCharacterSignature(string, strlen(string));
 
-		if (matcher.match(data, e.length))
-		{
-            int score = matcher.rank(data, e.length);
-			assert(score != INT_MAX);
+	struct RangeMatches
+	{
+		std::vector<Match> heap;
+		std::vector<unsigned int> matches;
+	};
+
+	// every range keeps the best limit matches in a heap with the worst of them on top; perfect matches count towards the limit since nothing ranks better
+	// when all matches are collected, entries that can't be among the best ones are still matched, but they are not ranked
+	auto ranges = filterRanges<RangeMatches>(candidates ? candidates->size() : entries.entryCount, allMatches ? ~0u : output->limit,
+		[&](unsigned int begin, unsigned int end, RangeMatches& range) -> unsigned int {
+			FuzzyMatcher matcher(string);
+
+			std::vector<Match>& heap = range.heap;
+			unsigned int perfectMatches = 0;
+
+			// returns true once the range has enough perfect matches and there is nothing else to collect
+			auto addMatch = [&](unsigned int i) -> bool {
+				const FilterEntry& e = entries.entries[i];
+				const char* data = entries.buffer + e.offset;
+
+				if (!matcher.match(data, e.length))
+					return false;
+
+				if (allMatches)
+				{
+					range.matches.push_back(i);
+
+					if (perfectMatches >= output->limit)
+						return false;
+				}
+
+				int score = matcher.rank(data, e.length);
+				assert(score != INT_MAX);
+
+				Match m = std::make_pair(score, &e);
+
+				if (heap.size() < output->limit)
+				{
+					heap.push_back(m);
+					std::push_heap(heap.begin(), heap.end(), compareMatches);
+				}
+				else if (!heap.empty() && compareMatches(m, heap.front()))
+				{
+					std::pop_heap(heap.begin(), heap.end(), compareMatches);
+					heap.back() = m;
+					std::push_heap(heap.begin(), heap.end(), compareMatches);
+				}
+
+				return score == 0 && ++perfectMatches >= output->limit && !allMatches;
+			};
+
+			if (candidates)
+			{
+				for (unsigned int k = begin; k < end; ++k)
+				{
+					unsigned int i = (*candidates)[k];
 
-			matches.push_back(std::make_pair(score, &e));
+					if (entries.signatures && (entries.signatures[i] & signature) != signature)
+						continue;
 
-			if (score == 0)
+					if (addMatch(i))
+						break;
+				}
+			}
+			else
 			{
-				perfectMatches++;
-				if (perfectMatches >= output->limit) break;
+				bool done = false;
+
+				for (unsigned int block = begin; block < end && !done; block += 32)
+				{
+					// entries that don't have all query characters are rejected by their signatures before they are matched
+					uint32_t mask = getSignatureCandidates(entries, block, std::min(end - block, 32u), signature);
+
+					for (; mask && !done; mask &= mask - 1)
+						done = addMatch(block + countTrailingZeros(mask));
+				}
 			}
-		}
+
+			return perfectMatches;
+		});
+
+	std::vector<Match> matches;
+
+	for (auto& r: ranges)
+	{
+		matches.insert(matches.end(), r.heap.begin(), r.heap.end());
+
+		if (allMatches)
+			allMatches->insert(allMatches->end(), r.matches.begin(), r.matches.end());
 	}
 
-	auto compareMatches = [](const Match& l, const Match& r) { return l.first == r.first ? l.second < r.second : l.first < r.first; };
+	FuzzyMatcher matcher(string);
 
 	if (matches.size() <= output->limit)
 		std::sort(matches.begin(), matches.end(), compareMatches);
@@ -299,7 +508,7 @@ static void buildNameBuffer(FilterEntries& names, const FilterEntries& entries,
     names.entries = entryptr.get();
     names.entryCount = entries.entryCount;
 
-    size_t offset = 0;
+    uint32_t offset = 0;
 
     for (unsigned int i = 0; i < entries.entryCount; ++i)
     {
@@ -310,10 +519,10 @@ static void buildNameBuffer(FilterEntries& names, const FilterEntries& entries,
 
         while (name > path && name[-1] != '/' && name[-1] != '\\') name--;
 
-        FilterEntry& n = names.entries[i];
+        FilterEntry& n = entryptr[i];
 
         n.offset = offset;
-        n.length = path + e.length - name;
+        n.length = static_cast<uint32_t>(path + e.length - name);
 
         offset += n.length + 1;
     }
@@ -345,7 +554,49 @@ static const FilterEntries& getNameBuffer(const FilterEntries* namesOpt, FilterE
     return names;
 }
 
-unsigned int filter(Output* output_, const char* string, unsigned int options, unsigned int limit, const FilterEntries& entries, const FilterEntries* namesOpt)
+static bool isSubsequence(const std::string& query, const char* string)
+{
+	size_t offset = 0;
+
+	for (const char* s = string; *s && offset < query.size(); ++s)
+		if (casefold(*s) == casefold(query[offset]))
+			offset++;
+
+	return offset == query.size();
+}
+
+static bool isSubstring(const std::string& query, const char* string, bool ignoreCase)
+{
+	std::string s = string;
+	std::string q = query;
+
+	if (ignoreCase)
+	{
+		casefoldRange(&s[0], s.c_str(), s.c_str() + s.size());
+		casefoldRange(&q[0], q.c_str(), q.c_str() + q.size());
+	}
+
+	return s.find(q) != std::string::npos;
+}
+
+// Every match of a query is a match of the last query if the last query is contained in it: in order for fuzzy queries, as a substring for literals
+static bool isSessionRefined(const FilterSession& session, const char* string, unsigned int options)
+{
+	if (!session.valid || session.options != options)
+		return false;
+
+	if (options & (SO_FILE_NAMEREGEX | SO_FILE_PATHREGEX))
+		return (options & SO_LITERAL) && isSubstring(session.query, string, (options & SO_IGNORECASE) != 0);
+	else if (options & SO_FILE_VISUALASSIST)
+		return false;
+	else if (options & SO_FILE_FUZZY)
+		return isSubsequence(session.query, string);
+	else
+		return false;
+}
+
+unsigned int filter(Output* output_, const char* string, unsigned int options, unsigned int limit, const FilterEntries& entries, const FilterEntries* namesOpt,
+	FilterSession* session)
 {
     assert(!namesOpt || namesOpt->entryCount == entries.entryCount);
 
@@ -355,19 +606,38 @@ unsigned int filter(Output* output_, const char* string, unsigned int options, u
 
 	FilterOutput output(output_, options, limit);
 
+	// sessions remember all matches of queries that later queries can refine
+	bool narrowing = session && (options & (SO_FILE_NAMEREGEX | SO_FILE_PATHREGEX) ? (options & SO_LITERAL) != 0 : (options & SO_FILE_FUZZY) != 0);
+
+	std::vector<unsigned int> matches;
+	std::vector<unsigned int>* allMatches = narrowing && *string ? &matches : nullptr;
+	const std::vector<unsigned int>* candidates = allMatches && isSessionRefined(*session, string, options) ? &session->matches : nullptr;
+
+	unsigned int result;
+
 	if (*string == 0)
-		return dumpEntries(entries, &output);
+		result = dumpEntries(entries, &output);
 	else if (options & SO_FILE_NAMEREGEX)
-		return filterRegex(entries, getNameBuffer(namesOpt, names, entries, nameEntries, nameBuffer), string, &output);
+		result = filterRegex(entries, getNameBuffer(namesOpt, names, entries, nameEntries, nameBuffer), string, &output, candidates, allMatches);
 	else if (options & SO_FILE_PATHREGEX)
-		return filterRegex(entries, entries, string, &output);
+		result = filterRegex(entries, entries, string, &output, candidates, allMatches);
 	else if (options & SO_FILE_VISUALASSIST)
-		return filterVisualAssist(entries, getNameBuffer(namesOpt, names, entries, nameEntries, nameBuffer), string, &output);
+		result = filterVisualAssist(entries, getNameBuffer(namesOpt, names, entries, nameEntries, nameBuffer), string, &output);
 	else if (options & SO_FILE_FUZZY)
-		return filterFuzzy(entries, string, &output);
+		result = filterFuzzy(entries, string, &output, candidates, allMatches);
 	else
 	{
 		output_->error("Unknown file search type\n");
 		return 0;
 	}
+
+	if (session)
+	{
+		session->query = string;
+		session->options = options;
+		session->valid = allMatches != nullptr;
+		session->matches.swap(matches);
+	}
+
+	return result;
 }
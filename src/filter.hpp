@@ -1,12 +1,15 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
+#include <string>
+#include <vector>
+
 class Output;
 
 struct FilterEntry
 {
-    size_t offset;
-    size_t length;
+    uint32_t offset;
+    uint32_t length;
 };
 
 struct FilterEntries
@@ -14,9 +17,38 @@ struct FilterEntries
     const char* buffer;
     size_t bufferSize;
 
-    FilterEntry* entries;
+    const FilterEntry* entries;
     unsigned int entryCount;
+
+    // optional table of getCharacterSignature() values of the entries, which lets filters skip entries without looking at them
+    const uint64_t* signatures;
+};
+
+// Keeps all entries that matched the last query, so that a query that can only match some of them (a longer fuzzy or literal query) only looks at those
+struct FilterSession
+{
+    FilterSession(): options(0), valid(false)
+    {
+    }
+
+    // matches are only reused for the same entry list; the key identifies the list, and a different key starts over
+    void setList(const std::string& key)
+    {
+        if (list != key)
+        {
+            list = key;
+            valid = false;
+        }
+    }
+
+    std::string list;
+
+    std::string query;
+    unsigned int options;
+    bool valid;
+
+    std::vector<unsigned int> matches;
 };
 
-unsigned int filter(Output* output, const char* string, unsigned int options, unsigned int limit, const FilterEntries& entries, const FilterEntries* names = 0);
+unsigned int filter(Output* output, const char* string, unsigned int options, unsigned int limit, const FilterEntries& entries, const FilterEntries* names = 0, FilterSession* session = 0);
 
@@ -24,7 +24,7 @@ unsigned int filterBuffer(Output* output, const char* string, unsigned int optio
 
 		if (i < next)
 		{
-			FilterEntry e = {i, next - i};
+			FilterEntry e = {static_cast<uint32_t>(i), static_cast<uint32_t>(next - i)};
 			data.push_back(e);
 		}
 
@@ -39,6 +39,8 @@ unsigned int filterBuffer(Output* output, const char* string, unsigned int optio
 	entries.entries = data.empty() ? nullptr : &data[0];
 	entries.entryCount = data.size();
 
+	entries.signatures = nullptr;
+
 	return filter(output, string, options, limit, entries);
 }
 
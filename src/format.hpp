@@ -1,34 +1,71 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
-const char kFileFileHeaderMagic[] = "QGF0";
+const char kFileFileHeaderMagic[] = "QGF2";
 
+// File list data follows the header; it's used in place when it's not compressed, so the tables don't need to be rebuilt for every search
 struct FileFileHeader
 {
 	char magic[4];
 
 	uint32_t fileCount;
+
+	// zero when the data is stored uncompressed
 	uint32_t compressedSize;
 	uint32_t uncompressedSize;
 
-	uint32_t nameBufferOffset;
-	uint32_t nameBufferLength;
+	// offsets are relative to the start of the data; entry tables have fileCount entries with offsets relative to their buffers
+	uint32_t pathEntryOffset;
+	uint32_t nameEntryOffset;
 
 	uint32_t pathBufferOffset;
 	uint32_t pathBufferLength;
+
+	uint32_t nameBufferOffset;
+	uint32_t nameBufferLength;
+
+	// table of getCharacterSignature() values of all paths
+	uint32_t pathSignatureOffset;
+	uint32_t reserved;
 };
 
+// Matches FilterEntry; every string in the buffer is terminated with a newline that isn't part of the length
 struct FileFileEntry
 {
-	uint32_t nameOffset;
-	uint32_t pathOffset;
+	uint32_t offset;
+	uint32_t length;
 };
 
-const char kDataFileHeaderMagic[] = "QGD2";
+const char kDataFileHeaderMagic[] = "QGDA";
 
+// Updates can append chunks and a new directory to an existing data file; data before committedSize is never modified
+// by appending, so readers that use the committed size see a consistent file while the next version is written past it
 struct DataFileHeader
 {
 	char magic[4];
+	uint32_t reserved;
+
+	// the file footer ends at committedSize; the rest of the file is unused
+	uint64_t committedSize;
+};
+
+enum DataChunkIndexType
+{
+	DCI_BLOOM = 0,
+	DCI_BLOOMBLOCKED = 1,
+	// blocked bloom filter that also has the 2-grams and 3-grams of the chunk, see extractShortNgrams
+	DCI_BLOOMBLOCKED_SHORT = 2,
+};
+
+// Chunks of one data file can use different codecs, so that updates only recompress the chunks they rebuild
+enum DataChunkCodec
+{
+	DCC_LZ4 = 0,
+	DCC_ZSTD = 1,
+	// zstd with the dictionary stored in the data file
+	DCC_ZSTD_DICTIONARY = 2,
+
+	DCC_COUNT
 };
 
 struct DataChunkHeader
@@ -41,8 +78,92 @@ struct DataChunkHeader
 
 	uint32_t indexSize;
 	uint32_t indexHashIterations;
+	uint32_t indexType;
 
+	// extra data has the paths of all files in the chunk, separated by newlines
 	uint32_t extraSize;
+
+	// compressed data starts with the block table, see DataChunkBlockHeader
+	uint32_t blockCount;
+	uint32_t blockTableSize;
+
+	// all blocks of the chunk are compressed with the same codec, see DataChunkCodec
+	uint32_t codec;
+	uint32_t reserved;
+};
+
+// Chunk data is split into blocks that are compressed independently: the first block has the file table, and each of
+// the other blocks has the data of consecutive files, so searches can skip the blocks that can't contain matches.
+// Block table has blockCount DataChunkBlockHeader structures followed by block indices; compressed blocks follow the table
+struct DataChunkBlockHeader
+{
+	uint32_t compressedSize;
+	uint32_t uncompressedSize;
+
+	// chunks with a single data block don't have block indices since the chunk index covers the block
+	uint32_t indexSize;
+	uint32_t indexHashIterations;
+	uint32_t indexType;
+};
+
+// Chunk directory follows the last chunk and is terminated by DataFileFooter; chunks that an appending update preserves
+// are referenced by the new directory in place, so chunk offsets don't have to follow the directory order
+struct DataChunkDirectoryEntry
+{
+	// DataChunkHeader is stored at headerOffset and is followed by extra data
+	uint64_t headerOffset;
+	uint64_t indexOffset;
+	uint64_t dataOffset;
+
+	DataChunkHeader header;
+};
+
+const char kDataFileFooterMagic[] = "QGDE";
+
+// Alias table follows the chunk directory: aliasCount DataFileAliasEntry structures followed by aliasNameSize bytes of names
+// Compression dictionary is stored before the directory; it's written once and every chunk that uses it refers to it
+struct DataFileFooter
+{
+	uint64_t directoryOffset;
+	uint64_t dictionaryOffset;
+	uint32_t dictionarySize;
+
+	uint32_t chunkCount;
+
+	uint32_t aliasCount;
+	uint32_t aliasNameSize;
+
+	uint32_t reserved;
+	char magic[4];
+};
+
+// Files with the same contents as a file that is already stored are stored as references without data; the alias table
+// lists the paths of references for every stored file so that matches in its data are reported for all of them
+struct DataFileAliasEntry
+{
+	// sorted by chunk and file index of the stored file
+	uint32_t chunkIndex;
+	uint32_t fileIndex;
+
+	uint32_t nameOffset;
+	uint32_t nameLength;
+};
+
+// Files are classified when they are read; the class is kept along with the way the project settings say to store it
+enum DataChunkFileFlags
+{
+	DCF_REFERENCE = 1 << 0,
+
+	DCF_BINARY = 1 << 1,
+	DCF_GENERATED = 1 << 2,
+
+	// contents are not stored
+	DCF_SKIPPED = 1 << 3,
+	// contents are stored in a chunk without an index
+	DCF_UNINDEXED = 1 << 4,
+
+	DCF_CLASS_MASK = DCF_BINARY | DCF_GENERATED,
+	DCF_POLICY_MASK = DCF_SKIPPED | DCF_UNINDEXED,
 };
 
 struct DataChunkFileHeader
@@ -53,8 +174,113 @@ struct DataChunkFileHeader
 	uint32_t dataSize;
 
 	uint32_t startLine;
-	uint32_t reserved;
+	uint32_t flags;
 
 	uint64_t fileSize;
 	uint64_t timeStamp;
+
+	// hash of the data for files that start at the first line; references have the hash of the data they refer to
+	uint64_t contentHash;
+};
+
+const char kSliceFileHeaderMagic[] = "QGX0";
+
+// Bit-sliced index over chunk signatures; signatures are blocked chunk indices folded to blockCount blocks
+// Chunks are split into groups; each group stores blockCount * kBloomBlockSize * 8 rows, with one bit per chunk in each row
+struct SliceFileHeader
+{
+	char magic[4];
+
+	uint32_t chunkCount;
+	uint32_t groupSize;
+	uint32_t blockCount;
+	uint32_t iterations;
+	uint32_t reserved;
+
+	// used to validate that the index matches the data file
+	uint64_t dataFileSize;
+};
+
+const char kPostingFileHeaderMagic[] = "QGP0";
+
+// Exact ngram index: sorted PostingFileEntry table at tableOffset, pointing to delta-encoded varint chunk lists
+struct PostingFileHeader
+{
+	char magic[4];
+
+	uint32_t chunkCount;
+	uint32_t ngramCount;
+	uint32_t reserved;
+
+	// used to validate that the index matches the data file
+	uint64_t dataFileSize;
+
+	uint64_t tableOffset;
+};
+
+struct PostingFileEntry
+{
+	uint32_t ngram;
+	uint32_t count;
+	uint64_t offset;
+};
+
+// Identifier index has the layout of posting lists, with entries keyed by identifierHash instead of ngrams
+const char kIdentifierFileHeaderMagic[] = "QGW0";
+
+const char kSnapshotFileHeaderMagic[] = "QGL0";
+
+// Directory listings from the last scan; the compressed data is a sequence of SnapshotFileEntry structures (not aligned),
+// each followed by pathLength bytes of directory path and nameCount zero-terminated entry names
+struct SnapshotFileHeader
+{
+	char magic[4];
+
+	uint32_t scansLeft;
+	uint32_t directoryCount;
+
+	uint32_t compressedSize;
+	uint32_t uncompressedSize;
+};
+
+struct SnapshotFileEntry
+{
+	uint64_t mtime;
+
+	uint32_t pathLength;
+	uint32_t nameCount;
+};
+
+const char kServerRequestMagic[] = "QGS1";
+
+enum ServerRequestFlags
+{
+	SRF_TTY = 1 << 0,
+};
+
+// Server requests carry command arguments, each prefixed with uint32_t length
+struct ServerRequestHeader
+{
+	char magic[4];
+
+	uint32_t flags;
+	uint32_t argumentCount;
+
+	// requests from a coordinator only search the shardIndex-th of shardCount chunk ranges; shardCount is 0 for other requests
+	uint32_t shardIndex;
+	uint32_t shardCount;
+};
+
+enum ServerMessageType
+{
+	SMT_OUTPUT = 0,
+	SMT_ERROR = 1,
+	SMT_END = 2,
+};
+
+// Server responses are a sequence of messages terminated with SMT_END; message data follows the header
+struct ServerMessageHeader
+{
+	uint32_t type;
+	uint32_t size;
 };
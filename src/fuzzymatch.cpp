@@ -4,80 +4,108 @@
 
 #include "casefold.hpp"
 
+#include <algorithm>
+
 #include <string.h>
 #include <limits.h>
 
-struct RankContext
-{
-    const RankPathElement* path;
-    size_t pathLength;
-    const char* pattern;
-    size_t patternLength;
-    int* cache;
-    int* cachepos;
-};
-
-template <bool fillPosition>
-static int rankRecursive(const RankContext& c, size_t pathOffset, int lastMatch, size_t patternOffset)
+static int rankGap(const RankPathElement* path, size_t lastMatch, size_t match)
 {
-    const RankPathElement* path = c.path;
-    size_t pathLength = c.pathLength;
-    const char* pattern = c.pattern;
-    size_t patternLength = c.patternLength;
-    int* cache = c.cache;
-
-    if (pathOffset == pathLength) return 0;
+    // a gap costs the boundary scores of both sides, plus a penalty that grows with the gap length
+    return path[lastMatch].rightScore + 10 + (path[match].position - path[lastMatch].position - 2) + path[match].leftScore;
+}
 
-    int& cv = cache[pathOffset * patternLength + patternOffset];
+// Every pattern character after the first continues the match after the element that matched the previous character, so the best score of a
+// pattern suffix only depends on that element; scores are computed for all of them from the last pattern character to the first, which takes
+// O(pattern * path) time. For every element, the cost of a gapped match at any later element only depends on the later element, so the best gapped
+// match is a running minimum. The results are the same as trying all matches in order: the first match with the lowest score wins, and the last
+// pattern character always takes the first element that matches it. choices[pathOffset * patternLength + patternOffset] gets the chosen elements
+static int rankDynamic(const RankPathElement* path, size_t pathLength, const char* pattern, size_t patternLength, int* scores, int* nextScores, int* choices)
+{
+    for (size_t p = patternLength - 1; p > 0; --p)
+    {
+        bool last = p + 1 == patternLength;
 
-    if (cv != INT_MIN) return cv;
+        // matches past this element leave too few elements for the rest of the pattern
+        size_t end = pathLength - (patternLength - 1 - p);
 
-    int bestScore = INT_MAX;
-    int bestPos = -1;
+        // best gapped match after the current element, without the costs that depend on the previous match
+        int bestValue = INT_MAX;
+        int bestIndex = -1;
 
-    size_t patternRest = patternLength - patternOffset - 1;
+        scores[pathLength] = INT_MAX;
 
-    for (size_t i = pathOffset; i + patternRest < pathLength; ++i)
-        if (casefold(path[i].character) == pattern[patternOffset])
+        for (size_t o = pathLength - 1; o > 0; --o)
         {
-            int distance = path[i].position - lastMatch;
+            int score = INT_MAX;
+            int choice = -1;
 
-            int charScore = (patternOffset == 0) ? path[i].leftScore : 0;
-
-            if (distance > 1 && lastMatch >= 0)
+            if (o < end && casefold(path[o].character) == pattern[p])
             {
-                assert(static_cast<unsigned int>(lastMatch) == path[pathOffset - 1].position);
+                int rest = last ? path[o].rightScore : nextScores[o + 1];
 
-                charScore += path[pathOffset - 1].rightScore;
-                charScore += 10 + (distance - 2);
-                charScore += path[i].leftScore;
+                if (rest != INT_MAX)
+                {
+                    if (path[o].position - path[o - 1].position == 1)
+                    {
+                        score = rest;
+                        choice = o;
+                    }
+
+                    int value = path[o].position + path[o].leftScore + rest;
+
+                    // the last character only takes the first match, other characters take the first of the best ones
+                    if (last || value <= bestValue)
+                    {
+                        bestValue = value;
+                        bestIndex = o;
+                    }
+                }
             }
 
-            int restScore =
-                (patternOffset + 1 < patternLength)
-                ? rankRecursive<fillPosition>(c, i + 1, path[i].position, patternOffset + 1)
-                : path[i].rightScore;
-
-            if (restScore != INT_MAX)
+            // an adjacent match has no gap cost and comes first, so it's only beaten by a lower score; the last character can't skip it
+            if (bestIndex >= 0 && !(last && choice >= 0))
             {
-                int score = charScore + restScore;
+                int gapScore = rankGap(path, o - 1, bestIndex) + (bestValue - path[bestIndex].position - path[bestIndex].leftScore);
 
-                if (bestScore > score)
+                if (gapScore < score)
                 {
-                    bestScore = score;
-                    bestPos = i;
+                    score = gapScore;
+                    choice = bestIndex;
                 }
             }
 
-            if (patternOffset + 1 < patternLength)
-                ;
-            else
+            scores[o] = score;
+            if (choices) choices[o * patternLength + p] = choice;
+        }
+
+        std::swap(scores, nextScores);
+    }
+
+    // the first character has no previous match, so it's only scored by its left boundary
+    size_t end = pathLength - (patternLength - 1);
+
+    int score = INT_MAX;
+    int choice = -1;
+
+    for (size_t i = 0; i < end; ++i)
+        if (casefold(path[i].character) == pattern[0])
+        {
+            int rest = patternLength > 1 ? nextScores[i + 1] : path[i].rightScore;
+
+            if (rest != INT_MAX && path[i].leftScore + rest < score)
+            {
+                score = path[i].leftScore + rest;
+                choice = i;
+            }
+
+            if (patternLength == 1)
                 break;
         }
 
-    if (fillPosition) c.cachepos[pathOffset * patternLength + patternOffset] = bestPos;
+    if (choices) choices[0] = choice;
 
-    return cv = bestScore;
+    return score;
 }
 
 static void fillPositions(int* positions, const RankPathElement* path, size_t pathLength, size_t patternLength, int* cachepos)
@@ -97,6 +125,25 @@ static void fillPositions(int* positions, const RankPathElement* path, size_t pa
     }
 }
 
+static unsigned int getSignatureBit(unsigned char ch)
+{
+	// letters and digits get a bit each, other characters share the remaining bits
+	if (ch >= 'a' && ch <= 'z') return ch - 'a';
+	if (ch >= '0' && ch <= '9') return 26 + (ch - '0');
+
+	return 36 + ch % 28;
+}
+
+uint64_t getCharacterSignature(const char* data, size_t size)
+{
+	uint64_t result = 0;
+
+	for (size_t i = 0; i < size; ++i)
+		result |= uint64_t(1) << getSignatureBit(static_cast<unsigned char>(casefold(data[i])));
+
+	return result;
+}
+
 FuzzyMatcher::FuzzyMatcher(const char* query)
 {
     // initialize casefolded query
@@ -195,23 +242,22 @@ int FuzzyMatcher::rank(const char* data, size_t size, int* positions)
         }
     }
 
-    cache.clear();
-    cache.resize(bufsize * cfquery.size(), INT_MIN);
+    if (bufsize == 0) return 0;
+    if (bufsize < cfquery.size()) return INT_MAX;
 
-    RankContext c = {&buf[0], bufsize, cfquery.c_str(), cfquery.size(), &cache[0], nullptr};
+    // two rows of scores, for the current and the next pattern character
+    if (cache.size() < (bufsize + 1) * 2) cache.resize((bufsize + 1) * 2);
 
     if (positions)
     {
-        cachepos.clear();
-        cachepos.resize(bufsize * cfquery.size(), -1);
-        c.cachepos = &cachepos[0];
+        if (cachepos.size() < bufsize * cfquery.size()) cachepos.resize(bufsize * cfquery.size());
 
-        int score = rankRecursive<true>(c, 0, -1, 0);
+        int score = rankDynamic(&buf[0], bufsize, cfquery.c_str(), cfquery.size(), &cache[0], &cache[bufsize + 1], &cachepos[0]);
 
         if (score != INT_MAX) fillPositions(positions, &buf[0], bufsize, cfquery.size(), &cachepos[0]);
 
         return score;
     }
     else
-        return rankRecursive<false>(c, 0, -1, 0);
+        return rankDynamic(&buf[0], bufsize, cfquery.c_str(), cfquery.size(), &cache[0], &cache[bufsize + 1], nullptr);
 }
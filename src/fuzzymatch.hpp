@@ -5,6 +5,8 @@
 #include <vector>
 #include <utility>
 
+#include <stdint.h>
+
 struct RankPathElement
 {
 	unsigned int position;
@@ -29,6 +31,9 @@ struct RankPathElement
 	}
 };
 
+// Casefolded character presence mask; a string can only contain the characters of another string if its signature has all bits of the other one
+uint64_t getCharacterSignature(const char* data, size_t size);
+
 class FuzzyMatcher
 {
 public:
@@ -0,0 +1,186 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "gitindex.hpp"
+
+#include "output.hpp"
+#include "fileutil.hpp"
+
+#include <fstream>
+
+#include <string.h>
+
+static uint32_t readBE32(const unsigned char* data)
+{
+	return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+}
+
+static uint32_t readBE16(const unsigned char* data)
+{
+	return (uint32_t(data[0]) << 8) | data[1];
+}
+
+// Worktrees and submodules have a .git file that points to the actual git directory
+static std::string getGitDirectory(const char* path)
+{
+	std::string dotgit = normalizePath(path, ".git");
+
+	std::ifstream in(dotgit.c_str());
+	std::string line;
+
+	if (in && std::getline(in, line) && line.compare(0, 8, "gitdir: ") == 0)
+	{
+		while (!line.empty() && (line.back() == '\r' || line.back() == '\n'))
+			line.pop_back();
+
+		return normalizePath(path, line.c_str() + 8);
+	}
+
+	return dotgit;
+}
+
+// Index format is described in Documentation/gitformat-index.txt; the hash size is not stored in the index, so the parser is tried with SHA-1 and SHA-256 sizes
+static bool parseGitIndex(const unsigned char* data, size_t size, size_t hashSize, std::vector<std::string>& files)
+{
+	files.clear();
+
+	if (size < 12 + hashSize || memcmp(data, "DIRC", 4) != 0)
+		return false;
+
+	uint32_t version = readBE32(data + 4);
+	uint32_t count = readBE32(data + 8);
+
+	if (version < 2 || version > 4)
+		return false;
+
+	// entries are followed by extensions and the index checksum
+	const unsigned char* pos = data + 12;
+	const unsigned char* end = data + size - hashSize;
+
+	// fixed part of the entry: ctime, mtime, dev, ino, mode, uid, gid, size, hash, flags
+	size_t headerSize = 40 + hashSize + 2;
+
+	std::string name;
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		const unsigned char* entry = pos;
+
+		if (size_t(end - pos) < headerSize)
+			return false;
+
+		uint32_t mode = readBE32(entry + 24);
+		uint32_t flags = readBE16(entry + 40 + hashSize);
+		uint32_t extendedFlags = 0;
+
+		pos += headerSize;
+
+		if (flags & 0x4000)
+		{
+			if (version < 3 || end - pos < 2)
+				return false;
+
+			extendedFlags = readBE16(pos);
+			pos += 2;
+		}
+
+		if (version == 4)
+		{
+			// the name replaces the given number of trailing bytes of the previous name
+			size_t strip = 0;
+
+			for (;;)
+			{
+				if (pos == end)
+					return false;
+
+				unsigned char ch = *pos++;
+				strip = (strip << 7) + (ch & 127);
+
+				if ((ch & 128) == 0)
+					break;
+
+				// this varint encoding adds one for every continuation byte
+				strip++;
+			}
+
+			if (strip > name.size())
+				return false;
+
+			const unsigned char* suffix = static_cast<const unsigned char*>(memchr(pos, 0, end - pos));
+			if (!suffix)
+				return false;
+
+			name.resize(name.size() - strip);
+			name.append(reinterpret_cast<const char*>(pos), suffix - pos);
+
+			pos = suffix + 1;
+		}
+		else
+		{
+			const unsigned char* nameEnd = static_cast<const unsigned char*>(memchr(pos, 0, end - pos));
+			if (!nameEnd || ((flags & 0xfff) != 0xfff && size_t(nameEnd - pos) != (flags & 0xfff)))
+				return false;
+
+			name.assign(reinterpret_cast<const char*>(pos), nameEnd - pos);
+
+			// entries are padded with 1-8 zero bytes to a multiple of 8 bytes
+			size_t entrySize = (nameEnd - entry + 8) & ~size_t(7);
+
+			if (size_t(end - entry) < entrySize)
+				return false;
+
+			pos = entry + entrySize;
+		}
+
+		// only regular files are searched, same as in folder traversal; gitlinks, symlinks and sparse directory entries are skipped
+		bool regular = (mode & 0170000) == 0100000;
+
+		// conflicted files have an entry per merge stage; skip-worktree entries are not checked out
+		bool duplicate = !files.empty() && files.back() == name;
+		bool skipWorktree = (extendedFlags & 0x4000) != 0;
+
+		if (regular && !duplicate && !skipWorktree)
+			files.push_back(name);
+	}
+
+	// split index keeps most entries in a separate shared index
+	while (size_t(end - pos) >= 8)
+	{
+		if (memcmp(pos, "link", 4) == 0)
+			return false;
+
+		uint32_t extensionSize = readBE32(pos + 4);
+
+		if (size_t(end - pos) - 8 < extensionSize)
+			return false;
+
+		pos += 8 + extensionSize;
+	}
+
+	return pos == end;
+}
+
+bool readGitIndex(Output* output, const char* path, std::vector<std::string>& files)
+{
+	std::string indexPath = getGitDirectory(path) + "/index";
+
+	uint64_t size = 0;
+	const void* data = mapFile(indexPath.c_str(), &size);
+
+	if (!data)
+	{
+		output->error("Error reading git index %s\n", indexPath.c_str());
+		return false;
+	}
+
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+	bool result = parseGitIndex(bytes, size, 20, files) || parseGitIndex(bytes, size, 32, files);
+
+	unmapFile(data, size);
+
+	if (!result)
+		output->error("Error reading git index %s: unsupported format\n", indexPath.c_str());
+
+	return result;
+}
@@ -0,0 +1,11 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <string>
+#include <vector>
+
+class Output;
+
+// Reads paths of the regular files tracked in the git worktree at path from the git index; the paths are relative to the worktree and sorted
+// Files that are not checked out (sparse checkouts) are skipped
+bool readGitIndex(Output* output, const char* path, std::vector<std::string>& files);
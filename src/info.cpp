@@ -6,14 +6,21 @@
 #include "format.hpp"
 #include "stringutil.hpp"
 #include "fileutil.hpp"
-#include "filestream.hpp"
+#include "datafile.hpp"
 #include "compression.hpp"
+#include "bloom.hpp"
+#include "search.hpp"
+#include "project.hpp"
+#include "constants.hpp"
 
 #include <memory>
 #include <string>
+#include <vector>
 #include <type_traits>
 #include <algorithm>
 
+#include <math.h>
+
 template <typename T> struct Statistics
 {
 	unsigned int count;
@@ -45,8 +52,33 @@ template <typename T> struct Statistics
 	}
 };
 
+// Achieved false positive rate of a chunk filter; filters that are at the size limit can't reach the project target
+struct ChunkIndexInfo
+{
+	unsigned int chunk;
+	std::string firstFile;
+	double falsePositiveRate;
+	size_t indexSize;
+	size_t dataSize;
+	bool limited;
+};
+
 struct ProjectInfo
 {
+	uint64_t dataFileSize;
+	uint64_t dataUnusedSize;
+
+	// files stored as references to the same contents in another file
+	unsigned int referenceCount;
+
+	// files classified as binary or generated, and files that are stored without contents or without an index because of that
+	unsigned int binaryCount;
+	unsigned int generatedCount;
+	unsigned int skippedCount;
+	unsigned long long skippedSize;
+	unsigned int unindexedCount;
+	unsigned long long unindexedSize;
+
 	unsigned int chunkCount;
 
 	Statistics<unsigned int> chunkSizeExceptLast;
@@ -56,10 +88,28 @@ struct ProjectInfo
 	Statistics<unsigned int> chunkCompressedSize;
 	Statistics<double> chunkCompressionRatio;
 
+	Statistics<unsigned int> blockCount;
+	unsigned long long blockIndexTotalSize;
+
+	unsigned int codecChunkCount[DCC_COUNT];
+	unsigned long long dictionarySize;
+
 	unsigned int indexChunkCount;
 	unsigned long long indexTotalSize;
 	Statistics<unsigned int> indexHashIterations;
 	Statistics<double> indexFilled;
+	Statistics<double> indexFalsePositiveRate;
+
+	// target rate of the project, and filters that miss it because they are limited to a share of the chunk data
+	double indexTargetFalsePositiveRate;
+	std::vector<ChunkIndexInfo> indexChunks;
+	unsigned int indexLimitedCount;
+	unsigned int indexAboveTargetCount;
+
+	// chunks without an index: files that are stored without one, too little data to index, or no data (references and skipped files)
+	unsigned int unindexedChunkPolicyCount;
+	unsigned int unindexedChunkSmallCount;
+	unsigned int unindexedChunkEmptyCount;
 
 	unsigned long long lineCount;
 	unsigned int lineMaxSize;
@@ -137,7 +187,26 @@ inline unsigned int popcount(unsigned char v)
 		((v >> 7) & 1);
 }
 
-static void processChunkIndex(Output* output, ProjectInfo& info, const DataChunkHeader& header, const char* data)
+static double getBlockedFalsePositiveRate(const DataChunkHeader& header, const char* data)
+{
+	size_t blocks = header.indexSize / kBloomBlockSize;
+	double result = 0;
+
+	// each ngram is checked against one block, so the rate is averaged over blocks
+	for (size_t block = 0; block < blocks; ++block)
+	{
+		unsigned int filled = 0;
+
+		for (size_t i = 0; i < kBloomBlockSize; ++i)
+			filled += popcount(static_cast<unsigned char>(data[block * kBloomBlockSize + i]));
+
+		result += pow(static_cast<double>(filled) / (kBloomBlockSize * 8), header.indexHashIterations);
+	}
+
+	return blocks == 0 ? 1 : result / blocks;
+}
+
+static double processChunkIndex(Output* output, ProjectInfo& info, const DataChunkHeader& header, const char* data)
 {
 	info.indexHashIterations.update(header.indexHashIterations);
 
@@ -150,9 +219,73 @@ static void processChunkIndex(Output* output, ProjectInfo& info, const DataChunk
 
 	info.indexFilled.update(filledRatio);
 
+	// expected rate of chunks that pass the filter for an ngram they don't contain
+	double falsePositiveRate = header.indexType != DCI_BLOOM
+		? getBlockedFalsePositiveRate(header, data)
+		: pow(filledRatio, header.indexHashIterations);
+
+	info.indexFalsePositiveRate.update(falsePositiveRate);
+
 	info.indexTotalSize += header.indexSize;
 
 	info.indexChunkCount++;
+
+	return falsePositiveRate;
+}
+
+// Mirrors the sizing in build: blocked filters only grow in powers of two, and no filter is larger than the chunk data divided by kChunkIndexMaxRatio
+static void processChunkIndexCoverage(ProjectInfo& info, unsigned int chunkIndex, const DataChunkHeader& header, const char* data, double falsePositiveRate)
+{
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+
+	size_t dataSize = 0;
+	bool unindexed = false;
+
+	for (size_t i = 0; i < header.fileCount; ++i)
+		if (files[i].dataSize)
+		{
+			dataSize += files[i].dataSize;
+			unindexed = (files[i].flags & DCF_UNINDEXED) != 0;
+		}
+
+	if (header.indexSize == 0)
+	{
+		if (dataSize == 0)
+			info.unindexedChunkEmptyCount++;
+		else if (unindexed)
+			info.unindexedChunkPolicyCount++;
+		else
+			info.unindexedChunkSmallCount++;
+
+		return;
+	}
+
+	size_t maxSize = dataSize / kChunkIndexMaxRatio;
+	bool limited = header.indexType == DCI_BLOOM ? header.indexSize >= maxSize : header.indexSize * 2 > maxSize;
+
+	ChunkIndexInfo ci;
+	ci.chunk = chunkIndex;
+	ci.firstFile = header.fileCount ? std::string(data + files[0].nameOffset, files[0].nameLength) : std::string();
+	ci.falsePositiveRate = falsePositiveRate;
+	ci.indexSize = header.indexSize;
+	ci.dataSize = dataSize;
+	ci.limited = limited;
+
+	info.indexChunks.push_back(ci);
+
+	if (falsePositiveRate > info.indexTargetFalsePositiveRate)
+	{
+		info.indexAboveTargetCount++;
+		info.indexLimitedCount += limited;
+	}
+}
+
+static void processChunkBlocks(ProjectInfo& info, const DataChunkHeader& header)
+{
+	// the first block has the file table
+	info.blockCount.update(header.blockCount - 1);
+	info.blockIndexTotalSize += header.blockTableSize - header.blockCount * sizeof(DataChunkBlockHeader);
+	info.codecChunkCount[header.codec]++;
 }
 
 static void processChunkData(Output* output, ProjectInfo& info, const DataChunkHeader& header, const char* data)
@@ -177,56 +310,94 @@ static void processChunkData(Output* output, ProjectInfo& info, const DataChunkH
 		std::string path(data + f.nameOffset, f.nameLength);
 
 		processFilePart(output, info, path.c_str(), f.fileSize, f.timeStamp, data + f.dataOffset, f.dataSize, f.startLine);
+
+		if (f.flags & DCF_REFERENCE)
+			info.referenceCount++;
+
+		if (f.startLine == 0)
+		{
+			info.binaryCount += (f.flags & DCF_BINARY) != 0;
+			info.generatedCount += (f.flags & DCF_GENERATED) != 0;
+
+			if (f.flags & DCF_SKIPPED)
+			{
+				info.skippedCount++;
+				info.skippedSize += f.fileSize;
+			}
+
+			info.unindexedCount += (f.flags & DCF_UNINDEXED) != 0;
+		}
+
+		if (f.flags & DCF_UNINDEXED)
+			info.unindexedSize += f.dataSize;
 	}
 }
 
 static bool processFile(Output* output, ProjectInfo& info, const char* path)
 {
-	FileStream in(path, "rb");
+	DataFileReader in(path);
 	if (!in)
 	{
 		output->error("Error reading data file %s\n", path);
 		return false;
 	}
 
-	DataFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+	std::vector<DataChunkDirectoryEntry> chunks;
+	std::vector<DataFileAliasEntry> aliases;
+	std::vector<char> aliasNames;
+	std::shared_ptr<CompressionDictionary> dictionary;
+	if (!readDataFileDirectory(in, chunks) || !readDataFileAliases(in, aliases, aliasNames) || !readDataFileDictionary(in, dictionary))
 	{
 		output->error("Error reading data file %s: malformed header\n", path);
 		return false;
 	}
 
-	DataChunkHeader chunk;
+	// appending updates leave replaced chunks in the data file until it's rewritten
+	uint64_t usedSize = sizeof(DataFileHeader) + chunks.size() * sizeof(DataChunkDirectoryEntry) + aliases.size() * sizeof(DataFileAliasEntry) + aliasNames.size() + sizeof(DataFileFooter) +
+		(dictionary ? dictionary->getData().size() : 0);
 
-	while (read(in, chunk))
+	for (auto& entry: chunks)
+		usedSize += sizeof(DataChunkHeader) + entry.header.extraSize + entry.header.indexSize + entry.header.compressedSize;
+
+	info.dictionarySize = dictionary ? dictionary->getData().size() : 0;
+	info.dataFileSize = in.size();
+	info.dataUnusedSize = info.dataFileSize - usedSize;
+
+	for (auto& entry: chunks)
 	{
-		in.skip(chunk.extraSize);
+		const DataChunkHeader& chunk = entry.header;
+		double falsePositiveRate = 0;
 
 		if (chunk.indexSize)
 		{
-			std::unique_ptr<char[]> index(new (std::nothrow) char[chunk.indexSize]);
+			in.seek(entry.indexOffset);
+
+			const char* index = in.read(chunk.indexSize);
 
-			if (!index || !read(in, index.get(), chunk.indexSize))
+			if (!index)
 			{
 				output->error("Error reading data file %s: malformed chunk\n", path);
 				return false;
 			}
 
-			processChunkIndex(output, info, chunk, index.get());
+			falsePositiveRate = processChunkIndex(output, info, chunk, index);
 		}
 
-		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.compressedSize + chunk.uncompressedSize]);
+		in.seek(entry.dataOffset);
 
-		if (!data || !read(in, data.get(), chunk.compressedSize))
+		const char* compressed = in.read(chunk.compressedSize);
+		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.uncompressedSize]);
+
+		if (!data || !compressed)
 		{
 			output->error("Error reading data file %s: malformed chunk\n", path);
 			return false;
 		}
 
-		char* uncompressed = data.get() + chunk.compressedSize;
-
-		decompress(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize);
-		processChunkData(output, info, chunk, uncompressed);
+		decompressChunk(data.get(), chunk, compressed, dictionary.get());
+		processChunkBlocks(info, chunk);
+		processChunkData(output, info, chunk, data.get());
+		processChunkIndexCoverage(info, &entry - chunks.data(), chunk, data.get(), falsePositiveRate);
 	}
 
 	return true;
@@ -258,6 +429,11 @@ static std::string lastChunkSize(unsigned long long sizeExceptLast, unsigned lon
 	}
 }
 
+static double getPercentage(unsigned long long part, unsigned long long total)
+{
+	return total == 0 ? 0 : static_cast<double>(part) * 100 / static_cast<double>(total);
+}
+
 void printProjectInfo(Output* output, const char* path)
 {
     output->print("Project %s:\n", path);
@@ -265,6 +441,10 @@ void printProjectInfo(Output* output, const char* path)
 
 	ProjectInfo info = {};
 
+	// filters are checked against the current target of the project, which may differ from the one they were built for
+	std::unique_ptr<ProjectGroup> group = parseProject(output, path);
+	info.indexTargetFalsePositiveRate = group ? group->indexFalsePositiveRate : kChunkIndexFalsePositiveRate;
+
 	std::string dataPath = replaceExtension(path, ".qgd");
 
 	if (processFile(output, info, dataPath.c_str()))
@@ -277,8 +457,11 @@ void printProjectInfo(Output* output, const char* path)
 
 	#define FI(v) formatInteger(v).c_str()
 
-		output->print("Files: %s (%s file parts)\n", FI(info.fileCount), FI(info.filePartCount));
+		output->print("Data file: %s bytes (%s bytes unused)\n", FI(info.dataFileSize), FI(info.dataUnusedSize));
+		output->print("Files: %s (%s file parts, %s references to duplicate contents)\n", FI(info.fileCount), FI(info.filePartCount), FI(info.referenceCount));
 		output->print("File data: %s bytes\n", FI(info.fileTotalSize));
+		output->print("Classified files: %s binary, %s generated (%s skipped, %s bytes; %s not indexed, %s bytes)\n",
+			FI(info.binaryCount), FI(info.generatedCount), FI(info.skippedCount), FI(info.skippedSize), FI(info.unindexedCount), FI(info.unindexedSize));
 		output->print("Lines: %s (longest line: %s bytes in %s)\n", FI(info.lineCount), FI(info.lineMaxSize), info.lineMaxSizeFile.c_str());
 
 		output->print("Chunks (data): %s (%s bytes, [%s..%s] (avg %s) bytes per chunk%s)\n",
@@ -295,11 +478,139 @@ void printProjectInfo(Output* output, const char* path)
 			info.chunkCompressedSize.total == 0 ? 1.0 : static_cast<double>(info.chunkSize.total) / static_cast<double>(info.chunkCompressedSize.total),
 			info.chunkCompressionRatio.min, info.chunkCompressionRatio.max, info.chunkCompressionRatio.average());
 
+		output->print("Blocks: [%d..%d] (avg %.1f) per chunk (%s bytes of block filters, %.1f%% of compressed data)\n",
+			info.blockCount.min, info.blockCount.max, info.blockCount.average(), FI(info.blockIndexTotalSize),
+			getPercentage(info.blockIndexTotalSize, info.chunkCompressedSize.total));
+
+		output->print("Codecs: %s chunks LZ4, %s chunks zstd, %s chunks zstd with dictionary (%s bytes of dictionary)\n",
+			FI(info.codecChunkCount[DCC_LZ4]), FI(info.codecChunkCount[DCC_ZSTD]), FI(info.codecChunkCount[DCC_ZSTD_DICTIONARY]), FI(info.dictionarySize));
+
 		output->print("Index: %s chunks (%s bytes, hash iterations [%d..%d] (avg %.1f), filled ratio [%.1f%%..%.1f%%] (avg %.1f%%))\n",
 			FI(info.indexChunkCount), FI(info.indexTotalSize),
 			info.indexHashIterations.min, info.indexHashIterations.max, info.indexHashIterations.average(),
 			info.indexFilled.min * 100, info.indexFilled.max * 100, info.indexFilled.average() * 100);
 
+		output->print("Index false positive rate: [%.3f%%..%.3f%%] (avg %.3f%%) per ngram\n",
+			info.indexFalsePositiveRate.min * 100, info.indexFalsePositiveRate.max * 100, info.indexFalsePositiveRate.average() * 100);
+
+		output->print("Index target %.3f%%: reached by %s of %s chunks, %s chunks above (%s limited to 1/%d of the chunk data)\n",
+			info.indexTargetFalsePositiveRate * 100, FI(info.indexChunkCount - info.indexAboveTargetCount), FI(info.indexChunkCount),
+			FI(info.indexAboveTargetCount), FI(info.indexLimitedCount), int(kChunkIndexMaxRatio));
+
+		output->print("Chunks without index: %s (%s with files stored without an index, %s with less than %s bytes of file data, %s without file data)\n",
+			FI(info.unindexedChunkPolicyCount + info.unindexedChunkSmallCount + info.unindexedChunkEmptyCount),
+			FI(info.unindexedChunkPolicyCount), FI(info.unindexedChunkSmallCount), FI(kChunkIndexMaxRatio * 1024), FI(info.unindexedChunkEmptyCount));
+
+		std::vector<ChunkIndexInfo>& indexChunks = info.indexChunks;
+
+		std::stable_sort(indexChunks.begin(), indexChunks.end(), [](const ChunkIndexInfo& l, const ChunkIndexInfo& r) { return l.falsePositiveRate > r.falsePositiveRate; });
+
+		if (info.indexAboveTargetCount)
+			output->print("Chunks with the highest index false positive rate:\n");
+
+		for (size_t i = 0; i < info.indexAboveTargetCount && i < kIndexAnalysisListSize; ++i)
+		{
+			const ChunkIndexInfo& ci = indexChunks[i];
+
+			output->print("  chunk %d (starts with %s): %.3f%%, %s index bytes for %s bytes of data%s\n",
+				ci.chunk, ci.firstFile.c_str(), ci.falsePositiveRate * 100, FI(ci.indexSize), FI(ci.dataSize), ci.limited ? " (size limit)" : "");
+		}
+
 	#undef FI
 	}
 }
+
+void printProjectIndexAnalysis(Output* output, const char* path, const std::vector<std::string>& queries, unsigned int options)
+{
+    output->print("Project %s:\n", path);
+	output->print("Analyzing index...\r");
+
+	IndexAnalysis analysis;
+
+	if (!analyzeSearchIndex(output, path, queries, options, analysis))
+		return;
+
+	#define FI(v) formatInteger(v).c_str()
+
+	unsigned long long chunkCount = analysis.chunks.size();
+
+	output->print("Chunks: %s (%s without index); searches check %s%s\n", FI(chunkCount), FI(analysis.unindexedChunks),
+		analysis.hasIdentifiers ? "identifier index for whole word queries, otherwise " : "",
+		analysis.hasPostings ? "posting lists" : analysis.hasSlices ? "slice index and chunk indices" : "chunk indices");
+
+	unsigned long long totalChunks = 0, passedChunks = 0, matchedChunks = 0, falsePositives = 0, bloomFalsePositives = 0;
+
+	for (size_t i = 0; i < analysis.queries.size(); ++i)
+	{
+		const IndexAnalysis::Query& q = analysis.queries[i];
+
+		output->print("Query %d: %s\n", int(i + 1), q.query.c_str());
+
+		if (q.identifiers)
+			output->print("  whole word query, chunks are selected by the identifier index\n");
+		else if (q.atoms.empty())
+			output->print("  no ngrams to check, all chunks are searched\n");
+
+		output->print("  %s chunks searched, %.1f%% skipped (chunk indices alone %.1f%%, ideal %.1f%%)\n",
+			FI(q.passedChunks), 100 - getPercentage(q.passedChunks, chunkCount), 100 - getPercentage(q.indexPassedChunks, chunkCount), 100 - getPercentage(q.matchedChunks, chunkCount));
+		output->print("  %s chunks with matches, %s false positives (%s from index collisions)\n",
+			FI(q.matchedChunks), FI(q.falsePositives), FI(q.bloomFalsePositives));
+
+		totalChunks += chunkCount;
+		passedChunks += q.passedChunks;
+		matchedChunks += q.matchedChunks;
+		falsePositives += q.falsePositives;
+		bloomFalsePositives += q.bloomFalsePositives;
+	}
+
+	output->print("Total: %s chunks searched, %.1f%% skipped (ideal %.1f%%), %s false positives (%s from index collisions)\n",
+		FI(passedChunks), 100 - getPercentage(passedChunks, totalChunks), 100 - getPercentage(matchedChunks, totalChunks), FI(falsePositives), FI(bloomFalsePositives));
+
+	// atoms that the chunk indices report for chunks that don't contain them
+	std::vector<std::pair<size_t, size_t>> atoms;
+
+	for (size_t i = 0; i < analysis.queries.size(); ++i)
+		for (size_t j = 0; j < analysis.queries[i].atoms.size(); ++j)
+			if (analysis.queries[i].atoms[j].falsePositives)
+				atoms.push_back(std::make_pair(i, j));
+
+	std::stable_sort(atoms.begin(), atoms.end(), [&](const std::pair<size_t, size_t>& l, const std::pair<size_t, size_t>& r) {
+		return analysis.queries[l.first].atoms[l.second].falsePositives > analysis.queries[r.first].atoms[r.second].falsePositives; });
+
+	if (!atoms.empty())
+		output->print("Atoms with most index false positives:\n");
+
+	for (size_t i = 0; i < atoms.size() && i < kIndexAnalysisListSize; ++i)
+	{
+		const IndexAnalysis::Atom& atom = analysis.queries[atoms[i].first].atoms[atoms[i].second];
+
+		output->print("  \"%s\" (query %d): reported for %s of %s chunks without it (%.1f%%)\n",
+			atom.text.c_str(), int(atoms[i].first + 1), FI(atom.falsePositives), FI(atom.absentChunks), getPercentage(atom.falsePositives, atom.absentChunks));
+	}
+
+	std::vector<size_t> chunks;
+
+	for (size_t i = 0; i < analysis.chunks.size(); ++i)
+		if (analysis.chunks[i].falsePositives)
+			chunks.push_back(i);
+
+	std::sort(chunks.begin(), chunks.end(), [&](size_t l, size_t r) {
+		const IndexAnalysis::Chunk& lc = analysis.chunks[l];
+		const IndexAnalysis::Chunk& rc = analysis.chunks[r];
+
+		return lc.falsePositives != rc.falsePositives ? lc.falsePositives > rc.falsePositives : lc.bloomFalsePositives > rc.bloomFalsePositives; });
+
+	if (!chunks.empty())
+		output->print("Chunks with most false positives:\n");
+
+	for (size_t i = 0; i < chunks.size() && i < kIndexAnalysisListSize; ++i)
+	{
+		const IndexAnalysis::Chunk& chunk = analysis.chunks[chunks[i]];
+
+		output->print("  chunk %d (starts with %s): %s false positives (%s from index collisions), %s index bytes for %s ngrams (%.1f bits per ngram)\n",
+			int(chunks[i]), chunk.firstFile.c_str(), FI(chunk.falsePositives), FI(chunk.bloomFalsePositives), FI(chunk.indexSize), FI(chunk.ngramCount),
+			chunk.ngramCount ? static_cast<double>(chunk.indexSize) * 8 / static_cast<double>(chunk.ngramCount) : 0.0);
+	}
+
+	#undef FI
+}
@@ -1,6 +1,12 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
+#include <string>
+#include <vector>
+
 class Output;
 
 void printProjectInfo(Output* output, const char* path);
+
+// Replays the queries against the project indices and prints how many chunks they let through without matches, and the atoms and chunks responsible
+void printProjectIndexAnalysis(Output* output, const char* path, const std::vector<std::string>& queries, unsigned int options);
@@ -0,0 +1,79 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <string.h>
+
+// Addresses of the form host:port (or [host]:port for IPv6) are TCP addresses; anything else is a local address
+// that uses Unix domain sockets on POSIX systems and named pipes on Windows
+inline bool parseNetworkAddress(const char* address, std::string& host, std::string& port)
+{
+	const char* last = strrchr(address, ':');
+
+	if (!last || !last[1] || strchr(address, '/') || strchr(address, '\\'))
+		return false;
+
+	for (const char* p = last + 1; *p; ++p)
+		if (*p < '0' || *p > '9')
+			return false;
+
+	host.assign(address, last);
+	port.assign(last + 1);
+
+	if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+		host = host.substr(1, host.size() - 2);
+
+	return true;
+}
+
+inline bool isNetworkAddress(const char* address)
+{
+	std::string host, port;
+	return parseNetworkAddress(address, host, port);
+}
+
+// Stream connection to a local or a network address
+class IpcConnection
+{
+public:
+	// Network connections are TCP sockets, which Windows closes and reads differently from pipes
+	explicit IpcConnection(uintptr_t handle, bool network = false);
+	~IpcConnection();
+
+	// Reads or writes exactly size bytes; fails if the other side closed the connection
+	bool read(void* data, size_t size);
+	bool write(const void* data, size_t size);
+
+private:
+	IpcConnection(const IpcConnection&);
+	IpcConnection& operator=(const IpcConnection&);
+
+	uintptr_t handle;
+	bool network;
+};
+
+class IpcServer
+{
+public:
+	IpcServer();
+	~IpcServer();
+
+	// Fails if another server is already listening at the address; network servers listen on all interfaces if the host is empty
+	bool listen(const char* address);
+
+	// Waits for the next client; returns nullptr on failure
+	std::unique_ptr<IpcConnection> accept();
+
+private:
+	IpcServer(const IpcServer&);
+	IpcServer& operator=(const IpcServer&);
+
+	std::string address;
+	uintptr_t handle;
+	bool network;
+};
+
+// Returns nullptr if there is no server listening at the address
+std::unique_ptr<IpcConnection> ipcConnect(const char* address);
@@ -0,0 +1,278 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#ifndef _WIN32
+
+#include "common.hpp"
+#include "ipc.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool getSocketAddress(sockaddr_un& result, const char* address)
+{
+	memset(&result, 0, sizeof(result));
+	result.sun_family = AF_UNIX;
+
+	if (strlen(address) >= sizeof(result.sun_path))
+		return false;
+
+	strcpy(result.sun_path, address);
+	return true;
+}
+
+static int createSocket(int family = AF_UNIX)
+{
+	int fd = socket(family, SOCK_STREAM, 0);
+
+#ifdef SO_NOSIGPIPE
+	// writes to a closed connection should fail instead of terminating the process
+	int value = 1;
+	if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(value));
+#endif
+
+	return fd;
+}
+
+// Resolves both the addresses to listen at and the addresses to connect to; the list has to be freed with freeaddrinfo
+static addrinfo* getNetworkAddresses(const char* address, bool passive)
+{
+	std::string host, port;
+	if (!parseNetworkAddress(address, host, port))
+		return nullptr;
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+	addrinfo* result = nullptr;
+	if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0)
+		return nullptr;
+
+	return result;
+}
+
+IpcConnection::IpcConnection(uintptr_t handle, bool network): handle(handle), network(network)
+{
+	// responses are written in large batches, so small writes at their end shouldn't wait for acknowledgements
+	int value = 1;
+	if (network) setsockopt(static_cast<int>(handle), IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+}
+
+IpcConnection::~IpcConnection()
+{
+	close(static_cast<int>(handle));
+}
+
+bool IpcConnection::read(void* data, size_t size)
+{
+	char* dest = static_cast<char*>(data);
+
+	while (size > 0)
+	{
+		ssize_t result = recv(static_cast<int>(handle), dest, size, 0);
+
+		if (result < 0 && errno == EINTR)
+			continue;
+
+		if (result <= 0)
+			return false;
+
+		dest += result;
+		size -= result;
+	}
+
+	return true;
+}
+
+bool IpcConnection::write(const void* data, size_t size)
+{
+	const char* src = static_cast<const char*>(data);
+
+#ifdef MSG_NOSIGNAL
+	int flags = MSG_NOSIGNAL;
+#else
+	int flags = 0;
+#endif
+
+	while (size > 0)
+	{
+		ssize_t result = send(static_cast<int>(handle), src, size, flags);
+
+		if (result < 0 && errno == EINTR)
+			continue;
+
+		if (result <= 0)
+			return false;
+
+		src += result;
+		size -= result;
+	}
+
+	return true;
+}
+
+IpcServer::IpcServer(): handle(~uintptr_t(0)), network(false)
+{
+}
+
+IpcServer::~IpcServer()
+{
+	if (handle != ~uintptr_t(0))
+	{
+		close(static_cast<int>(handle));
+
+		if (!network)
+			unlink(address.c_str());
+	}
+}
+
+static int listenNetwork(const char* address)
+{
+	addrinfo* addrs = getNetworkAddresses(address, /* passive= */ true);
+	if (!addrs)
+		return -1;
+
+	int fd = -1;
+
+	for (addrinfo* addr = addrs; addr && fd < 0; addr = addr->ai_next)
+	{
+		fd = createSocket(addr->ai_family);
+		if (fd < 0)
+			continue;
+
+		// a restarted server shouldn't have to wait for connections of the previous one to time out; listening sockets still can't be shared
+		int value = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+
+		if (bind(fd, addr->ai_addr, addr->ai_addrlen) != 0 || ::listen(fd, SOMAXCONN) != 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	freeaddrinfo(addrs);
+
+	return fd;
+}
+
+bool IpcServer::listen(const char* address)
+{
+	if (isNetworkAddress(address))
+	{
+		int fd = listenNetwork(address);
+		if (fd < 0)
+			return false;
+
+		this->address = address;
+		this->handle = fd;
+		this->network = true;
+
+		return true;
+	}
+
+	sockaddr_un addr;
+	if (!getSocketAddress(addr, address))
+		return false;
+
+	int fd = createSocket();
+	if (fd < 0)
+		return false;
+
+	if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+	{
+		// the socket file can be left over from a server that was terminated; it's only reused if nobody listens to it
+		if (errno != EADDRINUSE || ipcConnect(address) || unlink(address) != 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+		{
+			close(fd);
+			return false;
+		}
+	}
+
+	if (::listen(fd, SOMAXCONN) != 0)
+	{
+		close(fd);
+		unlink(address);
+		return false;
+	}
+
+	this->address = address;
+	this->handle = fd;
+
+	return true;
+}
+
+std::unique_ptr<IpcConnection> IpcServer::accept()
+{
+	for (;;)
+	{
+		int fd = ::accept(static_cast<int>(handle), nullptr, nullptr);
+
+		if (fd >= 0)
+		{
+		#ifdef SO_NOSIGPIPE
+			int value = 1;
+			setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(value));
+		#endif
+
+			return std::unique_ptr<IpcConnection>(new IpcConnection(fd, network));
+		}
+
+		if (errno != EINTR && errno != ECONNABORTED)
+			return std::unique_ptr<IpcConnection>();
+	}
+}
+
+static std::unique_ptr<IpcConnection> connectNetwork(const char* address)
+{
+	addrinfo* addrs = getNetworkAddresses(address, /* passive= */ false);
+	if (!addrs)
+		return std::unique_ptr<IpcConnection>();
+
+	int fd = -1;
+
+	for (addrinfo* addr = addrs; addr && fd < 0; addr = addr->ai_next)
+	{
+		fd = createSocket(addr->ai_family);
+
+		if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) != 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	freeaddrinfo(addrs);
+
+	return std::unique_ptr<IpcConnection>(fd < 0 ? nullptr : new IpcConnection(fd, /* network= */ true));
+}
+
+std::unique_ptr<IpcConnection> ipcConnect(const char* address)
+{
+	if (isNetworkAddress(address))
+		return connectNetwork(address);
+
+	sockaddr_un addr;
+	if (!getSocketAddress(addr, address))
+		return std::unique_ptr<IpcConnection>();
+
+	int fd = createSocket();
+	if (fd < 0)
+		return std::unique_ptr<IpcConnection>();
+
+	if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+	{
+		close(fd);
+		return std::unique_ptr<IpcConnection>();
+	}
+
+	return std::unique_ptr<IpcConnection>(new IpcConnection(fd));
+}
+
+#endif
@@ -0,0 +1,304 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#ifdef _WIN32
+
+#include "common.hpp"
+#include "ipc.hpp"
+
+#include <algorithm>
+
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+
+const DWORD kPipeBufferSize = 65536;
+
+// Winsock has to be initialized once before any socket is created
+static bool initializeSockets()
+{
+	static bool initialized = []() {
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	}();
+
+	return initialized;
+}
+
+// Resolves both the addresses to listen at and the addresses to connect to; the list has to be freed with freeaddrinfo
+static addrinfo* getNetworkAddresses(const char* address, bool passive)
+{
+	std::string host, port;
+	if (!initializeSockets() || !parseNetworkAddress(address, host, port))
+		return nullptr;
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+	addrinfo* result = nullptr;
+	if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0)
+		return nullptr;
+
+	return result;
+}
+
+// Named pipes live in a separate namespace, so the address is turned into a pipe name
+static std::wstring getPipeName(const char* address)
+{
+	std::wstring result = L"\\\\.\\pipe\\qgrep-";
+
+	int length = MultiByteToWideChar(CP_UTF8, 0, address, -1, nullptr, 0);
+
+	if (length > 1)
+	{
+		std::wstring path(length - 1, 0);
+		MultiByteToWideChar(CP_UTF8, 0, address, -1, &path[0], length);
+
+		std::replace(path.begin(), path.end(), L'\\', L'-');
+		std::replace(path.begin(), path.end(), L'/', L'-');
+		std::replace(path.begin(), path.end(), L':', L'-');
+
+		result += path;
+	}
+
+	return result;
+}
+
+static HANDLE createPipe(const std::wstring& name, bool first)
+{
+	return CreateNamedPipeW(name.c_str(), PIPE_ACCESS_DUPLEX | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, PIPE_UNLIMITED_INSTANCES, kPipeBufferSize, kPipeBufferSize, 0, nullptr);
+}
+
+IpcConnection::IpcConnection(uintptr_t handle, bool network): handle(handle), network(network)
+{
+	// responses are written in large batches, so small writes at their end shouldn't wait for acknowledgements
+	BOOL value = TRUE;
+	if (network) setsockopt(static_cast<SOCKET>(handle), IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+IpcConnection::~IpcConnection()
+{
+	if (network)
+	{
+		// sent data is delivered before the connection is closed as long as the socket isn't reset
+		shutdown(static_cast<SOCKET>(handle), SD_SEND);
+		closesocket(static_cast<SOCKET>(handle));
+		return;
+	}
+
+	// make sure the other side gets all data before the pipe is closed
+	FlushFileBuffers(reinterpret_cast<HANDLE>(handle));
+	CloseHandle(reinterpret_cast<HANDLE>(handle));
+}
+
+bool IpcConnection::read(void* data, size_t size)
+{
+	char* dest = static_cast<char*>(data);
+
+	while (size > 0)
+	{
+		if (network)
+		{
+			int result = recv(static_cast<SOCKET>(handle), dest, static_cast<int>(std::min(size, size_t(kPipeBufferSize))), 0);
+
+			if (result <= 0)
+				return false;
+
+			dest += result;
+			size -= result;
+			continue;
+		}
+
+		DWORD result = 0;
+
+		if (!ReadFile(reinterpret_cast<HANDLE>(handle), dest, static_cast<DWORD>(std::min(size, size_t(kPipeBufferSize))), &result, nullptr) || result == 0)
+			return false;
+
+		dest += result;
+		size -= result;
+	}
+
+	return true;
+}
+
+bool IpcConnection::write(const void* data, size_t size)
+{
+	const char* src = static_cast<const char*>(data);
+
+	while (size > 0)
+	{
+		if (network)
+		{
+			int result = send(static_cast<SOCKET>(handle), src, static_cast<int>(std::min(size, size_t(kPipeBufferSize))), 0);
+
+			if (result <= 0)
+				return false;
+
+			src += result;
+			size -= result;
+			continue;
+		}
+
+		DWORD result = 0;
+
+		if (!WriteFile(reinterpret_cast<HANDLE>(handle), src, static_cast<DWORD>(std::min(size, size_t(kPipeBufferSize))), &result, nullptr) || result == 0)
+			return false;
+
+		src += result;
+		size -= result;
+	}
+
+	return true;
+}
+
+IpcServer::IpcServer(): handle(reinterpret_cast<uintptr_t>(INVALID_HANDLE_VALUE)), network(false)
+{
+}
+
+IpcServer::~IpcServer()
+{
+	if (network)
+		closesocket(static_cast<SOCKET>(handle));
+	else if (reinterpret_cast<HANDLE>(handle) != INVALID_HANDLE_VALUE)
+		CloseHandle(reinterpret_cast<HANDLE>(handle));
+}
+
+static SOCKET listenNetwork(const char* address)
+{
+	addrinfo* addrs = getNetworkAddresses(address, /* passive= */ true);
+	if (!addrs)
+		return INVALID_SOCKET;
+
+	SOCKET result = INVALID_SOCKET;
+
+	for (addrinfo* addr = addrs; addr && result == INVALID_SOCKET; addr = addr->ai_next)
+	{
+		result = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (result == INVALID_SOCKET)
+			continue;
+
+		// without exclusive use, a second server could bind the same port and take over some of the connections
+		BOOL value = TRUE;
+		setsockopt(result, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, reinterpret_cast<const char*>(&value), sizeof(value));
+
+		if (bind(result, addr->ai_addr, static_cast<int>(addr->ai_addrlen)) != 0 || ::listen(result, SOMAXCONN) != 0)
+		{
+			closesocket(result);
+			result = INVALID_SOCKET;
+		}
+	}
+
+	freeaddrinfo(addrs);
+
+	return result;
+}
+
+bool IpcServer::listen(const char* address)
+{
+	if (isNetworkAddress(address))
+	{
+		SOCKET server = listenNetwork(address);
+		if (server == INVALID_SOCKET)
+			return false;
+
+		this->address = address;
+		this->handle = static_cast<uintptr_t>(server);
+		this->network = true;
+
+		return true;
+	}
+
+	// the first instance can only be created once, which rejects a second server
+	HANDLE pipe = createPipe(getPipeName(address), /* first= */ true);
+
+	if (pipe == INVALID_HANDLE_VALUE)
+		return false;
+
+	this->address = address;
+	this->handle = reinterpret_cast<uintptr_t>(pipe);
+
+	return true;
+}
+
+std::unique_ptr<IpcConnection> IpcServer::accept()
+{
+	if (network)
+	{
+		SOCKET client = ::accept(static_cast<SOCKET>(handle), nullptr, nullptr);
+
+		if (client == INVALID_SOCKET)
+			return std::unique_ptr<IpcConnection>();
+
+		return std::unique_ptr<IpcConnection>(new IpcConnection(static_cast<uintptr_t>(client), /* network= */ true));
+	}
+
+	HANDLE pipe = reinterpret_cast<HANDLE>(handle);
+
+	if (pipe == INVALID_HANDLE_VALUE)
+		pipe = createPipe(getPipeName(address.c_str()), /* first= */ false);
+
+	if (pipe == INVALID_HANDLE_VALUE)
+		return std::unique_ptr<IpcConnection>();
+
+	bool connected = ConnectNamedPipe(pipe, nullptr) || GetLastError() == ERROR_PIPE_CONNECTED;
+
+	// every client is served by its own pipe instance, so the next one is created ahead of time
+	handle = reinterpret_cast<uintptr_t>(createPipe(getPipeName(address.c_str()), /* first= */ false));
+
+	if (!connected)
+	{
+		CloseHandle(pipe);
+		return std::unique_ptr<IpcConnection>();
+	}
+
+	return std::unique_ptr<IpcConnection>(new IpcConnection(reinterpret_cast<uintptr_t>(pipe)));
+}
+
+static std::unique_ptr<IpcConnection> connectNetwork(const char* address)
+{
+	addrinfo* addrs = getNetworkAddresses(address, /* passive= */ false);
+	if (!addrs)
+		return std::unique_ptr<IpcConnection>();
+
+	SOCKET result = INVALID_SOCKET;
+
+	for (addrinfo* addr = addrs; addr && result == INVALID_SOCKET; addr = addr->ai_next)
+	{
+		result = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+
+		if (result != INVALID_SOCKET && connect(result, addr->ai_addr, static_cast<int>(addr->ai_addrlen)) != 0)
+		{
+			closesocket(result);
+			result = INVALID_SOCKET;
+		}
+	}
+
+	freeaddrinfo(addrs);
+
+	return std::unique_ptr<IpcConnection>(result == INVALID_SOCKET ? nullptr : new IpcConnection(static_cast<uintptr_t>(result), /* network= */ true));
+}
+
+std::unique_ptr<IpcConnection> ipcConnect(const char* address)
+{
+	if (isNetworkAddress(address))
+		return connectNetwork(address);
+
+	std::wstring name = getPipeName(address);
+
+	for (;;)
+	{
+		HANDLE pipe = CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+
+		if (pipe != INVALID_HANDLE_VALUE)
+			return std::unique_ptr<IpcConnection>(new IpcConnection(reinterpret_cast<uintptr_t>(pipe)));
+
+		// all instances are busy; the server creates a new one as soon as it accepts a client
+		if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(name.c_str(), 1000))
+			return std::unique_ptr<IpcConnection>();
+	}
+}
+
+#endif
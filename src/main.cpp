@@ -14,8 +14,18 @@
 #include "filterutil.hpp"
 #include "watch.hpp"
 #include "changes.hpp"
+#include "serve.hpp"
+#include "ipc.hpp"
+#include "bench.hpp"
+#include "trace.hpp"
+#include "fileutil.hpp"
+#include "budget.hpp"
+#include "constants.hpp"
+#include "qgrep.h"
 
 #include <thread>
+#include <map>
+#include <set>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,8 +44,12 @@
 #endif
 
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <chrono>
 #include <stdexcept>
+#include <fstream>
+#include <iostream>
 
 const char* kVersion = "1.3";
 
@@ -138,6 +152,134 @@ private:
 	std::mutex mutex;
 };
 
+// Collects output until the consumer thread picks it up; output that is produced while the consumer is busy is sent as one batch
+class CallbackOutput: public Output
+{
+public:
+	CallbackOutput(): pendingSize(0), finished(false), cancelled(false)
+	{
+	}
+
+	virtual void rawprint(const char* data, size_t size)
+	{
+		append(false, data, size);
+	}
+
+	virtual void print(const char* message, ...)
+	{
+		va_list l;
+		va_start(l, message);
+		std::string result;
+		strprintf(result, message, l);
+		va_end(l);
+
+		append(false, result.c_str(), result.size());
+	}
+
+	virtual void error(const char* message, ...)
+	{
+		va_list l;
+		va_start(l, message);
+		std::string result;
+		strprintf(result, message, l);
+		va_end(l);
+
+		append(true, result.c_str(), result.size());
+	}
+
+	virtual bool isCancelled()
+	{
+		return cancelled;
+	}
+
+	void cancel()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cancelled = true;
+		}
+
+		condition.notify_all();
+	}
+
+	void finish()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			finished = true;
+		}
+
+		condition.notify_all();
+	}
+
+	// Runs callbacks until the producer finishes
+	void pump(QgrepCallback callback, void* context)
+	{
+		std::vector<Batch> batches;
+
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+
+				condition.wait(lock, [&]() { return !pending.empty() || finished; });
+
+				if (pending.empty())
+					return;
+
+				batches.swap(pending);
+				pendingSize = 0;
+			}
+
+			condition.notify_all();
+
+			for (auto& batch: batches)
+				if (!cancelled && callback(context, batch.data.c_str(), batch.data.size(), batch.error) != 0)
+					cancel();
+
+			batches.clear();
+		}
+	}
+
+private:
+	struct Batch
+	{
+		bool error;
+		std::string data;
+	};
+
+	void append(bool error, const char* data, size_t size)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		// the producer waits for the consumer to catch up to keep memory usage bounded
+		condition.wait(lock, [&]() { return pendingSize == 0 || pendingSize + size <= kCallbackOutputLimit || cancelled; });
+
+		if (cancelled)
+			return;
+
+		if (pending.empty() || pending.back().error != error)
+		{
+			Batch batch = { error, std::string() };
+			pending.push_back(batch);
+		}
+
+		pending.back().data.append(data, size);
+		pendingSize += size;
+
+		lock.unlock();
+		condition.notify_all();
+	}
+
+	std::mutex mutex;
+	std::condition_variable condition;
+
+	std::vector<Batch> pending;
+	size_t pendingSize;
+	bool finished;
+	std::atomic<bool> cancelled;
+};
+
 
 unsigned int parseSearchFileOption(char opt)
 {
@@ -236,6 +378,31 @@ void parseSearchOptions(const char* opts, unsigned int& options, unsigned int& l
 
 		case 'S':
 			options |= SO_SUMMARY;
+			if (s[1] == 'E')
+			{
+				options |= SO_SUMMARY_EXTENDED;
+				s++;
+			}
+			break;
+
+		case 'q':
+			options |= SO_QUERYFILE;
+			break;
+
+		case 'U':
+			options |= SO_UNORDERED;
+			break;
+
+		case 'c':
+			options |= SO_COUNT;
+			break;
+
+		case 'W':
+			options |= SO_WINDOW;
+			break;
+
+		case 'w':
+			options |= SO_WORD;
 			break;
 
 		case 'f':
@@ -245,6 +412,8 @@ void parseSearchOptions(const char* opts, unsigned int& options, unsigned int& l
 				s = parseOrRegex(include, s + 1) - 1;
 			else if (*s == 'e')
 				s = parseOrRegex(exclude, s + 1) - 1;
+			else if (*s == 'l')
+				options |= SO_FILESONLY;
 			else
 				options |= parseSearchFileOption(*s);
 			break;
@@ -289,7 +458,82 @@ std::tuple<unsigned int, unsigned int, std::string, std::string> getSearchOption
 	return std::make_tuple(options, limit, include, exclude);
 }
 
-void processSearchCommand(Output* output, int argc, const char** argv, unsigned int (*search)(Output*, const char*, const char*, unsigned int, unsigned int, const char*, const char*))
+std::vector<std::string> readQueries(const char* path)
+{
+	std::vector<std::string> result;
+	std::string line;
+
+	std::ifstream file;
+	if (strcmp(path, "-") != 0)
+	{
+		file.open(path, std::ios::in);
+		if (!file) throw std::runtime_error(std::string("Error reading query file ") + path);
+	}
+
+	std::istream& in = strcmp(path, "-") == 0 ? std::cin : file;
+
+	while (std::getline(in, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+
+		if (!line.empty())
+			result.push_back(line);
+	}
+
+	return result;
+}
+
+typedef unsigned int (*SearchFunction)(Output*, const std::vector<std::string>&, const char*, unsigned int, unsigned int, const char*, const char*, SearchCache*, SearchStatistics*);
+typedef unsigned int (*SearchMultiFunction)(Output*, const std::vector<std::string>&, const std::vector<std::string>&, unsigned int, unsigned int, const char*, const char*, SearchCache*, SearchStatistics*);
+
+// File searches don't read chunks, so there are no statistics to collect
+unsigned int searchFilesList(Output* output, const std::vector<std::string>& files, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchCache* cache, SearchStatistics*)
+{
+	unsigned int total = 0;
+
+	for (size_t i = 0; total < limit && i < files.size(); ++i)
+	{
+		unsigned int result = searchFiles(output, files[i].c_str(), string, options, limit - total, include, exclude, cache ? getSearchCacheFilterSession(cache, files[i].c_str()) : nullptr);
+
+		assert(result <= limit - total);
+		total += result;
+	}
+
+	return total;
+}
+
+static double getSeconds(uint64_t microseconds)
+{
+	return static_cast<double>(microseconds) / 1e6;
+}
+
+static double getMegabytes(uint64_t bytes)
+{
+	return static_cast<double>(bytes) / 1e6;
+}
+
+static void printSearchStatistics(Output* output, const SearchStatistics& s)
+{
+	output->print("Chunks: %llu total, %llu skipped, %llu searched, %llu of them cached\n",
+		(unsigned long long)s.chunkCount, (unsigned long long)s.chunksSkipped, (unsigned long long)s.chunksSearched, (unsigned long long)s.chunksCached);
+	output->print("Data: %.2f MB compressed, %.2f MB decompressed of %.2f MB, %.2f MB output\n",
+		getMegabytes(s.compressedSize), getMegabytes(s.decompressedSize), getMegabytes(s.uncompressedSize), getMegabytes(s.outputSize));
+	output->print("Time: read %.3f sec, index %.3f sec, decompress %.3f sec, search %.3f sec (changed files %.3f sec), write %.3f sec\n",
+		getSeconds(s.readTime), getSeconds(s.indexTime), getSeconds(s.decompressTime), getSeconds(s.matchTime), getSeconds(s.changeTime), getSeconds(s.writeTime));
+	output->print("Waits: producer %.3f sec, idle workers %.3f sec, waiting for output %.3f sec\n",
+		getSeconds(s.producerWaitTime), getSeconds(s.workerIdleTime), getSeconds(s.outputWaitTime));
+}
+
+// Processes that work with several projects use the largest memory budget that the projects set
+static void applyProjectMemoryBudget(const std::vector<std::string>& paths)
+{
+	if (size_t size = getProjectMemoryBudget(paths))
+		setMemoryBudget(size);
+}
+
+// Searches of a shard leave the summary to the coordinator
+void processSearchCommand(Output* output, int argc, const char** argv, SearchFunction search, SearchMultiFunction searchMulti, SearchCache* cache = nullptr, bool summary = true)
 {
 	std::vector<std::string> paths = getProjectPaths(argv[2]);
 
@@ -299,31 +543,176 @@ void processSearchCommand(Output* output, int argc, const char** argv, unsigned
 	std::string include, exclude;
 	std::tie(options, limit, include, exclude) = getSearchOptions(argc, argv, 3, output->isTTY());
 
+	if (!summary)
+		options &= ~(SO_SUMMARY | SO_SUMMARY_EXTENDED);
+
 	if (*query == 0)
 	{
 		// There's no use highlighting matches from an empty query, and it substantially slows down output (since it matches on every character)
 		options &= ~SO_HIGHLIGHT_MATCHES;
 	}
 
-	unsigned int total = 0;
-
-	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<std::string> queries;
 
-	for (size_t i = 0; limit > 0 && i < paths.size(); ++i)
+	if (options & SO_QUERYFILE)
 	{
-		unsigned int result = search(output, paths[i].c_str(), query, options, limit, include.empty() ? 0 : include.c_str(), exclude.empty() ? 0 : exclude.c_str());
+		if (!searchMulti)
+			throw std::runtime_error("Query files are only supported for search commands");
 
-		assert(result <= limit);
-		limit -= result;
-		total += result;
+		queries = readQueries(query);
 	}
 
+	// QGREP_TRACE names a file that receives the stages of the search as Chrome trace JSON
+	const char* tracePath = getenv("QGREP_TRACE");
+	std::unique_ptr<TraceLog> trace(tracePath && *tracePath ? new TraceLog() : nullptr);
+
+	SearchStatistics statistics;
+	statistics.timing = (options & SO_SUMMARY_EXTENDED) || trace;
+	statistics.trace = trace.get();
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	unsigned int total = (options & SO_QUERYFILE)
+		? searchMulti(output, paths, queries, options, limit, include.empty() ? 0 : include.c_str(), exclude.empty() ? 0 : exclude.c_str(), cache, &statistics)
+		: search(output, paths, query, options, limit, include.empty() ? 0 : include.c_str(), exclude.empty() ? 0 : exclude.c_str(), cache, &statistics);
+
+	assert(total <= limit);
+	limit -= total;
+
 	if (options & SO_SUMMARY)
 	{
 		auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
 
 		output->print("Search complete, found %d%s matches in %.2f sec\n", total, (limit == 0 ? "+" : ""), static_cast<double>(time.count()) / 1000.0);
 	}
+
+	if (options & SO_SUMMARY_EXTENDED)
+		printSearchStatistics(output, statistics);
+
+	if (trace && !trace->write(tracePath))
+		output->error("Error saving trace to %s\n", tracePath);
+}
+
+bool isSearchCommand(int argc, const char** argv)
+{
+	return (argc > 3 && strcmp(argv[1], "search") == 0) || (argc > 2 && strcmp(argv[1], "files") == 0);
+}
+
+void processServerCommand(Output* output, int argc, const char** argv, SearchCache* cache, bool shard)
+{
+	try
+	{
+		if (argc > 3 && strcmp(argv[1], "search") == 0)
+			processSearchCommand(output, argc, argv, searchProject, searchProjectMulti, cache, !shard);
+		else if (argc > 2 && strcmp(argv[1], "files") == 0)
+			processSearchCommand(output, argc, argv, searchFilesList, nullptr, cache, !shard);
+		else
+			output->error("Unsupported server command %s\n", argc > 1 ? argv[1] : "");
+	}
+	catch (const std::exception& e)
+	{
+		output->error("Uncaught exception: %s\n", e.what());
+	}
+}
+
+// Every shard searches a part of each project; file lists are the same on all shards, so they come from the first one
+void processCoordinatorCommand(Output* output, int argc, const char** argv, const std::map<std::string, std::vector<std::string>>& shards)
+{
+	try
+	{
+		if ((argc > 3 && strcmp(argv[1], "search") == 0) || (argc > 2 && strcmp(argv[1], "files") == 0))
+		{
+			bool files = strcmp(argv[1], "files") == 0;
+
+			unsigned int options, limit;
+			std::string include, exclude;
+			std::tie(options, limit, include, exclude) = getSearchOptions(argc, argv, 3, output->isTTY());
+
+			auto start = std::chrono::high_resolution_clock::now();
+
+			std::string cwd = getCurrentDirectory();
+			std::vector<const char*> args(argv, argv + argc);
+			unsigned int total = 0;
+
+			// results are ordered by project and then by chunk, so projects are sent to the shards one at a time
+			for (auto& path: getProjectPaths(argv[2]))
+			{
+				if (total == limit || output->isCancelled())
+					break;
+
+				auto it = shards.find(normalizePath(cwd.c_str(), path.c_str()));
+
+				if (it == shards.end())
+				{
+					output->error("Project %s is not served by the coordinator\n", path.c_str());
+					break;
+				}
+
+				std::vector<std::string> servers = files ? std::vector<std::string>(1, it->second[0]) : it->second;
+
+				args[2] = path.c_str();
+				total += forwardShardCommand(output, servers, args.size(), args.data(), limit - total);
+			}
+
+			if (options & SO_SUMMARY)
+			{
+				auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start);
+
+				output->print("Search complete, found %d%s matches in %.2f sec\n", total, (total == limit ? "+" : ""), static_cast<double>(time.count()) / 1000.0);
+			}
+		}
+		else
+			output->error("Unsupported server command %s\n", argc > 1 ? argv[1] : "");
+	}
+	catch (const std::exception& e)
+	{
+		output->error("Uncaught exception: %s\n", e.what());
+	}
+}
+
+// Search commands are sent to the server if it's running; returns false if the command has to run locally
+bool forwardSearchCommand(Output* output, int argc, const char** argv)
+{
+	if (!isSearchCommand(argc, argv))
+		return false;
+
+	std::string address = getServerPath();
+
+	if (address.empty())
+		return false;
+
+	try
+	{
+		// query files are read relative to the current directory or from stdin
+		if (std::get<0>(getSearchOptions(argc, argv, 3, output->isTTY())) & SO_QUERYFILE)
+			return false;
+
+		// the server runs in a different directory, so project paths have to be absolute
+		std::string cwd = getCurrentDirectory();
+		std::string projects;
+
+		for (auto& path: getProjectPaths(argv[2]))
+		{
+			if (!projects.empty()) projects += ",";
+			projects += normalizePath(cwd.c_str(), path.c_str());
+		}
+
+		std::vector<const char*> args(argv, argv + argc);
+		args[2] = projects.c_str();
+
+		// global options come from the environment of the client, so they are passed ahead of command-line options
+		const char* gopts = getenv("QGREP_OPTIONS");
+
+		if (gopts && argc > 3)
+			args.insert(args.begin() + 3, gopts);
+
+		return forwardServerCommand(output, address.c_str(), args.size(), args.data());
+	}
+	catch (const std::exception&)
+	{
+		// errors are reported when the command runs locally
+		return false;
+	}
 }
 
 void processFilterCommand(Output* output, int argc, const char** argv, const char* input, size_t inputSize)
@@ -363,7 +752,11 @@ void printHelp(Output* output, bool extended)
 "  qgrep files <project-list> <search-options> <query>\n"
 "  qgrep filter <search-options> <query>\n"
 "  qgrep info <project-list>\n"
-"  qgrep projects\n");
+"  qgrep info <project-list> <search-options> <query-file>\n"
+"  qgrep projects\n"
+"  qgrep serve <project-list> [<cache-size-mb>]\n"
+"  qgrep coordinate <project-list>\n"
+"  qgrep bench <path> [<corpus-size-mb>]\n");
 
     output->print(
 "\n"
@@ -378,11 +771,18 @@ void printHelp(Output* output, bool extended)
     if (extended)
         output->print(
 "  C - output match column number       CE - output match starting and ending column numbers\n"
+"  SE - print search summary with chunk counts, data sizes and time spent in every stage\n"
 "  L<num> - limit output to <num> lines\n"
+"  q - read queries from file <query> (one per line, - for stdin); matches are prefixed with query number\n"
+"  U - print results as soon as they are found instead of in project order\n"
+"  c - print the number of matching lines for each file instead of the lines\n"
+"  W - only print the part of long lines around the match\n"
+"  w - only match whole words\n"
 "\n"
 "<search-options> can include flags for restricting searches to certain files:\n"
 "  fi<re> - only search in files with paths matching regex <re>\n"
 "  fe<re> - don't search in files with paths matching regex <re>\n"
+"  fl - only print names of files with matches\n"
 "\n"
 "<search-options> can include additional options for output highlighting:\n"
 "  H - force enable highlighting        HD - force disable highlighting\n"
@@ -407,6 +807,8 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 		{
 			std::vector<std::string> paths = getProjectPaths(argv[2]);
 
+			applyProjectMemoryBudget(paths);
+
 			for (size_t i = 0; i < paths.size(); ++i)
 				buildProject(output, paths[i].c_str());
 		}
@@ -414,16 +816,20 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 		{
 			std::vector<std::string> paths = getProjectPaths(argv[2]);
 
+			applyProjectMemoryBudget(paths);
+
 			for (size_t i = 0; i < paths.size(); ++i)
 				updateProject(output, paths[i].c_str());
 		}
 		else if (argc > 3 && strcmp(argv[1], "search") == 0)
 		{
-			processSearchCommand(output, argc, argv, searchProject);
+			applyProjectMemoryBudget(getProjectPaths(argv[2]));
+			processSearchCommand(output, argc, argv, searchProject, searchProjectMulti);
 		}
 		else if (argc > 2 && strcmp(argv[1], "files") == 0)
 		{
-			processSearchCommand(output, argc, argv, searchFiles);
+			applyProjectMemoryBudget(getProjectPaths(argv[2]));
+			processSearchCommand(output, argc, argv, searchFilesList, nullptr);
 		}
 		else if (argc > 1 && strcmp(argv[1], "projects") == 0)
 		{
@@ -436,10 +842,18 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 		{
 			std::vector<std::string> paths = getProjectPaths(argv[2]);
 
+			// queries from a log file are replayed to see how well the indices skip chunks for them
+			std::vector<std::string> queries = argc > 3 ? readQueries(argv[argc - 1]) : std::vector<std::string>();
+			unsigned int options = std::get<0>(getSearchOptions(argc, argv, 3, false));
+
 			for (size_t i = 0; i < paths.size(); ++i)
 			{
 				if (i != 0) output->print("\n");
-				printProjectInfo(output, paths[i].c_str());
+
+				if (argc > 3)
+					printProjectIndexAnalysis(output, paths[i].c_str(), queries, options);
+				else
+					printProjectInfo(output, paths[i].c_str());
 			}
 		}
 		else if (argc > 1 && strcmp(argv[1], "filter") == 0)
@@ -450,13 +864,9 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 		{
 			std::vector<std::string> paths = getProjectPaths(argv[2]);
 
-			std::vector<std::thread> threads;
-
-			for (size_t i = 0; i < paths.size(); ++i)
-				threads.emplace_back([=] { watchProject(output, paths[i].c_str(), /* interactive= */ false); });
+			applyProjectMemoryBudget(paths);
 
-			for (auto& t: threads)
-				t.join();
+			watchProjects(output, paths, /* interactive= */ false);
 		}
 		else if (argc > 2 && strcmp(argv[1], "change") == 0)
 		{
@@ -472,13 +882,17 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 			std::vector<std::string> paths = getProjectPaths(argv[2]);
 			std::vector<std::thread> threads;
 
-			for (size_t i = 0; i < paths.size(); ++i)
-				threads.emplace_back([=] { watchProject(output, paths[i].c_str(), /* interactive= */ true); });
+			applyProjectMemoryBudget(paths);
+
+			threads.emplace_back([=] { watchProjects(output, paths, /* interactive= */ true); });
 
 			std::vector<const char*> intArgv(argv, argv + argc);
 			std::string intInput;
 			intArgv.push_back(""); // Used later to place the input
 
+			// searches share the data and the contents of changed files the same way the search server does
+			std::unique_ptr<SearchCache, void (*)(SearchCache*)> cache(createSearchCache(kServerChunkCacheSize), destroySearchCache);
+
 			char buf[1024];
 			while (fgets(buf, sizeof(buf), stdin))
 			{
@@ -487,20 +901,110 @@ void mainImpl(Output* output, int argc, const char** argv, const char* input, si
 					intArgv[1] = "search";
 					intInput = std::string(buf + 7, buf + strlen(buf) - 1);
 					intArgv.back() = intInput.c_str();
-					processSearchCommand(output, intArgv.size(), &intArgv[0], searchProject);
+					processSearchCommand(output, intArgv.size(), &intArgv[0], searchProject, searchProjectMulti, cache.get());
 				}
 				else if (strncmp(buf, "files ", 6) == 0)
 				{
 					intArgv[1] = "files";
 					intInput = std::string(buf + 6, buf + strlen(buf) - 1);
 					intArgv.back() = intInput.c_str();
-					processSearchCommand(output, intArgv.size(), &intArgv[0], searchFiles);
+					processSearchCommand(output, intArgv.size(), &intArgv[0], searchFilesList, nullptr, cache.get());
 				}
 			}
 
 			for (auto& t : threads)
 				t.join();
 		}
+		else if (argc > 2 && strcmp(argv[1], "serve") == 0)
+		{
+			std::vector<std::string> paths = getProjectPaths(argv[2]);
+
+			applyProjectMemoryBudget(paths);
+
+			size_t cacheSize = kServerChunkCacheSize;
+
+			if (argc > 3)
+			{
+				char* end = nullptr;
+				unsigned long size = strtoul(argv[3], &end, 10);
+
+				if (*end != 0 || size == 0)
+					throw std::runtime_error(std::string("Cache size should be a number of megabytes: ") + argv[3]);
+
+				cacheSize = size_t(size) * 1024 * 1024;
+			}
+
+			std::string address = getServerPath();
+
+			if (address.empty())
+				throw std::runtime_error("Server address is not set; set QGREP_SERVER to the server address");
+
+			if (!isNetworkAddress(address.c_str()))
+				serveProjects(output, address.c_str(), paths, cacheSize, processServerCommand);
+			else
+			{
+				std::string cwd = getCurrentDirectory();
+				std::set<std::string> served;
+
+				for (auto& path: paths)
+					served.insert(normalizePath(cwd.c_str(), path.c_str()));
+
+				// anyone who can reach a network address can send requests, so they are limited to the projects that are served
+				serveProjects(output, address.c_str(), paths, cacheSize, [&](Output* output, int argc, const char** argv, SearchCache* cache, bool shard) {
+					for (auto& path: getProjectPaths(argc > 2 ? argv[2] : ""))
+						if (!served.count(normalizePath(cwd.c_str(), path.c_str())))
+						{
+							output->error("Project %s is not served at %s\n", path.c_str(), address.c_str());
+							return;
+						}
+
+					processServerCommand(output, argc, argv, cache, shard);
+				});
+			}
+		}
+		else if (argc > 2 && strcmp(argv[1], "coordinate") == 0)
+		{
+			std::string cwd = getCurrentDirectory();
+			std::map<std::string, std::vector<std::string>> shards;
+			std::set<std::string> servers;
+
+			for (auto& path: getProjectPaths(argv[2]))
+			{
+				std::vector<std::string> list = getProjectShards(path);
+
+				if (list.empty())
+					throw std::runtime_error("Project " + path + " should list the addresses of its shard servers");
+
+				servers.insert(list.begin(), list.end());
+				shards[normalizePath(cwd.c_str(), path.c_str())] = list;
+			}
+
+			std::string address = getServerPath();
+
+			if (address.empty())
+				throw std::runtime_error("Server address is not set; set QGREP_SERVER to the server address");
+
+			coordinateServers(output, address.c_str(), servers.size(), [&](Output* output, int argc, const char** argv, SearchCache*, bool) {
+				processCoordinatorCommand(output, argc, argv, shards);
+			});
+		}
+		else if (argc > 2 && strcmp(argv[1], "bench") == 0)
+		{
+			size_t corpusSize = kBenchCorpusSize;
+
+			if (argc > 3)
+			{
+				char* end = nullptr;
+				unsigned long size = strtoul(argv[3], &end, 10);
+
+				if (*end != 0 || size == 0)
+					throw std::runtime_error(std::string("Corpus size should be a number of megabytes: ") + argv[3]);
+
+				corpusSize = size_t(size) * 1024 * 1024;
+			}
+
+			runBenchmark(output, argv[2], corpusSize);
+		}
 		else if (argc > 1 && strcmp(argv[1], "version") == 0)
 		{
 			output->print("%s\n", kVersion);
@@ -537,23 +1041,22 @@ static void pinModule()
 int main(int argc, const char** argv)
 {
 	StandardOutput output;
-	mainImpl(&output, argc, argv, 0, 0);
+
+	if (!forwardSearchCommand(&output, argc, argv))
+		mainImpl(&output, argc, argv, 0, 0);
 }
 
-extern "C" DLLEXPORT const char* qgrepVim(const char* args)
+// Arguments are separated with \n and optionally followed by \2 and the input; argv points into argstr
+static void parseEmbeddedArgs(const char* args, std::string& argstr, std::vector<const char*>& argv, const char*& input, size_t& inputSize)
 {
-	// make sure the DLL is not unloaded up until the process exit to speed up calls
-	pinModule();
-
 	size_t argsLength = strlen(args);
 
 	const char* argsInput = strchr(args, '\2');
 	if (argsInput) argsInput++;
 
-	std::vector<const char*> argv;
 	argv.push_back("qgrep");
 
-	std::string argstr(args, argsInput ? argsInput - 1 : args + argsLength);
+	argstr.assign(args, argsInput ? argsInput - 1 : args + argsLength);
 	argstr += '\n';
 
 	size_t last = 0;
@@ -566,12 +1069,96 @@ extern "C" DLLEXPORT const char* qgrepVim(const char* args)
 			last = i + 1;
 		}
 
+	input = argsInput;
+	inputSize = argsInput ? args + argsLength - argsInput : 0;
+}
+
+extern "C" DLLEXPORT const char* qgrepVim(const char* args)
+{
+	// make sure the DLL is not unloaded up until the process exit to speed up calls
+	pinModule();
+
+	std::string argstr;
+	std::vector<const char*> argv;
+	const char* input;
+	size_t inputSize;
+	parseEmbeddedArgs(args, argstr, argv, input, inputSize);
+
 	// string contents is preserved until next call
 	static std::string result;
 	result.clear();
 
 	StringOutput output(result);
-	mainImpl(&output, argv.size(), &argv[0], argsInput, args + argsLength - argsInput);
+
+	if (!forwardSearchCommand(&output, argv.size(), &argv[0]))
+		mainImpl(&output, argv.size(), &argv[0], input, inputSize);
 
 	return result.c_str();
 }
+
+struct QgrepHandle
+{
+	std::unique_ptr<SearchCache, void (*)(SearchCache*)> cache;
+
+	// output of the running command, used for cancellation from other threads
+	std::mutex mutex;
+	CallbackOutput* output;
+
+	QgrepHandle(size_t cacheSize): cache(createSearchCache(cacheSize), destroySearchCache), output(nullptr)
+	{
+	}
+};
+
+extern "C" DLLEXPORT QgrepHandle* qgrepCreate(size_t cacheSize)
+{
+	pinModule();
+
+	return new QgrepHandle(cacheSize ? cacheSize : kServerChunkCacheSize);
+}
+
+extern "C" DLLEXPORT void qgrepDestroy(QgrepHandle* handle)
+{
+	delete handle;
+}
+
+extern "C" DLLEXPORT void qgrepRun(QgrepHandle* handle, const char* args, QgrepCallback callback, void* context)
+{
+	std::string argstr;
+	std::vector<const char*> argv;
+	const char* input;
+	size_t inputSize;
+	parseEmbeddedArgs(args, argstr, argv, input, inputSize);
+
+	CallbackOutput output;
+
+	{
+		std::unique_lock<std::mutex> lock(handle->mutex);
+		handle->output = &output;
+	}
+
+	// the command runs on a separate thread so that the callbacks can run on the calling thread while results are produced
+	std::thread worker([&]() {
+		if (isSearchCommand(argv.size(), &argv[0]))
+			processServerCommand(&output, argv.size(), &argv[0], handle->cache.get(), /* shard= */ false);
+		else
+			mainImpl(&output, argv.size(), &argv[0], input, inputSize);
+
+		output.finish();
+	});
+
+	output.pump(callback, context);
+	worker.join();
+
+	{
+		std::unique_lock<std::mutex> lock(handle->mutex);
+		handle->output = nullptr;
+	}
+}
+
+extern "C" DLLEXPORT void qgrepCancel(QgrepHandle* handle)
+{
+	std::unique_lock<std::mutex> lock(handle->mutex);
+
+	if (handle->output)
+		handle->output->cancel();
+}
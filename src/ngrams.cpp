@@ -0,0 +1,300 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "ngrams.hpp"
+
+#include "bloom.hpp"
+#include "casefold.hpp"
+#include "constants.hpp"
+
+#include <algorithm>
+#include <memory>
+
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+#include "charsimd.hpp"
+#endif
+
+// Data is casefolded in blocks that stay in L1 while the windows are built
+static const size_t kNgramBlockSize = 4096;
+
+// Returns the masks of newline and zero bytes in [data, data + 64)
+static void getBlockMasks(const char* data, uint64_t& newlines, uint64_t& zeros)
+{
+#if defined(USE_SSE2) || defined(USE_NEON)
+	simd16 newline = simd_dup('\n');
+	simd16 zero = simd_dup(0);
+
+	newlines = 0;
+	zeros = 0;
+
+	for (unsigned int i = 0; i < 64; i += 16)
+	{
+		simd16 v = simd_load(data + i);
+
+		newlines |= uint64_t(unsigned(simd_movemask(simd_cmpeq(v, newline))) & 0xffff) << i;
+		zeros |= uint64_t(unsigned(simd_movemask(simd_cmpeq(v, zero))) & 0xffff) << i;
+	}
+#else
+	newlines = 0;
+	zeros = 0;
+
+	for (unsigned int i = 0; i < 64; ++i)
+	{
+		newlines |= uint64_t(data[i] == '\n') << i;
+		zeros |= uint64_t(data[i] == 0) << i;
+	}
+#endif
+}
+
+inline unsigned int loadNgram(const char* data)
+{
+	// ngram() puts the first character in the top byte, which is a byte swapped little endian load
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+
+#ifdef _MSC_VER
+	return _byteswap_ulong(value);
+#else
+	return __builtin_bswap32(value);
+#endif
+}
+
+// Appends ngrams of the casefolded block; the block is padded with newlines so that windows past the end are rejected
+static size_t appendBlockNgrams(unsigned int* result, const char* block, size_t windowCount)
+{
+	size_t count = 0;
+	uint64_t nextNewlines, nextZeros;
+
+	getBlockMasks(block, nextNewlines, nextZeros);
+
+	for (size_t offset = 0; offset < windowCount; offset += 64)
+	{
+		uint64_t newlines = nextNewlines, zeros = nextZeros;
+
+		getBlockMasks(block + offset + 64, nextNewlines, nextZeros);
+
+		// a window starting at bit i covers bits i..i+3; it's rejected if it crosses a line or if all four bytes are zero
+		uint64_t crossMask = newlines | (newlines >> 1 | nextNewlines << 63) | (newlines >> 2 | nextNewlines << 62) | (newlines >> 3 | nextNewlines << 61);
+		uint64_t zeroMask = zeros & (zeros >> 1 | nextZeros << 63) & (zeros >> 2 | nextZeros << 62) & (zeros >> 3 | nextZeros << 61);
+		uint64_t reject = crossMask | zeroMask;
+
+		const char* data = block + offset;
+
+		// windows are stored unconditionally and only counted if they are kept, which avoids unpredictable branches
+		for (unsigned int i = 0; i < 64; ++i)
+		{
+			result[count] = loadNgram(data + i);
+			count += ((reject >> i) & 1) ^ 1;
+		}
+	}
+
+	return count;
+}
+
+// Open addressing set with linear probing; zero marks empty slots
+class NgramSet
+{
+public:
+	NgramSet(size_t expectedCount): capacity(16), shift(28), size(0)
+	{
+		while (expectedCount >= capacity / 2)
+		{
+			capacity *= 2;
+			shift--;
+		}
+
+		data.reset(new unsigned int[capacity]());
+	}
+
+	void insert(unsigned int key)
+	{
+		size_t mask = capacity - 1;
+		size_t index = hash(key);
+
+		while (data[index] != key)
+		{
+			if (data[index] == 0)
+			{
+				data[index] = key;
+
+				if (++size >= capacity / 2)
+					grow();
+
+				return;
+			}
+
+			index = (index + 1) & mask;
+		}
+	}
+
+	void extract(std::vector<unsigned int>& result) const
+	{
+		result.reserve(size);
+
+		for (size_t i = 0; i < capacity; ++i)
+			if (data[i])
+				result.push_back(data[i]);
+	}
+
+private:
+	size_t hash(unsigned int key) const
+	{
+		// Fibonacci hashing; the top bits of the product are the best mixed
+		return (key * 2654435769u) >> shift;
+	}
+
+	void grow()
+	{
+		std::unique_ptr<unsigned int[]> old(std::move(data));
+		size_t oldCapacity = capacity;
+
+		capacity *= 2;
+		shift--;
+		data.reset(new unsigned int[capacity]());
+
+		size_t mask = capacity - 1;
+
+		for (size_t i = 0; i < oldCapacity; ++i)
+			if (unsigned int key = old[i])
+			{
+				size_t index = hash(key);
+
+				while (data[index] != 0)
+					index = (index + 1) & mask;
+
+				data[index] = key;
+			}
+	}
+
+	std::unique_ptr<unsigned int[]> data;
+	size_t capacity;
+	unsigned int shift;
+	size_t size;
+};
+
+void extractNgrams(std::vector<unsigned int>& result, const char* data, size_t size)
+{
+	result.clear();
+
+	if (size < 4)
+		return;
+
+	size_t windowCount = size - 3;
+
+	// assume ~10% ngrams are unique
+	NgramSet ngrams(size / 10);
+
+	// padding covers the newline mask that is computed past the last window
+	char block[kNgramBlockSize + 64];
+	unsigned int windows[kNgramBlockSize + 64];
+
+	for (size_t offset = 0; offset < windowCount; offset += kNgramBlockSize)
+	{
+		size_t blockWindows = std::min(windowCount - offset, kNgramBlockSize);
+		size_t blockSize = blockWindows + 3;
+
+		casefoldRange(block, data + offset, data + offset + blockSize);
+		memset(block + blockSize, '\n', sizeof(block) - blockSize);
+
+		size_t count = appendBlockNgrams(windows, block, blockWindows);
+
+		for (size_t i = 0; i < count; ++i)
+			ngrams.insert(windows[i]);
+	}
+
+	ngrams.extract(result);
+}
+
+void extractShortNgrams(std::vector<unsigned int>& result, const char* data, size_t size)
+{
+	result.clear();
+
+	// there are only 64K 2-grams so they are collected in a bitmap
+	std::vector<uint64_t> digrams(65536 / 64);
+
+	// assume ~5% 3-grams are unique
+	NgramSet trigrams(size / 20);
+
+	// blocks overlap by two characters so that windows can start anywhere in the block
+	char block[kNgramBlockSize + 2];
+
+	for (size_t offset = 0; offset + 1 < size; offset += kNgramBlockSize)
+	{
+		size_t blockSize = std::min(size - offset, kNgramBlockSize + 2);
+		size_t blockWindows = std::min(blockSize - 1, kNgramBlockSize);
+
+		casefoldRange(block, data + offset, data + offset + blockSize);
+
+		for (size_t i = 0; i < blockWindows; ++i)
+		{
+			unsigned char a = block[i], b = block[i + 1];
+
+			if (a == '\n' || b == '\n')
+				continue;
+
+			unsigned int digram = ngram(0, 0, a, b);
+
+			digrams[digram / 64] |= 1ull << (digram % 64);
+
+			if (i + 2 < blockSize && block[i + 2] != '\n')
+				if (unsigned int trigram = ngram(0, a, b, block[i + 2]))
+					trigrams.insert(trigram);
+		}
+	}
+
+	trigrams.extract(result);
+
+	// the zero ngram is skipped
+	for (unsigned int i = 1; i < 65536; ++i)
+		if (digrams[i / 64] & (1ull << (i % 64)))
+			result.push_back(i);
+}
+
+static bool isIdentifierChar(char ch)
+{
+	return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_';
+}
+
+unsigned int identifierHash(const char* data, size_t size)
+{
+	// FNV-1a
+	unsigned int result = 2166136261u;
+
+	for (size_t i = 0; i < size; ++i)
+		result = (result ^ static_cast<unsigned char>(casefold(data[i]))) * 16777619u;
+
+	// the zero key marks empty slots in ngram sets
+	return result ? result : 1;
+}
+
+void extractIdentifiers(std::vector<unsigned int>& result, const char* data, size_t size)
+{
+	result.clear();
+
+	// assume ~1% of the data starts a unique identifier
+	NgramSet identifiers(size / 100);
+
+	for (size_t i = 0; i < size; )
+	{
+		if (!isIdentifierChar(data[i]))
+		{
+			i++;
+			continue;
+		}
+
+		size_t start = i;
+
+		while (i < size && isIdentifierChar(data[i]))
+			i++;
+
+		if (i - start <= kIdentifierMaxLength)
+			identifiers.insert(identifierHash(data + start, i - start));
+	}
+
+	identifiers.extract(result);
+}
@@ -0,0 +1,16 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <vector>
+
+// Collects unique casefolded ngrams of the data in no particular order; ngrams that cross lines and the zero ngram are skipped
+void extractNgrams(std::vector<unsigned int>& result, const char* data, size_t size);
+
+// Collects unique casefolded 2-grams and 3-grams of the data in no particular order, stored as ngram(0, 0, a, b) and ngram(0, a, b, c)
+void extractShortNgrams(std::vector<unsigned int>& result, const char* data, size_t size);
+
+// Hash of the casefolded identifier that identifier indices are keyed by; never zero
+unsigned int identifierHash(const char* data, size_t size);
+
+// Collects unique hashes of the identifiers of the data ([A-Za-z0-9_] runs of at most kIdentifierMaxLength) in no particular order
+void extractIdentifiers(std::vector<unsigned int>& result, const char* data, size_t size);
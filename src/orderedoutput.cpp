@@ -4,57 +4,73 @@
 
 #include "output.hpp"
 #include "stringutil.hpp"
+#include "trace.hpp"
 
-#include <functional>
+#include <string.h>
 
-static void writeThreadFun(Output* output, BlockingQueue<OrderedOutput::Chunk*>& queue, unsigned int limit)
+OrderedOutput::Chunk::Chunk(unsigned int id, unsigned int lines): id(id), lines(lines)
 {
-	unsigned int total = 0;
+}
 
-	while (OrderedOutput::Chunk* chunk = queue.pop())
-	{
-		std::string::size_type pos = 0;
+OrderedOutput::OrderedOutput(Output* output, size_t memoryLimit, size_t flushThreshold, unsigned int lineLimit, size_t chunkLimit, bool unordered):
+	output(output), memoryLimit(memoryLimit), flushThreshold(flushThreshold), lineLimit(lineLimit), printedLines(0), unordered(unordered),
+	slots(new Slot[chunkLimit]), slotCount(chunkLimit), flushed(nullptr), flushedSpare(nullptr),
+	currentChunk(0), nextUnorderedChunk(0), currentLine(0), bufferedSize(0), cancelled(false), stopping(false), writerWaiting(false), endWaiting(0),
+	timing(false), trace(nullptr), writtenSize(0), writeTime(0), waitTime(0),
+	writeThread(&OrderedOutput::writeThreadFun, this)
+{
+}
 
-		for (unsigned int i = total; i < limit && pos < chunk->result.length(); ++i)
-		{
-			const char* line = chunk->result.c_str() + pos;
-			size_t length = strlen(line);
+OrderedOutput::~OrderedOutput()
+{
+	finish();
 
-			output->rawprint(line, length);
-			total++;
-			pos += length + 1;
-		}
+	// chunks that were not written can only remain after cancellation
+	assert(cancelled || !flushed);
 
-		delete chunk;
+	for (size_t i = 0; i < slotCount; ++i)
+	{
+		assert(cancelled || !slots[i].ready);
+
+		delete slots[i].ready.load();
+		delete slots[i].spare.load();
 	}
-}
 
-OrderedOutput::Chunk::Chunk(unsigned int id, unsigned int lines): id(id), lines(lines)
-{
+	delete flushed.load();
+	delete flushedSpare.load();
 }
 
-OrderedOutput::OrderedOutput(Output* output, size_t memoryLimit, size_t flushThreshold, unsigned int lineLimit):
-	output(output), flushThreshold(flushThreshold), lineLimit(lineLimit), writeQueue(memoryLimit),
-	writeThread(std::bind(writeThreadFun, output, std::ref(writeQueue), lineLimit)),
-	currentChunk(0), currentLine(0)
+void OrderedOutput::reserve(unsigned int id)
 {
-}
+	if (unordered)
+		return;
 
-OrderedOutput::~OrderedOutput()
-{
-	writeQueue.push(nullptr);
-	writeThread.join();
+	// all chunks before id are queued already and complete without waiting, so the writer keeps advancing
+	auto canReserve = [&]() { return cancelled || (id < currentChunk + slotCount && (id == currentChunk || bufferedSize < memoryLimit)); };
 
-	assert(chunks.empty());
+	if (canReserve())
+		return;
 
-    (void)output;
+	uint64_t time = 0;
+
+	{
+		TraceScope scope(timing, trace, time, "producer", "output wait");
+
+		std::unique_lock<std::mutex> lock(endMutex);
+
+		endWaiting++;
+		endCondition.wait(lock, canReserve);
+		endWaiting--;
+	}
+
+	waitTime += time;
 }
 
 OrderedOutput::Chunk* OrderedOutput::begin(unsigned int id)
 {
-	assert(id >= currentChunk);
+	assert(unordered || id >= currentChunk);
 
-	return new Chunk(id, 0);
+	return allocateChunk(slots[id % slotCount], id);
 }
 
 void OrderedOutput::write(Chunk* chunk, const char* format, ...)
@@ -69,47 +85,306 @@ void OrderedOutput::write(Chunk* chunk, const char* format, ...)
 
 void OrderedOutput::write(Chunk* chunk)
 {
-	chunk->result.push_back(0);
 	chunk->lines++;
 
-	if (chunk->result.size() > flushThreshold && chunk->id == currentChunk)
+	if (unordered)
 	{
-		Chunk* temp = new Chunk(chunk->id, chunk->lines);
+		if (chunk->result.size() > flushThreshold)
+		{
+			Chunk* temp = allocateChunk(slots[chunk->id % slotCount], chunk->id);
+
+			chunk->result.swap(temp->result);
+			temp->lines = chunk->lines;
+			chunk->lines = 0;
+
+			publishUnordered(temp);
+		}
+
+		return;
+	}
+
+	// the current chunk can hand its output to the writer early, as long as the previous part was written
+	if (chunk->result.size() > flushThreshold && chunk->id == currentChunk && !flushed)
+	{
+		Chunk* temp = flushedSpare.exchange(nullptr);
+
+		if (temp)
+		{
+			temp->id = chunk->id;
+			temp->result.clear();
+		}
+		else
+			temp = new Chunk(chunk->id, 0);
+
+		unsigned int lines = chunk->lines;
+
 		chunk->result.swap(temp->result);
+		temp->lines = lines;
 		chunk->lines = 0;
 
-		currentLine += temp->lines;
-		writeQueue.push(temp, temp->result.size());
+		// the lines are counted after publishing so that the writer sees the chunk if the count triggers cancellation
+		flushed = temp;
+		currentLine += lines;
+
+		if (writerWaiting)
+		{
+			std::unique_lock<std::mutex> lock(writerMutex);
+			writerCondition.notify_one();
+		}
 	}
 }
 
 void OrderedOutput::end(Chunk* chunk)
 {
-	std::lock_guard<std::mutex> lock(mutex);
+	if (unordered)
+		publishUnordered(chunk);
+	else
+		publish(chunk);
+}
+
+void OrderedOutput::publish(Chunk* chunk)
+{
+	unsigned int id = chunk->id;
+	size_t size = chunk->result.size();
+
+	// unordered chunks are counted as soon as they get an id, so they are written even after cancellation
+	bool discard = !unordered;
 
-	assert(chunks[chunk->id] == 0);
-	chunks[chunk->id] = chunk;
+	// ordered chunks were reserved by the producer, so they have a free slot; a worker that waited here could hold back
+	// the current chunk, which may still be queued for the same worker
+	assert(unordered || cancelled || id < currentChunk + slotCount);
 
-	while (!chunks.empty() && chunks.begin()->first == currentChunk)
+	// unordered chunks get consecutive ids as they are published, so all chunks before a waiting chunk are already in
+	// their slots, and the current chunk never waits
+	auto canPublish = [&]() { return id < currentChunk + slotCount && (id == currentChunk || bufferedSize == 0 || bufferedSize + size <= memoryLimit); };
+
+	if (unordered && !canPublish())
 	{
-		Chunk* chunk = chunks.begin()->second;
-		chunks.erase(chunks.begin());
+		uint64_t time = 0;
 
-		if (chunk->result.empty())
 		{
-			delete chunk;
-		}
-		else
-		{
-			currentLine += chunk->lines;
-			writeQueue.push(chunk, chunk->result.size());
+			TraceScope scope(timing, trace, time, "worker", "output wait");
+
+			std::unique_lock<std::mutex> lock(endMutex);
+
+			endWaiting++;
+			endCondition.wait(lock, canPublish);
+			endWaiting--;
 		}
 
-		currentChunk++;
+		waitTime += time;
+	}
+
+	Slot& slot = slots[id % slotCount];
+
+	if (discard && cancelled)
+	{
+		recycle(slot, chunk);
+		return;
+	}
+
+	bufferedSize += size;
+	slot.ready.store(chunk, std::memory_order_release);
+
+	if (writerWaiting)
+	{
+		std::unique_lock<std::mutex> lock(writerMutex);
+		writerCondition.notify_one();
+	}
+}
+
+void OrderedOutput::publishUnordered(Chunk* chunk)
+{
+	if (cancelled || chunk->result.empty())
+	{
+		recycle(slots[chunk->id % slotCount], chunk);
+		return;
 	}
+
+	// the lines are counted right away since every published chunk is written in full
+	chunk->id = nextUnorderedChunk++;
+	currentLine += chunk->lines;
+
+	publish(chunk);
+}
+
+void OrderedOutput::cancel()
+{
+	{
+		std::unique_lock<std::mutex> lock(writerMutex);
+		cancelled = true;
+	}
+
+	writerCondition.notify_one();
+
+	{
+		std::unique_lock<std::mutex> lock(endMutex);
+	}
+
+	endCondition.notify_all();
+}
+
+void OrderedOutput::finish()
+{
+	if (!writeThread.joinable())
+		return;
+
+	{
+		std::unique_lock<std::mutex> lock(writerMutex);
+		stopping = true;
+	}
+
+	writerCondition.notify_one();
+	writeThread.join();
 }
 
 unsigned int OrderedOutput::getLineCount() const
 {
 	return std::min(currentLine.load(), lineLimit);
 }
+
+void OrderedOutput::enableTiming(TraceLog* trace)
+{
+	this->trace = trace;
+	timing = true;
+}
+
+uint64_t OrderedOutput::getWrittenSize() const
+{
+	return writtenSize;
+}
+
+uint64_t OrderedOutput::getWriteTime() const
+{
+	return writeTime;
+}
+
+uint64_t OrderedOutput::getWaitTime() const
+{
+	return waitTime;
+}
+
+void OrderedOutput::writeThreadFun()
+{
+	for (;;)
+	{
+		unsigned int id = currentChunk;
+		Slot& slot = slots[id % slotCount];
+
+		// lines that were handed over before cancellation are within the limit and still have to be written
+		bool stop = cancelled && !unordered;
+
+		// the chunk has to be loaded first: its partial output, if any, was published before it
+		Chunk* chunk = slot.ready.load(std::memory_order_acquire);
+		Chunk* partial = flushed.exchange(nullptr);
+
+		if (partial)
+		{
+			writeChunk(partial);
+
+			Chunk* old = flushedSpare.exchange(partial);
+			delete old;
+		}
+
+		if (stop)
+			break;
+
+		if (chunk)
+		{
+			slot.ready.store(nullptr, std::memory_order_relaxed);
+
+			if (!unordered)
+				currentLine += chunk->lines;
+
+			bufferedSize -= chunk->result.size();
+
+			writeChunk(chunk);
+			recycle(slot, chunk);
+
+			currentChunk = id + 1;
+
+			if (endWaiting)
+			{
+				std::unique_lock<std::mutex> lock(endMutex);
+				endCondition.notify_all();
+			}
+
+			continue;
+		}
+
+		if (partial)
+			continue;
+
+		std::unique_lock<std::mutex> lock(writerMutex);
+
+		// writerWaiting has to be visible before the slot is checked, otherwise a publish could miss the writer
+		writerWaiting = true;
+
+		auto ready = [&]() { return slot.ready || flushed || (cancelled && !unordered); };
+
+		if (stopping && !ready())
+			break;
+
+		writerCondition.wait(lock, [&]() { return ready() || stopping; });
+		writerWaiting = false;
+	}
+}
+
+void OrderedOutput::writeChunk(Chunk* chunk)
+{
+	if (printedLines >= lineLimit || chunk->result.empty())
+		return;
+
+	const char* data = chunk->result.c_str();
+	size_t size = chunk->result.size();
+
+	// every line ends with a newline, so the output can be cut at the limit without splitting lines
+	if (chunk->lines > lineLimit - printedLines)
+	{
+		const char* end = data;
+
+		for (unsigned int i = printedLines; i < lineLimit && end < data + size; ++i)
+		{
+			const char* next = static_cast<const char*>(memchr(end, '\n', data + size - end));
+
+			end = next ? next + 1 : data + size;
+		}
+
+		size = end - data;
+		printedLines = lineLimit;
+	}
+	else
+		printedLines += chunk->lines;
+
+	TraceScope scope(timing.load(std::memory_order_acquire), trace, writeTime, "output", "write");
+
+	output->rawprint(data, size);
+	writtenSize += size;
+}
+
+OrderedOutput::Chunk* OrderedOutput::allocateChunk(Slot& slot, unsigned int id)
+{
+	Chunk* chunk = slot.spare.exchange(nullptr);
+
+	if (!chunk)
+		return new Chunk(id, 0);
+
+	chunk->id = id;
+	chunk->lines = 0;
+	chunk->result.clear();
+
+	return chunk;
+}
+
+void OrderedOutput::recycle(Slot& slot, Chunk* chunk)
+{
+	// large buffers are released to keep memory usage bounded
+	if (chunk->result.capacity() > flushThreshold * 16)
+	{
+		delete chunk;
+		return;
+	}
+
+	Chunk* old = slot.spare.exchange(chunk);
+	delete old;
+}
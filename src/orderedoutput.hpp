@@ -2,14 +2,16 @@
 #pragma once
 
 #include <string>
-#include <map>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <atomic>
 
-#include "blockingqueue.hpp"
+#include <stdint.h>
 
 class Output;
+class TraceLog;
 
 class OrderedOutput
 {
@@ -23,27 +25,96 @@ public:
 		Chunk(unsigned int id, unsigned int lines);
 	};
 
-	OrderedOutput(Output* output, size_t memoryLimit, size_t flushThreshold, unsigned int lineLimit);
+	// Unordered output writes chunks in the order they are ended; the chunk ids are reassigned to order the writes
+	OrderedOutput(Output* output, size_t memoryLimit, size_t flushThreshold, unsigned int lineLimit, size_t chunkLimit, bool unordered = false);
 	~OrderedOutput();
 
-    Chunk* begin(unsigned int id);
-    void write(Chunk* chunk, const char* format, ...);
-    void write(Chunk* chunk);
-    void end(Chunk* chunk);
+	// Waits until chunk id is close enough to the writer and buffered output is within the memory limit; ordered output
+	// requires the producer to call this before it queues the work that ends the chunk, so that workers never wait in end()
+	void reserve(unsigned int id);
+
+	Chunk* begin(unsigned int id);
+	void write(Chunk* chunk, const char* format, ...);
+	void write(Chunk* chunk);
+	void end(Chunk* chunk);
+
+	// Discards chunks that are not written yet; chunks ended after this are discarded as well
+	void cancel();
+
+	// Writes all ended chunks and stops the writer; has to be called after the last chunk is ended
+	void finish();
 
 	unsigned int getLineCount() const;
 
+	// Measures the time spent writing and the time chunks wait for the writer, and records it to the trace if there is one
+	// Has to be called before the first chunk is ended
+	void enableTiming(TraceLog* trace = nullptr);
+
+	// Output size in bytes and times in microseconds; complete once the output is finished
+	// Wait time is the time the producer waits in reserve() or, for unordered output, the time workers wait in end()
+	uint64_t getWrittenSize() const;
+	uint64_t getWriteTime() const;
+	uint64_t getWaitTime() const;
+
 private:
+	// Completed chunks are published to the slot at id % slotCount; slots also keep a spare chunk so that buffers are reused
+	struct Slot
+	{
+		std::atomic<Chunk*> ready;
+		std::atomic<Chunk*> spare;
+
+		Slot(): ready(nullptr), spare(nullptr)
+		{
+		}
+	};
+
+	Chunk* allocateChunk(Slot& slot, unsigned int id);
+	void publish(Chunk* chunk);
+	void publishUnordered(Chunk* chunk);
+
+	void writeThreadFun();
+	void writeChunk(Chunk* chunk);
+	void recycle(Slot& slot, Chunk* chunk);
+
 	Output* output;
 
+	size_t memoryLimit;
 	size_t flushThreshold;
 	unsigned int lineLimit;
+	unsigned int printedLines;
+	bool unordered;
 
-	BlockingQueue<Chunk*> writeQueue;
-	std::thread writeThread;
+	std::unique_ptr<Slot[]> slots;
+	size_t slotCount;
+
+	// partial output of the current chunk, flushed before the chunk is complete
+	std::atomic<Chunk*> flushed;
+	std::atomic<Chunk*> flushedSpare;
 
-	std::mutex mutex;
 	std::atomic<unsigned int> currentChunk;
+	std::atomic<unsigned int> nextUnorderedChunk;
 	std::atomic<unsigned int> currentLine;
-	std::map<unsigned int, Chunk*> chunks;
+	std::atomic<size_t> bufferedSize;
+	std::atomic<bool> cancelled;
+	std::atomic<bool> stopping;
+
+	std::mutex writerMutex;
+	std::condition_variable writerCondition;
+	std::atomic<bool> writerWaiting;
+
+	std::mutex endMutex;
+	std::condition_variable endCondition;
+	std::atomic<unsigned int> endWaiting;
+
+	// the writer reads the timing flag while it runs, so it's atomic; the trace is set before the flag
+	std::atomic<bool> timing;
+	TraceLog* trace;
+	uint64_t writtenSize;
+	uint64_t writeTime;
+	std::atomic<uint64_t> waitTime;
+
+	std::thread writeThread;
+
+	OrderedOutput(const OrderedOutput&);
+	OrderedOutput& operator=(const OrderedOutput&);
 };
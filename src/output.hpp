@@ -12,4 +12,7 @@ public:
 	virtual void error(const char* message, ...) = 0;
 
 	virtual bool isTTY() { return false; }
+
+	// Long-running commands poll this to stop early, i.e. when the query is superseded by a newer one
+	virtual bool isCancelled() { return false; }
 };
@@ -0,0 +1,491 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "postings.hpp"
+
+#include "output.hpp"
+#include "format.hpp"
+#include "fileutil.hpp"
+#include "filestream.hpp"
+#include "datafile.hpp"
+#include "constants.hpp"
+#include "budget.hpp"
+#include "workqueue.hpp"
+#include "blockpool.hpp"
+#include "ngrams.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+
+#include <string.h>
+
+struct PostingBuilder
+{
+	PostingKind kind;
+	std::string targetPath;
+	std::string tempPath;
+	std::string runPath;
+
+	std::mutex mutex;
+	std::vector<uint64_t> pairs;
+	std::vector<size_t> runs;
+	bool failed;
+};
+
+static const char* getPostingExtension(PostingKind kind)
+{
+	return kind == PK_IDENTIFIERS ? ".qgw" : ".qgp";
+}
+
+static const char* getPostingMagic(PostingKind kind)
+{
+	return kind == PK_IDENTIFIERS ? kIdentifierFileHeaderMagic : kPostingFileHeaderMagic;
+}
+
+static const char* getPostingName(PostingKind kind)
+{
+	return kind == PK_IDENTIFIERS ? "identifier index" : "posting lists";
+}
+
+static void extractChunkKeys(std::vector<uint64_t>& result, PostingKind kind, unsigned int chunk, const char* data, size_t size)
+{
+	// same set of ngrams as chunk indices use; pairs are sorted when runs are written
+	std::vector<unsigned int> keys;
+
+	if (kind == PK_IDENTIFIERS)
+		extractIdentifiers(keys, data, size);
+	else
+		extractNgrams(keys, data, size);
+
+	result.reserve(keys.size());
+
+	for (auto key: keys)
+		result.push_back((uint64_t(key) << 32) | chunk);
+}
+
+static bool writeRun(PostingBuilder& builder, std::vector<uint64_t>& pairs)
+{
+	std::sort(pairs.begin(), pairs.end());
+
+	std::string path = builder.runPath + std::to_string(builder.runs.size());
+
+	FileStream out(path.c_str(), "wb");
+	if (!out || (!pairs.empty() && out.write(&pairs[0], pairs.size() * sizeof(uint64_t)) != pairs.size() * sizeof(uint64_t)))
+		return false;
+
+	builder.runs.push_back(pairs.size());
+	pairs.clear();
+
+	return true;
+}
+
+static void appendPairs(PostingBuilder& builder, const std::vector<uint64_t>& pairs)
+{
+	std::unique_lock<std::mutex> lock(builder.mutex);
+
+	builder.pairs.insert(builder.pairs.end(), pairs.begin(), pairs.end());
+
+	// spill sorted runs to disk to keep memory bounded for large projects
+	if (builder.pairs.size() >= kPostingRunSize && !writeRun(builder, builder.pairs))
+		builder.failed = true;
+}
+
+struct PostingRun
+{
+	FileStream in;
+	size_t remaining;
+
+	std::vector<uint64_t> buffer;
+	size_t offset;
+
+	bool next(uint64_t& value)
+	{
+		if (offset == buffer.size())
+		{
+			size_t count = std::min(remaining, size_t(65536));
+
+			buffer.resize(count);
+			offset = 0;
+
+			if (count == 0 || !read(in, &buffer[0], count * sizeof(uint64_t)))
+				return false;
+
+			remaining -= count;
+		}
+
+		value = buffer[offset++];
+		return true;
+	}
+};
+
+class PostingWriter
+{
+public:
+	PostingWriter(FileStream& out): out(out), offset(sizeof(PostingFileHeader)), last(0)
+	{
+	}
+
+	void append(uint64_t pair)
+	{
+		unsigned int ngram = unsigned(pair >> 32);
+		unsigned int chunk = unsigned(pair);
+
+		if (table.empty() || table.back().ngram != ngram)
+		{
+			flush();
+
+			PostingFileEntry e = { ngram, 0, offset };
+			table.push_back(e);
+			last = 0;
+		}
+
+		assert(table.back().count == 0 || chunk > last);
+
+		// chunk ids are delta-encoded as LEB128 varints
+		unsigned int delta = chunk - last;
+
+		do
+		{
+			buffer.push_back((delta & 127) | (delta > 127 ? 128 : 0));
+			delta >>= 7;
+		}
+		while (delta);
+
+		last = chunk;
+		table.back().count++;
+
+		if (buffer.size() >= 65536)
+			flush();
+	}
+
+	void flush()
+	{
+		if (!buffer.empty())
+		{
+			out.write(&buffer[0], buffer.size());
+			offset += buffer.size();
+			buffer.clear();
+		}
+	}
+
+	FileStream& out;
+	uint64_t offset;
+	unsigned int last;
+
+	std::vector<PostingFileEntry> table;
+	std::vector<unsigned char> buffer;
+};
+
+static bool mergeRuns(PostingBuilder& builder, PostingWriter& writer)
+{
+	std::vector<std::unique_ptr<PostingRun>> runs;
+
+	for (size_t i = 0; i < builder.runs.size(); ++i)
+	{
+		std::unique_ptr<PostingRun> run(new PostingRun());
+		run->remaining = builder.runs[i];
+		run->offset = 0;
+
+		if (!run->in.open((builder.runPath + std::to_string(i)).c_str(), "rb"))
+			return false;
+
+		runs.push_back(std::move(run));
+	}
+
+	typedef std::pair<uint64_t, size_t> Item;
+	std::priority_queue<Item, std::vector<Item>, std::greater<Item>> heap;
+
+	for (size_t i = 0; i < runs.size(); ++i)
+	{
+		uint64_t value;
+
+		if (runs[i]->next(value))
+			heap.push(std::make_pair(value, i));
+	}
+
+	while (!heap.empty())
+	{
+		Item item = heap.top();
+		heap.pop();
+
+		writer.append(item.first);
+
+		uint64_t value;
+
+		if (runs[item.second]->next(value))
+			heap.push(std::make_pair(value, item.second));
+	}
+
+	return true;
+}
+
+static void removeRuns(PostingBuilder& builder)
+{
+	for (size_t i = 0; i < builder.runs.size(); ++i)
+		removeFile((builder.runPath + std::to_string(i)).c_str());
+}
+
+static bool readPostingChunks(Output* output, std::vector<std::unique_ptr<PostingBuilder>>& builders, DataFileReader& in, const std::vector<DataChunkDirectoryEntry>& chunks, const CompressionDictionary* dictionary, const char* dataPath)
+{
+	// the pool outlives the queue, so blocks that jobs hold are returned to it
+	BlockPool pool(kChunkSize * 3 / 2);
+	WorkQueue queue(WorkQueue::getIdealWorkerCount(), getQueuedDataLimit());
+
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		const DataChunkDirectoryEntry& entry = chunks[i];
+		const DataChunkHeader& chunk = entry.header;
+
+		size_t dataOffset = getChunkDataOffset(chunk.compressedSize);
+		BlockRef data = pool.allocate(dataOffset + chunk.uncompressedSize, std::nothrow);
+
+		in.seek(entry.dataOffset);
+
+		if (!data || !in.read(data.get(), chunk.compressedSize))
+		{
+			output->error("Error reading data file %s: malformed chunk\n", dataPath);
+			return false;
+		}
+
+		// all indices are built from one pass over the chunks, so every chunk is decompressed once
+		queue.push([=, &builders]() {
+			char* uncompressed = data.get() + dataOffset;
+			decompressChunk(uncompressed, chunk, data.get(), dictionary);
+
+			const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(uncompressed);
+			size_t fileDataOffset = chunk.fileCount ? files[0].dataOffset : chunk.uncompressedSize;
+
+			for (auto& builder: builders)
+			{
+				std::vector<uint64_t> pairs;
+				extractChunkKeys(pairs, builder->kind, i, uncompressed + fileDataOffset, chunk.uncompressedSize - fileDataOffset);
+
+				appendPairs(*builder, pairs);
+			}
+		}, dataOffset + chunk.uncompressedSize);
+	}
+
+	return true;
+}
+
+static bool writePostingFile(Output* output, PostingBuilder& builder, size_t chunkCount, uint64_t dataFileSize)
+{
+	const char* name = getPostingName(builder.kind);
+
+	if (builder.failed)
+	{
+		output->error("Error saving %s %s\n", name, builder.runPath.c_str());
+		return false;
+	}
+
+	FileStream out(builder.tempPath.c_str(), "wb");
+	if (!out)
+	{
+		output->error("Error saving %s %s\n", name, builder.tempPath.c_str());
+		return false;
+	}
+
+	PostingFileHeader header = {};
+	out.write(&header, sizeof(header));
+
+	PostingWriter writer(out);
+
+	if (builder.runs.empty())
+	{
+		std::sort(builder.pairs.begin(), builder.pairs.end());
+
+		for (auto pair: builder.pairs)
+			writer.append(pair);
+	}
+	else
+	{
+		if ((!builder.pairs.empty() && !writeRun(builder, builder.pairs)) || !mergeRuns(builder, writer))
+		{
+			output->error("Error saving %s %s\n", name, builder.runPath.c_str());
+			return false;
+		}
+	}
+
+	writer.flush();
+
+	// the table is used in place from the mapped file, so it's padded to the entry alignment
+	char padding[alignof(PostingFileEntry)] = {};
+	size_t paddingSize = (alignof(PostingFileEntry) - writer.offset % alignof(PostingFileEntry)) % alignof(PostingFileEntry);
+
+	out.write(padding, paddingSize);
+	writer.offset += paddingSize;
+
+	if (!writer.table.empty())
+		out.write(&writer.table[0], writer.table.size() * sizeof(PostingFileEntry));
+
+	memcpy(header.magic, getPostingMagic(builder.kind), sizeof(header.magic));
+	header.chunkCount = chunkCount;
+	header.ngramCount = writer.table.size();
+	header.dataFileSize = dataFileSize;
+	header.tableOffset = writer.offset;
+
+	out.seek(0);
+	out.write(&header, sizeof(header));
+
+	if (!out)
+	{
+		output->error("Error saving %s %s\n", name, builder.tempPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool buildPostings(Output* output, const char* path, bool postings, bool identifiers)
+{
+	std::string dataPath = replaceExtension(path, ".qgd");
+
+	std::vector<std::unique_ptr<PostingBuilder>> builders;
+
+	const PostingKind kinds[] = { PK_NGRAMS, PK_IDENTIFIERS };
+
+	for (auto kind: kinds)
+	{
+		std::string targetPath = replaceExtension(path, getPostingExtension(kind));
+
+		if (!(kind == PK_IDENTIFIERS ? identifiers : postings))
+		{
+			removeFile(targetPath.c_str());
+			continue;
+		}
+
+		std::unique_ptr<PostingBuilder> builder(new PostingBuilder());
+		builder->kind = kind;
+		builder->targetPath = targetPath;
+		builder->tempPath = targetPath + "_";
+		builder->runPath = builder->tempPath + "run";
+		builder->failed = false;
+
+		builders.push_back(std::move(builder));
+	}
+
+	if (builders.empty())
+		return true;
+
+	output->print("Building %s...\r", builders.size() > 1 ? "posting lists and identifier index" : getPostingName(builders[0]->kind));
+
+	DataFileReader in(dataPath.c_str());
+	std::vector<DataChunkDirectoryEntry> chunks;
+	std::shared_ptr<CompressionDictionary> dictionary;
+
+	if (!in || !readDataFileDirectory(in, chunks) || !readDataFileDictionary(in, dictionary))
+	{
+		output->error("Error reading data file %s\n", dataPath.c_str());
+		return false;
+	}
+
+	bool result = readPostingChunks(output, builders, in, chunks, dictionary.get(), dataPath.c_str());
+
+	for (auto& builder: builders)
+	{
+		result = result && writePostingFile(output, *builder, chunks.size(), in.size());
+
+		removeRuns(*builder);
+	}
+
+	if (!result)
+		return false;
+
+	for (auto& builder: builders)
+		if (!renameFile(builder->tempPath.c_str(), builder->targetPath.c_str()))
+		{
+			output->error("Error saving %s %s\n", getPostingName(builder->kind), builder->targetPath.c_str());
+			return false;
+		}
+
+	return true;
+}
+
+PostingIndex::PostingIndex(): data(nullptr), size(0), table(nullptr), tableSize(0)
+{
+}
+
+PostingIndex::~PostingIndex()
+{
+	if (data) unmapFile(data, size);
+}
+
+bool PostingIndex::open(const char* path, PostingKind kind, uint64_t dataFileSize, size_t chunkCount)
+{
+	assert(!data);
+
+	std::string indexPath = replaceExtension(path, getPostingExtension(kind));
+
+	data = static_cast<const char*>(mapFile(indexPath.c_str(), &size));
+	if (!data) return false;
+
+	PostingFileHeader header;
+
+	if (size < sizeof(header))
+		return false;
+
+	memcpy(&header, data, sizeof(header));
+
+	if (memcmp(header.magic, getPostingMagic(kind), sizeof(header.magic)) != 0 || header.dataFileSize != dataFileSize || header.chunkCount != chunkCount)
+		return false;
+
+	if (header.tableOffset < sizeof(header) || header.tableOffset + uint64_t(header.ngramCount) * sizeof(PostingFileEntry) != size)
+		return false;
+
+	// indices built before the table was aligned are ignored until they are rebuilt
+	if (header.tableOffset % alignof(PostingFileEntry) != 0)
+		return false;
+
+	table = reinterpret_cast<const PostingFileEntry*>(data + header.tableOffset);
+	tableSize = header.ngramCount;
+
+	return true;
+}
+
+const PostingFileEntry* PostingIndex::lookup(unsigned int ngram) const
+{
+	const PostingFileEntry* it = std::lower_bound(table, table + tableSize, ngram, [](const PostingFileEntry& e, unsigned int n) { return e.ngram < n; });
+
+	return (it != table + tableSize && it->ngram == ngram) ? it : nullptr;
+}
+
+size_t PostingIndex::count(unsigned int ngram) const
+{
+	const PostingFileEntry* e = lookup(ngram);
+
+	return e ? e->count : 0;
+}
+
+void PostingIndex::find(unsigned int ngram, std::vector<unsigned int>& result) const
+{
+	result.clear();
+
+	const PostingFileEntry* e = lookup(ngram);
+	if (!e) return;
+
+	const unsigned char* pos = reinterpret_cast<const unsigned char*>(data) + e->offset;
+	const unsigned char* end = reinterpret_cast<const unsigned char*>(table);
+
+	unsigned int last = 0;
+
+	result.reserve(e->count);
+
+	for (size_t i = 0; i < e->count; ++i)
+	{
+		unsigned int delta = 0;
+
+		for (unsigned int shift = 0; pos < end; shift += 7)
+		{
+			unsigned char byte = *pos++;
+			delta |= (byte & 127) << shift;
+
+			if ((byte & 128) == 0)
+				break;
+		}
+
+		last += delta;
+		result.push_back(last);
+	}
+}
@@ -0,0 +1,45 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <vector>
+
+class Output;
+struct PostingFileEntry;
+
+// Posting lists map ngrams of the chunk data to the chunks that contain them; identifier indices map hashes of identifiers
+enum PostingKind
+{
+	PK_NGRAMS,
+	PK_IDENTIFIERS,
+};
+
+// Builds the enabled indices in one pass over the data file and removes the disabled ones
+bool buildPostings(Output* output, const char* path, bool postings, bool identifiers);
+
+class PostingIndex
+{
+public:
+	PostingIndex();
+	~PostingIndex();
+
+	// Opens the posting index for the data file; fails if the index is missing or doesn't match the data file
+	bool open(const char* path, PostingKind kind, uint64_t dataFileSize, size_t chunkCount);
+
+	// Returns the number of chunks that contain the ngram (or identifier hash)
+	size_t count(unsigned int ngram) const;
+
+	// Returns sorted ids of chunks that contain the ngram (or identifier hash)
+	void find(unsigned int ngram, std::vector<unsigned int>& result) const;
+
+private:
+	PostingIndex(const PostingIndex&);
+	PostingIndex& operator=(const PostingIndex&);
+
+	const PostingFileEntry* lookup(unsigned int ngram) const;
+
+	const char* data;
+	uint64_t size;
+
+	const PostingFileEntry* table;
+	size_t tableSize;
+};
@@ -6,6 +6,8 @@
 #include "fileutil.hpp"
 #include "stringutil.hpp"
 #include "regex.hpp"
+#include "constants.hpp"
+#include "gitindex.hpp"
 
 #include <fstream>
 #include <memory>
@@ -13,6 +15,9 @@
 #include <stdexcept>
 #include <map>
 #include <string>
+#include <thread>
+
+#include <stdlib.h>
 
 static std::string getHomePath()
 {
@@ -66,6 +71,18 @@ std::string getProjectName(const char* path)
 	return path;
 }
 
+std::string getServerPath()
+{
+	const char* server = getenv("QGREP_SERVER");
+
+	if (server)
+		return server;
+
+	std::string home = getHomePath();
+
+	return home.empty() ? "" : home + "/server";
+}
+
 static std::vector<std::string> getProjectsByPrefix(const char* prefix)
 {
 	std::vector<std::string> result;
@@ -169,23 +186,112 @@ static std::shared_ptr<Regex> createOrRegexCached(const std::vector<std::string>
 	return createRegexCached(re, regexCache);
 }
 
+// Include and exclude patterns of every group; rules are built from them once the parents of all groups are parsed
+typedef std::map<ProjectGroup*, std::pair<std::vector<std::string>, std::vector<std::string>>> ProjectPatterns;
+
 static std::unique_ptr<ProjectGroup> buildGroup(std::unique_ptr<ProjectGroup> group, const std::vector<std::string>& include, const std::vector<std::string>& exclude,
-	std::map<std::string, std::shared_ptr<Regex>>& regexCache)
+	std::map<std::string, std::shared_ptr<Regex>>& regexCache, ProjectPatterns& patterns)
 {
 	group->include = createOrRegexCached(include, regexCache);
 	group->exclude = createOrRegexCached(exclude, regexCache);
 
+	patterns[group.get()] = std::make_pair(include, exclude);
+
 	return group;
 }
 
+// Matches of a pattern in a directory path with a trailing slash are also matches in every path that starts with it, unless the match depends on what follows it
+static bool isPrefixPattern(const std::string& pattern)
+{
+	return pattern.find('$') == std::string::npos && pattern.find("\\b") == std::string::npos && pattern.find("\\B") == std::string::npos;
+}
+
+static void buildRulesRec(ProjectGroup* group, ProjectPatterns& patterns)
+{
+	std::vector<std::string> rulePatterns;
+	unsigned int level = 0;
+
+	group->ruleIncludeLevels = 0;
+
+	for (ProjectGroup* g = group; g; g = g->parent, ++level)
+	{
+		const auto& groupPatterns = patterns[g];
+
+		for (auto& pattern: groupPatterns.first)
+		{
+			ProjectRule rule = { level, false, false };
+
+			rulePatterns.push_back(pattern);
+			group->ruleInfo.push_back(rule);
+
+			if (level < 64)
+				group->ruleIncludeLevels |= uint64_t(1) << level;
+		}
+
+		for (auto& pattern: groupPatterns.second)
+		{
+			ProjectRule rule = { level, true, isPrefixPattern(pattern) };
+
+			rulePatterns.push_back(pattern);
+			group->ruleInfo.push_back(rule);
+		}
+	}
+
+	// deeper hierarchies only use the per-group patterns
+	if (!rulePatterns.empty() && level <= 64)
+		group->rules.reset(createRegexSet(rulePatterns, RO_IGNORECASE));
+
+	for (auto& child: group->groups)
+		buildRulesRec(child.get(), patterns);
+}
+
+static double parseIndexSetting(const std::string& value, double min, double max, const char* name)
+{
+	char* end = nullptr;
+	double result = strtod(value.c_str(), &end);
+
+	if (value.empty() || *end || !(result >= min && result <= max))
+		throw std::runtime_error(std::string("Invalid ") + name);
+
+	return result;
+}
+
+static size_t parseMemorySetting(const std::string& value)
+{
+	return static_cast<size_t>(parseIndexSetting(value, 1, double(SIZE_MAX >> 21), "memory budget")) << 20;
+}
+
+static FilePolicy parseFilePolicy(const std::string& value)
+{
+	if (value == "index") return FP_INDEX;
+	if (value == "store") return FP_STORE;
+	if (value == "skip") return FP_SKIP;
+
+	throw std::runtime_error("Unknown file policy");
+}
+
 static std::unique_ptr<ProjectGroup> parseGroup(std::ifstream& in, const char* file, unsigned int& lineId, ProjectGroup* parent,
-	std::map<std::string, std::shared_ptr<Regex>>& regexCache, const char* pathBase)
+	std::map<std::string, std::shared_ptr<Regex>>& regexCache, ProjectPatterns& patterns, const char* pathBase)
 {
 	std::string line, suffix;
 	std::vector<std::string> include, exclude;
 
 	std::unique_ptr<ProjectGroup> result(new ProjectGroup);
 	result->parent = parent;
+	result->postings = false;
+	result->identifiers = false;
+	result->chunkSize = kChunkSize;
+	result->indexFalsePositiveRate = kChunkIndexFalsePositiveRate;
+	result->blockFilters = false;
+	result->dedup = false;
+	result->memoryBudget = 0;
+
+	for (size_t i = 0; i < FC_COUNT; ++i)
+		result->policies[i] = FP_INDEX;
+
+	result->compressionCodec = CC_LZ4;
+	result->compressionLevel = kFileDataCompressionLevel;
+	result->compressFileList = false;
 
 	while (std::getline(in, line))
 	{
@@ -200,6 +306,11 @@ static std::unique_ptr<ProjectGroup> parseGroup(std::ifstream& in, const char* f
 			if (suffix.empty()) throw std::runtime_error("No path specified");
 			result->paths.push_back(normalizePath(pathBase, suffix.c_str()));
 		}
+		else if (extractSuffix(line, "git", suffix))
+		{
+			if (suffix.empty()) throw std::runtime_error("No path specified");
+			result->gitPaths.push_back(normalizePath(pathBase, suffix.c_str()));
+		}
 		else if (extractSuffix(line, "file", suffix))
 		{
 			if (suffix.empty()) throw std::runtime_error("No path specified");
@@ -215,12 +326,82 @@ static std::unique_ptr<ProjectGroup> parseGroup(std::ifstream& in, const char* f
 			createRegexCached(suffix, regexCache);
 			exclude.push_back(suffix);
 		}
+		else if (extractSuffix(line, "index", suffix))
+		{
+			if (parent) throw std::runtime_error("Index settings are only allowed in root group");
+
+			std::string value;
+
+			if (suffix == "postings")
+				result->postings = true;
+			else if (suffix == "identifiers")
+				result->identifiers = true;
+			else if (suffix == "blockfilters")
+				result->blockFilters = true;
+			else if (suffix == "dedup")
+				result->dedup = true;
+			else if (extractSuffix(suffix, "chunksize", value))
+				result->chunkSize = static_cast<size_t>(parseIndexSetting(value, kChunkSizeMin / 1024, kChunkSizeMax / 1024, "chunk size")) * 1024;
+			else if (extractSuffix(suffix, "fprate", value))
+				result->indexFalsePositiveRate = parseIndexSetting(value, 0.001, 50, "false positive rate") / 100;
+			else
+				throw std::runtime_error("Unknown index type");
+		}
+		else if (extractSuffix(line, "classify", suffix))
+		{
+			if (parent) throw std::runtime_error("Classification settings are only allowed in root group");
+
+			std::string value;
+
+			if (extractSuffix(suffix, "binary", value))
+				result->policies[FC_BINARY] = parseFilePolicy(value);
+			else if (extractSuffix(suffix, "generated", value))
+				result->policies[FC_GENERATED] = parseFilePolicy(value);
+			else
+				throw std::runtime_error("Unknown file class");
+		}
+		else if (extractSuffix(line, "compress", suffix))
+		{
+			if (parent) throw std::runtime_error("Compression settings are only allowed in root group");
+
+			std::string value;
+
+			if (suffix == "filelist")
+				result->compressFileList = true;
+			else if (extractSuffix(suffix, "lz4", value))
+			{
+				result->compressionCodec = CC_LZ4;
+				result->compressionLevel = value.empty() ? kFileDataCompressionLevel : static_cast<int>(parseIndexSetting(value, 0, getLZ4MaxLevel(), "compression level"));
+			}
+			else if (extractSuffix(suffix, "zstd", value))
+			{
+				if (!isZstdSupported()) throw std::runtime_error("zstd compression is not supported by this build");
+
+				result->compressionCodec = CC_ZSTD;
+				result->compressionLevel = value.empty() ? kZstdCompressionLevel : static_cast<int>(parseIndexSetting(value, 1, getZstdMaxLevel(), "compression level"));
+			}
+			else
+				throw std::runtime_error("Unknown compression codec");
+		}
+		else if (extractSuffix(line, "memory", suffix))
+		{
+			if (parent) throw std::runtime_error("Memory settings are only allowed in root group");
+
+			result->memoryBudget = parseMemorySetting(suffix);
+		}
+		else if (extractSuffix(line, "shard", suffix))
+		{
+			if (parent) throw std::runtime_error("Shard settings are only allowed in root group");
+			if (suffix.empty()) throw std::runtime_error("Shard setting should have a server address");
+
+			result->shards.push_back(suffix);
+		}
 		else if (extractSuffix(line, "group", suffix))
-			result->groups.push_back(parseGroup(in, file, lineId, result.get(), regexCache, pathBase));
+			result->groups.push_back(parseGroup(in, file, lineId, result.get(), regexCache, patterns, pathBase));
 		else if (extractSuffix(line, "endgroup", suffix))
 		{
 			if (!parent) throw std::runtime_error("Mismatched endgroup");
-			return buildGroup(std::move(result), include, exclude, regexCache);
+			return buildGroup(std::move(result), include, exclude, regexCache, patterns);
 		}
 		else
 		{
@@ -235,7 +416,60 @@ static std::unique_ptr<ProjectGroup> parseGroup(std::ifstream& in, const char* f
 	}
 
 	if (parent) throw std::runtime_error("End of file while looking for endgroup");
-	return buildGroup(std::move(result), include, exclude, regexCache);
+	return buildGroup(std::move(result), include, exclude, regexCache, patterns);
+}
+
+// Calls the callback with the values of a setting in the root group of the project file without parsing the rest
+template <typename Callback> static void readRootSetting(const std::string& file, const char* name, Callback callback)
+{
+	std::ifstream in(file.c_str());
+	std::string line, suffix;
+	unsigned int depth = 0;
+
+	while (std::getline(in, line))
+	{
+		line = trim(line);
+
+		if (extractSuffix(line, "group", suffix))
+			depth++;
+		else if (extractSuffix(line, "endgroup", suffix))
+			depth -= (depth > 0);
+		else if (depth == 0 && extractSuffix(line, name, suffix))
+			callback(suffix);
+	}
+}
+
+size_t getProjectMemoryBudget(const std::vector<std::string>& files)
+{
+	size_t result = 0;
+
+	for (auto& file: files)
+	{
+		// malformed values are reported when the project is parsed
+		readRootSetting(file, "memory", [&](const std::string& value) {
+			try
+			{
+				result = std::max(result, parseMemorySetting(value));
+			}
+			catch (const std::exception&)
+			{
+			}
+		});
+	}
+
+	return result;
+}
+
+std::vector<std::string> getProjectShards(const std::string& file)
+{
+	std::vector<std::string> result;
+
+	readRootSetting(file, "shard", [&](const std::string& value) {
+		if (!value.empty())
+			result.push_back(value);
+	});
+
+	return result;
 }
 
 std::unique_ptr<ProjectGroup> parseProject(Output* output, const char* file)
@@ -255,7 +489,12 @@ std::unique_ptr<ProjectGroup> parseProject(Output* output, const char* file)
 
 	try
 	{
-		return parseGroup(in, file, line, 0, regexCache, pathBase.c_str());
+		ProjectPatterns patterns;
+		std::unique_ptr<ProjectGroup> result = parseGroup(in, file, line, 0, regexCache, patterns, pathBase.c_str());
+
+		buildRulesRec(result.get(), patterns);
+
+		return result;
 	}
 	catch (const std::exception& e)
 	{
@@ -268,6 +507,29 @@ bool isFileAcceptable(ProjectGroup* group, const char* path)
 {
 	size_t length = strlen(path);
 
+	if (group->rules)
+	{
+		std::vector<int> matches;
+
+		if (group->rules->match(path, length, matches))
+		{
+			uint64_t includeLevels = 0;
+
+			for (int index: matches)
+			{
+				const ProjectRule& rule = group->ruleInfo[index];
+
+				if (rule.exclude)
+					return false;
+
+				includeLevels |= uint64_t(1) << rule.level;
+			}
+
+			// every group with include rules has to have one that matches
+			return (group->ruleIncludeLevels & ~includeLevels) == 0;
+		}
+	}
+
 	for (; group; group = group->parent)
 	{
 		if (group->include && !group->include->search(path, length))
@@ -288,6 +550,29 @@ bool isDirectoryAcceptable(ProjectGroup* group, const char* path)
 {
 	size_t length = strlen(path);
 
+	if (group->rules)
+	{
+		std::vector<int> matches;
+
+		if (group->rules->match(path, length, matches))
+		{
+			for (int index: matches)
+				if (group->ruleInfo[index].exclude)
+					return false;
+
+			// rules like ^boost/ don't match the directory name itself, but they reject every file in it
+			std::string prefix = path;
+			prefix += '/';
+
+			if (group->rules->match(prefix.c_str(), prefix.size(), matches))
+				for (int index: matches)
+					if (group->ruleInfo[index].prefix)
+						return false;
+
+			return true;
+		}
+	}
+
 	for (; group; group = group->parent)
 	{
 		if (group->exclude && group->exclude->search(path, length))
@@ -297,7 +582,47 @@ bool isDirectoryAcceptable(ProjectGroup* group, const char* path)
 	return true;
 }
 
-static void getProjectGroupFilesRec(Output* output, ProjectGroup* group, std::vector<FileInfo>& files)
+// The index only has the metadata of the files when they were staged, so the files are checked on several threads to get the current one
+static void getFileAttributesParallel(std::vector<FileInfo>& files, size_t offset)
+{
+	std::vector<char> found(files.size() - offset);
+	std::vector<std::thread> threads;
+
+	size_t count = files.size() - offset;
+	bool background = isBackgroundPriority();
+
+	for (unsigned int i = 0; i < kTraverseThreadCount; ++i)
+		threads.emplace_back([&, i]() {
+			if (background)
+				setBackgroundPriority();
+
+			for (size_t j = count * i / kTraverseThreadCount; j < count * (i + 1) / kTraverseThreadCount; ++j)
+			{
+				FileInfo& f = files[offset + j];
+
+				found[j] = getFileAttributes(f.path.c_str(), &f.timeStamp, &f.fileSize);
+			}
+		});
+
+	for (auto& t: threads)
+		t.join();
+
+	// files that were deleted but not staged yet are not in the worktree
+	size_t write = offset;
+
+	for (size_t j = 0; j < count; ++j)
+		if (found[j])
+		{
+			if (write != offset + j)
+				files[write] = std::move(files[offset + j]);
+
+			write++;
+		}
+
+	files.resize(write);
+}
+
+static void getProjectGroupFilesRec(Output* output, ProjectGroup* group, std::vector<FileInfo>& files, DirectoryListingCache* cached, DirectoryListingCache* listings)
 {
 	for (auto& path: group->files)
 	{
@@ -313,30 +638,54 @@ static void getProjectGroupFilesRec(Output* output, ProjectGroup* group, std::ve
 	{
 		std::string buf;
 
-		bool result = traverseDirectory(folder.c_str(), [&](const char* path, uint64_t mtime, uint64_t size) {
-			if (isFileAcceptable(group, path))
-			{
-				joinPaths(buf, folder.c_str(), path);
-				files.push_back({ buf, mtime, size });
-			}
+		bool result = traverseDirectoryParallel(folder.c_str(), [&](const char* path, uint64_t mtime, uint64_t size) {
+			joinPaths(buf, folder.c_str(), path);
+			files.push_back({ buf, mtime, size });
+			}, [&](const char* path) {
+				return isFileAcceptable(group, path);
 			}, [&](const char* path) {
 				return isDirectoryAcceptable(group, path);
-			});
+			}, cached, listings);
 
 		if (!result) output->error("Error reading folder %s\n", folder.c_str());
 	}
 
+	for (auto& folder: group->gitPaths)
+	{
+		std::vector<std::string> paths;
+
+		if (!readGitIndex(output, folder.c_str(), paths))
+			continue;
+
+		size_t offset = files.size();
+		std::string buf;
+
+		for (auto& path: paths)
+			if (isFileAcceptable(group, path.c_str()))
+			{
+				joinPaths(buf, folder.c_str(), path.c_str());
+				files.push_back({ buf, 0, 0 });
+			}
+
+		getFileAttributesParallel(files, offset);
+	}
+
 	for (auto& child: group->groups)
-		getProjectGroupFilesRec(output, child.get(), files);
+		getProjectGroupFilesRec(output, child.get(), files, cached, listings);
 }
 
-std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group)
+std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group, DirectoryListingCache* cached, DirectoryListingCache* listings)
 {
 	std::vector<FileInfo> files;
 	
-	getProjectGroupFilesRec(output, group, files);
+	getProjectGroupFilesRec(output, group, files, cached, listings);
+
+	auto pathLess = [](const FileInfo& l, const FileInfo& r) { return l.path < r.path; };
+
+	// folders are traversed in sorted order and git indices are sorted, so the list only needs to be sorted when a project has several sources
+	if (!std::is_sorted(files.begin(), files.end(), pathLess))
+		std::sort(files.begin(), files.end(), pathLess);
 
-	std::sort(files.begin(), files.end(), [](const FileInfo& l, const FileInfo& r) { return l.path < r.path; });
 	files.erase(std::unique(files.begin(), files.end(), [](const FileInfo& l, const FileInfo& r) { return l.path == r.path; }), files.end());
 
 	return files;
@@ -5,28 +5,93 @@
 #include <vector>
 #include <memory>
 
+#include "classify.hpp"
+#include "compression.hpp"
+#include "fileutil.hpp"
+
 class Output;
 class Regex;
+class RegexSet;
 
 std::string getProjectPath(const char* name);
 std::string getProjectName(const char* path);
 
+// Address of the search server; can be overridden with QGREP_SERVER, set it to an empty string to disable the server
+std::string getServerPath();
+
 std::vector<std::string> getProjects();
 std::vector<std::string> getProjectPaths(const char* list);
 
+struct ProjectRule
+{
+	// number of groups between the group that has the rule and the group that uses it
+	unsigned int level;
+	bool exclude;
+
+	// an exclude rule that matches a directory path followed by a slash matches every path in the directory
+	bool prefix;
+};
+
 struct ProjectGroup
 {
 	ProjectGroup* parent;
 
 	std::vector<std::string> paths;
 	std::vector<std::string> files;
+
+	// git worktrees; the tracked files are taken from the git index instead of scanning the folders
+	std::vector<std::string> gitPaths;
 	std::shared_ptr<Regex> include;
 	std::shared_ptr<Regex> exclude;
 
+	// include and exclude patterns of the group and all its parents, matched at once; ruleIncludeLevels has a bit for every level with include rules
+	std::shared_ptr<RegexSet> rules;
+	std::vector<ProjectRule> ruleInfo;
+	uint64_t ruleIncludeLevels;
+
 	std::vector<std::unique_ptr<ProjectGroup>> groups;
+
+	// root group only: build exact posting lists in addition to chunk filters
+	bool postings;
+
+	// root group only: build posting lists of identifiers for whole word searches
+	bool identifiers;
+
+	// root group only: approximate chunk size and target false positive rate of chunk filters
+	size_t chunkSize;
+	double indexFalsePositiveRate;
+
+	// root group only: build filters for the blocks of each chunk so that searches can skip blocks
+	bool blockFilters;
+
+	// root group only: store files with the same contents as a stored file as references; their matches follow the stored file
+	bool dedup;
+
+	// root group only: memory budget of processes that work with the project in bytes, or 0 to use the default
+	size_t memoryBudget;
+
+	// root group only: addresses of the servers that coordinators split searches of the project between
+	std::vector<std::string> shards;
+
+	// root group only: what to do with binary and generated files; text files are always indexed
+	FilePolicy policies[FC_COUNT];
+
+	// root group only: codec and compression level for new chunks
+	CompressionCodec compressionCodec;
+	int compressionLevel;
+
+	// root group only: store the file list compressed instead of in a form that searches use in place
+	bool compressFileList;
 };
 
 std::unique_ptr<ProjectGroup> parseProject(Output* output, const char* file);
+
+// Reads the memory budget from the root groups of the project files without parsing the rest; returns the largest one, or 0 if none is set
+size_t getProjectMemoryBudget(const std::vector<std::string>& files);
+
+// Reads the shard server addresses from the root group of the project file without parsing the rest
+std::vector<std::string> getProjectShards(const std::string& file);
+
 bool isFileAcceptable(ProjectGroup* group, const char* path);
 
 struct FileInfo
@@ -36,4 +101,5 @@ struct FileInfo
 	uint64_t fileSize;
 };
 
-std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group);
+// Cached listings are used for directories that didn't change since they were cached; listings of all scanned directories are added to listings
+std::vector<FileInfo> getProjectGroupFiles(Output* output, ProjectGroup* group, DirectoryListingCache* cached = nullptr, DirectoryListingCache* listings = nullptr);
@@ -0,0 +1,29 @@
+/* This file is part of qgrep and is distributed under the MIT license, see LICENSE.md */
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Keeps project data and decompressed chunks resident between commands; commands on one handle must not run concurrently */
+typedef struct QgrepHandle QgrepHandle;
+
+/* Receives a batch of output, or an error message if error is non-zero; returning non-zero cancels the command */
+typedef int (*QgrepCallback)(void* context, const char* data, size_t size, int error);
+
+/* cacheSize is the amount of decompressed chunk data to keep in bytes, 0 selects the default */
+QgrepHandle* qgrepCreate(size_t cacheSize);
+void qgrepDestroy(QgrepHandle* handle);
+
+/* Runs the command; arguments are separated with \n, optionally followed by \2 and the input for filter commands (same as qgrepVim) */
+/* Output is delivered in batches as soon as it's available; callbacks are invoked on the calling thread */
+void qgrepRun(QgrepHandle* handle, const char* args, QgrepCallback callback, void* context);
+
+/* Cancels the command that is running on the handle; can be called from any thread */
+void qgrepCancel(QgrepHandle* handle);
+
+#ifdef __cplusplus
+}
+#endif
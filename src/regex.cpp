@@ -3,11 +3,15 @@
 #include "regex.hpp"
 
 #include "casefold.hpp"
+#include "constants.hpp"
+#include "stringutil.hpp"
 
 #include "re2/re2.h"
+#include "re2/set.h"
 #include "re2/prefilter.h"
 #include "re2/prefilter_tree.h"
 
+#include <algorithm>
 #include <memory>
 #include <stdexcept>
 
@@ -17,11 +21,6 @@
 #include "charsimd.hpp"
 #endif
 
-#ifdef _MSC_VER
-#   include <intrin.h>
-#   pragma intrinsic(_BitScanForward)
-#endif
-
 static bool transformRegexCasefold(const char* pattern, std::string& res, bool literal)
 {
 	res.clear();
@@ -49,6 +48,91 @@ static bool transformRegexCasefold(const char* pattern, std::string& res, bool l
 	return true;
 }
 
+static std::string getWordPattern(const char* pattern, unsigned int options)
+{
+	// queries use POSIX syntax, which doesn't have non-capturing groups
+	return "\\b(" + ((options & RO_LITERAL) ? RE2::QuoteMeta(pattern) : std::string(pattern)) + ")\\b";
+}
+
+static bool isIdentifierChar(char ch)
+{
+	return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_';
+}
+
+static bool parseIdentifierAlternation(const char*& p, std::vector<std::string>& result, bool bounded);
+
+// Parses an identifier or a group with an alternation of them; unbounded items have to be enclosed in word boundaries
+static bool parseIdentifierItem(const char*& p, std::vector<std::string>& result, bool bounded)
+{
+	if (*p == '(')
+	{
+		p++;
+
+		if (!parseIdentifierAlternation(p, result, bounded) || *p != ')')
+			return false;
+
+		p++;
+		return true;
+	}
+
+	if (!bounded)
+	{
+		if (p[0] != '\\' || p[1] != 'b')
+			return false;
+
+		p += 2;
+
+		if (!parseIdentifierItem(p, result, /* bounded= */ true) || p[0] != '\\' || p[1] != 'b')
+			return false;
+
+		p += 2;
+		return true;
+	}
+
+	const char* begin = p;
+
+	while (isIdentifierChar(*p))
+		p++;
+
+	if (p == begin)
+		return false;
+
+	result.push_back(std::string(begin, p));
+	return true;
+}
+
+static bool parseIdentifierAlternation(const char*& p, std::vector<std::string>& result, bool bounded)
+{
+	for (;;)
+	{
+		if (!parseIdentifierItem(p, result, bounded))
+			return false;
+
+		if (*p != '|')
+			return true;
+
+		p++;
+	}
+}
+
+static bool getPatternIdentifiers(const char* pattern, unsigned int options, std::vector<std::string>& result)
+{
+	result.clear();
+
+	if (options & RO_LITERAL)
+		return false;
+
+	const char* p = pattern;
+
+	if (!parseIdentifierAlternation(p, result, /* bounded= */ false) || *p != 0)
+	{
+		result.clear();
+		return false;
+	}
+
+	return true;
+}
+
 class LiteralMatcher
 {
 public:
@@ -58,33 +142,26 @@ public:
 };
 
 #if defined(USE_SSE2) || defined(USE_NEON)
-inline int countTrailingZeros(int value)
-{
-#ifdef _MSC_VER
-	unsigned long r;
-	_BitScanForward(&r, value);
-	return r;
-#else
-	return __builtin_ctz(value);
-#endif
-}
-
+// Matchers can optionally compare data | 0x20 against the pattern to search case-insensitively without a casefolded copy;
+// this also matches some non-letter pairs (e.g. '@' and '`') so the results have to be verified
 class LiteralMatcher1: public LiteralMatcher
 {
 public:
-	LiteralMatcher1(const char* string): first(string[0])
+	LiteralMatcher1(const char* string, char fold): fold(fold)
 	{
+		first = string[0] | fold;
 	}
 
 	virtual size_t match(const char* data, size_t size)
 	{
 		simd16 pattern = simd_dup(first);
+		simd16 foldMask = simd_dup(fold);
 
 		size_t offset = 0;
 
 		while (offset + 16 <= size)
 		{
-			simd16 val = simd_load(data + offset);
+			simd16 val = simd_or(simd_load(data + offset), foldMask);
 			simd16 maskv = simd_cmpeq(val, pattern);
 			int mask = simd_movemask(maskv);
 
@@ -96,20 +173,55 @@ public:
 			offset += 16;
 		}
 
-		while (offset < size && data[offset] != first)
+		while (offset < size && (data[offset] | fold) != first)
 			offset++;
 
 		return offset;
 	}
 
-private:
+protected:
 	char first;
+	char fold;
 };
 
+#ifdef USE_SSE2
+class LiteralMatcher1AVX2: public LiteralMatcher1
+{
+public:
+	LiteralMatcher1AVX2(const char* string, char fold): LiteralMatcher1(string, fold)
+	{
+	}
+
+	SIMD_TARGET_AVX2 virtual size_t match(const char* data, size_t size)
+	{
+		simd32 pattern = simd32_dup(first);
+		simd32 foldMask = simd32_dup(fold);
+
+		size_t offset = 0;
+
+		while (offset + 32 <= size)
+		{
+			simd32 val = simd32_or(simd32_load(data + offset), foldMask);
+			unsigned int mask = simd32_movemask(simd32_cmpeq(val, pattern));
+
+			if (mask != 0)
+				return offset + countTrailingZeros(mask);
+
+			offset += 32;
+		}
+
+		while (offset < size && (data[offset] | fold) != first)
+			offset++;
+
+		return offset;
+	}
+};
+#endif
+
 class LiteralMatcher16: public LiteralMatcher
 {
 public:
-	LiteralMatcher16(const char* string)
+	LiteralMatcher16(const char* string, char fold): fold(fold)
 	{
 		size_t length = strlen(string);
 
@@ -118,9 +230,9 @@ public:
 
 		for (size_t i = 0; i < 16; ++i)
 		{
-			firstLetter[i] = string[firstPos];
+			firstLetter[i] = string[firstPos] | fold;
 
-			patternData[i] = (dataOffset + i < length) ? string[dataOffset + i] : 0;
+			patternData[i] = (dataOffset + i < length) ? string[dataOffset + i] | fold : 0;
 			patternMask[i] = (dataOffset + i < length) ? 0 : 0xff;
 		}
 
@@ -128,19 +240,36 @@ public:
 		firstLetterOffset = firstPos - dataOffset;
 
 		pattern = string;
+
+		for (size_t i = 0; i < length; ++i)
+			pattern[i] |= fold;
 	}
 
 	virtual size_t match(const char* data, size_t size)
+	{
+		return matchFrom(data, size, firstLetterPos);
+	}
+
+protected:
+	unsigned char firstLetter[16];
+	unsigned char patternData[16];
+	unsigned char patternMask[16];
+	size_t firstLetterPos;
+	size_t firstLetterOffset;
+
+	std::string pattern;
+	char fold;
+
+	size_t matchFrom(const char* data, size_t size, size_t offset)
 	{
 		simd16 firstLetter = simd_load(this->firstLetter);
 		simd16 patternData = simd_load(this->patternData);
 		simd16 patternMask = simd_load(this->patternMask);
-
-		size_t offset = firstLetterPos;
+		simd16 foldMask = simd_dup(fold);
 
 		while (offset + 32 <= size)
 		{
-			simd16 value = simd_load(data + offset);
+			simd16 value = simd_or(simd_load(data + offset), foldMask);
 			unsigned int mask = simd_movemask(simd_cmpeq(value, firstLetter));
 
 			// advance offset regardless of match results to reduce number of live values
@@ -154,7 +283,7 @@ public:
 				mask &= ~(1 << pos);
 
 				// check if we have a match
-				simd16 patternMatch = simd_load(data + dataOffset);
+				simd16 patternMatch = simd_or(simd_load(data + dataOffset), foldMask);
 				simd16 matchMask = simd_or(patternMask, simd_cmpeq(patternMatch, patternData));
 
 				if (simd_movemask(matchMask) == 0xffff)
@@ -162,7 +291,7 @@ public:
 					size_t matchOffset = dataOffset + firstLetterOffset - firstLetterPos;
 
 					// final check for full pattern
-					if (matchOffset + pattern.size() <= size && memcmp(data + matchOffset, pattern.c_str(), pattern.size()) == 0)
+					if (matchOffset + pattern.size() <= size && compare(data + matchOffset, pattern.c_str(), pattern.size(), fold))
 					{
 						return matchOffset;
 					}
@@ -170,24 +299,27 @@ public:
 			}
 		}
 
-		return findMatch(pattern.c_str(), pattern.size(), data, size, offset - firstLetterPos);
+		return findMatch(pattern.c_str(), pattern.size(), data, size, offset - firstLetterPos, fold);
 	}
 
-private:
-	unsigned char firstLetter[16];
-	unsigned char patternData[16];
-	unsigned char patternMask[16];
-	size_t firstLetterPos;
-	size_t firstLetterOffset;
+	static bool compare(const char* data, const char* pattern, size_t size, char fold)
+	{
+		if (fold == 0)
+			return memcmp(data, pattern, size) == 0;
 
-	std::string pattern;
+		for (size_t i = 0; i < size; ++i)
+			if ((data[i] | fold) != pattern[i])
+				return false;
+
+		return true;
+	}
 
-	static size_t findMatch(const char* x, size_t m, const char* y, size_t n, size_t start)
+	static size_t findMatch(const char* x, size_t m, const char* y, size_t n, size_t start, char fold)
 	{
 		for (size_t j = start; j + m <= n; ++j)
 		{
 			size_t i = 0;
-			while (i < m && x[i] == y[i + j]) ++i;
+			while (i < m && x[i] == (y[i + j] | fold)) ++i;
 
 			if (i == m) return j;
 		}
@@ -226,21 +358,113 @@ private:
 		return result;
 	}
 };
+
+#ifdef USE_SSE2
+class LiteralMatcher16AVX2: public LiteralMatcher16
+{
+public:
+	LiteralMatcher16AVX2(const char* string, char fold): LiteralMatcher16(string, fold)
+	{
+	}
+
+	SIMD_TARGET_AVX2 virtual size_t match(const char* data, size_t size)
+	{
+		simd32 firstLetter = simd32_dup(this->firstLetter[0]);
+		simd32 foldMask32 = simd32_dup(fold);
+		simd16 patternData = simd_load(this->patternData);
+		simd16 patternMask = simd_load(this->patternMask);
+		simd16 foldMask = simd_dup(fold);
+
+		size_t offset = firstLetterPos;
+
+		// pattern checks read up to 16 bytes past the end of the 32-byte block
+		while (offset + 48 <= size)
+		{
+			simd32 value = simd32_or(simd32_load(data + offset), foldMask32);
+			unsigned int mask = simd32_movemask(simd32_cmpeq(value, firstLetter));
+
+			offset += 32;
+
+			while (mask != 0)
+			{
+				unsigned int pos = countTrailingZeros(mask);
+				size_t dataOffset = offset - 32 + pos - firstLetterOffset;
+
+				mask &= mask - 1;
+
+				simd16 patternMatch = simd_or(simd_load(data + dataOffset), foldMask);
+				simd16 matchMask = simd_or(patternMask, simd_cmpeq(patternMatch, patternData));
+
+				if (simd_movemask(matchMask) == 0xffff)
+				{
+					size_t matchOffset = dataOffset + firstLetterOffset - firstLetterPos;
+
+					if (matchOffset + pattern.size() <= size && compare(data + matchOffset, pattern.c_str(), pattern.size(), fold))
+					{
+						return matchOffset;
+					}
+				}
+			}
+		}
+
+		return matchFrom(data, size, offset);
+	}
+};
+#endif
+
+static LiteralMatcher* createLiteralMatcher(const std::string& prefix, bool fold)
+{
+	char foldMask = fold ? 0x20 : 0;
+
+#ifdef USE_SSE2
+	if (simd_avx2())
+	{
+		if (prefix.length() == 1)
+			return new LiteralMatcher1AVX2(prefix.c_str(), foldMask);
+		else
+			return new LiteralMatcher16AVX2(prefix.c_str(), foldMask);
+	}
 #endif
 
+	if (prefix.length() == 1)
+		return new LiteralMatcher1(prefix.c_str(), foldMask);
+	else
+		return new LiteralMatcher16(prefix.c_str(), foldMask);
+}
+#endif
+
+static RE2::Options getRE2Options(unsigned int options)
+{
+	RE2::Options opts;
+	opts.set_posix_syntax(true);
+	opts.set_perl_classes(true);
+	opts.set_word_boundary(true);
+	opts.set_one_line(false);
+	opts.set_never_nl(true);
+	opts.set_literal((options & RO_LITERAL) != 0);
+	opts.set_log_errors(false);
+
+	return opts;
+}
+
 class RE2Regex: public Regex
 {
 public:
-	RE2Regex(const char* string, unsigned int options): casefold(false)
+	RE2Regex(const char* source, unsigned int options): casefold(false), foldInPlace(false)
 	{
-		RE2::Options opts;
-		opts.set_posix_syntax(true);
-		opts.set_perl_classes(true);
-		opts.set_word_boundary(true);
-		opts.set_one_line(false);
-		opts.set_never_nl(true);
-		opts.set_literal((options & RO_LITERAL) != 0);
-		opts.set_log_errors(false);
+		std::string wordPattern;
+
+		if (options & RO_WORD)
+		{
+			wordPattern = getWordPattern(source, options);
+			options &= ~RO_LITERAL;
+		}
+
+		const char* string = (options & RO_WORD) ? wordPattern.c_str() : source;
+
+		identifiersValid = getPatternIdentifiers(string, options, identifiers);
+
+		RE2::Options opts = getRE2Options(options);
 		
 		std::string pattern;
 		if ((options & RO_IGNORECASE) && transformRegexCasefold(string, pattern, (options & RO_LITERAL) != 0))
@@ -255,23 +479,24 @@ public:
 		
 		re.reset(new RE2(pattern, opts));
 		if (!re->ok())
-			throw std::runtime_error("Error parsing regular expression " + (string + (": " + re->error())));
+			throw std::runtime_error("Error parsing regular expression " + (source + (": " + re->error())));
 
 		std::string prefix = getPrefix(re.get(), 128);
 
 	#if defined(USE_SSE2) || defined(USE_NEON)
-		if (prefix.length() == 1)
-			matcher.reset(new LiteralMatcher1(prefix.c_str()));
-		else if (prefix.length() > 1)
-			matcher.reset(new LiteralMatcher16(prefix.c_str()));
+		if (!prefix.empty())
+		{
+			foldInPlace = casefold && (options & RO_FOLDINPLACE) != 0;
+			matcher.reset(createLiteralMatcher(prefix, foldInPlace));
+		}
 	#endif
 	}
 	
-	virtual const char* rangePrepare(const char* data, size_t size)
+	virtual const char* rangePrepare(const char* data, size_t size, RegexBuffer* buffer)
 	{
-		if (casefold)
+		if (casefold && !foldInPlace)
 		{
-			char* temp = new char[size];
+			char* temp = buffer ? buffer->get(size) : new char[size];
 			casefoldRange(temp, data, data + size);
 			return temp;
 		}
@@ -281,6 +506,9 @@ public:
 
 	virtual RegexMatch rangeSearch(const char* data, size_t size)
 	{
+		if (foldInPlace)
+			return rangeSearchFolded(data, size);
+
 		size_t offset = 0;
 
 		if (matcher)
@@ -300,9 +528,9 @@ public:
 		return RegexMatch();
 	}
 	
-	virtual void rangeFinalize(const char* data)
+	virtual void rangeFinalize(const char* data, RegexBuffer* buffer)
 	{
-		if (casefold)
+		if (casefold && !foldInPlace && !buffer)
 		{
 			delete[] data;
 		}
@@ -310,9 +538,9 @@ public:
 
 	virtual RegexMatch search(const char* data, size_t size)
 	{
-		const char* range = rangePrepare(data, size);
+		const char* range = rangePrepare(data, size, nullptr);
 		RegexMatch result = rangeSearch(range, size);
-		rangeFinalize(range);
+		rangeFinalize(range, nullptr);
 
 		return result ? RegexMatch(result.data - range + data, result.size) : RegexMatch();
 	}
@@ -323,7 +551,7 @@ public:
 
 		if (prf && prf->op() != re2::Prefilter::NONE)
 		{
-			prefilter.reset(new re2::PrefilterTree());
+			prefilter.reset(new re2::PrefilterTree(kChunkIndexMinAtomLength));
 			prefilter->Add(prf.release());
 
 			std::vector<std::string> result;
@@ -350,15 +578,70 @@ public:
 		assert(result.size() <= 1);
 		return !result.empty();
 	}
+
+	virtual bool getIdentifiers(std::vector<std::string>& result)
+	{
+		result = identifiers;
+
+		return identifiersValid;
+	}
 	
 private:
+	RegexMatch rangeSearchFolded(const char* data, size_t size)
+	{
+		size_t offset = 0;
+
+		while (offset < size)
+		{
+			size_t start = offset;
+
+			// matcher compares casefolded data so the candidates are a superset of actual prefix matches
+			offset += matcher->match(data + offset, size - offset);
+			assert(offset <= size);
+
+			if (offset == size) break;
+
+			// matches never span lines (never_nl) so we only need to casefold the line with the candidate
+			const char* lbeg = findLineStart(data + start, data + offset);
+			const char* lend = findLineEnd(data + offset, data + size);
+
+			if (RegexMatch match = matchLine(lbeg, lend - lbeg, data + offset - lbeg))
+				return match;
+
+			offset = lend - data + 1;
+		}
+
+		return RegexMatch();
+	}
+
+	RegexMatch matchLine(const char* data, size_t size, size_t offset)
+	{
+		char buffer[1024];
+		std::unique_ptr<char[]> heap(size > sizeof(buffer) ? new char[size] : nullptr);
+		char* temp = heap ? heap.get() : buffer;
+
+		casefoldRange(temp, data, data + size);
+
+		re2::StringPiece p(temp, size);
+		re2::StringPiece match;
+
+		if (re->Match(p, offset, size, re2::RE2::UNANCHORED, &match, 1))
+			return RegexMatch(match.data() - temp + data, match.size());
+
+		return RegexMatch();
+	}
+
 	std::unique_ptr<RE2> re;
 	bool casefold;
+	bool foldInPlace;
 
 	std::unique_ptr<LiteralMatcher> matcher;
 
 	std::unique_ptr<re2::PrefilterTree> prefilter;
 
+	std::vector<std::string> identifiers;
+	bool identifiersValid;
+
 	static std::string getPrefix(RE2* re, size_t maxlen)
 	{
 		std::string min, max;
@@ -388,7 +671,97 @@ RegexMatch::operator bool() const
 	return data != 0;
 }
 
+class RE2RegexSet: public RegexSet
+{
+public:
+	RE2RegexSet(const std::vector<std::string>& patterns, unsigned int options): casefold((options & RO_IGNORECASE) != 0)
+	{
+		// word patterns wrap literals in regex syntax
+		unsigned int patternOptions = (options & RO_WORD) ? options & ~RO_LITERAL : options;
+
+		set.reset(new RE2::Set(getRE2Options(patternOptions), RE2::UNANCHORED));
+
+		for (size_t i = 0; i < patterns.size(); ++i)
+		{
+			std::string source = (options & RO_WORD) ? getWordPattern(patterns[i].c_str(), options) : patterns[i];
+			std::string pattern = source;
+
+			// case-insensitive patterns are matched against casefolded data, same as RE2Regex
+			if (casefold && !transformRegexCasefold(source.c_str(), pattern, (patternOptions & RO_LITERAL) != 0))
+			{
+				unchecked.push_back(i);
+				continue;
+			}
+
+			int index = set->Add(pattern, nullptr);
+
+			if (index < 0)
+			{
+				unchecked.push_back(i);
+				continue;
+			}
+
+			assert(size_t(index) == setPatterns.size());
+			setPatterns.push_back(i);
+		}
+
+		if (!setPatterns.empty() && !set->Compile())
+		{
+			unchecked.insert(unchecked.end(), setPatterns.begin(), setPatterns.end());
+			setPatterns.clear();
+		}
+
+		std::sort(unchecked.begin(), unchecked.end());
+	}
+
+	virtual bool match(const char* data, size_t size, std::vector<int>& result, RegexBuffer* buffer)
+	{
+		result = unchecked;
+
+		if (setPatterns.empty())
+			return unchecked.empty();
+
+		std::unique_ptr<char[]> heap(casefold && !buffer ? new char[size] : nullptr);
+		char* temp = !casefold ? nullptr : buffer ? buffer->get(size) : heap.get();
+
+		if (temp)
+			casefoldRange(temp, data, data + size);
+
+		std::vector<int> matches;
+		RE2::Set::ErrorInfo error;
+		bool exact = unchecked.empty();
+
+		if (set->Match(re2::StringPiece(temp ? temp : data, size), &matches, &error))
+		{
+			for (auto index: matches)
+				result.push_back(setPatterns[index]);
+		}
+		else if (error.kind != RE2::Set::kNoError)
+		{
+			// DFA ran out of memory; we don't know which patterns match so all of them have to be searched
+			result.insert(result.end(), setPatterns.begin(), setPatterns.end());
+			exact = false;
+		}
+
+		std::sort(result.begin(), result.end());
+
+		return exact;
+	}
+
+private:
+	std::unique_ptr<RE2::Set> set;
+	bool casefold;
+
+	std::vector<int> setPatterns;
+	std::vector<int> unchecked;
+};
+
 Regex* createRegex(const char* pattern, unsigned int options)
 {
 	return new RE2Regex(pattern, options);
 }
+
+RegexSet* createRegexSet(const std::vector<std::string>& patterns, unsigned int options)
+{
+	return new RE2RegexSet(patterns, options);
+}
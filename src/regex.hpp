@@ -3,11 +3,19 @@
 
 #include <vector>
 #include <string>
+#include <memory>
 
 enum RegexOptions
 {
 	RO_IGNORECASE = 1 << 0,
 	RO_LITERAL = 1 << 1,
+
+	// case-insensitive searches casefold only the lines around prefix matches instead of the entire range; this is
+	// faster when matches are sparse but makes repeated searches within one long line expensive
+	RO_FOLDINPLACE = 1 << 2,
+
+	// only matches whole words: the pattern (or the literal) is wrapped in word boundaries
+	RO_WORD = 1 << 3,
 };
 
 struct RegexMatch
@@ -21,19 +29,61 @@ struct RegexMatch
 	operator bool() const;
 };
 
+// Memory for casefolded copies of the searched data that is reused between searches; it keeps the largest size it was used with
+class RegexBuffer
+{
+public:
+	RegexBuffer(): capacity(0)
+	{
+	}
+
+	char* get(size_t size)
+	{
+		if (size > capacity)
+		{
+			data.reset(new char[size]);
+			capacity = size;
+		}
+
+		return data.get();
+	}
+
+private:
+	std::unique_ptr<char[]> data;
+	size_t capacity;
+
+	RegexBuffer(const RegexBuffer&);
+	RegexBuffer& operator=(const RegexBuffer&);
+};
+
 class Regex
 {
 public:
 	virtual ~Regex() {}
 
-	virtual const char* rangePrepare(const char* data, size_t size) = 0;
+	// Prepared range can be a casefolded copy of the data; the copy is placed in the buffer if one is given, which has to be passed to rangeFinalize as well
+	virtual const char* rangePrepare(const char* data, size_t size, RegexBuffer* buffer = nullptr) = 0;
 	virtual RegexMatch rangeSearch(const char* data, size_t size) = 0;
-	virtual void rangeFinalize(const char* data) = 0;
+	virtual void rangeFinalize(const char* data, RegexBuffer* buffer = nullptr) = 0;
 
 	virtual RegexMatch search(const char* data, size_t size) = 0;
 
 	virtual std::vector<std::string> prefilterPrepare() = 0;
 	virtual bool prefilterMatch(const std::vector<int>& matches) = 0;
+
+	// Identifiers that every match is one of, if the pattern is a word-bounded literal or an alternation of them (like \bfoo\b or \b(foo|bar)\b)
+	virtual bool getIdentifiers(std::vector<std::string>& result) = 0;
+};
+
+class RegexSet
+{
+public:
+	virtual ~RegexSet() {}
+
+	// Returns sorted indices of patterns that may match somewhere in the range; patterns that can't be checked are always returned
+	// The result is true if all returned patterns were checked, in which case the indices are exactly the patterns that match
+	virtual bool match(const char* data, size_t size, std::vector<int>& result, RegexBuffer* buffer = nullptr) = 0;
 };
 
-Regex* createRegex(const char* pattern, unsigned int options);
\ No newline at end of file
+Regex* createRegex(const char* pattern, unsigned int options);
+RegexSet* createRegexSet(const std::vector<std::string>& patterns, unsigned int options);
\ No newline at end of file
@@ -5,41 +5,223 @@
 #include "output.hpp"
 #include "format.hpp"
 #include "fileutil.hpp"
-#include "filestream.hpp"
+#include "datafile.hpp"
 #include "workqueue.hpp"
 #include "regex.hpp"
 #include "orderedoutput.hpp"
 #include "constants.hpp"
+#include "budget.hpp"
 #include "blockpool.hpp"
 #include "stringutil.hpp"
+#include "encoding.hpp"
 #include "bloom.hpp"
 #include "casefold.hpp"
 #include "highlight.hpp"
 #include "compression.hpp"
 #include "changes.hpp"
+#include "slices.hpp"
+#include "postings.hpp"
+#include "filter.hpp"
+#include "trace.hpp"
+#include "ngrams.hpp"
 
 #include <algorithm>
 #include <memory>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <map>
+#include <list>
+#include <unordered_map>
+
+#include <string.h>
+
+// Per-file summaries are produced for each part of a file; a file split between chunks is reported in adjacent chunks, so adjacent entries are merged here
+// Entries have the form tag\0path\0count\n; entries are adjacent per tag (query), so merging happens separately for every tag
+class FileSummaryOutput: public Output
+{
+public:
+	FileSummaryOutput(Output* output, unsigned int options): output(output), options(options)
+	{
+	}
+
+	virtual void rawprint(const char* data, size_t size)
+	{
+		const char* end = data + size;
+
+		while (data < end)
+		{
+			const char* tagEnd = static_cast<const char*>(memchr(data, 0, end - data));
+			const char* pathEnd = tagEnd ? static_cast<const char*>(memchr(tagEnd + 1, 0, end - tagEnd - 1)) : nullptr;
+			const char* lineEnd = pathEnd ? static_cast<const char*>(memchr(pathEnd + 1, '\n', end - pathEnd - 1)) : nullptr;
+
+			assert(lineEnd);
+			if (!lineEnd) break;
+
+			Entry& entry = pending[std::string(data, tagEnd)];
+
+			if (entry.path.compare(0, std::string::npos, tagEnd + 1, pathEnd - tagEnd - 1) != 0)
+			{
+				print(entry);
+
+				entry.path.assign(tagEnd + 1, pathEnd);
+				entry.count = 0;
+			}
+
+			entry.count += strtoul(pathEnd + 1, nullptr, 10);
+
+			data = lineEnd + 1;
+		}
+	}
+
+	virtual void print(const char* message, ...)
+	{
+		va_list l;
+		va_start(l, message);
+		std::string result;
+		strprintf(result, message, l);
+		va_end(l);
+
+		output->rawprint(result.c_str(), result.size());
+	}
+
+	virtual void error(const char* message, ...)
+	{
+		va_list l;
+		va_start(l, message);
+		std::string result;
+		strprintf(result, message, l);
+		va_end(l);
+
+		output->error("%s", result.c_str());
+	}
+
+	virtual bool isTTY()
+	{
+		return output->isTTY();
+	}
+
+	virtual bool isCancelled()
+	{
+		return output->isCancelled();
+	}
+
+	void flush()
+	{
+		for (auto& p: pending)
+			print(p.second);
+
+		pending.clear();
+	}
+
+private:
+	struct Entry
+	{
+		std::string path;
+		unsigned int count;
+	};
+
+	void print(const Entry& entry)
+	{
+		if (entry.path.empty())
+			return;
+
+		std::string result = entry.path;
+
+		if (options & SO_COUNT)
+		{
+			if (options & SO_HIGHLIGHT) result += kHighlightSeparator;
+			result += (options & SO_VISUALSTUDIO) ? ": " : ":";
+			if (options & SO_HIGHLIGHT) result += kHighlightNumber;
+			result += std::to_string(entry.count);
+			if (options & SO_HIGHLIGHT) result += kHighlightEnd;
+		}
+
+		result += '\n';
+
+		output->rawprint(result.c_str(), result.size());
+	}
+
+	Output* output;
+	unsigned int options;
+	std::map<std::string, Entry> pending;
+};
 
 struct SearchOutput
 {
-	SearchOutput(Output* output, unsigned int options, unsigned int limit): options(options), limit(limit), output(output, kMaxBufferedOutput, kBufferedOutputFlushThreshold, limit)
+	SearchOutput(Output* output, unsigned int options, unsigned int limit)
+		: options(options), limit(limit), target(output), summary(output, options)
+		, output((options & (SO_COUNT | SO_FILESONLY)) ? &summary : output, getBufferedOutputLimit(), kBufferedOutputFlushThreshold, limit, kBufferedOutputChunks, (options & (SO_UNORDERED | SO_COUNT | SO_FILESONLY)) == SO_UNORDERED)
+	{
+	}
+
+	// no further output can be produced once the limit is reached or the caller gives up on the query
+	bool isCancelled() const
 	{
+		return output.getLineCount() >= limit || target->isCancelled();
 	}
 
 	bool isLimitReached(OrderedOutput::Chunk* outputChunk = nullptr) const
 	{
-		return (outputChunk && outputChunk->lines >= limit) || output.getLineCount() >= limit;
+		return (outputChunk && outputChunk->lines >= limit) || isCancelled();
 	}
 
 	unsigned int options;
 	unsigned int limit;
+	Output* target;
+	FileSummaryOutput summary;
 	OrderedOutput output;
 };
 
-struct HighlightBuffer
+// Buffers that a worker reuses for all chunks it searches, so that searches stop allocating once the buffers are large enough
+struct SearchScratch
+{
+	std::vector<HighlightRange> ranges;
+
+	// the chunk range stays prepared while changed files are searched, so they need a buffer of their own
+	RegexBuffer chunkRange;
+	RegexBuffer fileRange;
+
+	std::string path;
+	std::vector<int> matches;
+
+	// counters and stage times of the work done with this scratch, which are added to the search statistics once the workers are done
+	SearchStatistics statistics;
+};
+
+// Match in a stored file that is reported again for every reference to the file once the file is done
+struct AliasMatch
+{
+	const char* line;
+	size_t lineLength;
+	unsigned int lineNumber;
+
+	size_t matchOffset;
+	size_t matchLength;
+
+	// highlight ranges of the line in ChunkAliases::ranges
+	size_t rangeOffset;
+	size_t rangeCount;
+};
+
+// References to the files of a chunk; matches in a stored file are reported for the file and for the paths that refer to it
+struct ChunkAliases
 {
+	const DataFileAliasEntry* begin;
+	const DataFileAliasEntry* end;
+	const char* names;
+
+	// aliases that pass the path filters and are not read from disk, and files that are only searched for their aliases
+	std::vector<char> reported;
+	std::vector<char> hidden;
+
+	std::vector<AliasMatch> matches;
 	std::vector<HighlightRange> ranges;
+
+	ChunkAliases(): begin(nullptr), end(nullptr), names(nullptr)
+	{
+	}
 };
 
 static char* printString(char* dest, const char* src)
@@ -107,56 +289,199 @@ static size_t printMatchLineColumn(unsigned int line, size_t matchOffset, size_t
 	return pos - buf;
 }
 
-static void printHighlightMatch(std::string& result, Regex* re, HighlightBuffer& hlbuf, const char* line, size_t lineLength, const char* preparedRange, size_t matchOffset, size_t matchLength)
+// Returns the part of the line that is printed for the match with windowed output; the window is centered on the match and doesn't split UTF-8 sequences
+static std::pair<size_t, size_t> getMatchWindow(const char* line, size_t lineLength, size_t matchOffset, size_t matchLength)
+{
+	if (lineLength <= kMatchWindowSize)
+		return std::make_pair(0, lineLength);
+
+	size_t context = (kMatchWindowSize - std::min(matchLength, kMatchWindowSize)) / 2;
+	size_t begin = std::min(matchOffset - std::min(matchOffset, context), lineLength - kMatchWindowSize);
+	size_t end = begin + kMatchWindowSize;
+
+	while (begin < matchOffset && (line[begin] & 0xc0) == 0x80) begin++;
+	while (end > matchOffset + matchLength && end < lineLength && (line[end] & 0xc0) == 0x80) end--;
+
+	return std::make_pair(begin, end);
+}
+
+// Highlighting only needs to search the printed part of the line; the search can't continue to the next match if it stops there
+static const char* getHighlightSearchEnd(unsigned int options, const char* lbeg, const char* lend, const char* end, const RegexMatch& match)
+{
+	if ((options & SO_WINDOW) == 0)
+		return end;
+
+	const char* wend = lbeg + getMatchWindow(lbeg, lend - lbeg, match.data - lbeg, match.size).second;
+
+	return wend < lend ? wend : end;
+}
+
+// Collects highlight ranges for all matches on the line of the match; the search doesn't stop at the end of the line, so the first match after it is returned to be processed next
+static RegexMatch collectLineMatches(Regex* re, std::vector<HighlightRange>& ranges, const char* lbeg, const char* lend, const char* end, const RegexMatch& match)
+{
+	ranges.clear();
+	ranges.push_back(HighlightRange(match.data - lbeg, match.size));
+
+	const char* begin = std::min(match.data + match.size, end);
+
+	for (;;)
+	{
+		RegexMatch next = re->rangeSearch(begin, end - begin);
+
+		if (!next || next.data > lend)
+			return next;
+
+		if (next.size > 0)
+		{
+			ranges.push_back(HighlightRange(next.data - lbeg, next.size));
+			begin = next.data + next.size;
+		}
+		else if (next.data == end)
+			return RegexMatch();
+		else
+			begin = next.data + 1;
+	}
+}
+
+// Makes highlight ranges relative to the window and removes the ones that are outside of it
+static void clipHighlightRanges(std::vector<HighlightRange>& ranges, size_t begin, size_t end)
 {
-	hlbuf.ranges.clear();
-	hlbuf.ranges.push_back(HighlightRange(matchOffset, matchLength));
-	highlightRegex(hlbuf.ranges, re, line, lineLength, preparedRange, matchOffset + matchLength);
+	size_t result = 0;
+
+	for (auto& r: ranges)
+	{
+		size_t rbegin = std::max(r.first, begin);
+		size_t rend = std::min(r.first + r.second, end);
+
+		if (rbegin < rend || (rbegin == rend && r.second == 0))
+			ranges[result++] = HighlightRange(rbegin - begin, rend - rbegin);
+	}
 
-	highlight(result, line, lineLength, hlbuf.ranges.empty() ? nullptr : &hlbuf.ranges[0], hlbuf.ranges.size(), kHighlightMatch);
+	ranges.resize(result);
 }
 
-static void processMatch(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
+// Highlight ranges of the line are in scratch.ranges if matches are highlighted
+static void processMatch(const char* tag, SearchOutput* output, OrderedOutput::Chunk* outputChunk, SearchScratch& scratch,
 	const char* path, size_t pathLength, const char* line, size_t lineLength, unsigned int lineNumber,
-	const char* preparedRange, size_t matchOffset, size_t matchLength)
+	size_t matchOffset, size_t matchLength)
 {
 	if (output->options & SO_VISUALSTUDIO)
 	{
-		char* buffer = static_cast<char*>(alloca(pathLength));
-		
-		std::transform(path, path + pathLength, buffer, BackSlashTransformer());
-		path = buffer;
+		scratch.path.assign(path, pathLength);
+
+		std::transform(scratch.path.begin(), scratch.path.end(), scratch.path.begin(), BackSlashTransformer());
+		path = scratch.path.c_str();
 	}
 
 	char linecolumn[256];
 	size_t linecolumnsize = printMatchLineColumn(lineNumber, matchOffset, matchLength, output->options, linecolumn);
 
+	if (tag)
+	{
+		outputChunk->result += tag;
+		outputChunk->result += ':';
+	}
+
 	if (output->options & SO_HIGHLIGHT) outputChunk->result += kHighlightPath;
 	outputChunk->result.append(path, pathLength);
 	outputChunk->result.append(linecolumn, linecolumnsize);
 	if (output->options & SO_HIGHLIGHT) outputChunk->result += kHighlightEnd;
 
+	std::pair<size_t, size_t> window = (output->options & SO_WINDOW) ? getMatchWindow(line, lineLength, matchOffset, matchLength) : std::make_pair(size_t(0), lineLength);
+
+	if (window.first > 0) outputChunk->result += "...";
+
 	if (output->options & SO_HIGHLIGHT_MATCHES)
-		printHighlightMatch(outputChunk->result, re, hlbuf, line, lineLength, preparedRange, matchOffset, matchLength);
+	{
+		if (window.second - window.first < lineLength)
+			clipHighlightRanges(scratch.ranges, window.first, window.second);
+
+		highlight(outputChunk->result, line + window.first, window.second - window.first, scratch.ranges.empty() ? nullptr : &scratch.ranges[0], scratch.ranges.size(), kHighlightMatch);
+	}
+	else
+		outputChunk->result.append(line + window.first, window.second - window.first);
+
+	if (window.second < lineLength) outputChunk->result += "...";
+
+	outputChunk->result += '\n';
+
+	output->output.write(outputChunk);
+}
+
+static void processFileSummary(const char* tag, SearchOutput* output, OrderedOutput::Chunk* outputChunk, const char* path, size_t pathLength, unsigned int count)
+{
+	if (tag)
+	{
+		outputChunk->result += tag;
+		outputChunk->result.push_back(0);
+		outputChunk->result += tag;
+		outputChunk->result += ':';
+	}
 	else
-		outputChunk->result.append(line, lineLength);
+		outputChunk->result.push_back(0);
 
+	if (output->options & SO_HIGHLIGHT) outputChunk->result += kHighlightPath;
+
+	if (output->options & SO_VISUALSTUDIO)
+		std::transform(path, path + pathLength, std::back_inserter(outputChunk->result), BackSlashTransformer());
+	else
+		outputChunk->result.append(path, pathLength);
+
+	if (output->options & SO_HIGHLIGHT) outputChunk->result += kHighlightEnd;
+
+	outputChunk->result.push_back(0);
+	outputChunk->result += std::to_string(count);
 	outputChunk->result += '\n';
 
 	output->output.write(outputChunk);
 }
 
-static void processFileData(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
+// Counts matching lines without formatting them; files-only searches stop at the first match
+static unsigned int countFileMatches(Regex* re, SearchOutput* output, const char* begin, const char* end)
+{
+	unsigned int count = 0;
+
+	while (RegexMatch match = re->rangeSearch(begin, end - begin))
+	{
+		// discard zero-length matches at the end (.* results in an extra line for every file part otherwise)
+		if (match.data == end) break;
+
+		count++;
+
+		if (output->options & SO_FILESONLY) break;
+
+		// move to next line
+		const char* lend = findLineEnd(match.data + match.size, end);
+		if (lend == end) break;
+		begin = lend + 1;
+	}
+
+	return count;
+}
+
+static void processFileData(Regex* re, const char* tag, SearchOutput* output, OrderedOutput::Chunk* outputChunk, SearchScratch& scratch,
 	const char* path, size_t pathLength, const char* data, size_t size, unsigned int startLine)
 {
-	const char* range = re->rangePrepare(data, size);
+	const char* range = re->rangePrepare(data, size, &scratch.fileRange);
+
+	if (output->options & (SO_COUNT | SO_FILESONLY))
+	{
+		if (unsigned int count = countFileMatches(re, output, range, range + size))
+			processFileSummary(tag, output, outputChunk, path, pathLength, count);
+
+		re->rangeFinalize(range, &scratch.fileRange);
+		return;
+	}
 
 	const char* begin = range;
 	const char* end = begin + size;
 
 	unsigned int line = startLine;
 
-	while (RegexMatch match = re->rangeSearch(begin, end - begin))
+	bool highlightMatches = (output->options & SO_HIGHLIGHT_MATCHES) != 0;
+	RegexMatch match = re->rangeSearch(begin, end - begin);
+
+	while (match)
 	{
 		// discard zero-length matches at the end (.* results in an extra line for every file part otherwise)
 		if (match.data == end) break;
@@ -167,7 +492,10 @@ static void processFileData(Regex* re, SearchOutput* output, OrderedOutput::Chun
 		// print match
 		const char* lbeg = findLineStart(begin, match.data);
 		const char* lend = findLineEnd(match.data + match.size, end);
-		processMatch(re, output, outputChunk, hlbuf, path, pathLength, (lbeg - range) + data, lend - lbeg, line, lbeg, match.data - lbeg, match.size);
+		const char* searchEnd = getHighlightSearchEnd(output->options, lbeg, lend, end, match);
+		RegexMatch next = highlightMatches ? collectLineMatches(re, scratch.ranges, lbeg, lend, searchEnd, match) : RegexMatch();
+
+		processMatch(tag, output, outputChunk, scratch, path, pathLength, (lbeg - range) + data, lend - lbeg, line, match.data - lbeg, match.size);
 		
 		// early-out for big matches
 		if (output->isLimitReached(outputChunk)) break;
@@ -175,9 +503,10 @@ static void processFileData(Regex* re, SearchOutput* output, OrderedOutput::Chun
 		// move to next line
 		if (lend == end) break;
 		begin = lend + 1;
+		match = (highlightMatches && searchEnd == end) ? next : re->rangeSearch(begin, end - begin);
 	}
 
-	re->rangeFinalize(range);
+	re->rangeFinalize(range, &scratch.fileRange);
 }
 
 static int comparePath(const std::string& path, const char* data, size_t size)
@@ -196,173 +525,605 @@ static bool ignorePath(const char* path, size_t size, Regex* includeRe, Regex* e
 	return false;
 }
 
-static size_t normalizeEOL(char* data, size_t size)
+static std::pair<const DataFileAliasEntry*, const DataFileAliasEntry*> getFileAliases(const ChunkAliases& aliases, size_t file)
 {
-	// replace \r\n with \n, replace stray \r with \n
-	size_t result = 0;
+	if (aliases.begin == aliases.end)
+		return std::make_pair(aliases.end, aliases.end);
 
-	for (size_t i = 0; i < size; ++i)
-	{
-		if (data[i] == '\r')
-		{
-			data[result++] = '\n';
-			if (i + 1 < size && data[i + 1] == '\n') i++;
-		}
-		else
-			data[result++] = data[i];
-	}
+	DataFileAliasEntry key = {};
+	key.fileIndex = file;
 
-	return result;
+	return std::equal_range(aliases.begin, aliases.end, key, [](const DataFileAliasEntry& l, const DataFileAliasEntry& r) { return l.fileIndex < r.fileIndex; });
 }
 
-static void processChangedFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf, const std::string& path, Regex* includeRe, Regex* excludeRe)
+static bool hasReportedAliases(const ChunkAliases& aliases, size_t file)
 {
-	if (ignorePath(path.c_str(), path.size(), includeRe, excludeRe))
-		return;
+	auto range = getFileAliases(aliases, file);
 
-	std::unique_ptr<FILE, int(*)(FILE*)> file(openFile(path.c_str(), "rb"), fclose);
-	if (!file)
-		return;
+	for (auto it = range.first; it != range.second; ++it)
+		if (aliases.reported[it - aliases.begin])
+			return true;
 
-	fseek(file.get(), 0, SEEK_END);
-	size_t length = ftell(file.get());
-	fseek(file.get(), 0, SEEK_SET);
+	return false;
+}
 
-	std::unique_ptr<char[]> data(new (std::nothrow) char[length]);
-	if (!data)
-		return;
+static bool isFileHidden(const ChunkAliases& aliases, size_t file)
+{
+	return !aliases.hidden.empty() && aliases.hidden[file];
+}
 
-	if (fread(data.get(), 1, length, file.get()) != length)
-		return;
+static void processAliasMatches(const char* tag, SearchOutput* output, OrderedOutput::Chunk* outputChunk, SearchScratch& scratch, ChunkAliases& aliases, size_t file)
+{
+	auto range = getFileAliases(aliases, file);
 
-	if (ferror(file.get()) != 0)
-		return;
+	for (auto it = range.first; it != range.second && !output->isLimitReached(outputChunk); ++it)
+		if (aliases.reported[it - aliases.begin])
+			for (auto& m: aliases.matches)
+			{
+				scratch.ranges.assign(aliases.ranges.begin() + m.rangeOffset, aliases.ranges.begin() + m.rangeOffset + m.rangeCount);
+
+				processMatch(tag, output, outputChunk, scratch, aliases.names + it->nameOffset, it->nameLength, m.line, m.lineLength, m.lineNumber, m.matchOffset, m.matchLength);
 
-	size_t nlength = normalizeEOL(data.get(), length);
+				if (output->isLimitReached(outputChunk))
+					break;
+			}
 
-	processFileData(re, output, outputChunk, hlbuf, path.c_str(), path.size(), data.get(), nlength, 0);
+	aliases.matches.clear();
+	aliases.ranges.clear();
 }
 
-static void processChunkFile(Regex* re, SearchOutput* output, OrderedOutput::Chunk* outputChunk, HighlightBuffer& hlbuf,
-	const char* path, size_t pathLength, const char* data, size_t size, unsigned int startLine, Regex* includeRe, Regex* excludeRe)
+static void processFileSummaries(const char* tag, SearchOutput* output, OrderedOutput::Chunk* outputChunk, const DataChunkFileHeader* files, const char* data, const ChunkAliases& aliases, size_t file, unsigned int count)
 {
-	if (ignorePath(path, pathLength, includeRe, excludeRe))
-		return;
+	if (!isFileHidden(aliases, file))
+		processFileSummary(tag, output, outputChunk, data + files[file].nameOffset, files[file].nameLength, count);
 
-	processFileData(re, output, outputChunk, hlbuf, path, pathLength, data, size, startLine);
+	auto range = getFileAliases(aliases, file);
+
+	for (auto it = range.first; it != range.second; ++it)
+		if (aliases.reported[it - aliases.begin])
+			processFileSummary(tag, output, outputChunk, aliases.names + it->nameOffset, it->nameLength, count);
 }
 
-static void processChunk(Regex* re, SearchOutput* output, unsigned int chunkIndex, const DataChunkHeader& chunk, char* buffer, Regex* includeRe, Regex* excludeRe, const std::string* changes, size_t changeBegin, size_t changeEnd)
+// Time spent on changed files is always measured and added to the time of their project, which watchers compare with the time of an update
+static void processChangedFile(Regex* re, const char* tag, SearchOutput* output, OrderedOutput::Chunk* outputChunk, SearchScratch& scratch, ChangeOverlay* overlay, std::atomic<uint64_t>& changeTime, const std::string& path, Regex* includeRe, Regex* excludeRe)
 {
-	char* data = buffer + chunk.compressedSize;
+	if (ignorePath(path.c_str(), path.size(), includeRe, excludeRe))
+		return;
 
-	decompress(data, chunk.uncompressedSize, buffer, chunk.compressedSize);
+	uint64_t time = 0;
 
-	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+	{
+		TraceScope scope(/* timing= */ true, scratch.statistics.trace, time, "worker", "changed file");
 
-	OrderedOutput::Chunk* outputChunk = output->output.begin(chunkIndex);
+		if (std::shared_ptr<std::vector<char>> data = overlay->getFile(path))
+			processFileData(re, tag, output, outputChunk, scratch, path.c_str(), path.size(), data->data(), data->size(), 0);
+	}
 
-	HighlightBuffer hlbuf;
+	scratch.statistics.changeTime += time;
+	changeTime += time;
+}
 
-	size_t changeIndex = changeBegin;
+static size_t findChunkFile(const DataChunkFileHeader* files, size_t first, size_t last, size_t offset)
+{
+	return std::upper_bound(files + first, files + last, offset,
+		[](size_t offset, const DataChunkFileHeader& f) { return offset < f.dataOffset; }) - files - 1;
+}
 
-	for (size_t i = 0; i < chunk.fileCount; ++i)
+static void processChunkFileSummaries(Regex* re, const char* tag, SearchOutput* output, OrderedOutput::Chunk* outputChunk, const ChunkAliases& aliases,
+	const DataChunkFileHeader* files, size_t first, size_t last, const char* data, const char* range, size_t rangeOffset)
+{
+	const char* begin = range + (files[first].dataOffset - rangeOffset);
+	const char* end = range + (files[last - 1].dataOffset + files[last - 1].dataSize - rangeOffset);
+
+	size_t file = last;
+	unsigned int count = 0;
+
+	while (RegexMatch match = re->rangeSearch(begin, end - begin))
 	{
-		// early-out for big matches
-		if (output->isLimitReached(outputChunk))
-			break;
+		// discard zero-length matches at the end (.* results in an extra line for every file part otherwise)
+		if (match.data == end) break;
 
-		const DataChunkFileHeader& f = files[i];
+		size_t index = findChunkFile(files, first, last, match.data - range + rangeOffset);
 
-		while (changeIndex < changeEnd && comparePath(changes[changeIndex], data + f.nameOffset, f.nameLength) < 0)
-		{
-			processChangedFile(re, output, outputChunk, hlbuf, changes[changeIndex], includeRe, excludeRe);
-			changeIndex++;
-		}
+		const DataChunkFileHeader& f = files[index];
+		const char* fend = range + (f.dataOffset + f.dataSize - rangeOffset);
 
-		if (changeIndex < changeEnd && comparePath(changes[changeIndex], data + f.nameOffset, f.nameLength) == 0)
-		{
-			processChangedFile(re, output, outputChunk, hlbuf, changes[changeIndex], includeRe, excludeRe);
-			changeIndex++;
-		}
-		else if (f.startLine > 0 && changeIndex > 0 && comparePath(changes[changeIndex-1], data + f.nameOffset, f.nameLength) == 0)
-		{
-			// This is a suffix of a file that started in the last chunk. This means if it was present in the change lists it has to be right before
-			// our change range (due to how getNextChange works), and this means we should have processed the changed file in the previous chunk - so
-			// here we should just skip it.
-		}
-		else
+		if (index != file)
 		{
-			processChunkFile(re, output, outputChunk, hlbuf, data + f.nameOffset, f.nameLength, data + f.dataOffset, f.dataSize, f.startLine, includeRe, excludeRe);
-		}
-	}
-
-	while (changeIndex < changeEnd)
-	{
-		processChangedFile(re, output, outputChunk, hlbuf, changes[changeIndex], includeRe, excludeRe);
-		changeIndex++;
-	}
+			if (count)
+				processFileSummaries(tag, output, outputChunk, files, data, aliases, file, count);
 
-	output->output.end(outputChunk);
-}
+			if (output->isLimitReached(outputChunk))
+				return;
 
-unsigned int getRegexOptions(unsigned int options)
-{
-	return
-		(options & SO_IGNORECASE ? RO_IGNORECASE : 0) |
-		(options & SO_LITERAL ? RO_LITERAL : 0);
-}
+			file = index;
+			count = 0;
+		}
 
-typedef std::vector<unsigned int> NgramString;
+		count++;
 
-NgramString ngramExtract(const std::string& string)
-{
-	NgramString result;
+		// skip the rest of the file after the first match
+		const char* lend = (output->options & SO_FILESONLY) ? fend - 1 : findLineEnd(match.data + match.size, fend);
 
-	for (size_t i = 3; i < string.length(); ++i)
-	{
-		char a = string[i - 3], b = string[i - 2], c = string[i - 1], d = string[i];
-		unsigned int n = ngram(casefold(a), casefold(b), casefold(c), casefold(d));
-		result.push_back(n);
+		// move to next line
+		if (lend >= end - 1) break;
+		begin = lend + 1;
 	}
 
-	return result;
+	if (count)
+		processFileSummaries(tag, output, outputChunk, files, data, aliases, file, count);
 }
 
-bool ngramExists(const std::vector<unsigned char>& index, unsigned int iterations, const NgramString& search)
+static void processChunkFiles(Regex* re, const char* tag, SearchOutput* output, OrderedOutput::Chunk* outputChunk, SearchScratch& scratch, ChunkAliases& aliases,
+	const DataChunkFileHeader* files, size_t first, size_t last, const char* data, const char* range, size_t rangeOffset)
 {
-	for (size_t i = 0; i < search.size(); ++i)
-		if (!bloomFilterExists(&index[0], index.size(), search[i], iterations))
-			return false;
+	if (first == last || output->isLimitReached(outputChunk))
+		return;
 
-	return true;
-}
+	if (output->options & (SO_COUNT | SO_FILESONLY))
+		return processChunkFileSummaries(re, tag, output, outputChunk, aliases, files, first, last, data, range, rangeOffset);
 
-class NgramRegex
-{
-public:
-	NgramRegex(Regex* re): re(re)
-	{
-		if (!re) return;
+	// files are consecutive in chunk data and end with a newline, so we can search them at once and map matches back to files
+	const char* begin = range + (files[first].dataOffset - rangeOffset);
+	const char* end = range + (files[last - 1].dataOffset + files[last - 1].dataSize - rangeOffset);
 
-		std::vector<std::string> atomstr = re->prefilterPrepare();
+	size_t file = last;
+	unsigned int line = 0;
 
-		for (size_t i = 0; i < atomstr.size(); ++i)
-			atoms.push_back(ngramExtract(atomstr[i]));
-	}
+	// matches in files with references are collected and reported for the references after the file is done
+	bool reportFile = true;
+	bool collectMatches = false;
+
+	bool highlightMatches = (output->options & SO_HIGHLIGHT_MATCHES) != 0;
+	RegexMatch match = re->rangeSearch(begin, end - begin);
 
-	bool match(const std::vector<unsigned char>& index, unsigned int iterations) const
+	while (match)
 	{
-		if (atoms.empty()) return true;
+		// discard zero-length matches at the end (.* results in an extra line for every file part otherwise)
+		if (match.data == end) break;
 
-		std::vector<int> matched;
+		size_t matchOffset = match.data - range + rangeOffset;
 
-		for (size_t i = 0; i < atoms.size(); ++i)
-			if (ngramExists(index, iterations, atoms[i]))
-				matched.push_back(i);
+		size_t index = findChunkFile(files, first, last, matchOffset);
 
-		return re->prefilterMatch(matched);
-	}
+		const DataChunkFileHeader& f = files[index];
+		const char* fbegin = range + (f.dataOffset - rangeOffset);
+		const char* fend = fbegin + f.dataSize;
+
+		// restart line counter at file boundaries
+		if (index != file)
+		{
+			assert(begin <= fbegin);
+
+			if (collectMatches)
+				processAliasMatches(tag, output, outputChunk, scratch, aliases, file);
+
+			if (output->isLimitReached(outputChunk)) break;
+
+			file = index;
+			line = f.startLine;
+			begin = fbegin;
+
+			reportFile = !isFileHidden(aliases, index);
+			collectMatches = hasReportedAliases(aliases, index);
+		}
+
+		// update line counter
+		line += 1 + countLines(begin, match.data);
+
+		// print match
+		const char* lbeg = findLineStart(begin, match.data);
+		const char* lend = findLineEnd(match.data + match.size, fend);
+		const char* searchEnd = getHighlightSearchEnd(output->options, lbeg, lend, end, match);
+		RegexMatch next = highlightMatches ? collectLineMatches(re, scratch.ranges, lbeg, lend, searchEnd, match) : RegexMatch();
+
+		if (collectMatches)
+		{
+			AliasMatch am = { (lbeg - range) + rangeOffset + data, size_t(lend - lbeg), line, size_t(match.data - lbeg), match.size, aliases.ranges.size(), scratch.ranges.size() };
+			aliases.matches.push_back(am);
+			aliases.ranges.insert(aliases.ranges.end(), scratch.ranges.begin(), scratch.ranges.end());
+		}
+
+		if (reportFile)
+			processMatch(tag, output, outputChunk, scratch, data + f.nameOffset, f.nameLength, (lbeg - range) + rangeOffset + data, lend - lbeg, line, match.data - lbeg, match.size);
+
+		// early-out for big matches
+		if (output->isLimitReached(outputChunk)) break;
+
+		// move to next line
+		if (lend == end) break;
+		begin = lend + 1;
+		match = (highlightMatches && searchEnd == end) ? next : re->rangeSearch(begin, end - begin);
+	}
+
+	if (collectMatches)
+		processAliasMatches(tag, output, outputChunk, scratch, aliases, file);
+}
+
+static void processChunkData(Regex* re, const char* tag, SearchOutput* output, OrderedOutput::Chunk* outputChunk, SearchScratch& scratch, ChunkAliases& aliases,
+	const DataChunkHeader& chunk, const char* data, Regex* includeRe, Regex* excludeRe, ChangeOverlay* overlay, std::atomic<uint64_t>& changeTime, const std::string* changes, size_t changeBegin, size_t changeEnd)
+{
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+
+	size_t changeIndex = changeBegin;
+
+	// prepare the entire data region once; file runs are searched in place
+	size_t dataOffset = chunk.fileCount ? files[0].dataOffset : chunk.uncompressedSize;
+	const char* range = re->rangePrepare(data + dataOffset, chunk.uncompressedSize - dataOffset, &scratch.chunkRange);
+
+	size_t runBegin = 0;
+	size_t i = 0;
+
+	for (; i < chunk.fileCount; ++i)
+	{
+		// early-out for big matches
+		if (output->isLimitReached(outputChunk))
+			break;
+
+		const DataChunkFileHeader& f = files[i];
+
+		bool changed = changeIndex < changeEnd && comparePath(changes[changeIndex], data + f.nameOffset, f.nameLength) <= 0;
+		bool suffix = f.startLine > 0 && changeIndex > 0 && comparePath(changes[changeIndex-1], data + f.nameOffset, f.nameLength) == 0;
+		bool ignored = ignorePath(data + f.nameOffset, f.nameLength, includeRe, excludeRe);
+
+		// files that don't end with a newline could produce matches that span file boundaries
+		bool split = i > runBegin && files[i - 1].dataSize > 0 && data[files[i - 1].dataOffset + files[i - 1].dataSize - 1] != '\n';
+
+		if (changed || suffix || ignored || split)
+		{
+			processChunkFiles(re, tag, output, outputChunk, scratch, aliases, files, runBegin, i, data, range, dataOffset);
+			runBegin = (changed || suffix || ignored) ? i + 1 : i;
+		}
+
+		while (changeIndex < changeEnd && comparePath(changes[changeIndex], data + f.nameOffset, f.nameLength) < 0)
+		{
+			processChangedFile(re, tag, output, outputChunk, scratch, overlay, changeTime, changes[changeIndex], includeRe, excludeRe);
+			changeIndex++;
+		}
+
+		if (changeIndex < changeEnd && comparePath(changes[changeIndex], data + f.nameOffset, f.nameLength) == 0)
+		{
+			processChangedFile(re, tag, output, outputChunk, scratch, overlay, changeTime, changes[changeIndex], includeRe, excludeRe);
+			changeIndex++;
+		}
+		else if (suffix)
+		{
+			// This is a suffix of a file that started in the last chunk. This means if it was present in the change lists it has to be right before
+			// our change range (due to how getNextChange works), and this means we should have processed the changed file in the previous chunk - so
+			// here we should just skip it.
+		}
+		else if (changed && !ignored)
+		{
+			// all changes before this file were processed, so the file has to be searched separately
+			runBegin = i;
+		}
+
+		// files with references are still searched for the references if the file itself is ignored or read from disk
+		if (runBegin == i + 1 && hasReportedAliases(aliases, i))
+		{
+			aliases.hidden[i] = true;
+			runBegin = i;
+		}
+	}
+
+	processChunkFiles(re, tag, output, outputChunk, scratch, aliases, files, runBegin, i, data, range, dataOffset);
+
+	re->rangeFinalize(range, &scratch.chunkRange);
+
+	while (changeIndex < changeEnd)
+	{
+		processChangedFile(re, tag, output, outputChunk, scratch, overlay, changeTime, changes[changeIndex], includeRe, excludeRe);
+		changeIndex++;
+	}
+}
+
+struct SearchQueries
+{
+	std::vector<std::string> strings;
+	std::vector<std::unique_ptr<Regex>> regexes;
+	std::vector<std::string> tags;
+
+	// only used when there are several queries to find out which ones need to run on each chunk
+	std::unique_ptr<RegexSet> set;
+
+	const char* getTag(size_t index) const
+	{
+		return tags.empty() ? nullptr : tags[index].c_str();
+	}
+};
+
+// Data file contents that stay the same until the project is updated; the search cache keeps packs open between searches
+struct SearchPack
+{
+	std::string dataPath;
+	uint64_t timeStamp;
+	uint64_t fileSize;
+
+	// identifies chunks of this pack in the chunk cache
+	unsigned int id;
+
+	DataFileReader in;
+	std::vector<DataChunkDirectoryEntry> chunks;
+
+	std::vector<DataFileAliasEntry> aliases;
+	std::vector<char> aliasNames;
+
+	std::shared_ptr<CompressionDictionary> dictionary;
+
+	// posting lists, identifier index and slice index are only opened for queries that can use them
+	bool indicesOpened;
+	bool hasPostings;
+	bool hasSlices;
+	bool hasIdentifiers;
+	PostingIndex postings;
+	SliceIndex slices;
+	PostingIndex identifiers;
+
+	SearchPack(): timeStamp(0), fileSize(0), id(0), indicesOpened(false), hasPostings(false), hasSlices(false), hasIdentifiers(false)
+	{
+	}
+};
+
+static void getChunkAliases(ChunkAliases& result, const SearchPack& pack, size_t chunkIndex, size_t fileCount, Regex* includeRe, Regex* excludeRe, const std::vector<std::string>& changes)
+{
+	DataFileAliasEntry key = {};
+	key.chunkIndex = chunkIndex;
+
+	auto range = std::equal_range(pack.aliases.begin(), pack.aliases.end(), key, [](const DataFileAliasEntry& l, const DataFileAliasEntry& r) { return l.chunkIndex < r.chunkIndex; });
+
+	if (range.first == range.second)
+		return;
+
+	result.begin = &*range.first;
+	result.end = result.begin + (range.second - range.first);
+	result.names = pack.aliasNames.data();
+
+	result.reported.resize(result.end - result.begin);
+	result.hidden.resize(fileCount);
+
+	// references that are in the change list are read from disk when their own chunk is searched
+	for (size_t i = 0; i < result.reported.size(); ++i)
+	{
+		const DataFileAliasEntry& alias = result.begin[i];
+		const char* path = result.names + alias.nameOffset;
+
+		bool changed = std::binary_search(changes.begin(), changes.end(), std::string(path, alias.nameLength));
+
+		result.reported[i] = alias.fileIndex < fileCount && !changed && !ignorePath(path, alias.nameLength, includeRe, excludeRe);
+	}
+}
+
+unsigned int getRegexOptions(unsigned int options)
+{
+	return
+		(options & SO_IGNORECASE ? RO_IGNORECASE : 0) |
+		(options & SO_LITERAL ? RO_LITERAL : 0) |
+		(options & SO_WORD ? RO_WORD : 0);
+}
+
+typedef std::vector<unsigned int> NgramString;
+
+NgramString ngramExtract(const std::string& string)
+{
+	NgramString result;
+
+	for (size_t i = 3; i < string.length(); ++i)
+	{
+		char a = string[i - 3], b = string[i - 2], c = string[i - 1], d = string[i];
+		unsigned int n = ngram(casefold(a), casefold(b), casefold(c), casefold(d));
+		result.push_back(n);
+	}
+
+	return result;
+}
+
+// Atoms that are too short for 4-grams are looked up as one 2-gram or 3-gram, see extractShortNgrams
+NgramString ngramExtractShort(const std::string& string)
+{
+	NgramString result;
+
+	if (string.length() == 2)
+		result.push_back(ngram(0, 0, casefold(string[0]), casefold(string[1])));
+	else if (string.length() == 3)
+		result.push_back(ngram(0, casefold(string[0]), casefold(string[1]), casefold(string[2])));
+
+	return result;
+}
+
+struct NgramAtom
+{
+	std::string text;
+	NgramString ngrams;
+
+	// ngrams are short ngrams, which only some index types have
+	bool shortNgrams;
+
+	// probes for blocked indices, one set per iteration count: probes[(iterations - 1) * ngrams.size() + i]
+	std::vector<BloomBlockedProbe> probes;
+};
+
+NgramAtom ngramPrepare(const std::string& string)
+{
+	NgramAtom result;
+	result.text = string;
+	result.ngrams = ngramExtract(string);
+	result.shortNgrams = result.ngrams.empty();
+
+	if (result.shortNgrams)
+		result.ngrams = ngramExtractShort(string);
+
+	result.probes.resize(result.ngrams.size() * kBloomMaxIterations);
+
+	for (unsigned int k = 1; k <= kBloomMaxIterations; ++k)
+		for (size_t i = 0; i < result.ngrams.size(); ++i)
+			bloomBlockedProbePrepare(result.probes[(k - 1) * result.ngrams.size() + i], result.ngrams[i], k);
+
+	return result;
+}
+
+bool ngramExists(const unsigned char* index, size_t indexSize, unsigned int iterations, unsigned int type, const NgramAtom& search)
+{
+	const NgramString& ngrams = search.ngrams;
+
+	if (search.shortNgrams && type != DCI_BLOOMBLOCKED_SHORT)
+		return true;
+
+	switch (type)
+	{
+	case DCI_BLOOM:
+		for (size_t i = 0; i < ngrams.size(); ++i)
+			if (!bloomFilterExists(index, indexSize, ngrams[i], iterations))
+				return false;
+
+		return true;
+
+	case DCI_BLOOMBLOCKED:
+	case DCI_BLOOMBLOCKED_SHORT:
+		if (iterations < 1 || iterations > kBloomMaxIterations)
+			return true;
+
+		for (size_t i = 0; i < ngrams.size(); ++i)
+			if (!bloomBlockedFilterExists(index, indexSize, search.probes[(iterations - 1) * ngrams.size() + i]))
+				return false;
+
+		return true;
+
+	default:
+		// unknown index types can't be used to reject the chunk
+		return true;
+	}
+}
+
+class NgramRegex
+{
+public:
+	NgramRegex(Regex* re): re(re), identifiersValid(false)
+	{
+		if (!re) return;
+
+		std::vector<std::string> atomstr = re->prefilterPrepare();
+
+		for (size_t i = 0; i < atomstr.size(); ++i)
+			atoms.push_back(ngramPrepare(atomstr[i]));
+
+		identifiersValid = re->getIdentifiers(identifiers);
+
+		// long identifiers are not indexed
+		for (auto& id: identifiers)
+			if (id.size() > kIdentifierMaxLength)
+				identifiersValid = false;
+	}
+
+	bool match(const unsigned char* index, size_t indexSize, unsigned int iterations, unsigned int type) const
+	{
+		if (atoms.empty()) return true;
+
+		std::vector<int> matched;
+
+		for (size_t i = 0; i < atoms.size(); ++i)
+			if (ngramExists(index, indexSize, iterations, type, atoms[i]))
+				matched.push_back(i);
+
+		return re->prefilterMatch(matched);
+	}
+
+	// Checks if the regex may match given the indices of the atoms that are present
+	bool matchAtoms(const std::vector<int>& matched) const
+	{
+		return atoms.empty() || re->prefilterMatch(matched);
+	}
+
+	const std::vector<NgramAtom>& getAtoms() const
+	{
+		return atoms;
+	}
+
+	bool hasIdentifiers() const
+	{
+		return identifiersValid;
+	}
+
+	// Marks the chunks that contain one of the identifiers of a whole word query; fails if the query isn't one
+	bool matchIdentifiers(const PostingIndex& index, size_t chunkCount, std::vector<char>& result) const
+	{
+		if (!identifiersValid)
+			return false;
+
+		result.assign(chunkCount, false);
+
+		std::vector<unsigned int> chunks;
+
+		for (auto& id: identifiers)
+		{
+			index.find(identifierHash(id.c_str(), id.size()), chunks);
+
+			for (auto chunk: chunks)
+				if (chunk < chunkCount)
+					result[chunk] = true;
+		}
+
+		return true;
+	}
+
+	void matchSlices(const SliceIndex& index, size_t chunkCount, std::vector<char>& result) const
+	{
+		std::vector<std::vector<unsigned char>> atomChunks(atoms.size());
+
+		for (size_t i = 0; i < atoms.size(); ++i)
+		{
+			atomChunks[i].assign(index.getChunkSetSize(), 0xff);
+
+			// slices can fold indices with and without short ngrams, so short atoms can't reject anything
+			if (atoms[i].shortNgrams)
+				continue;
+
+			for (auto n: atoms[i].ngrams)
+				index.intersect(atomChunks[i], n);
+		}
+
+		matchChunkSets(atomChunks, chunkCount, result);
+	}
+
+	void matchPostings(const PostingIndex& index, size_t chunkCount, std::vector<char>& result) const
+	{
+		std::vector<std::vector<unsigned char>> atomChunks(atoms.size());
+
+		std::vector<unsigned int> chunks, list, merged;
+
+		for (size_t i = 0; i < atoms.size(); ++i)
+		{
+			NgramString ngrams = atoms[i].ngrams;
+
+			// postings only have 4-grams
+			if (ngrams.empty() || atoms[i].shortNgrams)
+			{
+				atomChunks[i].assign((chunkCount + 7) / 8, 0xff);
+				continue;
+			}
+
+			// intersect shortest lists first so that the candidate set shrinks quickly
+			std::sort(ngrams.begin(), ngrams.end(), [&](unsigned int l, unsigned int r) { return index.count(l) < index.count(r); });
+
+			index.find(ngrams[0], chunks);
+
+			for (size_t j = 1; j < ngrams.size() && !chunks.empty(); ++j)
+			{
+				index.find(ngrams[j], list);
+
+				merged.clear();
+				std::set_intersection(chunks.begin(), chunks.end(), list.begin(), list.end(), std::back_inserter(merged));
+				chunks.swap(merged);
+			}
+
+			atomChunks[i].assign((chunkCount + 7) / 8, 0);
+
+			for (auto chunk: chunks)
+				if (chunk < chunkCount)
+					atomChunks[i][chunk / 8] |= 1 << (chunk % 8);
+		}
+
+		matchChunkSets(atomChunks, chunkCount, result);
+	}
 
 	bool empty() const
 	{
@@ -370,135 +1131,1574 @@ public:
 	}
 
 private:
-	std::vector<NgramString> atoms;
+	std::vector<NgramAtom> atoms;
 	Regex* re;
+
+	std::vector<std::string> identifiers;
+	bool identifiersValid;
+
+	void matchChunkSets(const std::vector<std::vector<unsigned char>>& atomChunks, size_t chunkCount, std::vector<char>& result) const
+	{
+		result.resize(chunkCount);
+
+		std::vector<int> matched;
+
+		for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+		{
+			matched.clear();
+
+			for (size_t i = 0; i < atoms.size(); ++i)
+				if (atomChunks[i][chunk / 8] & (1 << (chunk % 8)))
+					matched.push_back(i);
+
+			result[chunk] = re->prefilterMatch(matched);
+		}
+	}
 };
 
-size_t getNextChange(const std::vector<std::string>& changes, size_t changeIt, const char* data, size_t size)
+// Chunks have to be searched if any of the queries may match
+class NgramRegexList
+{
+public:
+	NgramRegexList(const std::vector<Regex*>& res)
+	{
+		for (auto re: res)
+			items.emplace_back(re);
+	}
+
+	bool match(const unsigned char* index, size_t indexSize, unsigned int iterations, unsigned int type) const
+	{
+		for (auto& item: items)
+			if (item.match(index, indexSize, iterations, type))
+				return true;
+
+		return false;
+	}
+
+	void matchSlices(const SliceIndex& index, size_t chunkCount, std::vector<char>& result) const
+	{
+		std::vector<char> itemResult;
+
+		result.assign(chunkCount, false);
+
+		for (auto& item: items)
+		{
+			item.matchSlices(index, chunkCount, itemResult);
+
+			for (size_t i = 0; i < chunkCount; ++i)
+				result[i] |= itemResult[i];
+		}
+	}
+
+	void matchPostings(const PostingIndex& index, size_t chunkCount, std::vector<char>& result) const
+	{
+		std::vector<char> itemResult;
+
+		result.assign(chunkCount, false);
+
+		for (auto& item: items)
+		{
+			item.matchPostings(index, chunkCount, itemResult);
+
+			for (size_t i = 0; i < chunkCount; ++i)
+				result[i] |= itemResult[i];
+		}
+	}
+
+	bool hasIdentifiers() const
+	{
+		for (auto& item: items)
+			if (!item.hasIdentifiers())
+				return false;
+
+		return !items.empty();
+	}
+
+	// Only works if all queries are whole word queries
+	bool matchIdentifiers(const PostingIndex& index, size_t chunkCount, std::vector<char>& result) const
+	{
+		std::vector<char> itemResult;
+
+		result.assign(chunkCount, false);
+
+		for (auto& item: items)
+		{
+			if (!item.matchIdentifiers(index, chunkCount, itemResult))
+			{
+				result.clear();
+				return false;
+			}
+
+			for (size_t i = 0; i < chunkCount; ++i)
+				result[i] |= itemResult[i];
+		}
+
+		return !items.empty();
+	}
+
+	bool empty() const
+	{
+		// a query without ngrams matches every chunk
+		for (auto& item: items)
+			if (item.empty())
+				return true;
+
+		return items.empty();
+	}
+
+private:
+	std::vector<NgramRegex> items;
+};
+
+// Decompresses the file table and the blocks that may contain matches; files in the blocks that are skipped are left empty and the
+// data of the other files is moved to keep it consecutive, so the result is laid out like a chunk of the returned size
+static DataChunkHeader decompressChunkFiltered(const NgramRegexList& ngregex, const DataChunkHeader& chunk, const char* compressed, char* data, const CompressionDictionary* dictionary)
+{
+	std::vector<DataChunkBlockHeader> blocks = getChunkBlocks(chunk, compressed);
+
+	const unsigned char* index = reinterpret_cast<const unsigned char*>(compressed) + blocks.size() * sizeof(DataChunkBlockHeader);
+	const char* source = compressed + chunk.blockTableSize;
+
+	decompressChunkBlock(data, chunk, blocks[0], source, dictionary);
+	source += blocks[0].compressedSize;
+
+	DataChunkFileHeader* files = reinterpret_cast<DataChunkFileHeader*>(data);
+
+	size_t blockOffset = blocks[0].uncompressedSize;
+	size_t dataOffset = blockOffset;
+	size_t file = 0;
+
+	for (size_t i = 1; i < blocks.size(); ++i)
+	{
+		const DataChunkBlockHeader& b = blocks[i];
+
+		bool matches = b.indexSize == 0 || ngregex.match(index, b.indexSize, b.indexHashIterations, b.indexType);
+
+		if (matches)
+			decompressChunkBlock(data + dataOffset, chunk, b, source, dictionary);
+
+		for (; file < chunk.fileCount && files[file].dataOffset < blockOffset + b.uncompressedSize; ++file)
+		{
+			DataChunkFileHeader& f = files[file];
+
+			f.dataOffset = matches ? f.dataOffset - blockOffset + dataOffset : dataOffset;
+			f.dataSize = matches ? f.dataSize : 0;
+		}
+
+		if (matches)
+			dataOffset += b.uncompressedSize;
+
+		blockOffset += b.uncompressedSize;
+		index += b.indexSize;
+		source += b.compressedSize;
+	}
+
+	// empty files at the end of the chunk
+	for (; file < chunk.fileCount; ++file)
+		files[file].dataOffset = dataOffset;
+
+	DataChunkHeader result = chunk;
+	result.uncompressedSize = dataOffset;
+
+	return result;
+}
+
+// Chunks that are already decompressed are passed without compressed data; returns true if the chunk was decompressed completely by this call
+// Chunks are only decompressed in part when the block filter is given, in which case only the blocks that may contain matches are searched
+static bool processChunk(const SearchQueries& queries, const NgramRegexList* blockFilter, SearchOutput* output, SearchScratch& scratch, unsigned int outputIndex, const SearchPack& pack, size_t chunkIndex, const DataChunkHeader& chunkHeader, const char* compressed, char* data, Regex* includeRe, Regex* excludeRe, ChangeOverlay* overlay, std::atomic<uint64_t>& changeTime, const std::vector<std::string>& changes, size_t changeBegin, size_t changeEnd)
+{
+	OrderedOutput::Chunk* outputChunk = output->output.begin(outputIndex);
+
+	// chunks that were picked up right before the search got cancelled aren't worth decompressing
+	if (output->isCancelled())
+	{
+		output->output.end(outputChunk);
+		return false;
+	}
+
+	SearchStatistics& statistics = scratch.statistics;
+
+	bool filtered = compressed && blockFilter && chunkHeader.blockCount > 2;
+
+	DataChunkHeader chunk = chunkHeader;
+
+	if (compressed)
+	{
+		TraceScope scope(statistics.timing, statistics.trace, statistics.decompressTime, "worker", "decompress");
+
+		if (filtered)
+			chunk = decompressChunkFiltered(*blockFilter, chunkHeader, compressed, data, pack.dictionary.get());
+		else
+			decompressChunk(data, chunk, compressed, pack.dictionary.get());
+
+		statistics.decompressedSize += chunk.uncompressedSize;
+	}
+
+	{
+		TraceScope scope(statistics.timing, statistics.trace, statistics.matchTime, "worker", "search");
+
+		ChunkAliases aliases;
+		getChunkAliases(aliases, pack, chunkIndex, chunk.fileCount, includeRe, excludeRe, changes);
+
+		std::vector<int>& matches = scratch.matches;
+		matches.clear();
+
+		// chunks with pending changes have to be searched with all queries since changed files are read from disk
+		if (queries.set && changeBegin == changeEnd)
+		{
+			const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+			size_t dataOffset = chunk.fileCount ? files[0].dataOffset : chunk.uncompressedSize;
+
+			queries.set->match(data + dataOffset, chunk.uncompressedSize - dataOffset, matches, &scratch.chunkRange);
+		}
+		else
+		{
+			for (size_t i = 0; i < queries.regexes.size(); ++i)
+				matches.push_back(i);
+		}
+
+		for (auto i: matches)
+		{
+			if (output->isLimitReached(outputChunk))
+				break;
+
+			processChunkData(queries.regexes[i].get(), queries.getTag(i), output, outputChunk, scratch, aliases, chunk, data, includeRe, excludeRe, overlay, changeTime, changes.data(), changeBegin, changeEnd);
+		}
+	}
+
+	output->output.end(outputChunk);
+
+	return compressed && !filtered;
+}
+
+// Chunks are ordered by path, so the changes that belong to a chunk are the ones up to the last path listed in its extra data
+size_t getNextChange(const std::vector<std::string>& changes, size_t changeIt, const char* extra, size_t size)
+{
+	size_t offset = size;
+
+	while (offset > 0 && extra[offset - 1] != '\n')
+		offset--;
+
+	while (changeIt < changes.size() && comparePath(changes[changeIt], extra + offset, size - offset) <= 0)
+		changeIt++;
+
+	return changeIt;
+}
+
+static bool readChunkPaths(DataFileReader& in, const DataChunkDirectoryEntry& entry, std::string& result)
+{
+	in.seek(entry.headerOffset + sizeof(DataChunkHeader));
+
+	const char* extra = in.read(entry.header.extraSize);
+
+	if (!extra)
+		return false;
+
+	result.assign(extra, entry.header.extraSize);
+	return true;
+}
+
+// Returns the first chunk of the shard; for per-file output, chunks that start with the rest of a file from the previous chunk stay in the shard of that chunk
+static size_t getShardBegin(DataFileReader& in, const std::vector<DataChunkDirectoryEntry>& chunks, unsigned int shardIndex, unsigned int shardCount, bool wholeFiles)
+{
+	size_t index = chunks.size() * shardIndex / shardCount;
+
+	std::string prev, next;
+
+	if (!wholeFiles || index == 0 || index == chunks.size() || !readChunkPaths(in, chunks[index - 1], prev))
+		return index;
+
+	for (; index < chunks.size(); ++index)
+	{
+		if (!readChunkPaths(in, chunks[index], next))
+			break;
+
+		// a path that is in both chunks is the last path of the previous one and the first path of the next one
+		std::string last = prev.substr(prev.rfind('\n') + 1);
+
+		if (next.compare(0, next.find('\n'), last) != 0)
+			break;
+
+		prev.swap(next);
+	}
+
+	return index;
+}
+
+static bool hasAcceptedPath(const SearchPack& pack, size_t chunkIndex, const char* paths, size_t size, Regex* includeRe, Regex* excludeRe)
+{
+	if (!excludeRe)
+	{
+		// matches can't span lines, so a single search finds out if any path matches
+		if (includeRe->search(paths, size))
+			return true;
+	}
+	else
+	{
+		for (const char* begin = paths, *end = paths + size; begin <= end; )
+		{
+			const char* next = static_cast<const char*>(memchr(begin, '\n', end - begin));
+			const char* lend = next ? next : end;
+
+			if (!ignorePath(begin, lend - begin, includeRe, excludeRe))
+				return true;
+
+			begin = lend + 1;
+		}
+	}
+
+	// references are reported along with the matches in the files they refer to
+	DataFileAliasEntry key = {};
+	key.chunkIndex = chunkIndex;
+
+	auto range = std::equal_range(pack.aliases.begin(), pack.aliases.end(), key, [](const DataFileAliasEntry& l, const DataFileAliasEntry& r) { return l.chunkIndex < r.chunkIndex; });
+
+	for (auto it = range.first; it != range.second; ++it)
+		if (!ignorePath(pack.aliasNames.data() + it->nameOffset, it->nameLength, includeRe, excludeRe))
+			return true;
+
+	return false;
+}
+
+// Chunks where the path filters reject every file are excluded from the candidates without reading chunk data
+static bool matchChunkPaths(SearchPack& pack, Regex* includeRe, Regex* excludeRe, std::vector<char>& candidates)
+{
+	const std::vector<DataChunkDirectoryEntry>& chunks = pack.chunks;
+
+	if (candidates.empty())
+		candidates.assign(chunks.size(), true);
+
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		if (!candidates[i])
+			continue;
+
+		const DataChunkDirectoryEntry& entry = chunks[i];
+
+		pack.in.seek(entry.headerOffset + sizeof(DataChunkHeader));
+
+		const char* extra = pack.in.read(entry.header.extraSize);
+		if (!extra)
+			return false;
+
+		candidates[i] = hasAcceptedPath(pack, i, extra, entry.header.extraSize, includeRe, excludeRe);
+	}
+
+	return true;
+}
+
+struct ChunkFilterBatch
+{
+	size_t begin, end;
+
+	std::vector<const unsigned char*> indices;
+	std::vector<unsigned char> indexData;
+
+	std::vector<char> matches;
+	std::promise<void> ready;
+};
+
+static bool readChunkFilterBatch(DataFileReader& in, const std::vector<DataChunkDirectoryEntry>& chunks, const std::vector<char>& candidates, ChunkFilterBatch& batch)
+{
+	size_t count = batch.end - batch.begin;
+
+	batch.indices.resize(count);
+	batch.matches.resize(count);
+
+	if (in.isMapped())
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			const DataChunkDirectoryEntry& entry = chunks[batch.begin + i];
+
+			if (!candidates.empty() && !candidates[batch.begin + i])
+				continue;
+
+			batch.indices[i] = reinterpret_cast<const unsigned char*>(in.map(entry.indexOffset, entry.header.indexSize));
+
+			if (!batch.indices[i])
+				return false;
+		}
+	}
+	else
+	{
+		// indices have to be copied since the batch is processed asynchronously
+		size_t totalSize = 0;
+
+		for (size_t i = 0; i < count; ++i)
+			if (candidates.empty() || candidates[batch.begin + i])
+				totalSize += chunks[batch.begin + i].header.indexSize;
+
+		try
+		{
+			batch.indexData.resize(totalSize);
+		}
+		catch (const std::bad_alloc&)
+		{
+			return false;
+		}
+
+		size_t offset = 0;
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			const DataChunkDirectoryEntry& entry = chunks[batch.begin + i];
+
+			if (!candidates.empty() && !candidates[batch.begin + i])
+				continue;
+
+			in.seek(entry.indexOffset);
+
+			if (entry.header.indexSize && !in.read(&batch.indexData[offset], entry.header.indexSize))
+				return false;
+
+			batch.indices[i] = batch.indexData.data() + offset;
+			offset += entry.header.indexSize;
+		}
+	}
+
+	return true;
+}
+
+static void processChunkFilterBatch(const NgramRegexList& ngregex, const std::vector<DataChunkDirectoryEntry>& chunks, const std::vector<char>& candidates, ChunkFilterBatch& batch)
+{
+	for (size_t i = batch.begin; i < batch.end; ++i)
+	{
+		const DataChunkHeader& chunk = chunks[i].header;
+
+		// chunks rejected by the slice index have no index data
+		if (!candidates.empty() && !candidates[i])
+			batch.matches[i - batch.begin] = false;
+		else
+			batch.matches[i - batch.begin] = chunk.indexSize == 0 || ngregex.match(batch.indices[i - batch.begin], chunk.indexSize, chunk.indexHashIterations, chunk.indexType);
+	}
+
+	batch.ready.set_value();
+}
+
+static std::shared_ptr<SearchPack> openSearchPack(Output* output, const char* file)
+{
+	std::shared_ptr<SearchPack> pack(new SearchPack());
+
+	pack->dataPath = replaceExtension(file, ".qgd");
+
+	// attributes are read before opening the file so that a concurrent update results in a stale timestamp, not a stale pack
+	getFileAttributes(pack->dataPath.c_str(), &pack->timeStamp, &pack->fileSize);
+
+	if (!pack->in.open(pack->dataPath.c_str()))
+	{
+		output->error("Error reading data file %s\n", pack->dataPath.c_str());
+		return std::shared_ptr<SearchPack>();
+	}
+
+	if (!readDataFileDirectory(pack->in, pack->chunks) || !readDataFileAliases(pack->in, pack->aliases, pack->aliasNames) || !readDataFileDictionary(pack->in, pack->dictionary))
+	{
+		output->error("Error reading data file %s: file format is out of date, update the project to fix\n", pack->dataPath.c_str());
+		return std::shared_ptr<SearchPack>();
+	}
+
+	return pack;
+}
+
+static void openSearchPackIndices(SearchPack& pack, const char* file)
+{
+	if (pack.indicesOpened)
+		return;
+
+	pack.hasPostings = pack.postings.open(file, PK_NGRAMS, pack.in.size(), pack.chunks.size());
+	pack.hasSlices = !pack.hasPostings && pack.slices.open(file, pack.in.size(), pack.chunks.size());
+	pack.hasIdentifiers = pack.identifiers.open(file, PK_IDENTIFIERS, pack.in.size(), pack.chunks.size());
+	pack.indicesOpened = true;
+}
+
+// Chunks are decompressed into memory of the NUMA node whose workers search them; without several nodes there is one pool
+class ChunkPools
+{
+public:
+	ChunkPools(const std::vector<unsigned int>& nodes)
+	{
+		// Assume 50% compression ratio (it's usually much better)
+		for (auto node: nodes)
+			pools.emplace_back(new BlockPool(kChunkSize * 3 / 2, node));
+
+		if (pools.empty())
+			pools.emplace_back(new BlockPool(kChunkSize * 3 / 2));
+	}
+
+	// Nodes are assigned to chunks in turn; the result is an index into the node list, or kAnyNode
+	size_t getChunkNode(size_t chunkIndex) const
+	{
+		return pools.size() > 1 ? chunkIndex % pools.size() : WorkQueue::kAnyNode;
+	}
+
+	// Node of the pool the block was allocated from
+	size_t getBlockNode(const BlockRef& block) const
+	{
+		for (size_t i = 0; i < pools.size() && pools.size() > 1; ++i)
+			if (pools[i].get() == block.getPool())
+				return i;
+
+		return WorkQueue::kAnyNode;
+	}
+
+	BlockRef allocate(size_t node, size_t size)
+	{
+		return pools[node == WorkQueue::kAnyNode ? 0 : node % pools.size()]->allocate(size, std::nothrow);
+	}
+
+private:
+	std::vector<std::unique_ptr<BlockPool>> pools;
+};
+
+class SearchCache
+{
+public:
+	SearchCache(size_t memoryLimit): chunkPools(WorkQueue::getIdealNodes()), changeOverlay(kChangeOverlaySize), shardIndex(0), shardCount(1), memoryLimit(memoryLimit), memorySize(0), nextPackId(1), resultSize(0)
+	{
+	}
+
+	// Returns the open pack for the project, reopening it if the data file changed since it was opened
+	std::shared_ptr<SearchPack> getPack(Output* output, const char* file)
+	{
+		std::string dataPath = replaceExtension(file, ".qgd");
+
+		uint64_t timeStamp = 0, fileSize = 0;
+		getFileAttributes(dataPath.c_str(), &timeStamp, &fileSize);
+
+		std::shared_ptr<SearchPack>& pack = packs[file];
+
+		if (pack && pack->timeStamp == timeStamp && pack->fileSize == fileSize)
+			return pack;
+
+		if (pack)
+			removeChunks(pack->id);
+
+		pack = openSearchPack(output, file);
+
+		if (pack)
+			pack->id = nextPackId++;
+
+		return pack;
+	}
+
+	BlockRef findChunk(const SearchPack& pack, size_t index)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		auto it = chunkMap.find(getChunkKey(pack.id, index));
+
+		if (it == chunkMap.end())
+			return BlockRef();
+
+		chunks.splice(chunks.begin(), chunks, it->second);
+
+		return it->second->data;
+	}
+
+	// Called by workers once the chunk is decompressed; least recently used chunks are evicted to stay within the memory limit
+	void insertChunk(const SearchPack& pack, size_t index, const BlockRef& data, size_t size)
+	{
+		if (size > memoryLimit)
+			return;
+
+		std::unique_lock<std::mutex> lock(mutex);
+
+		uint64_t key = getChunkKey(pack.id, index);
+
+		if (chunkMap.count(key))
+			return;
+
+		while (!chunks.empty() && memorySize + size > memoryLimit)
+		{
+			memorySize -= chunks.back().size;
+			chunkMap.erase(chunks.back().key);
+			chunks.pop_back();
+		}
+
+		CachedChunk chunk = { key, data, size };
+
+		chunks.push_front(chunk);
+		chunkMap[key] = chunks.begin();
+		memorySize += size;
+	}
+
+	// Results are stored along with the state of the files they were produced from; a stale result is dropped on lookup
+	bool findResult(const std::string& key, const std::string& stamp, std::string& output, unsigned int& lineCount)
+	{
+		auto it = resultMap.find(key);
+
+		if (it == resultMap.end())
+			return false;
+
+		if (it->second->stamp != stamp)
+		{
+			removeResult(it->second);
+			return false;
+		}
+
+		results.splice(results.begin(), results, it->second);
+
+		output = it->second->output;
+		lineCount = it->second->lineCount;
+
+		return true;
+	}
+
+	void insertResult(const std::string& key, const std::string& stamp, const std::string& output, unsigned int lineCount)
+	{
+		size_t size = key.size() + stamp.size() + output.size();
+
+		if (size > kServerResultCacheSize)
+			return;
+
+		auto it = resultMap.find(key);
+
+		if (it != resultMap.end())
+			removeResult(it->second);
+
+		while (!results.empty() && resultSize + size > kServerResultCacheSize)
+			removeResult(std::prev(results.end()));
+
+		CachedResult result = { key, stamp, output, lineCount };
+
+		results.push_front(result);
+		resultMap[key] = results.begin();
+		resultSize += size;
+	}
+
+	// Decompressed chunks are allocated from these pools so that cached blocks don't outlive their pool
+	ChunkPools chunkPools;
+
+	// Changed files are read once while they stay the same, instead of on every search
+	ChangeOverlay changeOverlay;
+
+	// File searches of every project narrow down the matches of the last one
+	std::map<std::string, FilterSession> filterSessions;
+
+	// Searches only cover the shardIndex-th of shardCount contiguous chunk ranges of every project
+	unsigned int shardIndex;
+	unsigned int shardCount;
+
+private:
+	struct CachedChunk
+	{
+		uint64_t key;
+		BlockRef data;
+		size_t size;
+	};
+
+	struct CachedResult
+	{
+		std::string key;
+		std::string stamp;
+		std::string output;
+		unsigned int lineCount;
+	};
+
+	void removeResult(std::list<CachedResult>::iterator it)
+	{
+		resultSize -= it->key.size() + it->stamp.size() + it->output.size();
+		resultMap.erase(it->key);
+		results.erase(it);
+	}
+
+	static uint64_t getChunkKey(unsigned int packId, size_t index)
+	{
+		return (uint64_t(packId) << 32) | index;
+	}
+
+	void removeChunks(unsigned int packId)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		for (auto it = chunks.begin(); it != chunks.end(); )
+			if ((it->key >> 32) == packId)
+			{
+				memorySize -= it->size;
+				chunkMap.erase(it->key);
+				it = chunks.erase(it);
+			}
+			else
+				++it;
+	}
+
+	std::map<std::string, std::shared_ptr<SearchPack>> packs;
+
+	std::mutex mutex;
+	size_t memoryLimit;
+	size_t memorySize;
+	unsigned int nextPackId;
+
+	// most recently used chunks first
+	std::list<CachedChunk> chunks;
+	std::unordered_map<uint64_t, std::list<CachedChunk>::iterator> chunkMap;
+
+	// results are only accessed by the search thread
+	size_t resultSize;
+	std::list<CachedResult> results;
+	std::unordered_map<std::string, std::list<CachedResult>::iterator> resultMap;
+
+};
+
+// Forwards output to the target and keeps a copy so that the results can be cached
+class RecordingOutput: public Output
+{
+public:
+	RecordingOutput(Output* output): output(output), failed(false), truncated(false)
+	{
+	}
+
+	virtual void rawprint(const char* data, size_t size)
+	{
+		record(data, size);
+
+		output->rawprint(data, size);
+	}
+
+	virtual void print(const char* message, ...)
+	{
+		va_list l;
+		va_start(l, message);
+		std::string result;
+		strprintf(result, message, l);
+		va_end(l);
+
+		rawprint(result.c_str(), result.size());
+	}
+
+	virtual void error(const char* message, ...)
+	{
+		va_list l;
+		va_start(l, message);
+		std::string result;
+		strprintf(result, message, l);
+		va_end(l);
+
+		// results of failed searches aren't cached since the failure may be temporary
+		failed = true;
+
+		output->error("%s", result.c_str());
+	}
+
+	virtual bool isTTY()
+	{
+		return output->isTTY();
+	}
+
+	virtual bool isCancelled()
+	{
+		return output->isCancelled();
+	}
+
+	// The output can be cached if all of it was recorded and the search ran to completion
+	bool isComplete()
+	{
+		return !failed && !truncated && !output->isCancelled();
+	}
+
+	std::string result;
+
+private:
+	void record(const char* data, size_t size)
+	{
+		if (truncated)
+			return;
+
+		if (result.size() + size > kServerResultCacheSize)
+		{
+			truncated = true;
+			result.clear();
+			return;
+		}
+
+		result.append(data, size);
+	}
+
+	Output* output;
+	std::atomic<bool> failed;
+	bool truncated;
+};
+
+static void appendResultKey(std::string& key, const char* value)
+{
+	// null and empty values are distinct
+	key += value ? '+' : '-';
+	if (value) key += value;
+	key += '\0';
+}
+
+static std::string getResultKey(const std::vector<std::string>& files, const SearchQueries& queries, unsigned int options, unsigned int limit, const char* include, const char* exclude)
+{
+	std::string key = std::to_string(options) + ":" + std::to_string(limit) + ":";
+
+	appendResultKey(key, include);
+	appendResultKey(key, exclude);
+
+	key += std::to_string(files.size()) + ":";
+
+	for (auto& file: files)
+		appendResultKey(key, file.c_str());
+
+	for (auto& string: queries.strings)
+		appendResultKey(key, string.c_str());
+
+	return key;
+}
+
+static void appendResultStamp(std::string& stamp, const char* path)
+{
+	uint64_t attributes[2] = {};
+	getFileAttributes(path, &attributes[0], &attributes[1]);
+
+	stamp.append(reinterpret_cast<const char*>(attributes), sizeof(attributes));
+}
+
+// Search results depend on the data file, the change list and the contents of the changed files, which are read from disk
+static std::string getResultStamp(const std::vector<std::string>& files)
+{
+	std::string stamp;
+
+	for (auto& file: files)
+	{
+		std::string changesPath = replaceExtension(file.c_str(), ".qgc");
+
+		appendResultStamp(stamp, replaceExtension(file.c_str(), ".qgd").c_str());
+		appendResultStamp(stamp, changesPath.c_str());
+
+		for (auto& path: readChanges(file.c_str()))
+			appendResultStamp(stamp, path.c_str());
+	}
+
+	return stamp;
+}
+
+SearchCache* createSearchCache(size_t memoryLimit)
+{
+	return new SearchCache(memoryLimit);
+}
+
+void destroySearchCache(SearchCache* cache)
+{
+	delete cache;
+}
+
+void setSearchCacheShard(SearchCache* cache, unsigned int index, unsigned int count)
+{
+	assert(index < count);
+
+	cache->shardIndex = index;
+	cache->shardCount = count;
+}
+
+FilterSession* getSearchCacheFilterSession(SearchCache* cache, const char* file)
+{
+	return &cache->filterSessions[file];
+}
+
+bool preloadSearchCache(Output* output, SearchCache* cache, const char* file)
 {
-	while (changeIt < changes.size() && comparePath(changes[changeIt], data, size) <= 0)
-		changeIt++;
+	std::shared_ptr<SearchPack> pack = cache->getPack(output, file);
 
-	return changeIt;
+	if (!pack)
+		return false;
+
+	openSearchPackIndices(*pack, file);
+
+	// chunk indices are read by every search so they are brought into memory right away
+	for (auto& entry: pack->chunks)
+		pack->in.prefetch(entry.indexOffset, entry.header.indexSize);
+
+	return true;
 }
 
-template <typename T> static bool readVector(FileStream& in, std::vector<T>& data, size_t size)
+// Per-project search state; queued jobs reference it so it has to outlive the work queue
+struct SearchProject
 {
-	try
+	std::shared_ptr<SearchPack> pack;
+
+	std::vector<std::string> changes;
+	std::vector<char> candidates;
+
+	// microseconds that workers spent on the changed files
+	std::atomic<uint64_t> changeTime;
+
+	SearchProject(): changeTime(0)
 	{
-		data.resize(size);
 	}
-	catch (const std::bad_alloc&)
+
+	// Index checks are done in batches by workers ahead of chunk processing; batches are used in order
+	std::vector<std::unique_ptr<ChunkFilterBatch>> filterBatches;
+	std::vector<std::future<void>> filterReady;
+};
+
+struct SearchContext
+{
+	SearchContext(SearchOutput& output, const SearchQueries& queries, const std::vector<Regex*>& regexes, const char* include, const char* exclude, SearchCache* cache, SearchStatistics* statistics)
+		: output(output), queries(queries), ngregex(regexes)
+		, includeRe(include ? createRegex(include, RO_IGNORECASE) : 0)
+		, excludeRe(exclude ? createRegex(exclude, RO_IGNORECASE) : 0)
+		, workerCount(WorkQueue::getIdealWorkerCount())
+		, nodes(WorkQueue::getIdealNodes())
+		, chunkPools(nodes)
+		, scratch(new SearchScratch[workerCount + 1])
+		, changeOverlay(kChangeOverlaySize)
+		, cache(cache)
+		, statistics(statistics ? *statistics : ownStatistics)
+		, queue(workerCount, getQueuedDataLimit(), nodes)
+		, chunkIndex(0)
 	{
-		return false;
+		if (this->statistics.timing)
+		{
+			queue.enableTiming(this->statistics.trace);
+			output.output.enableTiming(this->statistics.trace);
+		}
+
+		for (unsigned int i = 0; i <= workerCount; ++i)
+		{
+			scratch[i].statistics.timing = this->statistics.timing;
+			scratch[i].statistics.trace = this->statistics.trace;
+		}
 	}
 
-	if (size && !read(in, &data[0], size * sizeof(T)))
+	// Adds the counters of the workers to the statistics; has to be called after the queue is finished
+	void collectStatistics()
 	{
-		return false;
+		for (unsigned int i = 0; i <= workerCount; ++i)
+		{
+			const SearchStatistics& s = scratch[i].statistics;
+
+			statistics.decompressedSize += s.decompressedSize;
+			statistics.readTime += s.readTime;
+			statistics.indexTime += s.indexTime;
+			statistics.decompressTime += s.decompressTime;
+			statistics.matchTime += s.matchTime;
+			statistics.changeTime += s.changeTime;
+			statistics.producerWaitTime += s.producerWaitTime;
+		}
+
+		statistics.producerWaitTime += queue.getProducerWaitTime();
+		statistics.workerIdleTime += queue.getWorkerIdleTime();
+		statistics.outputWaitTime += output.output.getWaitTime();
 	}
 
-	return true;
-}
+	SearchOutput& output;
 
-unsigned int searchProject(Output* output_, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude)
-{
-	SearchOutput output(output_, options, limit);
-	std::unique_ptr<Regex> regex(createRegex(string, getRegexOptions(options)));
-	std::unique_ptr<Regex> includeRe(include ? createRegex(include, RO_IGNORECASE) : 0);
-	std::unique_ptr<Regex> excludeRe(exclude ? createRegex(exclude, RO_IGNORECASE) : 0);
-	NgramRegex ngregex((options & SO_BRUTEFORCE) ? nullptr : regex.get());
+	const SearchQueries& queries;
+	NgramRegexList ngregex;
+
+	std::unique_ptr<Regex> includeRe;
+	std::unique_ptr<Regex> excludeRe;
+
+	unsigned int workerCount;
+
+	std::vector<unsigned int> nodes;
+	ChunkPools chunkPools;
 
-	std::vector<std::string> changes = readChanges(file);
+	// Scratch buffers for every worker, and one for the work that is done on the producer
+	std::unique_ptr<SearchScratch[]> scratch;
+
+	// Changed files are read once per search even if there are many queries
+	ChangeOverlay changeOverlay;
+
+	SearchCache* cache;
+
+	// Counters are always collected since that's cheaper than checking if they are needed; times are only measured on request
+	SearchStatistics ownStatistics;
+	SearchStatistics& statistics;
+
+	// Projects stay alive until all workers are done since jobs reference their contents
+	std::vector<std::unique_ptr<SearchProject>> projects;
+
+	// Workers may reference the mapped file contents and filter batches so the queue has to be destroyed before them
+	WorkQueue queue;
+
+	// Output chunk indices are global across projects so that all results go through one ordered stream
+	unsigned int chunkIndex;
+};
+
+static bool searchProjectChunks(Output* output_, SearchContext& context, SearchProject& project, const char* file)
+{
+	SearchOutput& output = context.output;
+	const SearchQueries& queries = context.queries;
+	const NgramRegexList& ngregex = context.ngregex;
+	std::unique_ptr<Regex>& includeRe = context.includeRe;
+	std::unique_ptr<Regex>& excludeRe = context.excludeRe;
+	WorkQueue& queue = context.queue;
+	SearchCache* cache = context.cache;
+	ChunkPools& chunkPools = cache ? cache->chunkPools : context.chunkPools;
+	SearchScratch* scratch = context.scratch.get();
+	ChangeOverlay* overlay = cache ? &cache->changeOverlay : &context.changeOverlay;
+	unsigned int workerCount = context.workerCount;
+	unsigned int& chunkIndex = context.chunkIndex;
+	SearchStatistics& statistics = context.statistics;
+
+	// stage times of the producer are kept in its scratch, like the times of the workers
+	SearchStatistics& times = scratch[workerCount].statistics;
+
+	std::vector<std::string>& changes = project.changes;
+	std::atomic<uint64_t>& changeTime = project.changeTime;
 	size_t changeIt = 0;
-	
-	std::string dataPath = replaceExtension(file, ".qgd");
-	FileStream in(dataPath.c_str(), "rb");
-	if (!in)
+
 	{
-		output_->error("Error reading data file %s\n", dataPath.c_str());
-		return 0;
+		TraceScope scope(times.timing, times.trace, times.readTime, "producer", "open");
+
+		changes = readChanges(file);
+
+		project.pack = cache ? cache->getPack(output_, file) : openSearchPack(output_, file);
 	}
-	
-	DataFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+
+	if (!project.pack)
+		return false;
+
+	SearchPack* pack = project.pack.get();
+
+	const std::string& dataPath = pack->dataPath;
+	DataFileReader& in = pack->in;
+	const std::vector<DataChunkDirectoryEntry>& chunks = pack->chunks;
+
+	// shards split the chunks into contiguous ranges, so that concatenating the results of all shards keeps the chunk order
+	bool wholeFiles = (output.options & (SO_COUNT | SO_FILESONLY)) != 0;
+
+	size_t shardBegin = cache ? getShardBegin(in, chunks, cache->shardIndex, cache->shardCount, wholeFiles) : 0;
+	size_t shardEnd = cache ? getShardBegin(in, chunks, cache->shardIndex + 1, cache->shardCount, wholeFiles) : chunks.size();
+
+	statistics.chunkCount += shardEnd - shardBegin;
+
+	// Posting lists or slice index can reject most chunks at once without looking at chunk indices
+	std::vector<char>& candidates = project.candidates;
+	bool exactCandidates = false;
+
 	{
-		output_->error("Error reading data file %s: file format is out of date, update the project to fix\n", dataPath.c_str());
-		return 0;
+		TraceScope scope(times.timing, times.trace, times.indexTime, "producer", "index");
+
+		// whole word queries can use the identifier index even if they have no ngrams to check
+		if (!ngregex.empty() || ngregex.hasIdentifiers())
+		{
+			openSearchPackIndices(*pack, file);
+
+			if (pack->hasIdentifiers && ngregex.matchIdentifiers(pack->identifiers, chunks.size(), candidates))
+				exactCandidates = true;
+			else if (!ngregex.empty() && pack->hasPostings)
+			{
+				ngregex.matchPostings(pack->postings, chunks.size(), candidates);
+				exactCandidates = true;
+			}
+			else if (!ngregex.empty() && pack->hasSlices)
+				ngregex.matchSlices(pack->slices, chunks.size(), candidates);
+		}
+
+		if ((includeRe || excludeRe) && !matchChunkPaths(*pack, includeRe.get(), excludeRe.get(), candidates))
+		{
+			output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+			return false;
+		}
 	}
 
 	{
-		unsigned int chunkIndex = 0;
+		std::vector<std::unique_ptr<ChunkFilterBatch>>& filterBatches = project.filterBatches;
+		std::vector<std::future<void>>& filterReady = project.filterReady;
 
-		// Assume 50% compression ratio (it's usually much better)
-		BlockPool chunkPool(kChunkSize * 3 / 2);
+		// Posting lists are exact so chunk indices can't reject any more chunks
+		size_t filterBatchCount = (ngregex.empty() || exactCandidates) ? 0 : (shardEnd + kChunkFilterBatchSize - 1) / kChunkFilterBatchSize;
+		size_t filterBatchFirst = shardBegin / kChunkFilterBatchSize;
+		size_t filterBatchesQueued = filterBatchFirst;
 
-		std::vector<char> extra;
-		std::vector<unsigned char> index;
-		DataChunkHeader chunk;
+		// Chunks kept by the cache have to be decompressed completely; otherwise the blocks that can't contain matches are skipped
+		const NgramRegexList* blockFilter = (ngregex.empty() || cache) ? nullptr : &ngregex;
 
-		WorkQueue queue(WorkQueue::getIdealWorkerCount(), kMaxQueuedChunkData);
+		// Chunks that will be searched are read ahead in the background; on cold caches this keeps many scattered reads in flight
+		std::vector<char> prefetched(chunks.size());
+		size_t prefetchNext = shardBegin;
+		size_t prefetchSize = 0;
 
-		while (!output.isLimitReached() && read(in, chunk))
+		for (size_t i = 0; i < shardEnd && !output.isCancelled(); ++i)
 		{
-			if (!readVector(in, extra, chunk.extraSize))
+			const DataChunkDirectoryEntry& entry = chunks[i];
+			const DataChunkHeader& chunk = entry.header;
+
+			size_t changeNext = changeIt;
+
+			if (changeIt < changes.size())
 			{
-				output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
-				return 0;
+				in.seek(entry.headerOffset + sizeof(DataChunkHeader));
+
+				const char* extra = in.read(chunk.extraSize);
+
+				if (!extra)
+				{
+					output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+					return false;
+				}
+
+				changeNext = getNextChange(changes, changeIt, extra, chunk.extraSize);
 			}
 
-			size_t changeNext = getNextChange(changes, changeIt, extra.data(), extra.size());
+			// changes that sort into chunks of earlier shards are searched by those shards
+			if (i < shardBegin)
+			{
+				changeIt = changeNext;
+				continue;
+			}
 
-			if (ngregex.empty() || chunk.indexSize == 0 || changeNext != changeIt)
+			if (!candidates.empty() && !candidates[i] && changeNext == changeIt)
 			{
-				in.skip(chunk.indexSize);
+				statistics.chunksSkipped++;
+				continue;
 			}
-			else
+
+			if (filterBatchCount)
 			{
-				if (!readVector(in, index, chunk.indexSize))
+				size_t batchIndex = i / kChunkFilterBatchSize;
+
+				// keep enough batches in flight to occupy all workers
+				while (filterBatchesQueued < filterBatchCount && filterBatchesQueued <= batchIndex + workerCount)
 				{
-					output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
-					return 0;
+					std::unique_ptr<ChunkFilterBatch> batch(new ChunkFilterBatch());
+					batch->begin = std::max(filterBatchesQueued * kChunkFilterBatchSize, shardBegin);
+					batch->end = std::min((filterBatchesQueued + 1) * kChunkFilterBatchSize, shardEnd);
+
+					TraceScope scope(times.timing, times.trace, times.readTime, "producer", "read index");
+
+					if (!readChunkFilterBatch(in, chunks, candidates, *batch))
+					{
+						output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+						return false;
+					}
+
+					ChunkFilterBatch* batchp = batch.get();
+
+					filterReady.push_back(batch->ready.get_future());
+					filterBatches.push_back(std::move(batch));
+					filterBatchesQueued++;
+
+					queue.push([=, &ngregex, &chunks, &candidates, &queue]() {
+						SearchStatistics& s = scratch[queue.getWorkerIndex()].statistics;
+						TraceScope scope(s.timing, s.trace, s.indexTime, "worker", "index");
+
+						processChunkFilterBatch(ngregex, chunks, candidates, *batchp);
+					});
+				}
+
+				// batches are stored from the first batch of the shard
+				size_t batchSlot = batchIndex - filterBatchFirst;
+
+				{
+					TraceScope scope(times.timing, times.trace, times.producerWaitTime, "producer", "index wait");
+
+					filterReady[batchSlot].wait();
 				}
 
-				if (!ngregex.match(index, chunk.indexHashIterations))
+				// the previous batch is no longer needed; this keeps copied index data bounded
+				if (batchSlot > 0)
+					filterBatches[batchSlot - 1].reset();
+
+				// chunks with pending changes have to be processed even if the index doesn't match since changed files are read from disk
+				if (!filterBatches[batchSlot]->matches[i - filterBatches[batchSlot]->begin] && changeNext == changeIt)
 				{
-					in.skip(chunk.compressedSize);
+					statistics.chunksSkipped++;
+					continue;
+				}
+			}
+
+			statistics.chunksSearched++;
+			statistics.compressedSize += chunk.compressedSize;
+			statistics.uncompressedSize += chunk.uncompressedSize;
+
+			if (prefetched[i])
+				prefetchSize -= chunk.compressedSize;
+
+			for (prefetchNext = std::max(prefetchNext, i + 1); prefetchNext < shardEnd && prefetchSize < kChunkPrefetchWindow; ++prefetchNext)
+			{
+				if (!candidates.empty() && !candidates[prefetchNext])
 					continue;
+
+				if (filterBatchCount)
+				{
+					size_t batchIndex = prefetchNext / kChunkFilterBatchSize;
+
+					size_t batchSlot = batchIndex - filterBatchFirst;
+
+					// chunks with pending index checks are prefetched once the check is done
+					if (batchIndex >= filterBatchesQueued || filterReady[batchSlot].wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+						break;
+
+					if (!filterBatches[batchSlot]->matches[prefetchNext - filterBatches[batchSlot]->begin])
+						continue;
 				}
+
+				const DataChunkDirectoryEntry& next = chunks[prefetchNext];
+
+				in.prefetch(next.dataOffset, next.header.compressedSize);
+
+				prefetched[prefetchNext] = true;
+				prefetchSize += next.header.compressedSize;
+			}
+
+			// workers can't wait for the output, so the producer waits before it queues chunks too far ahead of it
+			output.output.reserve(chunkIndex);
+
+			// cached chunks are already resident, so they don't count towards the queued data limit
+			// jobs refer to the chunk header in the pack directory, which keeps the captures within the inline job storage
+			if (BlockRef cached = cache ? cache->findChunk(*pack, i) : BlockRef())
+			{
+				statistics.chunksCached++;
+
+				queue.push([=, &queries, &output, &includeRe, &excludeRe, &changes, &changeTime, &queue, &chunk]() {
+					processChunk(queries, nullptr, &output, scratch[queue.getWorkerIndex()], chunkIndex, *pack, i, chunk, nullptr, cached.get(), includeRe.get(), excludeRe.get(), overlay, changeTime, changes, changeIt, changeNext);
+				}, 0, chunkPools.getBlockNode(cached));
+
+				chunkIndex++;
+				changeIt = changeNext;
+				continue;
 			}
 
-			std::shared_ptr<char> data = chunkPool.allocate(chunk.compressedSize + chunk.uncompressedSize, std::nothrow);
+			in.seek(entry.dataOffset);
 
-			if (!data || !read(in, data.get(), chunk.compressedSize))
+			// Mapped chunk data is decompressed in place; otherwise the compressed data is read into the start of the block
+			size_t compressedCopySize = in.isMapped() ? 0 : getChunkDataOffset(chunk.compressedSize);
+
+			size_t node = chunkPools.getChunkNode(i);
+			BlockRef data = chunkPools.allocate(node, compressedCopySize + chunk.uncompressedSize);
+
+			const char* compressed = nullptr;
+
+			{
+				TraceScope scope(times.timing, times.trace, times.readTime, "producer", "read");
+
+				// mapped chunk data doesn't go through the sequential read-ahead since the chunks that are searched are prefetched above
+				compressed =
+					!data ? nullptr :
+					in.isMapped() ? in.map(entry.dataOffset, chunk.compressedSize) :
+					in.read(data.get(), chunk.compressedSize) ? data.get() : nullptr;
+			}
+
+			if (!compressed)
 			{
 				output_->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
-				return 0;
+				return false;
 			}
 
-			queue.push([=, &regex, &output, &includeRe, &excludeRe, &changes]() {
-				processChunk(regex.get(), &output, chunkIndex, chunk, data.get(), includeRe.get(), excludeRe.get(), changes.data(), changeIt, changeNext);
-			}, chunk.compressedSize + chunk.uncompressedSize);
+			queue.push([=, &queries, &output, &includeRe, &excludeRe, &changes, &changeTime, &queue, &chunk]() {
+				if (processChunk(queries, blockFilter, &output, scratch[queue.getWorkerIndex()], chunkIndex, *pack, i, chunk, compressed, data.get() + compressedCopySize, includeRe.get(), excludeRe.get(), overlay, changeTime, changes, changeIt, changeNext) && cache)
+					cache->insertChunk(*pack, i, BlockRef(data, data.get() + compressedCopySize), compressedCopySize + chunk.uncompressedSize);
+			}, chunk.compressedSize + chunk.uncompressedSize, node);
 
 			chunkIndex++;
 			changeIt = changeNext;
 		}
 
-		if (changeIt < changes.size())
+		// changes after the last chunk belong to the last shard
+		if (!output.isCancelled() && changeIt < changes.size() && shardEnd == chunks.size())
 		{
+			output.output.reserve(chunkIndex);
+
 			OrderedOutput::Chunk* chunk = output.output.begin(chunkIndex);
 
-			HighlightBuffer hlbuf;
+			for (size_t i = 0; i < queries.regexes.size(); ++i)
+				for (size_t j = changeIt; j < changes.size(); ++j)
+					processChangedFile(queries.regexes[i].get(), queries.getTag(i), &output, chunk, scratch[queue.getWorkerIndex()], overlay, changeTime, changes[j], includeRe.get(), excludeRe.get());
+
+			output.output.end(chunk);
+
+			chunkIndex++;
+		}
+	}
+
+	return true;
+}
+
+static unsigned int searchProjectQueries(Output* output_, const std::vector<std::string>& files, const SearchQueries& queries, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchCache* cache, SearchStatistics* statistics);
+
+static unsigned int searchProjectQueriesCached(Output* output_, const std::vector<std::string>& files, const SearchQueries& queries, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchCache* cache, SearchStatistics* statistics)
+{
+	if (!cache)
+		return searchProjectQueries(output_, files, queries, options, limit, include, exclude, nullptr, statistics);
+
+	std::string key = getResultKey(files, queries, options, limit, include, exclude) + std::to_string(cache->shardIndex) + "/" + std::to_string(cache->shardCount);
+	std::string stamp = getResultStamp(files);
+
+	std::string result;
+	unsigned int lineCount = 0;
+
+	if (cache->findResult(key, stamp, result, lineCount))
+	{
+		output_->rawprint(result.c_str(), result.size());
+		return lineCount;
+	}
+
+	RecordingOutput output(output_);
+
+	lineCount = searchProjectQueries(&output, files, queries, options, limit, include, exclude, cache, statistics);
+
+	// files may have changed during the search, in which case the next search has to produce the results again
+	if (output.isComplete() && getResultStamp(files) == stamp)
+		cache->insertResult(key, stamp, output.result, lineCount);
+
+	return lineCount;
+}
+
+static unsigned int searchProjectQueries(Output* output_, const std::vector<std::string>& files, const SearchQueries& queries, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchCache* cache, SearchStatistics* statistics)
+{
+	std::vector<Regex*> regexes;
+
+	if ((options & SO_BRUTEFORCE) == 0)
+		for (auto& re: queries.regexes)
+			regexes.push_back(re.get());
+
+	SearchOutput output(output_, options, limit);
+
+	{
+		SearchContext context(output, queries, regexes, include, exclude, cache, statistics);
+
+		// Chunks from all projects go to the same queue, so the next project is opened while workers are still busy with the previous one
+		for (size_t i = 0; i < files.size() && !output.isCancelled(); ++i)
+		{
+			context.projects.emplace_back(new SearchProject());
+
+			searchProjectChunks(output_, context, *context.projects.back(), files[i].c_str());
+		}
+
+		// queued chunks can't produce any output now; chunks that are being searched stop at the next file
+		if (output.isCancelled())
+		{
+			context.queue.cancel();
+			output.output.cancel();
+		}
+
+		context.queue.finish();
+		context.collectStatistics();
+
+		for (size_t i = 0; i < context.projects.size(); ++i)
+			if (uint64_t time = context.projects[i]->changeTime)
+				appendSearchChangeTime(files[i].c_str(), time);
+	}
+
+	output.output.finish();
+	output.summary.flush();
+
+	if (statistics)
+	{
+		statistics->outputSize += output.output.getWrittenSize();
+		statistics->writeTime += output.output.getWriteTime();
+	}
+
+	return output.output.getLineCount();
+}
+
+static unsigned int getSearchRegexOptions(unsigned int options)
+{
+	// highlighting searches each output line repeatedly, which is better done on a casefolded copy
+	return getRegexOptions(options) | ((options & SO_HIGHLIGHT_MATCHES) ? 0 : RO_FOLDINPLACE);
+}
+
+unsigned int searchProject(Output* output, const std::vector<std::string>& files, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchCache* cache, SearchStatistics* statistics)
+{
+	SearchQueries queries;
+	queries.strings.push_back(string);
+	queries.regexes.emplace_back(createRegex(string, getSearchRegexOptions(options)));
+
+	return searchProjectQueriesCached(output, files, queries, options, limit, include, exclude, cache, statistics);
+}
+
+unsigned int searchProjectMulti(Output* output, const std::vector<std::string>& files, const std::vector<std::string>& strings, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchCache* cache, SearchStatistics* statistics)
+{
+	SearchQueries queries;
+
+	queries.strings = strings;
+
+	for (size_t i = 0; i < strings.size(); ++i)
+	{
+		queries.regexes.emplace_back(createRegex(strings[i].c_str(), getSearchRegexOptions(options)));
+		queries.tags.push_back(std::to_string(i + 1));
+	}
+
+	if (strings.size() > 1)
+		queries.set.reset(createRegexSet(strings, getRegexOptions(options)));
+
+	return searchProjectQueriesCached(output, files, queries, options, limit, include, exclude, cache, statistics);
+}
+
+static bool hasAtomNgrams(const std::vector<unsigned int>& ngrams, const std::vector<unsigned int>& shortNgrams, const NgramAtom& atom)
+{
+	const std::vector<unsigned int>& set = atom.shortNgrams ? shortNgrams : ngrams;
+
+	for (auto n: atom.ngrams)
+		if (!std::binary_search(set.begin(), set.end(), n))
+			return false;
+
+	return true;
+}
+
+bool analyzeSearchIndex(Output* output, const char* file, const std::vector<std::string>& queries, unsigned int options, IndexAnalysis& result)
+{
+	std::shared_ptr<SearchPack> pack = openSearchPack(output, file);
+
+	if (!pack)
+		return false;
+
+	openSearchPackIndices(*pack, file);
+
+	DataFileReader& in = pack->in;
+	const std::vector<DataChunkDirectoryEntry>& chunks = pack->chunks;
+
+	std::vector<std::unique_ptr<Regex>> regexes;
+	std::vector<NgramRegex> ngregexes;
+	std::vector<std::vector<char>> candidates(queries.size());
+
+	result.hasPostings = pack->hasPostings;
+	result.hasSlices = pack->hasSlices;
+	result.hasIdentifiers = pack->hasIdentifiers;
+	result.queries.resize(queries.size());
+	result.chunks.resize(chunks.size());
+
+	for (size_t i = 0; i < queries.size(); ++i)
+	{
+		regexes.emplace_back(createRegex(queries[i].c_str(), getRegexOptions(options)));
+		ngregexes.emplace_back(regexes.back().get());
+
+		const NgramRegex& ngregex = ngregexes.back();
+
+		result.queries[i].query = queries[i];
+
+		for (auto& atom: ngregex.getAtoms())
+		{
+			result.queries[i].atoms.emplace_back();
+			result.queries[i].atoms.back().text = atom.text;
+		}
+
+		// searches only look at the chunk indices of the chunks that pass posting lists or slices; posting lists are exact so they are used alone, and so is the identifier index
+		if (pack->hasIdentifiers && ngregex.matchIdentifiers(pack->identifiers, chunks.size(), candidates[i]))
+		{
+			result.queries[i].identifiers = true;
+			continue;
+		}
+
+		if (ngregex.empty())
+			continue;
+
+		if (pack->hasPostings)
+			ngregex.matchPostings(pack->postings, chunks.size(), candidates[i]);
+		else if (pack->hasSlices)
+			ngregex.matchSlices(pack->slices, chunks.size(), candidates[i]);
+	}
+
+	RegexBuffer buffer;
+	std::vector<unsigned char> index;
+	std::vector<unsigned int> ngrams, shortNgrams;
+	std::vector<int> present, reported;
+
+	for (size_t c = 0; c < chunks.size(); ++c)
+	{
+		const DataChunkDirectoryEntry& entry = chunks[c];
+		const DataChunkHeader& chunk = entry.header;
+
+		// the index is copied since reading the chunk data reuses the read buffer
+		in.seek(entry.indexOffset);
+
+		const char* indexData = in.read(chunk.indexSize);
+
+		if (!indexData && chunk.indexSize)
+		{
+			output->error("Error reading data file %s: malformed chunk\n", pack->dataPath.c_str());
+			return false;
+		}
+
+		index.assign(indexData, indexData + chunk.indexSize);
+
+		in.seek(entry.dataOffset);
+
+		const char* compressed = in.read(chunk.compressedSize);
+		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.uncompressedSize]);
+
+		if (!data || !compressed)
+		{
+			output->error("Error reading data file %s: malformed chunk\n", pack->dataPath.c_str());
+			return false;
+		}
+
+		decompressChunk(data.get(), chunk, compressed, pack->dictionary.get());
+
+		const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data.get());
+		size_t dataOffset = chunk.fileCount ? files[0].dataOffset : chunk.uncompressedSize;
+
+		const char* begin = data.get() + dataOffset;
+		size_t size = chunk.uncompressedSize - dataOffset;
+
+		IndexAnalysis::Chunk& info = result.chunks[c];
+
+		if (chunk.fileCount)
+			info.firstFile.assign(data.get() + files[0].nameOffset, files[0].nameLength);
+
+		// the ngrams that are actually in the chunk tell bloom filter collisions apart from atoms that are there
+		ngrams.clear();
+		extractNgrams(ngrams, begin, size);
+		std::sort(ngrams.begin(), ngrams.end());
+
+		extractShortNgrams(shortNgrams, begin, size);
+		std::sort(shortNgrams.begin(), shortNgrams.end());
+
+		info.indexSize = chunk.indexSize;
+		info.ngramCount = ngrams.size() + (chunk.indexType == DCI_BLOOMBLOCKED_SHORT ? shortNgrams.size() : 0);
+
+		result.unindexedChunks += chunk.indexSize == 0;
+
+		for (size_t i = 0; i < queries.size(); ++i)
+		{
+			const NgramRegex& ngregex = ngregexes[i];
+			const std::vector<NgramAtom>& atoms = ngregex.getAtoms();
+			IndexAnalysis::Query& query = result.queries[i];
+
+			present.clear();
+			reported.clear();
+
+			for (size_t a = 0; a < atoms.size(); ++a)
+			{
+				bool has = hasAtomNgrams(ngrams, shortNgrams, atoms[a]);
+				bool exists = chunk.indexSize == 0 || ngramExists(index.data(), index.size(), chunk.indexHashIterations, chunk.indexType, atoms[a]);
 
-			while (changeIt < changes.size())
+				if (has)
+					present.push_back(a);
+
+				if (exists)
+					reported.push_back(a);
+
+				if (chunk.indexSize && !has)
+				{
+					query.atoms[a].absentChunks++;
+					query.atoms[a].falsePositives += exists;
+				}
+			}
+
+			bool indexPassed = ngregex.matchAtoms(reported);
+			bool exact = query.identifiers || pack->hasPostings;
+			bool passed = candidates[i].empty() ? indexPassed : candidates[i][c] && (exact || indexPassed);
+
+			query.indexPassedChunks += indexPassed;
+
+			if (!passed)
+				continue;
+
+			query.passedChunks++;
+
+			const char* range = regexes[i]->rangePrepare(begin, size, &buffer);
+			bool matched = regexes[i]->rangeSearch(range, size);
+			regexes[i]->rangeFinalize(range, &buffer);
+
+			if (matched)
 			{
-				processChangedFile(regex.get(), &output, chunk, hlbuf, changes[changeIt], includeRe.get(), excludeRe.get());
-				changeIt++;
+				query.matchedChunks++;
+				continue;
 			}
 
-			output.output.end(chunk);
+			bool bloomFalsePositive = !ngregex.matchAtoms(present);
+
+			query.falsePositives++;
+			query.bloomFalsePositives += bloomFalsePositive;
+
+			info.falsePositives++;
+			info.bloomFalsePositives += bloomFalsePositive;
 		}
 	}
 
-	return output.output.getLineCount();
+	return true;
 }
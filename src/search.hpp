@@ -1,7 +1,13 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
+#include <string>
+#include <vector>
+
 class Output;
+class SearchCache;
+struct FilterSession;
+class TraceLog;
 
 enum SearchOptions
 {
@@ -21,9 +27,153 @@ enum SearchOptions
 	SO_HIGHLIGHT = 1 << 10,
 	SO_HIGHLIGHT_MATCHES = 1 << 11,
 
-	SO_SUMMARY = 1 << 12
+	SO_SUMMARY = 1 << 12,
+	SO_SUMMARY_EXTENDED = 1 << 18,
+
+	SO_QUERYFILE = 1 << 13,
+
+	SO_UNORDERED = 1 << 14,
+
+	SO_COUNT = 1 << 15,
+	SO_FILESONLY = 1 << 16,
+
+	SO_WINDOW = 1 << 17,
+
+	SO_WORD = 1 << 19,
 };
 
 unsigned int getRegexOptions(unsigned int options);
 
-unsigned int searchProject(Output* output, const char* file, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude);
+// Keeps data files and decompressed chunks resident between searches; searches that share a cache must not run concurrently
+SearchCache* createSearchCache(size_t memoryLimit);
+void destroySearchCache(SearchCache* cache);
+
+// Searches that use the cache only cover the index-th of count contiguous ranges of the chunks of every project
+void setSearchCacheShard(SearchCache* cache, unsigned int index, unsigned int count);
+
+// File searches of the project that use the session only look at the results of the last one if the query refines it
+FilterSession* getSearchCacheFilterSession(SearchCache* cache, const char* file);
+
+// Opens the project data ahead of the first search
+bool preloadSearchCache(Output* output, SearchCache* cache, const char* file);
+
+// Chunk counts and stage times of one search; searches only fill them in if they are given a statistics object, and results from the search cache leave them empty
+struct SearchStatistics
+{
+	// chunks in all searched projects, and the chunks that were rejected by the index or path filters without reading chunk data
+	uint64_t chunkCount;
+	uint64_t chunksSkipped;
+
+	// chunks that were queued for search, and the amount of chunk data they contain
+	uint64_t chunksSearched;
+	uint64_t chunksCached;
+	uint64_t compressedSize;
+	uint64_t uncompressedSize;
+
+	// chunk data that was decompressed, which leaves out the blocks rejected by the block index, and the output that was written
+	uint64_t decompressedSize;
+	uint64_t outputSize;
+
+	// Stage times are only measured if timing is set; stages are recorded to the trace as well if there is one
+	bool timing;
+	TraceLog* trace;
+
+	// Times in microseconds, summed over all threads: reads of project data and index checks on the producer and on workers
+	uint64_t readTime;
+	uint64_t indexTime;
+
+	// decompression and search of chunks; search time includes the changed files, which are read from disk
+	// changed file time is measured even without timing, since it's also saved for the watcher of the project
+	uint64_t decompressTime;
+	uint64_t matchTime;
+	uint64_t changeTime;
+
+	// results written by the output thread
+	uint64_t writeTime;
+
+	// producer waiting for queue memory and index checks, workers waiting for jobs, and the producer (or, for unordered
+	// output, workers) waiting for the output thread
+	uint64_t producerWaitTime;
+	uint64_t workerIdleTime;
+	uint64_t outputWaitTime;
+
+	SearchStatistics(): chunkCount(0), chunksSkipped(0), chunksSearched(0), chunksCached(0), compressedSize(0), uncompressedSize(0), decompressedSize(0), outputSize(0)
+		, timing(false), trace(nullptr), readTime(0), indexTime(0), decompressTime(0), matchTime(0), changeTime(0), writeTime(0), producerWaitTime(0), workerIdleTime(0), outputWaitTime(0)
+	{
+	}
+};
+
+// All projects are searched at once with a shared worker pool; results are ordered by project
+unsigned int searchProject(Output* output, const std::vector<std::string>& files, const char* string, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchCache* cache = nullptr, SearchStatistics* statistics = nullptr);
+unsigned int searchProjectMulti(Output* output, const std::vector<std::string>& files, const std::vector<std::string>& strings, unsigned int options, unsigned int limit, const char* include, const char* exclude, SearchCache* cache = nullptr, SearchStatistics* statistics = nullptr);
+
+// Index decisions for a list of queries over the chunks of a project; every chunk is searched to find out which of the chunks that pass the indices have matches
+struct IndexAnalysis
+{
+	struct Atom
+	{
+		std::string text;
+
+		// indexed chunks that don't contain all ngrams of the atom, and the ones among them that the chunk index reports the atom for
+		unsigned int absentChunks;
+		unsigned int falsePositives;
+
+		Atom(): absentChunks(0), falsePositives(0)
+		{
+		}
+	};
+
+	struct Query
+	{
+		std::string query;
+		std::vector<Atom> atoms;
+
+		// chunks that a search reads, chunks that the chunk indices alone let through, and chunks with matches
+		unsigned int passedChunks;
+		unsigned int indexPassedChunks;
+		unsigned int matchedChunks;
+
+		// chunks that pass without matches; bloom false positives are the ones that an exact ngram index would reject
+		unsigned int falsePositives;
+		unsigned int bloomFalsePositives;
+
+		// whole word query that the identifier index selects the chunks for
+		bool identifiers;
+
+		Query(): passedChunks(0), indexPassedChunks(0), matchedChunks(0), falsePositives(0), bloomFalsePositives(0), identifiers(false)
+		{
+		}
+	};
+
+	struct Chunk
+	{
+		std::string firstFile;
+
+		// distinct ngrams of the chunk data, which is what the index is sized for
+		size_t indexSize;
+		size_t ngramCount;
+
+		// false positives of all queries
+		unsigned int falsePositives;
+		unsigned int bloomFalsePositives;
+
+		Chunk(): indexSize(0), ngramCount(0), falsePositives(0), bloomFalsePositives(0)
+		{
+		}
+	};
+
+	// chunks without an index always pass; searches use posting lists or slices before chunk indices if the project has them
+	unsigned int unindexedChunks;
+	bool hasPostings;
+	bool hasSlices;
+	bool hasIdentifiers;
+
+	std::vector<Query> queries;
+	std::vector<Chunk> chunks;
+
+	IndexAnalysis(): unindexedChunks(0), hasPostings(false), hasSlices(false), hasIdentifiers(false)
+	{
+	}
+};
+
+bool analyzeSearchIndex(Output* output, const char* file, const std::vector<std::string>& queries, unsigned int options, IndexAnalysis& result);
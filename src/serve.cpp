@@ -0,0 +1,446 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "serve.hpp"
+
+#include "output.hpp"
+#include "ipc.hpp"
+#include "format.hpp"
+#include "search.hpp"
+#include "constants.hpp"
+#include "stringutil.hpp"
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+#include <string.h>
+
+// Requests are small, so anything larger than this is a protocol error
+const uint32_t kServerMaxArguments = 1024;
+const uint32_t kServerMaxArgumentSize = 1024 * 1024;
+
+// Sends output to the client in batches of messages; the command is cancelled once the client goes away
+class ConnectionOutput: public Output
+{
+public:
+	ConnectionOutput(IpcConnection* connection, bool istty): connection(connection), istty(istty), failed(false)
+	{
+	}
+
+	virtual void rawprint(const char* data, size_t size)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		append(SMT_OUTPUT, data, size);
+	}
+
+	virtual void print(const char* message, ...)
+	{
+		va_list l;
+		va_start(l, message);
+		std::string result;
+		strprintf(result, message, l);
+		va_end(l);
+
+		std::unique_lock<std::mutex> lock(mutex);
+
+		append(SMT_OUTPUT, result.c_str(), result.size());
+	}
+
+	virtual void error(const char* message, ...)
+	{
+		va_list l;
+		va_start(l, message);
+		std::string result;
+		strprintf(result, message, l);
+		va_end(l);
+
+		std::unique_lock<std::mutex> lock(mutex);
+
+		append(SMT_ERROR, result.c_str(), result.size());
+	}
+
+	virtual bool isTTY()
+	{
+		return istty;
+	}
+
+	virtual bool isCancelled()
+	{
+		return failed;
+	}
+
+	void finish()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		append(SMT_END, nullptr, 0);
+		flush();
+	}
+
+private:
+	void append(uint32_t type, const char* data, size_t size)
+	{
+		if (failed)
+			return;
+
+		ServerMessageHeader header = { type, static_cast<uint32_t>(size) };
+
+		buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+		buffer.append(data, size);
+
+		if (buffer.size() >= kServerOutputBufferSize)
+			flush();
+	}
+
+	void flush()
+	{
+		if (!failed && !buffer.empty() && !connection->write(buffer.data(), buffer.size()))
+			failed = true;
+
+		buffer.clear();
+	}
+
+	IpcConnection* connection;
+	bool istty;
+
+	std::mutex mutex;
+	std::string buffer;
+	std::atomic<bool> failed;
+};
+
+static bool writeRequest(IpcConnection* connection, bool istty, int argc, const char** argv, unsigned int shardIndex = 0, unsigned int shardCount = 0)
+{
+	ServerRequestHeader header;
+	memcpy(header.magic, kServerRequestMagic, sizeof(header.magic));
+	header.flags = istty ? SRF_TTY : 0;
+	header.argumentCount = argc;
+	header.shardIndex = shardIndex;
+	header.shardCount = shardCount;
+
+	std::string request(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	for (int i = 0; i < argc; ++i)
+	{
+		uint32_t length = strlen(argv[i]);
+
+		request.append(reinterpret_cast<const char*>(&length), sizeof(length));
+		request.append(argv[i], length);
+	}
+
+	return connection->write(request.data(), request.size());
+}
+
+static bool readRequest(IpcConnection* connection, ServerRequestHeader& header, std::vector<std::string>& arguments)
+{
+	if (!connection->read(&header, sizeof(header)) || memcmp(header.magic, kServerRequestMagic, sizeof(header.magic)) != 0)
+		return false;
+
+	if (header.argumentCount > kServerMaxArguments)
+		return false;
+
+	if (header.shardCount && header.shardIndex >= header.shardCount)
+		return false;
+
+	arguments.resize(header.argumentCount);
+
+	for (auto& arg: arguments)
+	{
+		uint32_t length = 0;
+
+		if (!connection->read(&length, sizeof(length)) || length > kServerMaxArgumentSize)
+			return false;
+
+		arg.resize(length);
+
+		if (length && !connection->read(&arg[0], length))
+			return false;
+	}
+
+	return true;
+}
+
+static void serveConnection(IpcConnection* connection, SearchCache* cache, const ServerCommandFunction& command)
+{
+	ServerRequestHeader header;
+	std::vector<std::string> arguments;
+
+	if (!readRequest(connection, header, arguments) || arguments.empty())
+		return;
+
+	std::vector<const char*> argv;
+
+	for (auto& arg: arguments)
+		argv.push_back(arg.c_str());
+
+	ConnectionOutput output(connection, (header.flags & SRF_TTY) != 0);
+
+	bool shard = header.shardCount != 0;
+
+	if (cache)
+		setSearchCacheShard(cache, shard ? header.shardIndex : 0, shard ? header.shardCount : 1);
+
+	command(&output, argv.size(), argv.data(), cache, shard);
+
+	output.finish();
+}
+
+void serveProjects(Output* output, const char* address, const std::vector<std::string>& paths, size_t cacheSize, const ServerCommandFunction& command)
+{
+	IpcServer server;
+
+	if (!server.listen(address))
+	{
+		output->error("Error listening at %s: the address is not accessible or another server is running\n", address);
+		return;
+	}
+
+	std::unique_ptr<SearchCache, void (*)(SearchCache*)> cache(createSearchCache(cacheSize), destroySearchCache);
+
+	for (auto& path: paths)
+		preloadSearchCache(output, cache.get(), path.c_str());
+
+	output->print("Listening at %s\n", address);
+
+	// requests are handled one at a time since searches share the cache
+	while (std::unique_ptr<IpcConnection> connection = server.accept())
+		serveConnection(connection.get(), cache.get(), command);
+
+	output->error("Error accepting connections at %s\n", address);
+}
+
+bool forwardServerCommand(Output* output, const char* address, int argc, const char** argv)
+{
+	std::unique_ptr<IpcConnection> connection = ipcConnect(address);
+
+	if (!connection || !writeRequest(connection.get(), output->isTTY(), argc, argv))
+		return false;
+
+	std::string data;
+	bool received = false;
+
+	for (;;)
+	{
+		ServerMessageHeader header;
+
+		// a server that rejects the request closes the connection right away, so the command can still run locally
+		if (!connection->read(&header, sizeof(header)))
+		{
+			if (!received)
+				return false;
+
+			output->error("Error reading response from server at %s\n", address);
+			return true;
+		}
+
+		received = true;
+
+		if (header.type == SMT_END)
+			return true;
+
+		data.resize(header.size);
+
+		if (header.size && !connection->read(&data[0], header.size))
+		{
+			output->error("Error reading response from server at %s\n", address);
+			return true;
+		}
+
+		if (header.type == SMT_ERROR)
+			output->error("%s", data.c_str());
+		else
+			output->rawprint(data.data(), data.size());
+	}
+}
+
+void coordinateServers(Output* output, const char* address, size_t shardCount, const ServerCommandFunction& command)
+{
+	IpcServer server;
+
+	if (!server.listen(address))
+	{
+		output->error("Error listening at %s: the address is not accessible or another server is running\n", address);
+		return;
+	}
+
+	output->print("Listening at %s, forwarding searches to %d shard servers\n", address, int(shardCount));
+
+	while (std::unique_ptr<IpcConnection> connection = server.accept())
+		serveConnection(connection.get(), nullptr, command);
+
+	output->error("Error accepting connections at %s\n", address);
+}
+
+// Response of one shard that is read in the background, so that all shards search at the same time while the results are printed in order
+// The reader owns the connection and outlives the response if it's cancelled; the connection is closed at the next message, which cancels the search on the shard
+class ShardReader
+{
+public:
+	ShardReader(std::unique_ptr<IpcConnection> connection): connection(std::move(connection)), bufferSize(0), finished(false), failed(false), cancelled(false)
+	{
+	}
+
+	static void run(std::shared_ptr<ShardReader> reader)
+	{
+		for (;;)
+		{
+			ServerMessageHeader header;
+			std::string data;
+
+			bool received = reader->connection->read(&header, sizeof(header));
+
+			if (received && header.type != SMT_END)
+			{
+				data.resize(header.size);
+				received = header.size == 0 || reader->connection->read(&data[0], header.size);
+			}
+
+			std::unique_lock<std::mutex> lock(reader->mutex);
+
+			// shards can produce results much faster than the client reads them, so output of later shards waits here
+			if (received && header.type != SMT_END)
+				reader->producerReady.wait(lock, [&]() { return reader->cancelled || reader->bufferSize < kShardOutputBufferSize; });
+
+			if (!received || header.type == SMT_END || reader->cancelled)
+			{
+				reader->finished = true;
+				reader->failed = !received;
+				reader->connection.reset();
+				reader->consumerReady.notify_one();
+				break;
+			}
+
+			reader->bufferSize += data.size();
+			reader->messages.emplace_back(header.type, std::move(data));
+			reader->consumerReady.notify_one();
+		}
+	}
+
+	// Waits for the next message; returns false at the end of the response
+	bool next(uint32_t& type, std::string& data)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		consumerReady.wait(lock, [&]() { return finished || !messages.empty(); });
+
+		if (messages.empty())
+			return false;
+
+		type = messages.front().first;
+		data = std::move(messages.front().second);
+
+		messages.pop_front();
+		bufferSize -= data.size();
+		producerReady.notify_one();
+
+		return true;
+	}
+
+	// Has to be called after next returns false
+	bool isFailed()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		return failed;
+	}
+
+	void cancel()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		cancelled = true;
+		producerReady.notify_one();
+	}
+
+private:
+	std::unique_ptr<IpcConnection> connection;
+
+	std::mutex mutex;
+	std::condition_variable producerReady;
+	std::condition_variable consumerReady;
+
+	std::deque<std::pair<uint32_t, std::string>> messages;
+	size_t bufferSize;
+
+	bool finished;
+	bool failed;
+	bool cancelled;
+};
+
+// Returns the size of the prefix of the data that has at most count lines, and subtracts the lines in it from count
+static size_t takeLines(const char* data, size_t size, unsigned int& count)
+{
+	size_t offset = 0;
+
+	while (count > 0 && offset < size)
+	{
+		const char* end = static_cast<const char*>(memchr(data + offset, '\n', size - offset));
+
+		if (!end)
+			return size;
+
+		offset = end - data + 1;
+		count--;
+	}
+
+	return offset;
+}
+
+unsigned int forwardShardCommand(Output* output, const std::vector<std::string>& shards, int argc, const char** argv, unsigned int limit)
+{
+	std::vector<std::shared_ptr<ShardReader>> readers;
+
+	for (size_t i = 0; i < shards.size(); ++i)
+	{
+		std::unique_ptr<IpcConnection> connection = ipcConnect(shards[i].c_str());
+
+		if (!connection || !writeRequest(connection.get(), output->isTTY(), argc, argv, i, shards.size()))
+		{
+			output->error("Error sending request to shard server at %s\n", shards[i].c_str());
+
+			for (auto& reader: readers)
+				reader->cancel();
+
+			return 0;
+		}
+
+		readers.emplace_back(new ShardReader(std::move(connection)));
+
+		std::thread(ShardReader::run, readers.back()).detach();
+	}
+
+	unsigned int remaining = limit;
+
+	for (size_t i = 0; i < readers.size(); ++i)
+	{
+		ShardReader* reader = readers[i].get();
+
+		uint32_t type;
+		std::string data;
+
+		while (remaining > 0 && !output->isCancelled() && reader->next(type, data))
+		{
+			if (type == SMT_ERROR)
+				output->error("%s", data.c_str());
+			else
+				output->rawprint(data.data(), takeLines(data.data(), data.size(), remaining));
+		}
+
+		// once enough results are printed, the remaining shards are cancelled
+		if (remaining == 0 || output->isCancelled())
+		{
+			for (size_t j = i; j < readers.size(); ++j)
+				readers[j]->cancel();
+
+			break;
+		}
+
+		if (reader->isFailed())
+			output->error("Error reading response from shard server at %s\n", shards[i].c_str());
+	}
+
+	return limit - remaining;
+}
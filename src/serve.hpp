@@ -0,0 +1,24 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class Output;
+class SearchCache;
+
+// Shard requests come from a coordinator, which prints the search summary itself
+typedef std::function<void (Output* output, int argc, const char** argv, SearchCache* cache, bool shard)> ServerCommandFunction;
+
+// Answers requests until the process is terminated; project data and decompressed chunks stay resident between requests
+void serveProjects(Output* output, const char* address, const std::vector<std::string>& paths, size_t cacheSize, const ServerCommandFunction& command);
+
+// Runs the command on the server and prints the results; returns false if the server is not running, in which case the command should run locally
+bool forwardServerCommand(Output* output, const char* address, int argc, const char** argv);
+
+// Answers requests by running them on shard servers, which can be local or network servers, until the process is terminated; the command gets no cache
+void coordinateServers(Output* output, const char* address, size_t shardCount, const ServerCommandFunction& command);
+
+// Runs the command on all shard servers at once, each searching one chunk range of the project, and prints up to limit lines of results in shard order; returns the number of lines printed
+unsigned int forwardShardCommand(Output* output, const std::vector<std::string>& shards, int argc, const char** argv, unsigned int limit);
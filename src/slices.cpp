@@ -0,0 +1,238 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "slices.hpp"
+
+#include "output.hpp"
+#include "format.hpp"
+#include "fileutil.hpp"
+#include "filestream.hpp"
+#include "datafile.hpp"
+#include "constants.hpp"
+#include "bloom.hpp"
+
+#include <algorithm>
+#include <string>
+
+#include <string.h>
+
+static size_t getGroupRowSize(size_t chunkCount, size_t group, size_t groupSize)
+{
+	size_t count = std::min(groupSize, chunkCount - group * groupSize);
+
+	// rows are padded to 128 bits so that they can be processed with SIMD
+	return (count + 127) / 128 * 16;
+}
+
+static bool isChunkIndexFoldable(const DataChunkHeader& chunk)
+{
+	size_t blocks = chunk.indexSize / kBloomBlockSize;
+
+	return (chunk.indexType == DCI_BLOOMBLOCKED || chunk.indexType == DCI_BLOOMBLOCKED_SHORT) && chunk.indexHashIterations >= kSliceIndexIterations &&
+		chunk.indexSize % kBloomBlockSize == 0 && (blocks & (blocks - 1)) == 0 && blocks >= kSliceIndexBlocks;
+}
+
+static void foldChunkIndex(unsigned char* signature, const unsigned char* index, size_t indexSize)
+{
+	// blocked index with N blocks selects block as hash & (N - 1), so folding blocks with OR results in a valid index of smaller size
+	memcpy(signature, index, kSliceIndexBlocks * kBloomBlockSize);
+
+	for (size_t offset = kSliceIndexBlocks * kBloomBlockSize; offset < indexSize; offset += kSliceIndexBlocks * kBloomBlockSize)
+		for (size_t i = 0; i < kSliceIndexBlocks * kBloomBlockSize; ++i)
+			signature[i] |= index[offset + i];
+}
+
+bool buildSlices(Output* output, const char* path)
+{
+	std::string dataPath = replaceExtension(path, ".qgd");
+	std::string targetPath = replaceExtension(path, ".qgx");
+	std::string tempPath = targetPath + "_";
+
+	DataFileReader in(dataPath.c_str());
+	std::vector<DataChunkDirectoryEntry> chunks;
+
+	if (!in || !readDataFileDirectory(in, chunks))
+	{
+		output->error("Error reading data file %s\n", dataPath.c_str());
+		return false;
+	}
+
+	// small projects are fast to filter using chunk indices
+	if (chunks.size() < kSliceIndexMinChunks)
+	{
+		removeFile(targetPath.c_str());
+		return true;
+	}
+
+	{
+		FileStream out(tempPath.c_str(), "wb");
+		if (!out)
+		{
+			output->error("Error saving slice index %s\n", tempPath.c_str());
+			return false;
+		}
+
+		SliceFileHeader header = {};
+		memcpy(header.magic, kSliceFileHeaderMagic, sizeof(header.magic));
+		header.chunkCount = chunks.size();
+		header.groupSize = kSliceIndexGroupSize;
+		header.blockCount = kSliceIndexBlocks;
+		header.iterations = kSliceIndexIterations;
+		header.dataFileSize = in.size();
+
+		out.write(&header, sizeof(header));
+
+		const size_t rowCount = kSliceIndexBlocks * kBloomBlockSize * 8;
+
+		std::vector<unsigned char> rows;
+		std::vector<unsigned char> signature(kSliceIndexBlocks * kBloomBlockSize);
+
+		for (size_t group = 0; group * kSliceIndexGroupSize < chunks.size(); ++group)
+		{
+			size_t rowSize = getGroupRowSize(chunks.size(), group, kSliceIndexGroupSize);
+
+			rows.assign(rowCount * rowSize, 0);
+
+			for (size_t i = group * kSliceIndexGroupSize; i < chunks.size() && i < (group + 1) * kSliceIndexGroupSize; ++i)
+			{
+				const DataChunkDirectoryEntry& entry = chunks[i];
+
+				size_t byte = (i - group * kSliceIndexGroupSize) / 8;
+				unsigned char bit = 1 << (i % 8);
+
+				if (isChunkIndexFoldable(entry.header))
+				{
+					in.seek(entry.indexOffset);
+
+					const char* index = in.read(entry.header.indexSize);
+
+					if (!index)
+					{
+						output->error("Error reading data file %s: malformed chunk\n", dataPath.c_str());
+						return false;
+					}
+
+					foldChunkIndex(&signature[0], reinterpret_cast<const unsigned char*>(index), entry.header.indexSize);
+
+					for (size_t k = 0; k < signature.size(); ++k)
+						if (unsigned int v = signature[k])
+							for (size_t j = 0; j < 8; ++j)
+								if (v & (1 << j))
+									rows[(k * 8 + j) * rowSize + byte] |= bit;
+				}
+				else
+				{
+					// chunks without a suitable index can't be filtered
+					for (size_t k = 0; k < rowCount; ++k)
+						rows[k * rowSize + byte] |= bit;
+				}
+			}
+
+			out.write(&rows[0], rows.size());
+		}
+
+		if (!out)
+		{
+			output->error("Error saving slice index %s\n", tempPath.c_str());
+			return false;
+		}
+	}
+
+	if (!renameFile(tempPath.c_str(), targetPath.c_str()))
+	{
+		output->error("Error saving slice index %s\n", targetPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+SliceIndex::SliceIndex(): data(nullptr), size(0), chunkCount(0), groupSize(0), blockCount(0), iterations(0)
+{
+}
+
+SliceIndex::~SliceIndex()
+{
+	if (data) unmapFile(data, size);
+}
+
+bool SliceIndex::open(const char* path, uint64_t dataFileSize, size_t chunkCount)
+{
+	assert(!data);
+
+	std::string indexPath = replaceExtension(path, ".qgx");
+
+	data = static_cast<const char*>(mapFile(indexPath.c_str(), &size));
+	if (!data) return false;
+
+	SliceFileHeader header;
+
+	if (size < sizeof(header))
+		return false;
+
+	memcpy(&header, data, sizeof(header));
+
+	if (memcmp(header.magic, kSliceFileHeaderMagic, strlen(kSliceFileHeaderMagic)) != 0 || header.dataFileSize != dataFileSize || header.chunkCount != chunkCount)
+		return false;
+
+	if (header.groupSize == 0 || header.groupSize % 128 != 0 || header.blockCount == 0 || (header.blockCount & (header.blockCount - 1)) != 0 ||
+		header.iterations == 0 || header.iterations > kBloomMaxIterations)
+		return false;
+
+	uint64_t rowCount = uint64_t(header.blockCount) * kBloomBlockSize * 8;
+	uint64_t expectedSize = sizeof(header);
+
+	for (size_t group = 0; group * header.groupSize < header.chunkCount; ++group)
+		expectedSize += rowCount * getGroupRowSize(header.chunkCount, group, header.groupSize);
+
+	if (size != expectedSize)
+		return false;
+
+	this->chunkCount = header.chunkCount;
+	this->groupSize = header.groupSize;
+	this->blockCount = header.blockCount;
+	this->iterations = header.iterations;
+
+	return true;
+}
+
+size_t SliceIndex::getChunkSetSize() const
+{
+	return (chunkCount + groupSize - 1) / groupSize * groupSize / 8;
+}
+
+void SliceIndex::intersect(std::vector<unsigned char>& chunks, unsigned int ngram) const
+{
+	assert(data && chunks.size() == getChunkSetSize());
+
+	BloomBlockedProbe probe;
+	bloomBlockedProbePrepare(probe, ngram, iterations);
+
+	size_t block = probe.hash & (blockCount - 1);
+
+	size_t rowCount = blockCount * kBloomBlockSize * 8;
+	const char* group = data + sizeof(SliceFileHeader);
+
+	for (size_t g = 0; g * groupSize < chunkCount; ++g)
+	{
+		size_t rowSize = getGroupRowSize(chunkCount, g, groupSize);
+		unsigned char* result = &chunks[g * groupSize / 8];
+
+		for (size_t k = 0; k < kBloomBlockSize; ++k)
+			if (unsigned int v = probe.mask[k])
+				for (size_t j = 0; j < 8; ++j)
+					if (v & (1 << j))
+					{
+						const char* row = group + ((block * kBloomBlockSize + k) * 8 + j) * rowSize;
+
+					#if defined(USE_SSE2) || defined(USE_NEON)
+						for (size_t i = 0; i < rowSize; i += 16)
+							simd_store(result + i, simd_and(simd_load(result + i), simd_load(row + i)));
+					#else
+						for (size_t i = 0; i < rowSize; ++i)
+							result[i] &= row[i];
+					#endif
+					}
+
+		group += rowCount * rowSize;
+	}
+}
@@ -0,0 +1,36 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <vector>
+
+class Output;
+
+bool buildSlices(Output* output, const char* path);
+
+class SliceIndex
+{
+public:
+	SliceIndex();
+	~SliceIndex();
+
+	// Opens the slice index for the data file; fails if the index is missing or doesn't match the data file
+	bool open(const char* path, uint64_t dataFileSize, size_t chunkCount);
+
+	// Bit set with one bit per chunk, padded to a group boundary
+	size_t getChunkSetSize() const;
+
+	// Clears bits for chunks that definitely don't contain the ngram
+	void intersect(std::vector<unsigned char>& chunks, unsigned int ngram) const;
+
+private:
+	SliceIndex(const SliceIndex&);
+	SliceIndex& operator=(const SliceIndex&);
+
+	const char* data;
+	uint64_t size;
+
+	unsigned int chunkCount;
+	unsigned int groupSize;
+	unsigned int blockCount;
+	unsigned int iterations;
+};
@@ -0,0 +1,121 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "snapshot.hpp"
+
+#include "output.hpp"
+#include "format.hpp"
+#include "fileutil.hpp"
+#include "filestream.hpp"
+#include "compression.hpp"
+#include "constants.hpp"
+
+#include <string.h>
+
+bool readDirectorySnapshot(const char* path, DirectorySnapshot& snapshot)
+{
+	snapshot.scansLeft = 0;
+	snapshot.listings.clear();
+
+	// the snapshot is only a cache, so a missing or malformed file just means that the project has to be scanned in full
+	FileStream in(replaceExtension(path, ".qgs").c_str(), "rb");
+	if (!in)
+		return false;
+
+	SnapshotFileHeader header;
+	if (!read(in, header) || memcmp(header.magic, kSnapshotFileHeaderMagic, strlen(kSnapshotFileHeaderMagic)) != 0)
+		return false;
+
+	std::unique_ptr<char[]> compressed(new (std::nothrow) char[header.compressedSize]);
+	std::unique_ptr<char[]> data(new (std::nothrow) char[header.uncompressedSize]);
+
+	if (!compressed || !data || !read(in, compressed.get(), header.compressedSize))
+		return false;
+
+	decompress(data.get(), header.uncompressedSize, compressed.get(), header.compressedSize);
+
+	const char* pos = data.get();
+	const char* end = data.get() + header.uncompressedSize;
+
+	for (unsigned int i = 0; i < header.directoryCount; ++i)
+	{
+		SnapshotFileEntry e;
+
+		if (size_t(end - pos) < sizeof(e))
+			return false;
+
+		memcpy(&e, pos, sizeof(e));
+		pos += sizeof(e);
+
+		if (size_t(end - pos) < e.pathLength)
+			return false;
+
+		DirectoryListing& listing = snapshot.listings[std::string(pos, e.pathLength)];
+		pos += e.pathLength;
+
+		listing.mtime = e.mtime;
+		listing.names.reserve(e.nameCount);
+
+		for (unsigned int j = 0; j < e.nameCount; ++j)
+		{
+			const char* name = static_cast<const char*>(memchr(pos, 0, end - pos));
+			if (!name)
+				return false;
+
+			listing.names.emplace_back(pos, name);
+			pos = name + 1;
+		}
+	}
+
+	snapshot.scansLeft = header.scansLeft;
+
+	return true;
+}
+
+bool writeDirectorySnapshot(Output* output, const char* path, const DirectorySnapshot& snapshot)
+{
+	std::string targetPath = replaceExtension(path, ".qgs");
+	std::string tempPath = targetPath + "_";
+
+	std::vector<char> data;
+
+	for (auto& p: snapshot.listings)
+	{
+		SnapshotFileEntry e = { p.second.mtime, uint32_t(p.first.size()), uint32_t(p.second.names.size()) };
+
+		data.insert(data.end(), reinterpret_cast<const char*>(&e), reinterpret_cast<const char*>(&e + 1));
+		data.insert(data.end(), p.first.begin(), p.first.end());
+
+		for (auto& name: p.second.names)
+			data.insert(data.end(), name.c_str(), name.c_str() + name.size() + 1);
+	}
+
+	std::pair<std::unique_ptr<char[]>, size_t> compressed = compress(data.data(), data.size(), kFileListCompressionLevel);
+
+	{
+		FileStream out(tempPath.c_str(), "wb");
+		if (!out)
+		{
+			output->error("Error saving directory snapshot %s\n", tempPath.c_str());
+			return false;
+		}
+
+		SnapshotFileHeader header;
+		memcpy(header.magic, kSnapshotFileHeaderMagic, sizeof(header.magic));
+
+		header.scansLeft = snapshot.scansLeft;
+		header.directoryCount = snapshot.listings.size();
+		header.compressedSize = compressed.second;
+		header.uncompressedSize = data.size();
+
+		out.write(&header, sizeof(header));
+		if (compressed.first) out.write(compressed.first.get(), compressed.second);
+	}
+
+	if (!renameFile(tempPath.c_str(), targetPath.c_str()))
+	{
+		output->error("Error saving directory snapshot %s\n", targetPath.c_str());
+		return false;
+	}
+
+	return true;
+}
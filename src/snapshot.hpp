@@ -0,0 +1,19 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include "fileutil.hpp"
+
+class Output;
+
+// Directory listings from the last scan of the project; update uses them to skip reading directories that didn't change
+struct DirectorySnapshot
+{
+	// number of scans that can reuse the listings before the project has to be scanned in full
+	unsigned int scansLeft;
+
+	DirectoryListingCache listings;
+};
+
+// Returns false if the project has no usable snapshot
+bool readDirectorySnapshot(const char* path, DirectorySnapshot& snapshot);
+bool writeDirectorySnapshot(Output* output, const char* path, const DirectorySnapshot& snapshot);
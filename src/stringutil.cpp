@@ -2,6 +2,94 @@
 #include "common.hpp"
 #include "stringutil.hpp"
 
+#if defined(USE_SSE2) || defined(USE_NEON)
+#include "charsimd.hpp"
+#endif
+
+#include <algorithm>
+
+#ifdef USE_SSE2
+SIMD_TARGET_AVX2 static const char* countLinesAVX2(const char* begin, const char* end, unsigned int& count)
+{
+	simd32 newline = simd32_dup('\n');
+
+	const char* s = begin;
+
+	while (end - s >= 32)
+	{
+		size_t blocks = std::min<size_t>((end - s) / 32, 255);
+		simd32 counts = simd32_dup(0);
+
+		for (size_t i = 0; i < blocks; ++i, s += 32)
+			counts = simd32_sub(counts, simd32_cmpeq(simd32_load(s), newline));
+
+		count += simd32_sum(counts);
+	}
+
+	return s;
+}
+#endif
+
+const char* findLineStart(const char* begin, const char* pos)
+{
+	const char* s = pos;
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+	simd16 newline = simd_dup('\n');
+
+	for (; s - begin >= 16; s -= 16)
+		if (int mask = simd_movemask(simd_cmpeq(simd_load(s - 16), newline)))
+			return s - countLeadingZeros(mask << 16);
+#endif
+
+	for (; s > begin; --s)
+		if (s[-1] == '\n')
+			return s;
+
+	return begin;
+}
+
+const char* findLineEnd(const char* pos, const char* end)
+{
+	// memchr is vectorized by the C runtime
+	const char* result = static_cast<const char*>(memchr(pos, '\n', end - pos));
+
+	return result ? result : end;
+}
+
+unsigned int countLines(const char* begin, const char* end)
+{
+	unsigned int result = 0;
+
+	const char* s = begin;
+
+#ifdef USE_SSE2
+	if (end - s >= 64 && simd_avx2())
+		s = countLinesAVX2(s, end, result);
+#endif
+
+#if defined(USE_SSE2) || defined(USE_NEON)
+	simd16 newline = simd_dup('\n');
+
+	while (end - s >= 16)
+	{
+		// every byte counts up to 255 newlines, which are added up once per 255 blocks
+		size_t blocks = std::min<size_t>((end - s) / 16, 255);
+		simd16 counts = simd_dup(0);
+
+		for (size_t i = 0; i < blocks; ++i, s += 16)
+			counts = simd_sub(counts, simd_cmpeq(simd_load(s), newline));
+
+		result += simd_sum(counts);
+	}
+#endif
+
+	for (; s != end; ++s)
+		result += (*s == '\n');
+
+	return result;
+}
+
 void strprintf(std::string& result, const char* format, va_list args)
 {
 	// copy arglist before use so that we can use it again below
@@ -0,0 +1,111 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#include "common.hpp"
+#include "trace.hpp"
+
+#include "filestream.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include <stdio.h>
+
+static std::atomic<unsigned int> nextLogId(1);
+
+// buffer of the log that the calling thread recorded to last
+static thread_local unsigned int currentLog;
+static thread_local void* currentThread;
+
+uint64_t getTraceTime()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TraceLog::TraceLog(): id(nextLogId++), start(getTraceTime())
+{
+}
+
+TraceLog::~TraceLog()
+{
+}
+
+void TraceLog::record(const char* thread, const char* name, uint64_t begin, uint64_t end)
+{
+	Event e = { name, begin, end };
+
+	getThread(thread)->events.push_back(e);
+}
+
+TraceLog::Thread* TraceLog::getThread(const char* name)
+{
+	if (currentLog == id)
+		return static_cast<Thread*>(currentThread);
+
+	std::unique_ptr<Thread> thread(new Thread());
+	thread->name = name;
+
+	Thread* result = thread.get();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		threads.push_back(std::move(thread));
+	}
+
+	currentLog = id;
+	currentThread = result;
+
+	return result;
+}
+
+static void appendJsonString(std::string& result, const char* value)
+{
+	result += '"';
+
+	for (const char* s = value; *s; ++s)
+	{
+		if (*s == '"' || *s == '\\')
+			result += '\\';
+
+		result += *s;
+	}
+
+	result += '"';
+}
+
+bool TraceLog::write(const char* path) const
+{
+	std::string result = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		const Thread& thread = *threads[i];
+
+		result += "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " + std::to_string(i + 1) + ", \"args\": {\"name\": ";
+		appendJsonString(result, thread.name);
+		result += "}}";
+
+		for (auto& e: thread.events)
+		{
+			result += ",\n{\"name\": ";
+			appendJsonString(result, e.name);
+
+			// events that started before the log was created are clamped to its start
+			uint64_t begin = std::max(e.begin, start);
+
+			char buf[128];
+			snprintf(buf, sizeof(buf), ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %llu, \"dur\": %llu}",
+				int(i + 1), (unsigned long long)(begin - start), (unsigned long long)(std::max(e.end, begin) - begin));
+
+			result += buf;
+		}
+
+		result += (i + 1 < threads.size()) ? ",\n" : "\n";
+	}
+
+	result += "]}\n";
+
+	FileStream out(path, "wb");
+
+	return out && out.write(result.c_str(), result.size()) == result.size();
+}
@@ -0,0 +1,86 @@
+// This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+
+#include <stdint.h>
+
+// Monotonic time in microseconds
+uint64_t getTraceTime();
+
+// Events of the threads that take part in one operation, written as Chrome trace JSON (chrome://tracing or Perfetto)
+// Every thread records into a buffer of its own, so recording only locks for the first event of a thread
+class TraceLog
+{
+public:
+	TraceLog();
+	~TraceLog();
+
+	// Names have to stay valid until the log is written; the thread name is taken from the first event of the thread
+	void record(const char* thread, const char* name, uint64_t begin, uint64_t end);
+
+	// Has to be called after all threads are done recording
+	bool write(const char* path) const;
+
+private:
+	struct Event
+	{
+		const char* name;
+		uint64_t begin;
+		uint64_t end;
+	};
+
+	struct Thread
+	{
+		const char* name;
+		std::vector<Event> events;
+	};
+
+	Thread* getThread(const char* name);
+
+	// distinguishes logs in the per-thread buffer cache, since a log can be allocated where an old one was
+	unsigned int id;
+	uint64_t start;
+
+	std::mutex mutex;
+	std::vector<std::unique_ptr<Thread>> threads;
+
+	TraceLog(const TraceLog&);
+	TraceLog& operator=(const TraceLog&);
+};
+
+// Adds the time spent in the scope to the counter and records it to the trace if there is one; nothing is measured unless timing is enabled
+class TraceScope
+{
+public:
+	TraceScope(bool timing, TraceLog* trace, uint64_t& counter, const char* thread, const char* name)
+		: timing(timing), trace(trace), counter(counter), thread(thread), name(name), begin(timing ? getTraceTime() : 0)
+	{
+	}
+
+	~TraceScope()
+	{
+		if (!timing)
+			return;
+
+		uint64_t end = getTraceTime();
+
+		counter += end - begin;
+
+		if (trace)
+			trace->record(thread, name, begin, end);
+	}
+
+private:
+	bool timing;
+	TraceLog* trace;
+	uint64_t& counter;
+	const char* thread;
+	const char* name;
+	uint64_t begin;
+
+	TraceScope(const TraceScope&);
+	TraceScope& operator=(const TraceScope&);
+};
@@ -6,15 +6,26 @@
 #include "build.hpp"
 #include "format.hpp"
 #include "fileutil.hpp"
-#include "filestream.hpp"
+#include "datafile.hpp"
+#include "compression.hpp"
 #include "project.hpp"
 #include "files.hpp"
-#include "compression.hpp"
-
+#include "slices.hpp"
+#include "postings.hpp"
+#include "snapshot.hpp"
+#include "changes.hpp"
+#include "constants.hpp"
+#include "budget.hpp"
+#include "workqueue.hpp"
+#include "blockpool.hpp"
+
+#include <algorithm>
 #include <memory>
 #include <vector>
+#include <deque>
 #include <string>
 #include <chrono>
+#include <future>
 
 #include <string.h>
 
@@ -73,49 +84,113 @@ static bool isFileCurrent(const FileInfo& info, const DataChunkFileHeader& file,
 	return info.timeStamp == file.timeStamp && info.fileSize == file.fileSize;
 }
 
-static bool isChunkCurrent(UpdateFileIterator& fileit, const DataChunkHeader& chunk, const DataChunkFileHeader* files, const char* data, bool firstFileIsSuffix)
+static bool isFileDataCurrent(BuildContext* builder, const DataChunkFileHeader& file)
 {
-	// if first file in the chunk is not the first file part, then the chunk is current iff we added this file before and the rest is current
-	// so we can just start comparison 1 entry before
-	size_t back = firstFileIsSuffix ? 1 : 0;
-	if (fileit.index < back || fileit.index - back + chunk.fileCount > fileit.files.size()) return false;
+	// references don't have data, and files that the class policies store differently now are read again
+	return !(file.flags & DCF_REFERENCE) && buildIsFilePolicyCurrent(builder, file.flags);
+}
+
+// Existing chunks are read and checked by workers ahead of time; results are processed in directory order
+struct ChunkRead
+{
+	const DataChunkDirectoryEntry* entry;
+
+	BlockRef data;
+	std::unique_ptr<char[]> index;
+	std::unique_ptr<char[]> extra;
+
+	const char* compressed;
+	char* uncompressed;
+	const CompressionDictionary* dictionary;
+
+	// position of the first chunk file in the file list if all chunk files are current
+	size_t currentIndex;
+	bool decompressed;
+
+	std::promise<void> ready;
+};
+
+struct PendingChunkRead
+{
+	std::shared_ptr<ChunkRead> read;
+	std::future<void> ready;
+};
+
+static const size_t kChunkNotCurrent = ~size_t(0);
+
+static size_t findCurrentChunk(BuildContext* builder, const std::vector<FileInfo>& infos, const DataChunkHeader& chunk, const DataChunkFileHeader* files, const char* data)
+{
+	// chunks are checked out of order, so the files are located by path; the file list is sorted and has no duplicates
+	auto it = std::lower_bound(infos.begin(), infos.end(), files[0], [&](const FileInfo& info, const DataChunkFileHeader& f) { return comparePath(info, f, data) < 0; });
+	size_t index = it - infos.begin();
+
+	if (index + chunk.fileCount > infos.size()) return kChunkNotCurrent;
 
 	for (size_t i = 0; i < chunk.fileCount; ++i)
 	{
 		const DataChunkFileHeader& f = files[i];
-		const FileInfo& info = fileit.files[fileit.index - back + i];
+		const FileInfo& info = infos[index + i];
 
-		if (comparePath(info, f, data) != 0 || !isFileCurrent(info, f, data))
-			return false;
+		if (comparePath(info, f, data) != 0 || !isFileCurrent(info, f, data) || !buildIsFilePolicyCurrent(builder, f.flags))
+			return kChunkNotCurrent;
 	}
 
-	return true;
+	return index;
 }
 
-static void processChunkData(Output* output, BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats,
-	const DataChunkHeader& chunk, char* buffer, std::unique_ptr<char[]>& compressed, std::unique_ptr<char[]>& index, std::unique_ptr<char[]>& extra)
+static bool isChunkCurrent(const UpdateFileIterator& fileit, const ChunkRead& read, bool firstFileIsSuffix)
 {
-	const char* data = buffer;
+	// if first file in the chunk is not the first file part, then the chunk is current iff we added this file before and the rest is current
+	// so we can just start comparison 1 entry before
+	size_t back = firstFileIsSuffix ? 1 : 0;
+
+	// files that are added before the chunk move the position, in which case the chunk has to be rebuilt to keep the order
+	return read.currentIndex != kChunkNotCurrent && fileit.index >= back && read.currentIndex == fileit.index - back;
+}
+
+static void prepareChunkRead(BuildContext* builder, ChunkRead& read, const std::vector<FileInfo>& infos)
+{
+	const DataChunkHeader& chunk = read.entry->header;
 
 	// decompress the file table part of the chunk; this allows us to skip full chunk decompression if chunk is fully up-to-date
-	decompressPartial(buffer, chunk.uncompressedSize, compressed.get(), chunk.compressedSize, chunk.fileTableSize);
+	decompressChunkFileTable(read.uncompressed, chunk, read.compressed, read.dictionary);
 
-	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(read.uncompressed);
 
-	// if chunk is fully up-to-date, we can try adding it directly and skipping chunk recompression
 	assert(chunk.fileCount > 0);
+	read.currentIndex = findCurrentChunk(builder, infos, chunk, files, read.uncompressed);
+
+	// stale chunks are decompressed completely here so that only the rebuild is left for the ordered part
+	if (read.currentIndex == kChunkNotCurrent)
+	{
+		decompressChunk(read.uncompressed, chunk, read.compressed, read.dictionary);
+		read.decompressed = true;
+	}
+}
+
+static void processChunkData(Output* output, BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats, ChunkRead& read, bool append)
+{
+	const DataChunkDirectoryEntry& entry = *read.entry;
+	const DataChunkHeader& chunk = entry.header;
+	const char* data = read.uncompressed;
+
+	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
 
 	bool firstFileIsSuffix = files[0].startLine > 0;
 
-	if (isChunkCurrent(fileit, chunk, files, data, firstFileIsSuffix) && buildAppendChunk(builder, chunk, compressed, index, extra, firstFileIsSuffix))
+	// if chunk is fully up-to-date, we can try adding it directly and skipping chunk recompression
+	// when appending, the chunk stays where it is in the data file and the new directory refers to it
+	if (isChunkCurrent(fileit, read, firstFileIsSuffix) &&
+		(append ? buildPreserveChunk(builder, entry, data, firstFileIsSuffix) : buildAppendChunk(builder, chunk, data, read.data, read.index, read.extra, firstFileIsSuffix)))
 	{
 		fileit += chunk.fileCount - firstFileIsSuffix;
 		stats.chunksPreserved++;
 		return;
 	}
 
-	// decompress the chunk completely. this decompresses the file table redundantly but the performance cost of that is negligible
-	decompress(buffer, chunk.uncompressedSize, compressed.get(), chunk.compressedSize);
+	// decompress the chunk completely if the worker didn't. this decompresses the file table redundantly but the performance cost of that is negligible
+	if (!read.decompressed)
+		decompressChunk(read.uncompressed, chunk, read.compressed, read.dictionary);
 
 	// as a special case, first file in the chunk can be a part of an existing file
 	bool skipFirstFile = false;
@@ -126,9 +201,9 @@ static void processChunkData(Output* output, BuildContext* builder, UpdateFileIt
 		const DataChunkFileHeader& f = files[0];
 		const FileInfo* prev = &fileit.files[fileit.index - 1];
 
-		if (comparePath(*prev, f, data) == 0 && isFileCurrent(*prev, f, data))
+		if (comparePath(*prev, f, data) == 0 && isFileCurrent(*prev, f, data) && isFileDataCurrent(builder, f))
 		{
-			buildAppendFilePart(builder, prev->path.c_str(), f.startLine, data + f.dataOffset, f.dataSize, prev->timeStamp, prev->fileSize);
+			buildAppendFilePart(builder, prev->path.c_str(), f.startLine, data + f.dataOffset, f.dataSize, prev->timeStamp, prev->fileSize, f.flags & DCF_CLASS_MASK);
 			skipFirstFile = true;
 		}
 	}
@@ -149,14 +224,14 @@ static void processChunkData(Output* output, BuildContext* builder, UpdateFileIt
 		if (fileit && comparePath(*fileit, f, data) == 0)
 		{
 			// check if we can reuse the data from qgrep db
-			if (isFileCurrent(*fileit, f, data))
+			if (isFileCurrent(*fileit, f, data) && isFileDataCurrent(builder, f))
 			{
-				buildAppendFilePart(builder, fileit->path.c_str(), f.startLine, data + f.dataOffset, f.dataSize, fileit->timeStamp, fileit->fileSize);
+				buildAppendFilePart(builder, fileit->path.c_str(), f.startLine, data + f.dataOffset, f.dataSize, fileit->timeStamp, fileit->fileSize, f.flags & DCF_CLASS_MASK);
 			}
 			else
 			{
 				buildAppendFile(builder, fileit->path.c_str(), fileit->timeStamp, fileit->fileSize);
-				stats.filesChanged++;
+				stats.filesChanged += !isFileCurrent(*fileit, f, data);
 			}
 
 			++fileit;
@@ -168,40 +243,138 @@ static void processChunkData(Output* output, BuildContext* builder, UpdateFileIt
 	}
 }
 
-static bool processFile(Output* output, BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats, const char* path)
+static bool readChunk(DataFileReader& in, BlockPool& pool, ChunkRead& read, bool copy)
+{
+	const DataChunkDirectoryEntry& entry = *read.entry;
+	const DataChunkHeader& chunk = entry.header;
+
+	read.extra.reset(new (std::nothrow) char[copy ? chunk.extraSize : 0]);
+	read.index.reset(new (std::nothrow) char[copy ? chunk.indexSize : 0]);
+	size_t dataOffset = copy ? getChunkDataOffset(chunk.compressedSize) : 0;
+
+	read.data = pool.allocate(dataOffset + chunk.uncompressedSize, std::nothrow);
+
+	if (!read.extra || !read.index || !read.data)
+		return false;
+
+	if (copy)
+	{
+		in.seek(entry.headerOffset + sizeof(DataChunkHeader));
+
+		if (!in.read(read.extra.get(), chunk.extraSize))
+			return false;
+
+		in.seek(entry.indexOffset);
+
+		if (!in.read(read.index.get(), chunk.indexSize))
+			return false;
+
+		in.seek(entry.dataOffset);
+
+		if (!in.read(read.data.get(), chunk.compressedSize))
+			return false;
+	}
+
+	read.compressed = copy ? read.data.get() : in.map(entry.dataOffset, chunk.compressedSize);
+	read.uncompressed = read.data.get() + dataOffset;
+
+	return true;
+}
+
+static bool processFile(Output* output, BuildContext* builder, UpdateFileIterator& fileit, UpdateStatistics& stats, const char* path, bool append)
 {
-	FileStream in(path, "rb");
+	DataFileReader in(path);
 	if (!in) return true;
 
-	DataFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+	std::vector<DataChunkDirectoryEntry> chunks;
+	std::shared_ptr<CompressionDictionary> dictionary;
+	uint64_t dictionaryOffset = 0;
+	if (!readDataFileDirectory(in, chunks) || !readDataFileDictionary(in, dictionary, &dictionaryOffset))
 	{
 		output->error("Warning: data file %s has an out of date format, rebuilding\n", path);
 		return true;
 	}
 
-	DataChunkHeader chunk;
+	// chunks that are kept may use the dictionary, so new chunks use it as well
+	if (dictionary)
+		buildSetDictionary(builder, *dictionary, dictionaryOffset);
+
+	// preserved chunks are not copied when appending, so mapped chunk data can be used in place
+	bool copy = !append || !in.isMapped();
 
-	while (read(in, chunk))
+	// chunk data is read in order on this thread; decompression and the up-to-date checks run on workers
+	WorkQueue queue(WorkQueue::getIdealWorkerCount(), 0);
+
+	std::deque<PendingChunkRead> pending;
+	size_t pendingSize = 0;
+
+	const std::vector<FileInfo>& infos = fileit.files;
+
+	for (size_t i = 0; i <= chunks.size(); ++i)
 	{
-		std::unique_ptr<char[]> extra(new (std::nothrow) char[chunk.extraSize]);
-		std::unique_ptr<char[]> index(new (std::nothrow) char[chunk.indexSize]);
-		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.compressedSize + chunk.uncompressedSize]);
+		size_t size = i < chunks.size() ? chunks[i].header.compressedSize + chunks[i].header.uncompressedSize : 0;
 
-		if (!extra || !index || !data || !read(in, extra.get(), chunk.extraSize) || !read(in, index.get(), chunk.indexSize) || !read(in, data.get(), chunk.compressedSize))
+		// the amount of chunk data that is read ahead is limited; after the last chunk all remaining reads are processed
+		while (!pending.empty() && (i == chunks.size() || pending.size() >= kMaxPendingFileReads || pendingSize + size > getPendingDataLimit()))
+		{
+			PendingChunkRead& front = pending.front();
+			front.ready.wait();
+
+			ChunkRead& read = *front.read;
+
+			processChunkData(output, builder, fileit, stats, read, append);
+
+			pendingSize -= read.entry->header.compressedSize + read.entry->header.uncompressedSize;
+			pending.pop_front();
+		}
+
+		if (i == chunks.size())
+			break;
+
+		std::shared_ptr<ChunkRead> read(new ChunkRead());
+		read->entry = &chunks[i];
+		read->dictionary = dictionary.get();
+		read->currentIndex = kChunkNotCurrent;
+		read->decompressed = false;
+
+		if (!readChunk(in, buildGetChunkPool(builder), *read, copy))
 		{
 			output->error("Error reading data file %s: malformed chunk\n", path);
 			return false;
 		}
 
-		char* uncompressed = data.get() + chunk.compressedSize;
+		PendingChunkRead pendingRead = { read, read->ready.get_future() };
 
-		processChunkData(output, builder, fileit, stats, chunk, uncompressed, data, index, extra);
+		pending.push_back(std::move(pendingRead));
+		pendingSize += size;
+
+		queue.push([=, &infos]() { prepareChunkRead(builder, *read, infos); read->ready.set_value(); });
 	}
 
 	return true;
 }
 
+// Updates append to the data file until too much of it is taken by chunks that are no longer referenced
+static bool isDataFileAppendable(const char* path)
+{
+	DataFileReader in(path);
+
+	std::vector<DataChunkDirectoryEntry> chunks;
+	std::vector<DataFileAliasEntry> aliases;
+	std::vector<char> aliasNames;
+	std::shared_ptr<CompressionDictionary> dictionary;
+	if (!in || !readDataFileDirectory(in, chunks) || !readDataFileAliases(in, aliases, aliasNames) || !readDataFileDictionary(in, dictionary))
+		return false;
+
+	uint64_t usedSize = sizeof(DataFileHeader) + chunks.size() * sizeof(DataChunkDirectoryEntry) + aliases.size() * sizeof(DataFileAliasEntry) + aliasNames.size() + sizeof(DataFileFooter) +
+		(dictionary ? dictionary->getData().size() : 0);
+
+	for (auto& entry: chunks)
+		usedSize += sizeof(DataChunkHeader) + entry.header.extraSize + entry.header.indexSize + entry.header.compressedSize;
+
+	return in.size() - usedSize <= in.size() * kDataFileMaxUnusedRatio;
+}
+
 static void printStatistics(Output* output, const UpdateStatistics& stats, unsigned int totalChunks, double time)
 {
 	if (stats.filesAdded) output->print("+%d ", stats.filesAdded);
@@ -227,11 +400,21 @@ bool updateProject(Output* output, const char* path)
 
 	output->print("Scanning project...\r");
 
-	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get());
+	// directories that didn't change since the last scan are not read again; every few updates the project is scanned in full in case a change was missed
+	DirectorySnapshot snapshot = {};
+	bool snapshotValid = readDirectorySnapshot(path, snapshot) && snapshot.scansLeft > 0;
+
+	DirectorySnapshot scanned = {};
+	scanned.scansLeft = snapshotValid ? snapshot.scansLeft - 1 : kSnapshotFullScanInterval;
+
+	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get(), snapshotValid ? &snapshot.listings : nullptr, &scanned.listings);
+
+	// a snapshot that can't be saved only makes the next scan slower
+	writeDirectorySnapshot(output, path, scanned);
 
 	output->print("Building file table...\r");
 
-	if (!buildFiles(output, path, files))
+	if (!buildFiles(output, path, files, group->compressFileList))
 		return false;
 	
 	std::string targetPath = replaceExtension(path, ".qgd");
@@ -240,17 +423,22 @@ bool updateProject(Output* output, const char* path)
 	UpdateStatistics stats = {};
 	unsigned int totalChunks = 0;
 
+	// new chunks are usually appended to the existing data file; it's rewritten from scratch once it has too much unused data
+	bool append = isDataFileAppendable(targetPath.c_str());
+
 	{
-		BuildContext* builder = buildStart(output, tempPath.c_str(), files.size());
+		BuildContext* builder = append
+			? buildStartAppend(output, targetPath.c_str(), files.size(), *group)
+			: buildStart(output, tempPath.c_str(), files.size(), *group);
 		if (!builder)
 			return false;
 
 		UpdateFileIterator fileit = {files, 0};
 
 		// update contents using existing database (if any)
-		if (!processFile(output, builder, fileit, stats, targetPath.c_str()))
+		if (!processFile(output, builder, fileit, stats, targetPath.c_str(), append))
 		{
-			buildFinish(builder);
+			buildFinish(builder, /* commit= */ false);
 			return false;
 		}
 
@@ -271,11 +459,17 @@ bool updateProject(Output* output, const char* path)
 
 	printStatistics(output, stats, totalChunks, time.count() / 1e3);
 	
-	if (!renameFile(tempPath.c_str(), targetPath.c_str()))
+	if (!append && !renameFile(tempPath.c_str(), targetPath.c_str()))
 	{
 		output->error("Error saving data file %s\n", targetPath.c_str());
 		return false;
 	}
 
+	if (!buildSlices(output, path) || !buildPostings(output, path, group->postings, group->identifiers))
+		return false;
+
+	// watchers update once searches spend longer on changed files than the last update took
+	writeUpdateTime(path, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count());
+
 	return true;
 }
@@ -4,14 +4,16 @@
 
 #include "project.hpp"
 #include "fileutil.hpp"
-#include "filestream.hpp"
+#include "datafile.hpp"
 #include "output.hpp"
 #include "format.hpp"
-#include "compression.hpp"
 #include "constants.hpp"
 #include "update.hpp"
 #include "changes.hpp"
 
+#include <algorithm>
+#include <functional>
+#include <memory>
 #include <set>
 #include <thread>
 #include <mutex>
@@ -20,22 +22,133 @@
 
 #include <string.h>
 
+// Folders are watched once for all projects: every folder that isn't inside another watched folder gets one watcher, which
+// dispatches events to all groups with folders inside it, so overlapping projects don't add the same watches several times
+class WatchService
+{
+public:
+	WatchService(Output* output): output(output)
+	{
+	}
+
+	~WatchService()
+	{
+		for (auto& t: threads)
+			t.join();
+	}
+
+	// The callback gets paths relative to the folder; has to be called before start
+	void subscribe(const std::string& path, const std::function<void (const char* name)>& callback)
+	{
+		Subscriber s = { path, std::string(), callback };
+		subscribers.push_back(s);
+	}
+
+	// Watchers run on their own threads, so the folders are set up in parallel; they run until the process exits
+	void start()
+	{
+		// folders sort after the folders they are in
+		std::stable_sort(subscribers.begin(), subscribers.end(), [](const Subscriber& l, const Subscriber& r) { return l.path < r.path; });
+
+		for (auto& s: subscribers)
+		{
+			Root* root = nullptr;
+
+			for (auto& r: roots)
+				if (isPathInside(s.path, r.path))
+					root = &r;
+
+			if (!root)
+			{
+				roots.emplace_back();
+				root = &roots.back();
+				root->path = s.path;
+			}
+
+			size_t offset = root->path.size();
+
+			while (offset < s.path.size() && s.path[offset] == '/')
+				offset++;
+
+			s.relativePath = s.path.substr(offset);
+			root->subscribers.push_back(&s);
+		}
+
+		for (auto& root: roots)
+		{
+			output->print("Watching folder %s...\n", root.path.c_str());
+
+			threads.emplace_back([this, &root]
+			{
+				if (!watchDirectory(root.path.c_str(), [&](const char* file) { dispatch(root, file); }))
+					output->error("Error watching folder %s\n", root.path.c_str());
+
+				output->print("No longer watching folder %s\n", root.path.c_str());
+			});
+		}
+	}
+
+private:
+	struct Subscriber
+	{
+		std::string path;
+
+		// path of the folder relative to the watched folder; empty for the watched folder itself
+		std::string relativePath;
+
+		std::function<void (const char* name)> callback;
+	};
+
+	struct Root
+	{
+		std::string path;
+		std::vector<Subscriber*> subscribers;
+	};
+
+	static bool isPathInside(const std::string& path, const std::string& folder)
+	{
+		return path.compare(0, folder.size(), folder) == 0 &&
+			(path.size() == folder.size() || path[folder.size()] == '/' || (!folder.empty() && folder.back() == '/'));
+	}
+
+	static void dispatch(const Root& root, const char* file)
+	{
+		for (auto s: root.subscribers)
+		{
+			const std::string& relative = s->relativePath;
+
+			if (relative.empty())
+				s->callback(file);
+			else if (strncmp(file, relative.c_str(), relative.size()) == 0 && file[relative.size()] == '/')
+				s->callback(file + relative.size() + 1);
+		}
+	}
+
+	Output* output;
+
+	std::vector<Subscriber> subscribers;
+	std::vector<Root> roots;
+	std::vector<std::thread> threads;
+};
+
 struct WatchContext
 {
 	Output* output;
+	std::string path;
+	std::unique_ptr<ProjectGroup> group;
 
 	std::thread updateThread;
-	std::vector<std::thread> watchingThreads;
 
 	std::set<std::string> changedFiles;
 	std::mutex changedFilesMutex;
 	std::condition_variable changedFilesChanged;
 
-	~WatchContext()
+	WatchContext(Output* output, const std::string& path, std::unique_ptr<ProjectGroup> group): output(output), path(path), group(std::move(group))
 	{
-		for (auto& t: watchingThreads)
-			t.join();
+	}
 
+	~WatchContext()
+	{
 		if (updateThread.joinable())
 			updateThread.join();
 	}
@@ -54,26 +167,29 @@ static void fileChanged(WatchContext* context, ProjectGroup* group, const char*
 	}
 }
 
-static void startWatchingRec(WatchContext* context, ProjectGroup* group)
+static void subscribeRec(WatchService& service, WatchContext* context, ProjectGroup* group)
 {
 	for (auto& path : group->paths)
-	{
-		context->output->print("Watching folder %s...\n", path.c_str());
+		service.subscribe(path, [=](const char* file) { fileChanged(context, group, path.c_str(), file); });
 
-		context->watchingThreads.emplace_back([=]
-		{
-			if (!watchDirectory(path.c_str(), [=](const char* file) { fileChanged(context, group, path.c_str(), file); }))
-				context->output->error("Error watching folder %s\n", path.c_str());
-
-			context->output->print("No longer watching folder %s\n", path.c_str());
-		});
-	}
+	for (auto& path : group->gitPaths)
+		service.subscribe(path, [=](const char* file) { fileChanged(context, group, path.c_str(), file); });
 
 	for (auto& child: group->groups)
-		startWatchingRec(context, child.get());
+		subscribeRec(service, context, child.get());
 }
 
-static void processChunk(std::vector<FileInfo>& result, const char* data, size_t fileCount)
+// Files in the data pack along with the chunk that holds the start of each file
+struct WatchPack
+{
+	std::vector<FileInfo> files;
+	std::vector<unsigned int> fileChunks;
+
+	std::vector<uint64_t> chunkSizes;
+	uint64_t totalSize;
+};
+
+static void processChunk(WatchPack& result, const char* data, size_t fileCount)
 {
 	const DataChunkFileHeader* files = reinterpret_cast<const DataChunkFileHeader*>(data);
 
@@ -82,49 +198,107 @@ static void processChunk(std::vector<FileInfo>& result, const char* data, size_t
 		const DataChunkFileHeader& file = files[i];
 
 		if (file.startLine == 0)
-			result.push_back({ std::string(data + file.nameOffset, file.nameLength), file.timeStamp, file.fileSize });
+		{
+			result.files.push_back({ std::string(data + file.nameOffset, file.nameLength), file.timeStamp, file.fileSize });
+			result.fileChunks.push_back(result.chunkSizes.size() - 1);
+		}
 	}
 }
 
-static bool getDataFileList(Output* output, const char* path, std::vector<FileInfo>& result)
+static bool getDataFileList(Output* output, const char* path, WatchPack& result)
 {
-	FileStream in(path, "rb");
+	DataFileReader in(path);
 	if (!in)
 	{
 		output->error("Error reading data file %s\n", path);
 		return false;
 	}
 
-	DataFileHeader header;
-	if (!read(in, header) || memcmp(header.magic, kDataFileHeaderMagic, strlen(kDataFileHeaderMagic)) != 0)
+	std::vector<DataChunkDirectoryEntry> chunks;
+	std::shared_ptr<CompressionDictionary> dictionary;
+	if (!readDataFileDirectory(in, chunks) || !readDataFileDictionary(in, dictionary))
 	{
 		output->error("Error reading data file %s: file format is out of date, update the project to fix\n", path);
 		return false;
 	}
 
-	DataChunkHeader chunk;
-
-	while (read(in, chunk))
+	for (auto& entry: chunks)
 	{
-		in.skip(chunk.extraSize);
-		in.skip(chunk.indexSize);
+		const DataChunkHeader& chunk = entry.header;
 
-		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.compressedSize + chunk.uncompressedSize]);
+		in.seek(entry.dataOffset);
 
-		if (!data || !read(in, data.get(), chunk.compressedSize))
+		const char* compressed = in.read(chunk.compressedSize);
+		std::unique_ptr<char[]> data(new (std::nothrow) char[chunk.uncompressedSize]);
+
+		if (!data || !compressed)
 		{
 			output->error("Error reading data file %s: malformed chunk\n", path);
 			return false;
 		}
 
-		char* uncompressed = data.get() + chunk.compressedSize;
-		decompressPartial(uncompressed, chunk.uncompressedSize, data.get(), chunk.compressedSize, chunk.fileTableSize);
-		processChunk(result, uncompressed, chunk.fileCount);
+		result.chunkSizes.push_back(chunk.uncompressedSize);
+		result.totalSize += chunk.uncompressedSize;
+
+		decompressChunkFileTable(data.get(), chunk, compressed, dictionary.get());
+		processChunk(result, data.get(), chunk.fileCount);
 	}
 
 	return true;
 }
 
+// Amount of data every search has to read because of the changes: changed files are read from disk, and chunks with changes
+// are searched even if their index doesn't match
+static uint64_t getChangePenalty(const WatchPack& pack, const std::vector<std::string>& changedFiles)
+{
+	uint64_t result = 0;
+	std::set<unsigned int> chunks;
+
+	for (auto& path: changedFiles)
+	{
+		uint64_t timeStamp = 0, fileSize = 0;
+		if (getFileAttributes(path.c_str(), &timeStamp, &fileSize))
+			result += fileSize;
+
+		auto it = std::lower_bound(pack.files.begin(), pack.files.end(), path, [](const FileInfo& f, const std::string& p) { return f.path < p; });
+
+		// new files are searched along with the chunk that has the files around them
+		if (!pack.files.empty())
+			chunks.insert(pack.fileChunks[std::min(size_t(it - pack.files.begin()), pack.files.size() - 1)]);
+	}
+
+	for (auto c: chunks)
+		result += pack.chunkSizes[c];
+
+	return result;
+}
+
+// Searches record how long they spent on the changed files, so the update is worth it once that's longer than the last update took
+// Projects that weren't updated since they were built fall back to comparing the extra data that searches read with the size of the pack
+static bool isUpdateNeeded(const WatchPack& pack, uint64_t penalty, const ChangeTimes& times)
+{
+	if (times.updateTime)
+		return times.searchTime > times.updateTime;
+
+	return penalty > pack.totalSize * kWatchUpdatePenaltyRatio;
+}
+
+static bool updateProjectInBackground(WatchContext& context, const char* path)
+{
+	bool result = false;
+
+	// the update runs on its own thread so that the lowered priority doesn't affect the watcher
+	context.updateThread = std::thread([&]() {
+		setBackgroundPriority();
+
+		result = updateProject(context.output, path);
+	});
+
+	context.updateThread.join();
+
+	return result;
+}
+
 static std::vector<std::string> getChanges(const std::vector<FileInfo>& files, const std::vector<FileInfo>& packFiles)
 {
 	std::vector<std::string> result;
@@ -165,37 +339,37 @@ static std::vector<std::string> getChanges(const std::vector<FileInfo>& files, c
 	return result;
 }
 
-static void printStatistics(Output* output, const char* path, size_t fileCount)
+static void printStatistics(Output* output, const char* path, size_t fileCount, const WatchPack& pack, uint64_t penalty, const ChangeTimes& times)
 {
-	output->print("%s: %d files changed\r", getProjectName(path).c_str(), int(fileCount));
+	if (times.updateTime)
+		output->print("%s: %d files changed, searches spent %.2f sec on them (the last update took %.2f sec)\r", getProjectName(path).c_str(), int(fileCount),
+			double(times.searchTime) / 1e6, double(times.updateTime) / 1e6);
+	else
+		output->print("%s: %d files changed, searches read %d%% more data\r", getProjectName(path).c_str(), int(fileCount),
+			int(pack.totalSize == 0 ? 0 : penalty * 100 / pack.totalSize));
 }
 
-void watchProject(Output* output, const char* path, bool interactive)
+static void watchProject(WatchContext& context, bool interactive)
 {
-	WatchContext context = { output };
+	Output* output = context.output;
+	const char* path = context.path.c_str();
 	const char* lineEnd = interactive ? "\n" : "\r";
 
-	output->print("Watching %s:\n", path);
-
-	std::unique_ptr<ProjectGroup> group = parseProject(output, path);
-	if (!group)
-		return;
-
-	startWatchingRec(&context, group.get());
-
 	output->print("Scanning project...%s", lineEnd);
 
-	std::vector<FileInfo> files = getProjectGroupFiles(output, group.get());
+	std::vector<FileInfo> files = getProjectGroupFiles(output, context.group.get());
 
 	output->print("Reading data pack...%s", lineEnd);
 
-	std::vector<FileInfo> packFiles;
-	if (!getDataFileList(output, replaceExtension(path, ".qgd").c_str(), packFiles))
+	WatchPack pack = {};
+	if (!getDataFileList(output, replaceExtension(path, ".qgd").c_str(), pack))
 		return;
 
 	removeFile(replaceExtension(path, ".qgc").c_str());
 
-	std::vector<std::string> changedFiles = getChanges(files, packFiles);
+	std::vector<std::string> changedFiles = getChanges(files, pack.files);
+	uint64_t penalty = getChangePenalty(pack, changedFiles);
+	ChangeTimes times = readChangeTimes(path);
 
 	{
 		std::unique_lock<std::mutex> lock(context.changedFilesMutex);
@@ -205,7 +379,8 @@ void watchProject(Output* output, const char* path, bool interactive)
 
 	output->print("Listening for changes\n");
 
-	bool updateNeeded = changedFiles.size() > size_t(kWatchUpdateThresholdFiles);
+	// the update is scheduled once the extra work changes add to searches is large compared to updating the pack
+	bool updateNeeded = isUpdateNeeded(pack, penalty, times);
 	bool writeNeeded = true; // write initial state
 	auto writeDeadline = std::chrono::steady_clock::now();
 
@@ -213,6 +388,8 @@ void watchProject(Output* output, const char* path, bool interactive)
 	{
 		bool updateNow = false;
 		bool writeNow = false;
+		bool changed = false;
+		bool timesNeeded = false;
 
 		{
 			std::unique_lock<std::mutex> lock(context.changedFilesMutex);
@@ -233,6 +410,12 @@ void watchProject(Output* output, const char* path, bool interactive)
 					updateNow = true;
 				}
 			}
+			else if (!changedFiles.empty())
+			{
+				// searches don't notify the watcher, so the time they spent on the changes is checked periodically
+				if (context.changedFilesChanged.wait_for(lock, std::chrono::seconds(kWatchChangeTimeInterval)) == std::cv_status::timeout)
+					timesNeeded = true;
+			}
 			else
 			{
 				context.changedFilesChanged.wait(lock);
@@ -248,13 +431,22 @@ void watchProject(Output* output, const char* path, bool interactive)
 					writeDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(kWatchWriteDeadline);
 				}
 
-				if (changedFiles.size() > size_t(kWatchUpdateThresholdFiles))
-				{
-					updateNeeded = true;
-				}
+				changed = true;
 			}
 		}
 
+		// file attributes are read outside of the lock so that the watching threads aren't blocked
+		if (changed)
+			penalty = getChangePenalty(pack, changedFiles);
+
+		if (changed || timesNeeded)
+		{
+			times = readChangeTimes(path);
+
+			if (isUpdateNeeded(pack, penalty, times))
+				updateNeeded = true;
+		}
+
 		if (updateNow)
 		{
 			assert(updateNeeded);
@@ -266,9 +458,17 @@ void watchProject(Output* output, const char* path, bool interactive)
 			}
 
 			// this removes the current changes file and updates the pack
-			if (updateProject(output, path))
+			if (updateProjectInBackground(context, path))
 			{
 				updateNeeded = false;
+
+				// the update recorded its own time, which changes that arrive later are compared with
+				times = readChangeTimes(path);
+
+				// changes that arrive later are ranked against the updated pack
+				WatchPack updated = {};
+				if (getDataFileList(output, replaceExtension(path, ".qgd").c_str(), updated))
+					pack = std::move(updated);
 			}
 			else
 			{
@@ -288,7 +488,7 @@ void watchProject(Output* output, const char* path, bool interactive)
 			assert(writeNeeded);
 
 			if (!interactive)
-				printStatistics(output, path, changedFiles.size());
+				printStatistics(output, path, changedFiles.size(), pack, penalty, times);
 
 			if (writeChanges(path, changedFiles))
 			{
@@ -304,3 +504,33 @@ void watchProject(Output* output, const char* path, bool interactive)
 		}
 	}
 }
+
+void watchProjects(Output* output, const std::vector<std::string>& paths, bool interactive)
+{
+	// watchers call into the contexts, so the service is destroyed (and waits for the watchers) first
+	std::vector<std::unique_ptr<WatchContext>> contexts;
+	WatchService service(output);
+
+	for (auto& path: paths)
+	{
+		output->print("Watching %s:\n", path.c_str());
+
+		std::unique_ptr<ProjectGroup> group = parseProject(output, path.c_str());
+		if (!group)
+			continue;
+
+		contexts.emplace_back(new WatchContext(output, path, std::move(group)));
+		subscribeRec(service, contexts.back().get(), contexts.back()->group.get());
+	}
+
+	// watching starts before the projects are scanned so that changes made during the scan aren't lost
+	service.start();
+
+	std::vector<std::thread> threads;
+
+	for (auto& context: contexts)
+		threads.emplace_back([&context, interactive] { watchProject(*context, interactive); });
+
+	for (auto& t: threads)
+		t.join();
+}
@@ -1,6 +1,10 @@
 // This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
 #pragma once
 
+#include <string>
+#include <vector>
+
 class Output;
 
-void watchProject(Output* output, const char* path, bool interactive);
+// Watches the projects until the process exits; folders that several projects have are watched once
+void watchProjects(Output* output, const std::vector<std::string>& paths, bool interactive);
@@ -2,38 +2,396 @@
 #include "common.hpp"
 #include "workqueue.hpp"
 
-#include <functional>
+#include "fileutil.hpp"
+#include "budget.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
 #include <thread>
 
+#include <stdlib.h>
+
+// queue and index of the worker that runs on this thread
+static thread_local const WorkQueue* currentQueue;
+static thread_local size_t currentWorker;
+
+// job data queued by all queues of the process; a producer can wait for any queue to release data, so all producers wait on the same condition
+static std::atomic<size_t> processSize;
+static std::atomic<unsigned int> producersWaiting;
+static std::mutex producerMutex;
+static std::condition_variable producerCondition;
+
+// Each worker owns a ring buffer of jobs; the producer distributes jobs round-robin and idle workers steal from other rings
+struct WorkQueue::Worker
+{
+	struct Slot
+	{
+		Job job;
+		size_t size;
+	};
+
+	std::mutex mutex;
+	std::unique_ptr<Slot[]> slots;
+	size_t capacity;
+	size_t head;
+
+	// modified under the lock; read without it as a hint to skip empty workers
+	std::atomic<size_t> count;
+
+	// only changed by the thread of the worker
+	uint64_t idleTime;
+
+	// keeps heap-allocated workers on separate cache lines
+	char padding[64];
+
+	Worker(): capacity(0), head(0), count(0), idleTime(0)
+	{
+	}
+
+	void push(Job& job, size_t size)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		size_t currentCount = count.load(std::memory_order_relaxed);
+
+		if (currentCount == capacity)
+		{
+			size_t newCapacity = std::max(capacity * 2, size_t(16));
+			std::unique_ptr<Slot[]> newSlots(new Slot[newCapacity]);
+
+			for (size_t i = 0; i < currentCount; ++i)
+			{
+				Slot& slot = slots[(head + i) % capacity];
+
+				newSlots[i].job.relocate(slot.job);
+				newSlots[i].size = slot.size;
+			}
+
+			slots = std::move(newSlots);
+			capacity = newCapacity;
+			head = 0;
+		}
+
+		Slot& slot = slots[(head + currentCount) % capacity];
+
+		slot.job.relocate(job);
+		slot.size = size;
+
+		count.store(currentCount + 1, std::memory_order_relaxed);
+	}
+
+	bool pop(Job& job, size_t& size)
+	{
+		if (count.load(std::memory_order_relaxed) == 0)
+			return false;
+
+		std::unique_lock<std::mutex> lock(mutex);
+
+		size_t currentCount = count.load(std::memory_order_relaxed);
+
+		if (currentCount == 0)
+			return false;
+
+		// both the owner and thieves take the oldest job so that ordered output can be flushed as early as possible
+		Slot& slot = slots[head];
+
+		job.relocate(slot.job);
+		size = slot.size;
+
+		head = (head + 1) % capacity;
+		count.store(currentCount - 1, std::memory_order_relaxed);
+
+		return true;
+	}
+};
+
 unsigned int WorkQueue::getIdealWorkerCount()
 {
+	// shared hosts can limit the number of threads qgrep uses
+	if (const char* env = getenv("QGREP_WORKERS"))
+		if (int count = atoi(env))
+			if (count > 0)
+				return count;
+
 	return std::max(std::thread::hardware_concurrency(), 1u);
 }
 
-static void workerThreadFun(BlockingQueue<std::function<void()>>& queue)
+std::vector<unsigned int> WorkQueue::getIdealNodes()
 {
-	while (std::function<void()> fun = queue.pop())
+	std::vector<unsigned int> result = getNumaNodes();
+
+	if (const char* env = getenv("QGREP_NUMA"))
 	{
-		fun();
+		std::vector<unsigned int> selected;
+
+		for (const char* item = env; *item >= '0' && *item <= '9'; )
+		{
+			char* end;
+			unsigned int node = strtoul(item, &end, 10);
+
+			if (std::find(result.begin(), result.end(), node) != result.end() && std::find(selected.begin(), selected.end(), node) == selected.end())
+				selected.push_back(node);
+
+			item = *end == ',' ? end + 1 : end;
+		}
+
+		result.swap(selected);
 	}
+
+	// with a single node there is nothing to place
+	if (result.size() < 2)
+		result.clear();
+
+	return result;
 }
 
-WorkQueue::WorkQueue(size_t workerCount, size_t memoryLimit): queue(memoryLimit)
+WorkQueue::WorkQueue(size_t workerCount, size_t memoryLimit, const std::vector<unsigned int>& nodes)
+	: nextWorker(0), nodes(nodes.begin(), nodes.begin() + std::min(nodes.size(), workerCount))
+	, queuedCount(0), sleepingCount(0), stopping(false), cancelled(false)
+	, totalSize(0), totalSizeLimit(memoryLimit)
+	, timing(false), trace(nullptr), producerWaitTime(0)
 {
 	for (size_t i = 0; i < workerCount; ++i)
-		workers.emplace_back(std::bind(workerThreadFun, std::ref(queue)));
+		workers.emplace_back(new Worker());
+
+	for (size_t i = 0; i < this->nodes.size(); ++i)
+		nodeWorkers.push_back(std::make_pair(i * workerCount / this->nodes.size(), (i + 1) * workerCount / this->nodes.size()));
+
+	for (size_t i = 0; i < nodeWorkers.size(); ++i)
+		nextNodeWorker.push_back(nodeWorkers[i].first);
+
+	// workers of a queue that is created by a background update run at background priority as well
+	bool background = isBackgroundPriority();
+
+	for (size_t i = 0; i < workerCount; ++i)
+		threads.emplace_back(&WorkQueue::workerThreadFun, this, i, background);
 }
 
 WorkQueue::~WorkQueue()
 {
-	for (size_t i = 0; i < workers.size(); ++i)
-		queue.push(std::function<void()>());
+	finish();
+}
+
+void WorkQueue::finish()
+{
+	if (stopping)
+		return;
+
+	{
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+
+	sleepCondition.notify_all();
+
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
+
+void WorkQueue::enableTiming(TraceLog* trace)
+{
+	this->trace = trace;
+	timing = true;
+}
+
+uint64_t WorkQueue::getProducerWaitTime() const
+{
+	return producerWaitTime;
+}
+
+uint64_t WorkQueue::getWorkerIdleTime() const
+{
+	uint64_t result = 0;
+
+	for (auto& worker: workers)
+		result += worker->idleTime;
+
+	return result;
+}
+
+void WorkQueue::pushJob(Job& job, size_t size, size_t node)
+{
+	// without workers there is nobody to run the job, so run it inline
+	if (workers.empty())
+	{
+		job.run();
+		return;
+	}
+
+	// the job is destroyed without running
+	if (cancelled)
+		return;
+
+	// a queue without data in flight always gets to push, so that queues that wait for each other can't stall
+	size_t processLimit = getQueuedDataLimit();
+
+	auto mustWait = [&]() { return totalSize != 0 && (totalSize + size > totalSizeLimit || processSize + size > processLimit); };
+
+	if (size > 0 && mustWait())
+	{
+		TraceScope scope(timing, trace, producerWaitTime, "producer", "queue wait");
+
+		std::unique_lock<std::mutex> lock(producerMutex);
+
+		producersWaiting++;
+		producerCondition.wait(lock, [&]() { return !mustWait(); });
+		producersWaiting--;
+	}
+
+	totalSize += size;
+	processSize += size;
+
+	if (node != kAnyNode && !nodeWorkers.empty())
+	{
+		const std::pair<size_t, size_t>& range = nodeWorkers[node % nodeWorkers.size()];
+		size_t& next = nextNodeWorker[node % nodeWorkers.size()];
+
+		workers[next]->push(job, size);
+		next = next + 1 == range.second ? range.first : next + 1;
+	}
+	else
+	{
+		workers[nextWorker]->push(job, size);
+		nextWorker = (nextWorker + 1) % workers.size();
+	}
+
+	queuedCount++;
+
+	// waking workers up is expensive so only do it if some worker is actually asleep
+	if (sleepingCount > 0)
+	{
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		sleepCondition.notify_one();
+	}
+}
+
+bool WorkQueue::popJob(size_t workerIndex, Job& job)
+{
+	size_t size = 0;
+
+	// workers of the same node are tried first, starting with the worker itself
+	std::pair<size_t, size_t> range(0, workers.size());
+
+	for (auto& r: nodeWorkers)
+		if (workerIndex >= r.first && workerIndex < r.second)
+			range = r;
+
+	size_t nodeSize = range.second - range.first;
 
 	for (size_t i = 0; i < workers.size(); ++i)
-		workers[i].join();
+	{
+		size_t index = i < nodeSize ? range.first + (workerIndex - range.first + i) % nodeSize : (range.second + i - nodeSize) % workers.size();
+
+		if (workers[index]->pop(job, size))
+		{
+			queuedCount--;
+			releaseSize(size);
+
+			return true;
+		}
+	}
+
+	return false;
 }
 
-void WorkQueue::push(std::function<void()> fun, size_t size)
+void WorkQueue::releaseSize(size_t size)
 {
-	queue.push(std::move(fun), size);
+	if (size > 0)
+	{
+		totalSize -= size;
+		processSize -= size;
+
+		// the waiting producer can belong to another queue, so all of them have to check their limits
+		if (producersWaiting > 0)
+		{
+			std::unique_lock<std::mutex> lock(producerMutex);
+			producerCondition.notify_all();
+		}
+	}
+}
+
+void WorkQueue::cancel()
+{
+	cancelled = true;
+
+	for (auto& worker: workers)
+		for (;;)
+		{
+			// the job is destroyed at the end of the iteration, which releases the resources it captured
+			Job job;
+			size_t size = 0;
+
+			if (!worker->pop(job, size))
+				break;
+
+			queuedCount--;
+			releaseSize(size);
+		}
+}
+
+size_t WorkQueue::getWorkerIndex() const
+{
+	return currentQueue == this ? currentWorker : workers.size();
+}
+
+size_t WorkQueue::getWorkerCount() const
+{
+	return workers.size();
+}
+
+void WorkQueue::workerThreadFun(size_t workerIndex, bool background)
+{
+	const unsigned int kSpinCount = 16;
+
+	if (background)
+		setBackgroundPriority();
+
+	currentQueue = this;
+	currentWorker = workerIndex;
+
+	for (size_t i = 0; i < nodeWorkers.size(); ++i)
+		if (workerIndex >= nodeWorkers[i].first && workerIndex < nodeWorkers[i].second)
+			setThreadNumaNode(nodes[i]);
+
+	for (;;)
+	{
+		Job job;
+		bool found = false;
+
+		for (unsigned int spin = 0; spin < kSpinCount && !found; ++spin)
+		{
+			found = popJob(workerIndex, job);
+
+			if (!found && queuedCount == 0)
+				std::this_thread::yield();
+		}
+
+		if (found)
+		{
+			job.run();
+			continue;
+		}
+
+		// sleeping is expensive enough that idle time can be measured even if timing is not enabled; workers may be asleep before it is
+		uint64_t sleepBegin = getTraceTime();
+
+		{
+			std::unique_lock<std::mutex> lock(sleepMutex);
+
+			// sleepingCount has to be visible before queuedCount is checked, otherwise a push could miss this worker
+			sleepingCount++;
+			sleepCondition.wait(lock, [&]() { return queuedCount > 0 || stopping; });
+			sleepingCount--;
+		}
+
+		uint64_t sleepEnd = getTraceTime();
+
+		workers[workerIndex]->idleTime += sleepEnd - sleepBegin;
+
+		if (timing.load(std::memory_order_acquire) && trace)
+			trace->record("worker", "idle", sleepBegin, sleepEnd);
+
+		if (stopping && queuedCount == 0)
+			return;
+	}
 }
@@ -3,21 +3,164 @@
 
 #include <vector>
 #include <thread>
-#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
 
-#include "blockingqueue.hpp"
+#include <stdint.h>
+
+class TraceLog;
 
 class WorkQueue
 {
 public:
+	static const size_t kAnyNode = ~size_t(0);
+
+	// QGREP_WORKERS overrides the number of workers
 	static unsigned int getIdealWorkerCount();
+	// NUMA nodes to spread the workers over, empty unless the system has several; QGREP_NUMA can list the nodes to use, or be set to off
+	static std::vector<unsigned int> getIdealNodes();
 
-	WorkQueue(size_t workerCount, size_t memoryLimit);
+	// Workers are split evenly between the nodes and only run on the processors of their node
+	// The memory limit applies to the queue; all queues of the process also share the queued data limit of the memory budget
+	WorkQueue(size_t workerCount, size_t memoryLimit, const std::vector<unsigned int>& nodes = std::vector<unsigned int>());
 	~WorkQueue();
 
-	void push(std::function<void()> fun, size_t size = 0);
+	// Jobs are expected to be pushed from a single producer thread; size counts towards the memory limit until the job starts
+	// Jobs for a node (an index into the node list) go to the workers of the node first; idle workers of other nodes can still take them
+	template <typename F> void push(F fun, size_t size = 0, size_t node = kAnyNode)
+	{
+		Job job;
+		job.assign(std::move(fun));
+
+		pushJob(job, size, node);
+	}
+
+	// Drops all queued jobs without running them; jobs pushed after this are dropped as well
+	void cancel();
+
+	// Runs the remaining jobs and stops the workers; no jobs can be pushed after this, and the destructor calls it if it wasn't called before
+	void finish();
+
+	// Measures the time the producer waits for the memory limit, and records it and the time workers sleep without jobs to the trace if there is one
+	// Has to be called before the first job is pushed
+	void enableTiming(TraceLog* trace = nullptr);
+
+	// Wait times in microseconds; worker idle time is always measured, is summed over all workers and is complete once the queue is finished
+	uint64_t getProducerWaitTime() const;
+	uint64_t getWorkerIdleTime() const;
+
+	// Index of the worker that runs the calling job, which lets jobs use per-worker state; jobs that run inline on the producer get the worker count
+	size_t getWorkerIndex() const;
+	size_t getWorkerCount() const;
 
 private:
-	BlockingQueue<std::function<void()>> queue;
-	std::vector<std::thread> workers;
+	// Job descriptor with inline storage for the callable; only oversized callables are allocated on the heap
+	class Job
+	{
+	public:
+		static const size_t kStorageSize = 192;
+
+		Job(): runFunction(nullptr), relocateFunction(nullptr), destroyFunction(nullptr)
+		{
+		}
+
+		~Job()
+		{
+			if (runFunction)
+				destroyFunction(&storage);
+		}
+
+		template <typename F> void assign(F&& fun)
+		{
+			typedef typename std::decay<F>::type T;
+
+			assignImpl<T>(std::forward<F>(fun), std::integral_constant<bool, sizeof(T) <= kStorageSize && alignof(T) <= alignof(Storage)>());
+		}
+
+		// moves the callable into an empty job
+		void relocate(Job& other)
+		{
+			other.relocateFunction(&storage, &other.storage);
+			runFunction = other.runFunction;
+			relocateFunction = other.relocateFunction;
+			destroyFunction = other.destroyFunction;
+			other.runFunction = nullptr;
+		}
+
+		// runs and destroys the callable
+		void run()
+		{
+			void (*fun)(void*) = runFunction;
+			runFunction = nullptr;
+			fun(&storage);
+		}
+
+	private:
+		typedef typename std::aligned_storage<kStorageSize>::type Storage;
+
+		template <typename T, typename F> void assignImpl(F&& fun, std::true_type)
+		{
+			new (&storage) T(std::forward<F>(fun));
+
+			runFunction = [](void* self) { T* t = static_cast<T*>(self); (*t)(); t->~T(); };
+			relocateFunction = [](void* dest, void* source) { T* t = static_cast<T*>(source); new (dest) T(std::move(*t)); t->~T(); };
+			destroyFunction = [](void* self) { static_cast<T*>(self)->~T(); };
+		}
+
+		template <typename T, typename F> void assignImpl(F&& fun, std::false_type)
+		{
+			new (&storage) T*(new T(std::forward<F>(fun)));
+
+			runFunction = [](void* self) { std::unique_ptr<T> t(*static_cast<T**>(self)); (*t)(); };
+			relocateFunction = [](void* dest, void* source) { new (dest) T*(*static_cast<T**>(source)); };
+			destroyFunction = [](void* self) { delete *static_cast<T**>(self); };
+		}
+
+		Storage storage;
+		void (*runFunction)(void*);
+		void (*relocateFunction)(void*, void*);
+		void (*destroyFunction)(void*);
+
+		Job(const Job&);
+		Job& operator=(const Job&);
+	};
+
+	struct Worker;
+
+	void pushJob(Job& job, size_t size, size_t node);
+	bool popJob(size_t workerIndex, Job& job);
+	void releaseSize(size_t size);
+	void workerThreadFun(size_t workerIndex, bool background);
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+	size_t nextWorker;
+
+	// workers of every node are consecutive; nodes beyond the worker count are dropped
+	std::vector<unsigned int> nodes;
+	std::vector<std::pair<size_t, size_t>> nodeWorkers;
+	std::vector<size_t> nextNodeWorker;
+
+	std::atomic<size_t> queuedCount;
+	std::atomic<size_t> sleepingCount;
+	std::atomic<bool> stopping;
+	std::atomic<bool> cancelled;
+	std::mutex sleepMutex;
+	std::condition_variable sleepCondition;
+
+	std::atomic<size_t> totalSize;
+	size_t totalSizeLimit;
+
+	// workers read the timing flag while they run, so it's atomic; the trace is set before the flag
+	std::atomic<bool> timing;
+	TraceLog* trace;
+	uint64_t producerWaitTime;
+
+	WorkQueue(const WorkQueue&);
+	WorkQueue& operator=(const WorkQueue&);
 };
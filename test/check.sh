@@ -0,0 +1,587 @@
+#!/bin/sh
+# This file is part of qgrep and is distributed under the MIT license, see LICENSE.md
+
+# Regression check: generates a source tree, builds projects for it and compares search and file list results with
+# grep and find and between projects; usage: check.sh <qgrep-executable> <work-folder>
+
+set -u
+
+if [ $# -ne 2 ]; then
+	echo "Usage: $0 <qgrep-executable> <work-folder>" >&2
+	exit 2
+fi
+
+QGREP=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+SOURCE=$(cd "$(dirname "$0")/.." && pwd)
+
+rm -rf "$2"
+mkdir -p "$2" || exit 2
+WORK=$(cd "$2" && pwd)
+
+# searches run in this process unless a check starts a server
+QGREP_SERVER=
+LC_ALL=C
+export QGREP_SERVER LC_ALL
+
+checks=0
+failures=0
+
+# compare <name> <expected-file> <actual-file>
+compare()
+{
+	checks=$((checks + 1))
+
+	if ! cmp -s "$2" "$3"; then
+		echo "FAIL: $1"
+		diff "$2" "$3" | head -n 10
+		failures=$((failures + 1))
+	fi
+}
+
+# check <name> <condition...>
+check()
+{
+	name=$1
+	shift
+	checks=$((checks + 1))
+
+	if ! "$@"; then
+		echo "FAIL: $name"
+		failures=$((failures + 1))
+	fi
+}
+
+# generate <folder>: deterministic tree with code-like files, CRLF files, long lines, duplicates and edge cases
+generate()
+{
+	mkdir -p "$1/src" "$1/gen" "$1/misc"
+
+	awk -v dir="$1" 'BEGIN {
+		seed = 1
+		for (f = 0; f < 160; ++f) {
+			path = sprintf("%s/%s/file%03d.cpp", dir, f % 2 ? "gen" : "src", f)
+			eol = f % 7 == 3 ? "\r" : ""
+			for (l = 0; l < 2000; ++l) {
+				seed = (seed * 69069 + 1) % 4294967296
+				r = int(seed / 256)
+				k = r % 8
+				if (k == 0) line = sprintf("int id_%d = %d;", r % 5000, r % 977)
+				else if (k == 1) line = sprintf("\tWidget%d* widget_%d = makeWidget(%d);", r % 300, r % 5000, l)
+				else if (k == 2) line = sprintf("// comment about MARKER_%d and other things", r % 1000)
+				else if (k == 3) line = ""
+				else if (k == 4) line = sprintf("    return foo%dbar + qz%d;", r % 50, r % 10)
+				else if (k == 5) line = sprintf("mArKeR_%d ramp", r % 1000)
+				else if (k == 6) { line = "x"; for (i = 0; i < r % 60; ++i) line = line " abcdefgh" }
+				else line = sprintf("struct S%d { float x, y, z; };", r % 2000)
+				printf "%s%s\n", line, eol > path
+			}
+			close(path)
+		}
+
+		path = dir "/misc/minified.js"
+		for (l = 0; l < 20; ++l) {
+			line = ""
+			for (i = 0; i < 2000; ++i) line = line sprintf("a%d=b+c%d;", i, (l * i) % 997)
+			print line "MARKER_17;" > path
+		}
+		close(path)
+
+		path = dir "/misc/lines.txt"
+		for (l = 0; l < 100000; ++l) print (l % 4999 == 0 ? "MARKER_lines" : "x") > path
+		close(path)
+
+		printf "last line MARKER_17 without newline" > (dir "/misc/nonl.txt")
+		printf "" > (dir "/misc/empty.txt")
+	}'
+
+	# duplicates of files in a folder that sorts first and last
+	mkdir -p "$1/dup" "$1/aaa"
+	cp "$1"/src/file00[0-8].cpp "$1/dup/"
+	cp "$1"/gen/file15[1-9].cpp "$1/aaa/"
+}
+
+# project <name> <folder> <settings...>
+project()
+{
+	name=$1
+	folder=$2
+	shift 2
+
+	{
+		echo "path $folder"
+		for setting in "$@"; do echo "$setting"; done
+	} > "$WORK/$name.cfg"
+}
+
+# build <name>
+build()
+{
+	"$QGREP" build "$WORK/$1.cfg" > "$WORK/$1.log" 2>&1 || { echo "FAIL: building $1"; cat "$WORK/$1.log"; exit 1; }
+}
+
+# update <name>
+update()
+{
+	"$QGREP" update "$WORK/$1.cfg" > "$WORK/$1.log" 2>&1 || { echo "FAIL: updating $1"; cat "$WORK/$1.log"; exit 1; }
+}
+
+# queries: qgrep options, grep options and the query, separated with |
+QUERIES="l|-F|MARKER_17
+|-E|MARKER_1[0-9]6
+|-E|^struct S1[0-9]+
+i|-i|marker_4[23]
+il|-iF|WIDGET13*
+w|-w|id_40
+l|-F|qz
+|-E|foo(1|2)bar
+|-E|x( abcdefgh){56}
+|-E|MARKER_lines
+l|-F|c17;
+l|-F|zzzznotfound"
+
+# search <output-prefix> <project> [options]: runs all queries with the options, plus file list queries, and writes the
+# results to <output-prefix>.N
+search()
+{
+	n=0
+
+	while IFS='|' read -r qopts gopts query; do
+		n=$((n + 1))
+		qopts=${3:-}$qopts
+		"$QGREP" search "$WORK/$2.cfg" ${qopts:+"$qopts"} "$query" > "$1.$n" 2>> "$1.err"
+	done <<EOF
+$QUERIES
+EOF
+
+	"$QGREP" search "$WORK/$2.cfg" "${3:-}lfl" MARKER_17 > "$1.files-matches" 2>> "$1.err"
+	"$QGREP" files "$WORK/$2.cfg" > "$1.files" 2>> "$1.err"
+	"$QGREP" files "$WORK/$2.cfg" fn 'file0[0-4]' > "$1.files-query" 2>> "$1.err"
+}
+
+# reference <output-prefix> <folder>: the results of search() computed with grep and find
+reference()
+{
+	n=0
+
+	while IFS='|' read -r qopts gopts query; do
+		n=$((n + 1))
+		grep -r -n $gopts -e "$query" "$2" | tr -d '\r' | sort > "$1.$n"
+	done <<EOF
+$QUERIES
+EOF
+
+	grep -r -l -F -e MARKER_17 "$2" | sort > "$1.files-matches"
+	find "$2" -type f | sort > "$1.files"
+	grep -e '/file0[0-4][^/]*$' "$1.files" > "$1.files-query"
+}
+
+# results written by search() and reference()
+RESULTS="$(echo "$QUERIES" | awk '{ print NR }') files-matches files files-query"
+
+# compare_results <name> <expected-prefix> <actual-prefix> [sort]
+compare_results()
+{
+	for result in $RESULTS; do
+		expected=$2.$result
+		actual=$3.$result
+
+		if [ $# -gt 3 ]; then
+			sort "$expected" > "$expected.sorted"
+			sort "$actual" > "$actual.sorted"
+			expected=$expected.sorted
+			actual=$actual.sorted
+		fi
+
+		compare "$1 $result" "$expected" "$actual"
+	done
+
+	check "$1 produces no errors" test ! -s "$3.err"
+}
+
+TREE=$WORK/tree
+OUT=$WORK/out
+mkdir -p "$OUT"
+
+generate "$TREE"
+reference "$OUT/grep" "$TREE"
+
+# searches of mapped data files produce the same lines as grep; the output of this project is the reference for
+# projects that should produce the same ordered output
+project plain "$TREE"
+build plain
+search "$OUT/plain" plain
+compare_results "plain" "$OUT/grep" "$OUT/plain" sort
+
+# data files have the header of the current format; files of older formats are rejected and rebuilt by update
+check "data file uses the current format" test "$(head -c 4 "$WORK/plain.qgd")" = "$(sed -n 's/.*kDataFileHeaderMagic\[\] = "\(....\)".*/\1/p' "$SOURCE/src/format.hpp")"
+
+project format "$TREE"
+build format
+printf 'QGD2' | dd of="$WORK/format.qgd" bs=1 count=4 conv=notrunc 2> /dev/null
+"$QGREP" search "$WORK/format.cfg" l MARKER_17 > "$OUT/format-old" 2>&1
+check "older data file format is rejected" grep -q "format is out of date" "$OUT/format-old"
+"$QGREP" update "$WORK/format.cfg" > "$WORK/format.log" 2>&1
+search "$OUT/format" format
+compare_results "rebuild of older format" "$OUT/plain" "$OUT/format"
+
+# small chunks get a slice index, which rejects chunks before their filters are read
+project small "$TREE" "index chunksize 64"
+build small
+check "slice index is built" test -s "$WORK/small.qgx"
+search "$OUT/small" small
+compare_results "slice index" "$OUT/plain" "$OUT/small"
+
+project postings "$TREE" "index chunksize 64" "index postings"
+build postings
+check "posting index is built" test -s "$WORK/postings.qgp"
+search "$OUT/postings" postings
+compare_results "posting index" "$OUT/plain" "$OUT/postings"
+
+# queries from a file produce the matches of every query, prefixed with the query number; the options of the search
+# apply to all queries, so the file has the queries without options
+n=0
+m=0
+: > "$WORK/queries.txt"
+: > "$OUT/multi.expected"
+
+while IFS='|' read -r qopts gopts query; do
+	n=$((n + 1))
+	[ -n "$qopts" ] && continue
+
+	m=$((m + 1))
+	echo "$query" >> "$WORK/queries.txt"
+	sed "s/^/$m:/" "$OUT/plain.$n" >> "$OUT/multi.expected"
+done <<EOF
+$QUERIES
+EOF
+
+"$QGREP" search "$WORK/plain.cfg" q "$WORK/queries.txt" > "$OUT/multi" 2>&1
+sort "$OUT/multi.expected" > "$OUT/multi.expected.sorted"
+sort "$OUT/multi" > "$OUT/multi.sorted"
+compare "query file" "$OUT/multi.expected.sorted" "$OUT/multi.sorted"
+
+# searches stop at the line limit with the lines that an unlimited search prints first
+"$QGREP" search "$WORK/small.cfg" L100 '^struct S1[0-9]+' > "$OUT/limit" 2>&1
+head -n 100 "$OUT/plain.3" > "$OUT/limit.expected"
+compare "line limit" "$OUT/limit.expected" "$OUT/limit"
+
+# the output stays in order when workers complete chunks out of order and the buffered output is over the limit
+QGREP_WORKERS=8
+QGREP_MEMORY=1
+export QGREP_WORKERS QGREP_MEMORY
+search "$OUT/reorder" small
+unset QGREP_WORKERS QGREP_MEMORY
+compare_results "reordered output" "$OUT/plain" "$OUT/reorder"
+
+# unordered output has the same lines as ordered output
+search "$OUT/unordered" small U
+compare_results "unordered output" "$OUT/plain" "$OUT/unordered" sort
+
+# per-file counts and lists of files with matches agree with grep
+n=0
+
+while IFS='|' read -r qopts gopts query; do
+	n=$((n + 1))
+
+	grep -r -c $gopts -e "$query" "$TREE" | grep -v ':0$' | sort > "$OUT/grep-count.$n"
+	grep -r -l $gopts -e "$query" "$TREE" | sort > "$OUT/grep-files.$n"
+
+	"$QGREP" search "$WORK/small.cfg" "${qopts}c" "$query" 2>&1 | sort > "$OUT/count.$n"
+	"$QGREP" search "$WORK/small.cfg" "${qopts}fl" "$query" 2>&1 | sort > "$OUT/files.$n"
+
+	compare "count $n" "$OUT/grep-count.$n" "$OUT/count.$n"
+	compare "files with matches $n" "$OUT/grep-files.$n" "$OUT/files.$n"
+done <<EOF
+$QUERIES
+EOF
+
+# a project list is searched as one output stream in the order of the projects
+"$QGREP" search "$WORK/plain.cfg,$WORK/small.cfg" '^struct S1[0-9]+' > "$OUT/list" 2>&1
+cat "$OUT/plain.3" "$OUT/small.3" > "$OUT/list.expected"
+compare "project list" "$OUT/list.expected" "$OUT/list"
+
+# start_server <project-list>: starts a search server for the projects that later searches use
+start_server()
+{
+	QGREP_SERVER=$WORK/server
+
+	# searches write traces with the environment of the server, which shows that the server ran them
+	rm -f "$QGREP_SERVER" "$WORK/server.json"
+	QGREP_TRACE=$WORK/server.json "$QGREP" serve "$1" 16 > "$WORK/serve.log" 2>&1 &
+	server=$!
+
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		[ -S "$QGREP_SERVER" ] && break
+		sleep 1
+	done
+
+	check "server is running" test -S "$QGREP_SERVER"
+}
+
+# stop_server: stops the server, after which searches run in this process again
+stop_server()
+{
+	kill $server
+	wait $server 2> /dev/null
+	QGREP_SERVER=
+}
+
+# the server produces the same output as searches in this process
+start_server "$WORK/plain.cfg,$WORK/small.cfg"
+search "$OUT/server" plain
+search "$OUT/server-small" small
+check "searches are answered by the server" test -s "$WORK/server.json"
+stop_server
+
+compare_results "server" "$OUT/plain" "$OUT/server"
+compare_results "server" "$OUT/plain" "$OUT/server-small"
+
+# the server caches results until the projects are updated or their change lists change
+SRVTREE=$WORK/srvtree
+cp -R "$TREE" "$SRVTREE"
+
+project srv "$SRVTREE"
+build srv
+reference "$OUT/grep-srv" "$SRVTREE"
+
+start_server "$WORK/srv.cfg"
+search "$OUT/cached" srv
+search "$OUT/cached-again" srv
+compare_results "server cache" "$OUT/grep-srv" "$OUT/cached" sort
+compare_results "server cache" "$OUT/cached" "$OUT/cached-again"
+
+echo "int served_MARKER_17;" >> "$SRVTREE/gen/file101.cpp"
+rm "$SRVTREE/gen/file103.cpp"
+sleep 1
+update srv
+reference "$OUT/grep-server-update" "$SRVTREE"
+search "$OUT/server-update" srv
+compare_results "server cache after update" "$OUT/grep-server-update" "$OUT/server-update" sort
+
+echo "int changed_MARKER_17;" >> "$SRVTREE/src/file080.cpp"
+"$QGREP" change "$WORK/srv.cfg" "$SRVTREE/src/file080.cpp" > "$WORK/change.log" 2>&1
+reference "$OUT/grep-server-change" "$SRVTREE"
+search "$OUT/server-change" srv
+compare_results "server cache after change" "$OUT/grep-server-change" "$OUT/server-change" sort
+stop_server
+
+# filters sized for a higher false positive rate only let more chunks through
+project fprate "$TREE" "index chunksize 64" "index fprate 20"
+build fprate
+search "$OUT/fprate" fprate
+compare_results "filter rate" "$OUT/plain" "$OUT/fprate"
+
+# mutate <folder> <round>: changes, removes and adds files; round 1 only adds, so that the update appends everything
+mutate()
+{
+	echo "int appended_MARKER_17;" >> "$1/misc/nonl.txt"
+	echo "int added_MARKER_17; // zzz" > "$1/zzz.cpp"
+
+	[ $2 = 1 ] && return
+
+	for f in src/file010 src/file040 gen/file041 gen/file091 src/file100; do
+		sed -e 's/MARKER_42/MARKER_47/' -e '5s/.*/changed MARKER_17 foo2bar/' "$1/$f.cpp" > "$1/$f.tmp" && mv "$1/$f.tmp" "$1/$f.cpp"
+	done
+
+	rm "$1/src/file060.cpp" "$1/gen/file061.cpp" "$1/dup/file004.cpp"
+	cp "$1/src/file012.cpp" "$1/dup/copy012.cpp"
+	printf 'MARKER_17\r\nmarker_42 id_40\r\n' > "$1/aaa/first.cpp"
+}
+
+# updates append to the data file and produce the same output as a fresh build of the changed tree
+UPTREE=$WORK/uptree
+cp -R "$TREE" "$UPTREE"
+
+project up "$UPTREE" "index chunksize 64" "index postings" "index identifiers" "index blockfilters"
+project fresh "$UPTREE" "index chunksize 64" "index postings" "index identifiers" "index blockfilters"
+build up
+
+for round in 1 2; do
+	mutate "$UPTREE" $round
+	sleep 1
+
+	cp "$WORK/up.qgd" "$WORK/up.qgd.old"
+	update up
+
+	# appending only rewrites the committed size in the header
+	check "update $round appends to the data file" test "$(cmp -l "$WORK/up.qgd.old" "$WORK/up.qgd" 2> /dev/null | wc -l)" -le 8
+
+	build fresh
+	search "$OUT/up$round" up
+	search "$OUT/fresh$round" fresh
+	compare_results "update $round" "$OUT/fresh$round" "$OUT/up$round"
+done
+
+# leftovers of an interrupted update after the committed size are ignored, and overwritten by the next update
+printf 'leftovers of an interrupted update' >> "$WORK/up.qgd"
+search "$OUT/leftovers" up
+compare_results "data after committed size" "$OUT/fresh2" "$OUT/leftovers"
+
+mutate "$UPTREE" 1
+sleep 1
+update up
+build fresh
+search "$OUT/leftovers-update" up
+search "$OUT/leftovers-fresh" fresh
+compare_results "update after leftovers" "$OUT/leftovers-fresh" "$OUT/leftovers-update"
+
+# files with identical contents are stored once and reported with the path of every copy
+project dedup "$TREE" "index dedup"
+build dedup
+search "$OUT/dedup" dedup
+compare_results "dedup" "$OUT/grep" "$OUT/dedup" sort
+
+# updates keep references valid when copies or the files they refer to change
+DUPTREE=$WORK/duptree
+cp -R "$TREE" "$DUPTREE"
+
+project updup "$DUPTREE" "index dedup"
+build updup
+
+rm "$DUPTREE/src/file000.cpp" "$DUPTREE/aaa/file153.cpp"
+echo "int changed_MARKER_17;" >> "$DUPTREE/dup/file001.cpp"
+cp "$DUPTREE/src/file020.cpp" "$DUPTREE/aaa/copy020.cpp"
+cp "$DUPTREE/dup/file001.cpp" "$DUPTREE/gen/copy001.cpp"
+sleep 1
+
+update updup
+reference "$OUT/grep-updup" "$DUPTREE"
+search "$OUT/updup" updup
+compare_results "dedup update" "$OUT/grep-updup" "$OUT/updup" sort
+
+# changed files are searched from the file system until the next update
+for f in src/file020.cpp misc/lines.txt; do
+	sed -e 's/MARKER_42/MARKER_47/' -e '1s/.*/changed MARKER_17 MARKER_lines/' "$UPTREE/$f" > "$WORK/tmp" && cat "$WORK/tmp" > "$UPTREE/$f"
+done
+
+"$QGREP" change "$WORK/up.cfg" "$UPTREE/src/file020.cpp" "$UPTREE/misc/lines.txt" > "$WORK/change.log" 2>&1
+reference "$OUT/grep-change" "$UPTREE"
+search "$OUT/change" up
+compare_results "change" "$OUT/grep-change" "$OUT/change" sort
+
+# updates record how long they took and searches record the time they spent on changed files, which watchers compare
+check "update time is recorded" grep -q '^update [0-9]' "$WORK/up.qgt"
+check "search time of changed files is recorded" grep -q '^search [0-9]' "$WORK/up.qgt"
+
+# path filters agree with grep over the files they select
+grep -r -n -F -e MARKER_17 "$TREE/gen" | tr -d '\r' | sort > "$OUT/grep-include"
+grep -r -n -F --exclude='*.cpp' -e MARKER_17 "$TREE" | tr -d '\r' | sort > "$OUT/grep-exclude"
+
+"$QGREP" search "$WORK/small.cfg" l fi/gen/ MARKER_17 2>&1 | sort > "$OUT/include"
+"$QGREP" search "$WORK/small.cfg" l 'fe\.cpp$' MARKER_17 2>&1 | sort > "$OUT/exclude"
+
+compare "include filter" "$OUT/grep-include" "$OUT/include"
+compare "exclude filter" "$OUT/grep-exclude" "$OUT/exclude"
+
+project blockfilters "$TREE" "index blockfilters"
+build blockfilters
+search "$OUT/blockfilters" blockfilters
+compare_results "block filters" "$OUT/plain" "$OUT/blockfilters"
+
+# data files from before the codec of every chunk was stored are rejected and rebuilt by update
+printf 'QGD9' | dd of="$WORK/format.qgd" bs=1 count=4 conv=notrunc 2> /dev/null
+"$QGREP" search "$WORK/format.cfg" l MARKER_17 > "$OUT/format-codec" 2>&1
+check "data file without chunk codecs is rejected" grep -q "format is out of date" "$OUT/format-codec"
+"$QGREP" update "$WORK/format.cfg" > "$WORK/format.log" 2>&1
+search "$OUT/format" format
+compare_results "rebuild of data file without chunk codecs" "$OUT/plain" "$OUT/format"
+
+# zstd chunks, alone and mixed with LZ4 chunks after the codec changes, produce the same output
+project zstd "$TREE" "compress zstd"
+build zstd
+
+if grep -q "not supported" "$WORK/zstd.log"; then
+	echo "skipping zstd: not supported by this build"
+else
+	search "$OUT/zstd" zstd
+	compare_results "zstd" "$OUT/plain" "$OUT/zstd"
+
+	CODECTREE=$WORK/codectree
+	cp -R "$TREE" "$CODECTREE"
+
+	project codec "$CODECTREE"
+	build codec
+	project codec "$CODECTREE" "compress zstd"
+	echo "int appended_MARKER_17;" >> "$CODECTREE/gen/file101.cpp"
+	sleep 1
+
+	update codec
+	reference "$OUT/grep-codec" "$CODECTREE"
+	search "$OUT/codec" codec
+	compare_results "mixed codecs" "$OUT/grep-codec" "$OUT/codec" sort
+fi
+
+project filelist "$TREE" "compress filelist"
+build filelist
+search "$OUT/filelist" filelist
+compare_results "compressed file list" "$OUT/plain" "$OUT/filelist"
+
+# traces of searches are Chrome trace JSON files
+QGREP_TRACE=$WORK/trace.json "$QGREP" search "$WORK/small.cfg" l MARKER_17 > /dev/null 2>&1
+check "search writes a trace" grep -q '"traceEvents"' "$WORK/trace.json"
+
+# a coordinator splits searches between shard servers that listen at TCP addresses, and merges their results in order
+PORT=$((20000 + $$ % 20000))
+project sharded "$TREE" "index chunksize 64" "shard 127.0.0.1:$PORT" "shard localhost:$((PORT + 1))"
+build sharded
+
+shards=
+for address in 127.0.0.1:$PORT localhost:$((PORT + 1)); do
+	QGREP_SERVER=$address "$QGREP" serve "$WORK/sharded.cfg" 16 > "$WORK/shard.log" 2>&1 &
+	shards="$shards $!"
+
+	# network servers only answer searches of the projects they serve
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		QGREP_SERVER=$address "$QGREP" search "$WORK/plain.cfg" l MARKER_17 > "$WORK/shard-check" 2>&1
+		grep -q "is not served" "$WORK/shard-check" && break
+		sleep 1
+	done
+
+	check "shard server at $address rejects other projects" grep -q "is not served" "$WORK/shard-check"
+done
+
+rm -f "$WORK/coordinator"
+QGREP_SERVER=$WORK/coordinator "$QGREP" coordinate "$WORK/sharded.cfg" > "$WORK/coordinator.log" 2>&1 &
+coordinator=$!
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	[ -S "$WORK/coordinator" ] && break
+	sleep 1
+done
+
+check "coordinator is running" test -S "$WORK/coordinator"
+
+QGREP_SERVER=$WORK/coordinator
+search "$OUT/sharded" sharded
+"$QGREP" search "$WORK/sharded.cfg" lL25 MARKER_17 > "$OUT/sharded-limit" 2>&1
+QGREP_SERVER=
+
+kill $coordinator $shards
+wait $coordinator $shards 2> /dev/null
+
+compare_results "shards" "$OUT/plain" "$OUT/sharded"
+head -25 "$OUT/plain.1" > "$OUT/plain-limit"
+compare "shard limit" "$OUT/plain-limit" "$OUT/sharded-limit"
+
+# the memory budget of a project limits buffers without changing the output, and invalid budgets are rejected
+project memory "$TREE" "index chunksize 64" "memory 16"
+build memory
+search "$OUT/memory" memory
+compare_results "memory budget" "$OUT/plain" "$OUT/memory"
+
+project badmemory "$TREE" "memory 0"
+"$QGREP" build "$WORK/badmemory.cfg" > "$WORK/badmemory.log" 2>&1
+check "invalid memory budget is rejected" grep -q "Invalid memory budget" "$WORK/badmemory.log"
+
+project identifiers "$TREE" "index chunksize 64" "index identifiers"
+build identifiers
+check "identifier index is built" test -s "$WORK/identifiers.qgw"
+search "$OUT/identifiers" identifiers
+compare_results "identifier index" "$OUT/plain" "$OUT/identifiers"
+
+if [ $failures -ne 0 ]; then
+	echo "$failures of $checks checks failed"
+	exit 1
+fi
+
+echo "$checks checks passed"